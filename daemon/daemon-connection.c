@@ -21,6 +21,12 @@
 #include <config.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#ifdef HAVE_SHM_OPEN
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 #include <glib.h>
 #include <libgnomevfs/gnome-vfs.h>
 #include <libgnomevfs/gnome-vfs-cancellable-ops.h>
@@ -47,6 +53,11 @@ struct _DaemonConnection {
 
 	GMainContext   *main_context;
 	GMainLoop      *main_loop;
+
+	/* Shared with the client for the data of ReadMapped and
+	 * WriteMapped */
+	guchar         *buffer;
+	gsize           buffer_size;
 };
 
 typedef struct {
@@ -257,6 +268,12 @@ connection_destroy (DaemonConnection *conn)
 	
 	g_assert (!g_main_loop_is_running (conn->main_loop));
 
+#ifdef HAVE_SHM_OPEN
+	if (conn->buffer != NULL) {
+		munmap (conn->buffer, conn->buffer_size);
+	}
+#endif
+
 	g_main_loop_unref (conn->main_loop);
 	g_main_context_unref (conn->main_context);
 
@@ -972,6 +989,223 @@ connection_handle_write (DaemonConnection *conn,
 	dbus_message_unref (reply);
 }
 
+static void
+connection_handle_map_buffer (DaemonConnection *conn,
+			      DBusMessage      *message)
+{
+	gchar          *name;
+	guint64         size;
+	GnomeVFSResult  result;
+#ifdef HAVE_SHM_OPEN
+	int             fd;
+	struct stat     st;
+	gpointer        buffer;
+#endif
+
+	if (!get_operation_args (message, NULL,
+				 DVD_TYPE_STRING, &name,
+				 DVD_TYPE_UINT64, &size,
+				 DVD_TYPE_LAST)) {
+		connection_reply_result (conn, message,
+					 GNOME_VFS_ERROR_INTERNAL);
+		return;
+	}
+
+	d(g_print ("map buffer: %s, %llu\n", name, size));
+
+#ifdef HAVE_SHM_OPEN
+	result = GNOME_VFS_OK;
+	buffer = MAP_FAILED;
+
+	fd = shm_open (name, O_RDWR, 0);
+	if (fd == -1) {
+		result = gnome_vfs_result_from_errno ();
+	} else {
+		/* Don't take the client's word for the size, touching
+		 * pages beyond the end would kill us */
+		if (fstat (fd, &st) == -1 || st.st_size < size || size == 0) {
+			result = GNOME_VFS_ERROR_BAD_PARAMETERS;
+		} else {
+			buffer = mmap (NULL, size, PROT_READ | PROT_WRITE,
+				       MAP_SHARED, fd, 0);
+			if (buffer == MAP_FAILED) {
+				result = gnome_vfs_result_from_errno ();
+			}
+		}
+		close (fd);
+	}
+
+	if (result == GNOME_VFS_OK) {
+		if (conn->buffer != NULL) {
+			munmap (conn->buffer, conn->buffer_size);
+		}
+		conn->buffer = buffer;
+		conn->buffer_size = size;
+	}
+#else
+	result = GNOME_VFS_ERROR_NOT_SUPPORTED;
+#endif
+
+	g_free (name);
+
+	if (connection_check_and_reply_error (conn, message, result)) {
+		return;
+	}
+
+	connection_reply_ok (conn, message);
+}
+
+static void
+connection_handle_read_mapped (DaemonConnection *conn,
+			       DBusMessage      *message)
+{
+	gint32              cancellation_id;
+	gint32              handle_id;
+	guint64             num_bytes;
+	FileHandle         *handle;
+	CancellationHandle *cancellation;
+	GnomeVFSResult      result;
+	GnomeVFSFileSize    bytes_read;
+	DBusMessage        *reply;
+	DBusMessageIter     iter;
+	guint64             ui64;
+	GnomeVFSContext    *context;
+
+	if (!get_operation_args (message, &cancellation_id,
+				 DVD_TYPE_INT32, &handle_id,
+				 DVD_TYPE_UINT64, &num_bytes,
+				 DVD_TYPE_LAST)) {
+		connection_reply_result (conn, message,
+					 GNOME_VFS_ERROR_INTERNAL);
+
+		return;
+	}
+
+	d(g_print ("read mapped: %d, %llu, (%d)\n",
+		   handle_id, num_bytes, cancellation_id));
+
+	handle = get_file_handle (conn, handle_id);
+	if (!handle || conn->buffer == NULL) {
+		connection_reply_result (conn, message,
+					 GNOME_VFS_ERROR_INTERNAL);
+		return;
+	}
+
+	if (cancellation_id != -1) {
+		cancellation = connection_add_cancellation (conn, cancellation_id);
+		context = cancellation->context;
+	} else {
+		cancellation = NULL;
+		context = NULL;
+	}
+
+	/* Straight into the client's memory */
+	gnome_vfs_daemon_set_current_connection (conn->conn);
+	result = gnome_vfs_read_cancellable (handle->vfs_handle,
+					     conn->buffer,
+					     MIN (num_bytes, conn->buffer_size),
+					     &bytes_read,
+					     context);
+	gnome_vfs_daemon_set_current_connection (NULL);
+
+	if (cancellation) {
+		connection_remove_cancellation (conn, cancellation);
+	}
+
+	if (connection_check_and_reply_error (conn, message, result)) {
+		return;
+	}
+
+	reply = connection_create_reply_ok (message);
+
+	dbus_message_iter_init_append (reply, &iter);
+
+	ui64 = bytes_read;
+	if (!dbus_message_iter_append_basic (&iter,
+					     DBUS_TYPE_UINT64,
+					     &ui64)) {
+		g_error ("Out of memory");
+	}
+
+	dbus_connection_send (conn->conn, reply, NULL);
+	dbus_message_unref (reply);
+}
+
+static void
+connection_handle_write_mapped (DaemonConnection *conn,
+				DBusMessage      *message)
+{
+	gint32              cancellation_id;
+	gint32              handle_id;
+	guint64             num_bytes;
+	FileHandle         *handle;
+	CancellationHandle *cancellation;
+	GnomeVFSResult      result;
+	GnomeVFSFileSize    bytes_written;
+	DBusMessage        *reply;
+	DBusMessageIter     iter;
+	guint64             ui64;
+	GnomeVFSContext    *context;
+
+	if (!get_operation_args (message, &cancellation_id,
+				 DVD_TYPE_INT32, &handle_id,
+				 DVD_TYPE_UINT64, &num_bytes,
+				 DVD_TYPE_LAST)) {
+		connection_reply_result (conn, message,
+					 GNOME_VFS_ERROR_INTERNAL);
+
+		return;
+	}
+
+	d(g_print ("write mapped: %d, %llu, (%d)\n",
+		   handle_id, num_bytes, cancellation_id));
+
+	handle = get_file_handle (conn, handle_id);
+	if (!handle || conn->buffer == NULL || num_bytes > conn->buffer_size) {
+		connection_reply_result (conn, message,
+					 GNOME_VFS_ERROR_INTERNAL);
+		return;
+	}
+
+	if (cancellation_id != -1) {
+		cancellation = connection_add_cancellation (conn, cancellation_id);
+		context = cancellation->context;
+	} else {
+		cancellation = NULL;
+		context = NULL;
+	}
+
+	gnome_vfs_daemon_set_current_connection (conn->conn);
+	result = gnome_vfs_write_cancellable (handle->vfs_handle,
+					      conn->buffer,
+					      num_bytes,
+					      &bytes_written,
+					      context);
+	gnome_vfs_daemon_set_current_connection (NULL);
+
+	if (cancellation) {
+		connection_remove_cancellation (conn, cancellation);
+	}
+
+	if (connection_check_and_reply_error (conn, message, result)) {
+		return;
+	}
+
+	reply = connection_create_reply_ok (message);
+
+	dbus_message_iter_init_append (reply, &iter);
+
+	ui64 = bytes_written;
+	if (!dbus_message_iter_append_basic (&iter,
+					     DBUS_TYPE_UINT64,
+					     &ui64)) {
+		g_error ("Out of memory");
+	}
+
+	dbus_connection_send (conn->conn, reply, NULL);
+	dbus_message_unref (reply);
+}
+
 static void
 connection_handle_seek (DaemonConnection *conn,
 			DBusMessage      *message)
@@ -2098,6 +2332,15 @@ connection_message_func (DBusConnection *dbus_conn,
 	else if (IS_METHOD (message, DVD_DAEMON_METHOD_WRITE)) {
 		connection_handle_write (conn, message);
 	}
+	else if (IS_METHOD (message, DVD_DAEMON_METHOD_MAP_BUFFER)) {
+		connection_handle_map_buffer (conn, message);
+	}
+	else if (IS_METHOD (message, DVD_DAEMON_METHOD_READ_MAPPED)) {
+		connection_handle_read_mapped (conn, message);
+	}
+	else if (IS_METHOD (message, DVD_DAEMON_METHOD_WRITE_MAPPED)) {
+		connection_handle_write_mapped (conn, message);
+	}
 	else if (IS_METHOD (message, DVD_DAEMON_METHOD_SEEK)) {
 		connection_handle_seek (conn, message);
 	}
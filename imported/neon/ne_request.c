@@ -150,7 +150,7 @@ struct ne_request_s {
 	} buf;
     } body;
 	    
-    ne_off_t body_length; /* length of request body */
+    ne_off_t body_length; /* length of request body, -1 if chunked */
 
     /* temporary store for response lines. */
     char respbuf[NE_BUFSIZ];
@@ -418,6 +418,10 @@ static ssize_t body_fd_send(void *userdata, char *buffer, size_t count)
 ((((code) == NE_SOCK_CLOSED || (code) == NE_SOCK_RESET || \
  (code) == NE_SOCK_TRUNC) && retry) ? NE_RETRY : (acode))
 
+/* Longest chunk-size line send_request_body writes: up to 8 hex
+ * digits and CRLF. */
+#define CHUNK_SIZE_LEN (10)
+
 /* Sends the request body; returns 0 on success or an NE_* error code.
  * If retry is non-zero; will return NE_RETRY on persistent connection
  * timeout.  On error, the session error string is set and the
@@ -427,6 +431,8 @@ static int send_request_body(ne_request *req, int retry)
     ne_session *const sess = req->session;
     ne_off_t progress = 0;
     char buffer[NE_BUFSIZ];
+    char *data = buffer;
+    size_t room = sizeof buffer;
     ssize_t bytes;
 
     NE_DEBUG(NE_DBG_HTTP, "Sending request body:\n");
@@ -437,8 +443,31 @@ static int send_request_body(ne_request *req, int retry)
         return NE_ERROR;
     }
     
-    while ((bytes = req->body_cb(req->body_ud, buffer, sizeof buffer)) > 0) {
-	int ret = ne_sock_fullwrite(sess->socket, buffer, bytes);
+    if (req->body_length < 0) {
+        /* Chunk syntax is "SIZE CRLF CHUNK CRLF"; leave room around
+         * the block so each chunk goes out in a single write. */
+        data = buffer + CHUNK_SIZE_LEN;
+        room = sizeof buffer - CHUNK_SIZE_LEN - 2;
+    }
+
+    while ((bytes = req->body_cb(req->body_ud, data, room)) > 0) {
+	char *out = data;
+	size_t outlen = bytes;
+	int ret;
+
+        if (req->body_length < 0) {
+            char size[CHUNK_SIZE_LEN + 1];
+            size_t len;
+
+            ne_snprintf(size, sizeof size, "%x" EOL, (unsigned int)bytes);
+            len = strlen(size);
+            out = data - len;
+            memcpy(out, size, len);
+            memcpy(data + bytes, EOL, 2);
+            outlen = len + bytes + 2;
+        }
+
+	ret = ne_sock_fullwrite(sess->socket, out, outlen);
         if (ret < 0) {
             int aret = aborted(req, _("Could not send request body"), ret);
             return RETRY_RET(retry, ret, aret);
@@ -446,7 +475,7 @@ static int send_request_body(ne_request *req, int retry)
 
 	NE_DEBUG(NE_DBG_HTTPBODY, 
 		 "Body block (%" NE_FMT_SSIZE_T " bytes):\n[%.*s]\n",
-		 bytes, (int)bytes, buffer);
+		 bytes, (int)bytes, data);
 
         /* invoke progress callback */
         if (sess->progress_cb) {
@@ -457,6 +486,15 @@ static int send_request_body(ne_request *req, int retry)
         }
     }
 
+    if (bytes == 0 && req->body_length < 0) {
+        /* last-chunk, no trailers */
+        int ret = ne_sock_fullwrite(sess->socket, "0" EOL EOL, 5);
+        if (ret < 0) {
+            int aret = aborted(req, _("Could not send request body"), ret);
+            return RETRY_RET(retry, ret, aret);
+        }
+    }
+
     if (bytes == 0) {
         return NE_OK;
     } else {
@@ -540,11 +578,15 @@ ne_request *ne_request_create(ne_session *sess,
     return req;
 }
 
-/* Set the request body length to 'length' */
+/* Set the request body length to 'length', or use chunked
+ * transfer-encoding if 'length' is -1 */
 static void set_body_length(ne_request *req, ne_off_t length)
 {
     req->body_length = length;
-    ne_print_request_header(req, "Content-Length", "%" FMT_NE_OFF_T, length);
+    if (length < 0)
+        ne_add_request_header(req, "Transfer-Encoding", "chunked");
+    else
+        ne_print_request_header(req, "Content-Length", "%" FMT_NE_OFF_T, length);
 }
 
 void ne_set_request_body_buffer(ne_request *req, const char *buffer,
@@ -1021,7 +1063,7 @@ static int send_request(ne_request *req, const ne_buffer *request)
 	return RETRY_RET(retry, sret, aret);
     }
     
-    if (!req->use_expect100 && req->body_length > 0) {
+    if (!req->use_expect100 && req->body_length != 0) {
 	/* Send request body, if not using 100-continue. */
 	ret = send_request_body(req, retry);
 	if (ret) {
@@ -1041,7 +1083,7 @@ static int send_request(ne_request *req, const ne_buffer *request)
 	if ((ret = discard_headers(req)) != NE_OK) break;
 
 	if (req->use_expect100 && (status->code == 100)
-            && req->body_length > 0 && !sentbody) {
+            && req->body_length != 0 && !sentbody) {
 	    /* Send the body after receiving the first 100 Continue */
 	    if ((ret = send_request_body(req, 0)) != NE_OK) break;	    
 	    sentbody = 1;
@@ -85,7 +85,9 @@ typedef ssize_t (*ne_provide_body)(void *userdata,
 /* Install a callback which is invoked as needed to provide the
  * request body, a block at a time.  The total size of the request
  * body is 'length'; the callback must ensure that it returns no more
- * than 'length' bytes in total. */
+ * than 'length' bytes in total.  If 'length' is -1, the body is sent
+ * using chunked transfer-encoding and ends when the callback returns
+ * zero; only use this with HTTP/1.1 servers. */
 void ne_set_request_body_provider(ne_request *req, off_t length,
 				  ne_provide_body provider, void *userdata);
 
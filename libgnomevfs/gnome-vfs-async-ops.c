@@ -1004,6 +1004,11 @@ async_load_directory (GnomeVFSURI *uri,
  * Read the contents of the directory at @text_uri, passing back #GnomeVFSFileInfo 
  * structs about each file in the directory to @callback. @items_per_notification
  * files will be processed between each call to @callback.
+ *
+ * Only a few batches are on their way to @callback at any time; reading
+ * the directory pauses until the main loop has dispatched them, so a
+ * slow consumer keeps the memory used by the load bounded. See
+ * gnome_vfs_async_load_directory_hold() for taking over the pacing.
  */
 void
 gnome_vfs_async_load_directory (GnomeVFSAsyncHandle **handle_return,
@@ -1049,6 +1054,11 @@ gnome_vfs_async_load_directory (GnomeVFSAsyncHandle **handle_return,
  * Read the contents of the directory at @uri, passing back #GnomeVFSFileInfo structs
  * about each file in the directory to @callback. @items_per_notification
  * files will be processed between each call to @callback.
+ *
+ * Only a few batches are on their way to @callback at any time; reading
+ * the directory pauses until the main loop has dispatched them, so a
+ * slow consumer keeps the memory used by the load bounded. See
+ * gnome_vfs_async_load_directory_hold() for taking over the pacing.
  */
 void
 gnome_vfs_async_load_directory_uri (GnomeVFSAsyncHandle **handle_return,
@@ -1071,6 +1081,51 @@ gnome_vfs_async_load_directory_uri (GnomeVFSAsyncHandle **handle_return,
 					       callback, callback_data);
 }
 
+/**
+ * gnome_vfs_async_load_directory_hold:
+ * @handle: handle of the directory load whose callback is running.
+ *
+ * Only valid from inside a #GnomeVFSAsyncDirectoryLoadCallback. Keeps the
+ * batch passed to the callback counted as outstanding after the callback
+ * returns, until gnome_vfs_async_load_directory_release() is called for
+ * it. Use this to process the entries at your own pace: once a few
+ * batches are held, the directory load stops reading until one of them
+ * is released.
+ *
+ * The file infos in the list still have to be reffed to keep them
+ * around past the callback, holding the batch doesn't do that.
+ *
+ * Returns: %TRUE if the batch is now held, %FALSE if called outside of
+ * the callback for @handle.
+ *
+ * Since: 2.26
+ */
+gboolean
+gnome_vfs_async_load_directory_hold (GnomeVFSAsyncHandle *handle)
+{
+	g_return_val_if_fail (handle != NULL, FALSE);
+
+	return _gnome_vfs_job_load_directory_hold (handle);
+}
+
+/**
+ * gnome_vfs_async_load_directory_release:
+ * @handle: handle of the directory load.
+ *
+ * Acknowledges one batch held with gnome_vfs_async_load_directory_hold(),
+ * letting the directory load read on if it was waiting for that. Does
+ * nothing if the load is already over or no batch is held.
+ *
+ * Since: 2.26
+ */
+void
+gnome_vfs_async_load_directory_release (GnomeVFSAsyncHandle *handle)
+{
+	g_return_if_fail (handle != NULL);
+
+	_gnome_vfs_job_load_directory_release (handle);
+}
+
 /**
  * gnome_vfs_async_xfer:
  * @handle_return: when the function returns, will point to a handle for the operation.
@@ -484,6 +484,8 @@ void           gnome_vfs_async_load_directory_uri     (GnomeVFSAsyncHandle
 						       int				      priority,
 						       GnomeVFSAsyncDirectoryLoadCallback     callback,
 						       gpointer                               callback_data);
+gboolean       gnome_vfs_async_load_directory_hold    (GnomeVFSAsyncHandle                   *handle);
+void           gnome_vfs_async_load_directory_release (GnomeVFSAsyncHandle                   *handle);
 GnomeVFSResult gnome_vfs_async_xfer                   (GnomeVFSAsyncHandle                  **handle_return,
 						       GList                                 *source_uri_list,
 						       GList                                 *target_uri_list,
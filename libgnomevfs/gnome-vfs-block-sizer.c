@@ -0,0 +1,187 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 8; tab-width: 8 -*- */
+
+/* gnome-vfs-block-sizer.c - Adaptive I/O block size for the GNOME Virtual
+   File System.
+
+   Copyright (C) 2026 Free Software Foundation
+
+   The Gnome Library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   The Gnome Library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with the Gnome Library; see the file COPYING.LIB.  If not,
+   write to the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, USA.
+*/
+
+#include <config.h>
+#include "gnome-vfs-block-sizer.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Upper bound for the block size unless GNOME_VFS_MAX_BLOCK_SIZE says
+ * otherwise.
+ */
+#define DEFAULT_MAX_BLOCK_SIZE (1024 * 1024)
+
+/* Never go below this, whatever the method advises. */
+#define MIN_BLOCK_SIZE 4096
+
+/* Number of calls measured at each size before deciding on the next. */
+#define SAMPLE_CALLS 4
+
+/* A size is only worth keeping if it moves this much more data per
+ * second than half of it did.
+ */
+#define MIN_GAIN 1.1
+
+/* Calls taking longer than this on average make the block size shrink.
+ * Half of the xfer progress update period, so that progress and
+ * cancellation stay responsive.
+ */
+#define LATENCY_LIMIT_USECS 250000
+
+/* Once settled, the size is tried doubled again after this many rounds
+ * of SAMPLE_CALLS calls that all took less than a quarter of the latency
+ * limit on average, in case the method (or the network) got faster since.
+ */
+#define RETRY_ROUNDS 16
+
+static guint
+get_max_block_size (void)
+{
+	static volatile gint max_block_size = 0;
+	const char *value;
+	long size;
+
+	if (g_atomic_int_get (&max_block_size) == 0) {
+		size = 0;
+		value = getenv ("GNOME_VFS_MAX_BLOCK_SIZE");
+		if (value != NULL) {
+			size = strtol (value, NULL, 10);
+		}
+		if (size < MIN_BLOCK_SIZE) {
+			size = DEFAULT_MAX_BLOCK_SIZE;
+		}
+		g_atomic_int_set (&max_block_size, (gint) MIN (size, G_MAXINT));
+	}
+
+	return g_atomic_int_get (&max_block_size);
+}
+
+void
+_gnome_vfs_block_sizer_init (GnomeVFSBlockSizer *sizer,
+			     guint initial_size)
+{
+	memset (sizer, 0, sizeof (GnomeVFSBlockSizer));
+
+	sizer->max_size = get_max_block_size ();
+	sizer->min_size = CLAMP (initial_size, MIN_BLOCK_SIZE, sizer->max_size);
+	sizer->size = sizer->min_size;
+}
+
+void
+_gnome_vfs_block_sizer_begin (GnomeVFSBlockSizer *sizer)
+{
+	g_get_current_time (&sizer->start);
+}
+
+static void
+sizer_set_size (GnomeVFSBlockSizer *sizer,
+		guint size)
+{
+	sizer->size = CLAMP (size, sizer->min_size, sizer->max_size);
+	sizer->calls = 0;
+	sizer->short_calls = 0;
+	sizer->bytes = 0;
+	sizer->usecs = 0;
+}
+
+void
+_gnome_vfs_block_sizer_end (GnomeVFSBlockSizer *sizer,
+			    GnomeVFSFileSize bytes_requested,
+			    GnomeVFSFileSize bytes_done)
+{
+	GTimeVal now;
+	gint64 usecs;
+	gdouble throughput;
+
+	g_get_current_time (&now);
+	usecs = (gint64) (now.tv_sec - sizer->start.tv_sec) * G_USEC_PER_SEC
+		+ (now.tv_usec - sizer->start.tv_usec);
+	if (usecs < 1) {
+		/* clock went backwards, or the call was too quick to measure */
+		usecs = 1;
+	}
+
+	sizer->calls++;
+	sizer->bytes += bytes_done;
+	sizer->usecs += usecs;
+	if (bytes_done < bytes_requested) {
+		sizer->short_calls++;
+	}
+
+	if (sizer->calls < SAMPLE_CALLS) {
+		return;
+	}
+
+	if (sizer->usecs / sizer->calls > LATENCY_LIMIT_USECS) {
+		/* Too slow per call; back off, and stay there for a while. */
+		sizer->last_throughput = 0;
+		sizer->settled = TRUE;
+		sizer->fast_rounds = 0;
+		sizer_set_size (sizer, sizer->size / 2);
+		return;
+	}
+
+	throughput = (gdouble) sizer->bytes * G_USEC_PER_SEC / sizer->usecs;
+
+	if (sizer->short_calls > 0) {
+		/* If the method doesn't even fill the blocks we ask for,
+		 * bigger ones won't help.
+		 */
+		sizer->fast_rounds = 0;
+		sizer_set_size (sizer, sizer->size);
+		return;
+	}
+
+	if (sizer->settled) {
+		if (sizer->usecs / sizer->calls < LATENCY_LIMIT_USECS / 4) {
+			sizer->fast_rounds++;
+		} else {
+			sizer->fast_rounds = 0;
+		}
+
+		if (sizer->fast_rounds >= RETRY_ROUNDS &&
+		    sizer->size < sizer->max_size) {
+			sizer->settled = FALSE;
+			sizer->fast_rounds = 0;
+			sizer->last_throughput = throughput;
+			sizer_set_size (sizer, sizer->size * 2);
+		} else {
+			sizer_set_size (sizer, sizer->size);
+		}
+		return;
+	}
+
+	if (sizer->last_throughput > 0 &&
+	    throughput < sizer->last_throughput * MIN_GAIN) {
+		/* Doubling didn't pay off; go back to the smaller size. */
+		sizer->settled = TRUE;
+		sizer_set_size (sizer, sizer->size / 2);
+	} else if (sizer->size < sizer->max_size) {
+		sizer->last_throughput = throughput;
+		sizer_set_size (sizer, sizer->size * 2);
+	} else {
+		sizer->settled = TRUE;
+		sizer_set_size (sizer, sizer->size);
+	}
+}
@@ -0,0 +1,73 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 8; tab-width: 8 -*- */
+
+/* gnome-vfs-block-sizer.h - Adaptive I/O block size for the GNOME Virtual
+   File System.
+
+   Copyright (C) 2026 Free Software Foundation
+
+   The Gnome Library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   The Gnome Library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with the Gnome Library; see the file COPYING.LIB.  If not,
+   write to the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, USA.
+*/
+
+#ifndef GNOME_VFS_BLOCK_SIZER_H
+#define GNOME_VFS_BLOCK_SIZER_H
+
+#include <glib.h>
+#include <libgnomevfs/gnome-vfs-file-size.h>
+
+G_BEGIN_DECLS
+
+/* Picks the amount of data to ask a method for per read or write call.
+ * Starts at the block size the method advises and doubles it as long as
+ * that keeps improving the throughput per call, up to a cap (1 MB, or
+ * GNOME_VFS_MAX_BLOCK_SIZE from the environment). Halves it again when
+ * single calls start taking long enough to make progress reporting and
+ * cancellation sluggish. Once settled, tries a bigger size again now and
+ * then if calls have become fast.
+ *
+ * Not thread safe; every loop doing I/O keeps its own sizer.
+ */
+typedef struct {
+	guint size;
+	guint min_size;
+	guint max_size;
+
+	GTimeVal start;
+
+	/* measurements at the current size */
+	guint calls;
+	guint short_calls;
+	GnomeVFSFileSize bytes;
+	gint64 usecs;
+
+	/* bytes per second measured at the previous, smaller size */
+	gdouble last_throughput;
+	gboolean settled;
+	guint fast_rounds;	/* while settled */
+} GnomeVFSBlockSizer;
+
+G_GNUC_INTERNAL void _gnome_vfs_block_sizer_init  (GnomeVFSBlockSizer *sizer,
+						   guint               initial_size);
+G_GNUC_INTERNAL void _gnome_vfs_block_sizer_begin (GnomeVFSBlockSizer *sizer);
+G_GNUC_INTERNAL void _gnome_vfs_block_sizer_end   (GnomeVFSBlockSizer *sizer,
+						   GnomeVFSFileSize    bytes_requested,
+						   GnomeVFSFileSize    bytes_done);
+
+#define _gnome_vfs_block_sizer_get_size(sizer) ((sizer)->size)
+#define _gnome_vfs_block_sizer_get_max_size(sizer) ((sizer)->max_size)
+
+G_END_DECLS
+
+#endif /* GNOME_VFS_BLOCK_SIZER_H */
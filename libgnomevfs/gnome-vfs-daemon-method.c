@@ -22,6 +22,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <unistd.h>
+#ifdef HAVE_SHM_OPEN
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
 #include <glib.h>
 #include <libgnomevfs/gnome-vfs.h>
 #include <libgnomevfs/gnome-vfs-daemon-method.h>
@@ -41,6 +46,10 @@
 
 #define d(x)
 
+/* Size of the memory shared with the daemon for the data of reads and
+ * writes, see get_mapped_buffer () */
+#define MAPPED_BUFFER_SIZE (1024 * 1024)
+
 typedef struct {
 	gint32   handle_id;
 
@@ -58,6 +67,10 @@ typedef struct {
 	DBusConnection *connection;
 	gint conn_id;
 	gint handle;
+
+	guchar  *buffer;
+	gsize    buffer_size;
+	gboolean buffer_failed;
 } LocalConnection;
 
 static void              append_args_valist           (DBusMessage     *message,
@@ -348,6 +361,12 @@ destroy_private_connection (gpointer data)
 {
 	LocalConnection *ret = data;
 
+#ifdef HAVE_SHM_OPEN
+	if (ret->buffer != NULL) {
+		munmap (ret->buffer, ret->buffer_size);
+	}
+#endif
+
 	dbus_connection_close (ret->connection);
 	dbus_connection_unref (ret->connection);
 	g_free (ret);
@@ -433,7 +452,7 @@ get_private_connection ()
 	}
 	
 	
-	ret = g_new (LocalConnection, 1);
+	ret = g_new0 (LocalConnection, 1);
 	ret->connection = private_conn;
 	ret->conn_id = conn_id;
 	ret->handle = 0;
@@ -932,6 +951,188 @@ do_close (GnomeVFSMethod       *method,
 	return GNOME_VFS_OK;
 }
 
+#ifdef HAVE_SHM_OPEN
+/* Sets up memory shared with the daemon on this thread's connection,
+ * which reads and writes can then pass their data through instead of
+ * having it copied into and out of the messages. Returns FALSE if that
+ * didn't work out, for instance with a daemon that is too old for it.
+ */
+static gboolean
+get_mapped_buffer (LocalConnection *connection)
+{
+	static volatile gint  counter = 0;
+	gchar                *name;
+	int                   fd;
+	gpointer              buffer;
+	DBusMessage          *reply;
+	GnomeVFSResult        result;
+
+	if (connection->buffer != NULL) {
+		return TRUE;
+	}
+	if (connection->buffer_failed) {
+		return FALSE;
+	}
+
+	/* only try once */
+	connection->buffer_failed = TRUE;
+
+	name = g_strdup_printf ("/gnome-vfs-%lu-%d", (gulong) getpid (),
+				g_atomic_int_exchange_and_add (&counter, 1));
+
+	fd = shm_open (name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd == -1) {
+		g_free (name);
+		return FALSE;
+	}
+
+	if (ftruncate (fd, MAPPED_BUFFER_SIZE) == -1) {
+		close (fd);
+		shm_unlink (name);
+		g_free (name);
+		return FALSE;
+	}
+
+	buffer = mmap (NULL, MAPPED_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+		       MAP_SHARED, fd, 0);
+	close (fd);
+
+	if (buffer == MAP_FAILED) {
+		shm_unlink (name);
+		g_free (name);
+		return FALSE;
+	}
+
+	reply = execute_operation (DVD_DAEMON_METHOD_MAP_BUFFER,
+				   NULL, &result, -1,
+				   DVD_TYPE_STRING, name,
+				   DVD_TYPE_UINT64, (dbus_uint64_t) MAPPED_BUFFER_SIZE,
+				   DVD_TYPE_LAST);
+
+	/* The daemon has mapped it by now, if at all */
+	shm_unlink (name);
+	g_free (name);
+
+	if (!reply) {
+		/* the connection may be gone too */
+		munmap (buffer, MAPPED_BUFFER_SIZE);
+		return FALSE;
+	}
+
+	if (dbus_message_get_type (reply) == DBUS_MESSAGE_TYPE_ERROR) {
+		/* Unknown method */
+		dbus_message_unref (reply);
+		munmap (buffer, MAPPED_BUFFER_SIZE);
+		return FALSE;
+	}
+
+	if (check_if_reply_is_error (reply, &result)) {
+		munmap (buffer, MAPPED_BUFFER_SIZE);
+		return FALSE;
+	}
+
+	dbus_message_unref (reply);
+
+	connection->buffer = buffer;
+	connection->buffer_size = MAPPED_BUFFER_SIZE;
+	connection->buffer_failed = FALSE;
+
+	return TRUE;
+}
+
+static GnomeVFSResult
+do_read_mapped (LocalConnection  *connection,
+		FileHandle       *handle,
+		gpointer          buffer,
+		GnomeVFSFileSize  num_bytes,
+		GnomeVFSFileSize *bytes_read,
+		GnomeVFSContext  *context)
+{
+	DBusMessage    *reply;
+	GnomeVFSResult  result;
+	dbus_uint64_t   size;
+
+	*bytes_read = 0;
+
+	reply = execute_operation (DVD_DAEMON_METHOD_READ_MAPPED,
+				   context, &result, -1,
+				   DVD_TYPE_INT32, handle->handle_id,
+				   DVD_TYPE_UINT64,
+				   (dbus_uint64_t) MIN (num_bytes, connection->buffer_size),
+				   DVD_TYPE_LAST);
+
+	if (!reply) {
+		return result;
+	}
+
+	if (check_if_reply_is_error (reply, &result)) {
+		return result;
+	}
+
+	dbus_message_get_args (reply, NULL,
+			       DBUS_TYPE_INT32, &result,
+			       DBUS_TYPE_UINT64, &size,
+			       DBUS_TYPE_INVALID);
+
+	dbus_message_unref (reply);
+
+	size = MIN (size, connection->buffer_size);
+	memcpy (buffer, connection->buffer, size);
+
+	*bytes_read = size;
+
+	return GNOME_VFS_OK;
+}
+
+static GnomeVFSResult
+do_write_mapped (LocalConnection  *connection,
+		 FileHandle       *handle,
+		 gconstpointer     buffer,
+		 GnomeVFSFileSize  num_bytes,
+		 GnomeVFSFileSize *bytes_written,
+		 GnomeVFSContext  *context)
+{
+	DBusMessage      *reply;
+	GnomeVFSResult    result;
+	GnomeVFSFileSize  len;
+	dbus_uint64_t     written;
+
+	*bytes_written = 0;
+
+	/* Blocks bigger than the buffer go in several pieces */
+	do {
+		len = MIN (num_bytes - *bytes_written, connection->buffer_size);
+		memcpy (connection->buffer,
+			(const guchar *) buffer + *bytes_written, len);
+
+		reply = execute_operation (DVD_DAEMON_METHOD_WRITE_MAPPED,
+					   context, &result, -1,
+					   DVD_TYPE_INT32, handle->handle_id,
+					   DVD_TYPE_UINT64, (dbus_uint64_t) len,
+					   DVD_TYPE_LAST);
+
+		if (!reply) {
+			return *bytes_written > 0 ? GNOME_VFS_OK : result;
+		}
+
+		if (check_if_reply_is_error (reply, &result)) {
+			return *bytes_written > 0 ? GNOME_VFS_OK : result;
+		}
+
+		dbus_message_get_args (reply, NULL,
+				       DBUS_TYPE_INT32, &result,
+				       DBUS_TYPE_UINT64, &written,
+				       DBUS_TYPE_INVALID);
+
+		dbus_message_unref (reply);
+
+		*bytes_written += written;
+	} while (written == len && *bytes_written < num_bytes);
+
+	return GNOME_VFS_OK;
+}
+#endif
+
 static GnomeVFSResult
 do_read (GnomeVFSMethod *method,
 	 GnomeVFSMethodHandle *method_handle,
@@ -948,9 +1149,20 @@ do_read (GnomeVFSMethod *method,
 	DBusMessageIter  iter;
 	DBusMessageIter  array_iter;
 	int              type;
+#ifdef HAVE_SHM_OPEN
+	LocalConnection *connection;
+#endif
 
 	handle = (FileHandle *) method_handle;
 
+#ifdef HAVE_SHM_OPEN
+	connection = get_private_connection ();
+	if (connection != NULL && get_mapped_buffer (connection)) {
+		return do_read_mapped (connection, handle, buffer, num_bytes,
+				       bytes_read, context);
+	}
+#endif
+
 	reply = execute_operation (DVD_DAEMON_METHOD_READ,
 				   context, &result, -1,
 				   DVD_TYPE_INT32, handle->handle_id,
@@ -1002,9 +1214,20 @@ do_write (GnomeVFSMethod *method,
 	DBusMessage      *reply;
 	GnomeVFSResult    result;
 	dbus_uint64_t     written;
+#ifdef HAVE_SHM_OPEN
+	LocalConnection  *connection;
+#endif
 
 	handle = (FileHandle *) method_handle;
 
+#ifdef HAVE_SHM_OPEN
+	connection = get_private_connection ();
+	if (connection != NULL && get_mapped_buffer (connection)) {
+		return do_write_mapped (connection, handle, buffer, num_bytes,
+					bytes_written, context);
+	}
+#endif
+
 	reply = execute_operation (DVD_DAEMON_METHOD_WRITE,
 				   context, &result, -1,
 				   DVD_TYPE_INT32, handle->handle_id,
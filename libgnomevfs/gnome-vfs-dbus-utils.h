@@ -56,6 +56,12 @@ G_BEGIN_DECLS
 
 #define DVD_DAEMON_METHOD_TRUNCATE_HANDLE           "TruncateHandle"
 
+/* Reads and writes with their data in memory shared with the daemon
+ * instead of in the messages. */
+#define DVD_DAEMON_METHOD_MAP_BUFFER                "MapBuffer"
+#define DVD_DAEMON_METHOD_READ_MAPPED               "ReadMapped"
+#define DVD_DAEMON_METHOD_WRITE_MAPPED              "WriteMapped"
+
 #define DVD_DAEMON_METHOD_OPEN_DIRECTORY            "OpenDirectory"
 #define DVD_DAEMON_METHOD_CLOSE_DIRECTORY           "CloseDirectory"
 #define DVD_DAEMON_METHOD_READ_DIRECTORY            "ReadDirectory"
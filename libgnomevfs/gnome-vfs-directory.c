@@ -25,6 +25,7 @@
 #include "gnome-vfs-directory.h"
 
 #include "gnome-vfs-cancellable-ops.h"
+#include "gnome-vfs-file-info-arena.h"
 #include "gnome-vfs-method.h"
 #include "gnome-vfs-ops.h"
 #include <glib.h>
@@ -671,24 +672,47 @@ gnome_vfs_directory_visit_files (const gchar *text_uri,
 
 static GnomeVFSResult
 load_from_handle (GList **list,
-		  GnomeVFSDirectoryHandle *handle)
+		  GnomeVFSDirectoryHandle *handle,
+		  GnomeVFSFileInfoOptions options)
 {
 	GnomeVFSResult result;
+	GnomeVFSFileInfoArena *arena;
 	GnomeVFSFileInfo *info;
 
 	*list = NULL;
 
+	/* With GNOME_VFS_FILE_INFO_BULK, each entry is read into the same
+	 * info and copied, with its strings, into the arena.
+	 */
+	arena = NULL;
+	if (options & GNOME_VFS_FILE_INFO_BULK) {
+		arena = _gnome_vfs_file_info_arena_new ();
+	}
+
+	info = NULL;
 	for (;;) {
-		info = gnome_vfs_file_info_new ();
+		if (info == NULL) {
+			info = gnome_vfs_file_info_new ();
+		}
 		result = gnome_vfs_directory_read_next (handle, info);
 		if (result != GNOME_VFS_OK)
 			break;
-		*list = g_list_prepend (*list, info);
+		if (arena != NULL) {
+			*list = g_list_prepend (*list,
+						_gnome_vfs_file_info_arena_add (arena, info));
+			gnome_vfs_file_info_clear (info);
+		} else {
+			*list = g_list_prepend (*list, info);
+			info = NULL;
+		}
 	}
 
 	*list = g_list_reverse (*list);
 	
 	gnome_vfs_file_info_unref (info);
+	if (arena != NULL) {
+		_gnome_vfs_file_info_arena_free (arena);
+	}
 
 	if (result != GNOME_VFS_ERROR_EOF) {
 		gnome_vfs_file_info_list_free (*list);
@@ -717,12 +741,13 @@ gnome_vfs_directory_list_load (GList **list,
 	GnomeVFSDirectoryHandle *handle;
 	GnomeVFSResult result;
 
-	result = gnome_vfs_directory_open (&handle, text_uri, options);
+	result = gnome_vfs_directory_open (&handle, text_uri,
+					   options & ~GNOME_VFS_FILE_INFO_BULK);
 	if (result != GNOME_VFS_OK) {
 		return result;
 	}
 
-	result = load_from_handle (list, handle);
+	result = load_from_handle (list, handle, options);
 
 	gnome_vfs_directory_close (handle);
 	return result;
@@ -0,0 +1,45 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 8; tab-width: 8 -*- */
+
+/* gnome-vfs-file-info-arena.h - Bulk allocation of file information for
+   the GNOME Virtual File System.
+
+   Copyright (C) 2026 Free Software Foundation
+
+   The Gnome Library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   The Gnome Library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with the Gnome Library; see the file COPYING.LIB.  If not,
+   write to the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, USA.
+*/
+
+#ifndef GNOME_VFS_FILE_INFO_ARENA_H
+#define GNOME_VFS_FILE_INFO_ARENA_H
+
+#include <libgnomevfs/gnome-vfs-file-info.h>
+
+G_BEGIN_DECLS
+
+/* Directory listings loaded with GNOME_VFS_FILE_INFO_BULK allocate
+ * their file infos, with the strings, in an arena instead of a few heap
+ * blocks per entry. The file infos can be reffed, unreffed and copied
+ * from, but their strings belong to the arena.
+ */
+typedef struct GnomeVFSFileInfoArena GnomeVFSFileInfoArena;
+
+G_GNUC_INTERNAL GnomeVFSFileInfoArena *_gnome_vfs_file_info_arena_new   (void);
+G_GNUC_INTERNAL void                   _gnome_vfs_file_info_arena_free  (GnomeVFSFileInfoArena  *arena);
+G_GNUC_INTERNAL GnomeVFSFileInfo      *_gnome_vfs_file_info_arena_add   (GnomeVFSFileInfoArena  *arena,
+									 const GnomeVFSFileInfo *src);
+
+G_END_DECLS
+
+#endif /* GNOME_VFS_FILE_INFO_ARENA_H */
@@ -24,14 +24,191 @@
 
 #include <config.h>
 #include "gnome-vfs-file-info.h"
+#include "gnome-vfs-file-info-arena.h"
 
 #include <glib.h>
 #include <string.h>
 
-/* Mutex for making GnomeVFSFileInfo ref's/unref's atomic */
-/* Note that an atomic increment function (such as is present in NSPR) is preferable */
-/* FIXME: This mutex is probably not needed and might be causing performance issues */
-static GStaticMutex file_info_ref_lock = G_STATIC_MUTEX_INIT;
+/* The refcount is only ever changed with atomic operations, and clear
+ * and copy leave it alone, so no lock is needed.
+ */
+#define REFCOUNT_OFFSET G_STRUCT_OFFSET (GnomeVFSFileInfo, refcount)
+#define AFTER_REFCOUNT_OFFSET (REFCOUNT_OFFSET + sizeof (guint))
+
+/* A file info in an arena chunk is preceded by a header telling which
+ * chunk it is in and where its strings are. Applications may allocate
+ * file infos themselves, so an arena info is marked by pointing its
+ * reserved1 at its own header. Nothing else can have that value there:
+ * infos from gnome_vfs_file_info_new start out zeroed, and clear and
+ * copy keep the mark of the info they change.
+ */
+typedef struct ArenaChunk ArenaChunk;
+
+typedef struct {
+	ArenaChunk *chunk;
+	gsize strings_size;	/* bytes of strings right after the info */
+} FileInfoHeader;
+
+#define FILE_INFO_HEADER_SIZE ARENA_ALIGN (sizeof (FileInfoHeader))
+#define HEADER_FILE_INFO(header) ((GnomeVFSFileInfo *) ((char *) (header) + FILE_INFO_HEADER_SIZE))
+#define FILE_INFO_HEADER(info) ((FileInfoHeader *) ((char *) (info) - FILE_INFO_HEADER_SIZE))
+#define FILE_INFO_IN_ARENA(info) ((info)->reserved1 == (gpointer) FILE_INFO_HEADER (info))
+
+/* A string of an arena info still points into the chunk unless the
+ * application replaced it. Anything it put there instead was allocated
+ * separately and can't overlap the range.
+ */
+#define FILE_INFO_OWNS_STRING(header, info, str)				\
+	((const char *) (str) >= (const char *) ((info) + 1) &&			\
+	 (const char *) (str) < (const char *) ((info) + 1) + (header)->strings_size)
+
+/* Arenas get memory in chunks of this size, unless a single info needs
+ * more. Each chunk is freed on its own once all its infos are gone, so
+ * an info kept alive holds on to one chunk, not to the whole listing.
+ */
+#define ARENA_CHUNK_SIZE (16 * 1024)
+
+#define ARENA_ALIGN(size) (((size) + 2 * sizeof (gpointer) - 1) & ~(2 * sizeof (gpointer) - 1))
+
+struct ArenaChunk {
+	/* one for the arena while it fills the chunk, one per info */
+	volatile gint refcount;
+	gsize size;
+	gsize used;
+};
+
+#define ARENA_CHUNK_HEADER_SIZE ARENA_ALIGN (sizeof (ArenaChunk))
+#define ARENA_CHUNK_DATA(chunk) ((char *) (chunk) + ARENA_CHUNK_HEADER_SIZE)
+
+struct GnomeVFSFileInfoArena {
+	ArenaChunk *chunk;	/* the one being filled */
+};
+
+static void
+arena_chunk_unref (ArenaChunk *chunk)
+{
+	if (g_atomic_int_dec_and_test (&chunk->refcount)) {
+		g_free (chunk);
+	}
+}
+
+/*
+ * _gnome_vfs_file_info_arena_new:
+ *
+ * Creates an arena to allocate file infos in, together with their
+ * strings, for listings loaded with %GNOME_VFS_FILE_INFO_BULK.
+ *
+ * Returns: a new arena.
+ */
+GnomeVFSFileInfoArena *
+_gnome_vfs_file_info_arena_new (void)
+{
+	return g_new0 (GnomeVFSFileInfoArena, 1);
+}
+
+/*
+ * _gnome_vfs_file_info_arena_free:
+ * @arena: an arena.
+ *
+ * Frees @arena. The file infos added to it stay valid; their memory is
+ * returned chunk by chunk as they are unreffed.
+ */
+void
+_gnome_vfs_file_info_arena_free (GnomeVFSFileInfoArena *arena)
+{
+	if (arena->chunk != NULL) {
+		arena_chunk_unref (arena->chunk);
+	}
+	g_free (arena);
+}
+
+static char *
+copy_string (char **dest,
+	     const char *str)
+{
+	gsize size;
+
+	if (str == NULL) {
+		return NULL;
+	}
+
+	size = strlen (str) + 1;
+	memcpy (*dest, str, size);
+	*dest += size;
+
+	return *dest - size;
+}
+
+/*
+ * _gnome_vfs_file_info_arena_add:
+ * @arena: an arena.
+ * @src: file info to copy.
+ *
+ * Copies @src into @arena, with its strings right after it. The copy
+ * is ref counted like any other file info, but its strings must not be
+ * freed. The arena must not be used from more than one thread at a
+ * time.
+ *
+ * Returns: a new file info with a ref count of one.
+ */
+GnomeVFSFileInfo *
+_gnome_vfs_file_info_arena_add (GnomeVFSFileInfoArena *arena,
+				const GnomeVFSFileInfo *src)
+{
+	FileInfoHeader *header;
+	GnomeVFSFileInfo *info;
+	ArenaChunk *chunk;
+	gsize strings_size;
+	gsize size;
+	char *p;
+
+	strings_size = 0;
+	if (src->name != NULL) {
+		strings_size += strlen (src->name) + 1;
+	}
+	if (src->symlink_name != NULL) {
+		strings_size += strlen (src->symlink_name) + 1;
+	}
+	if (src->mime_type != NULL) {
+		strings_size += strlen (src->mime_type) + 1;
+	}
+	if (src->selinux_context != NULL) {
+		strings_size += strlen (src->selinux_context) + 1;
+	}
+	size = ARENA_ALIGN (FILE_INFO_HEADER_SIZE + sizeof (GnomeVFSFileInfo) + strings_size);
+
+	chunk = arena->chunk;
+	if (chunk == NULL || chunk->size - chunk->used < size) {
+		if (chunk != NULL) {
+			arena_chunk_unref (chunk);
+		}
+		chunk = g_malloc (ARENA_CHUNK_HEADER_SIZE + MAX (ARENA_CHUNK_SIZE, size));
+		chunk->refcount = 1;
+		chunk->size = MAX (ARENA_CHUNK_SIZE, size);
+		chunk->used = 0;
+		arena->chunk = chunk;
+	}
+
+	header = (FileInfoHeader *) (ARENA_CHUNK_DATA (chunk) + chunk->used);
+	chunk->used += size;
+	g_atomic_int_inc (&chunk->refcount);
+
+	header->chunk = chunk;
+	header->strings_size = strings_size;
+
+	info = HEADER_FILE_INFO (header);
+	memcpy (info, src, sizeof (GnomeVFSFileInfo));
+	info->refcount = 1;
+	info->reserved1 = header;
+
+	p = (char *) (info + 1);
+	info->name = copy_string (&p, src->name);
+	info->symlink_name = copy_string (&p, src->symlink_name);
+	info->mime_type = copy_string (&p, src->mime_type);
+	info->selinux_context = copy_string (&p, src->selinux_context);
+
+	return info;
+}
 
 /* Register GnomeVFSFileInfo in the type system */
 GType 
@@ -83,10 +260,7 @@ gnome_vfs_file_info_ref (GnomeVFSFileInfo *info)
 	g_return_if_fail (info != NULL);
 	g_return_if_fail (info->refcount > 0);
 
-	g_static_mutex_lock (&file_info_ref_lock);
-	info->refcount += 1;
-	g_static_mutex_unlock (&file_info_ref_lock);
-	
+	g_atomic_int_inc ((gint *) &info->refcount);
 }
 
 /**
@@ -101,13 +275,18 @@ gnome_vfs_file_info_unref (GnomeVFSFileInfo *info)
 	g_return_if_fail (info != NULL);
 	g_return_if_fail (info->refcount > 0);
 
-	g_static_mutex_lock (&file_info_ref_lock);
-	info->refcount -= 1;
-	g_static_mutex_unlock (&file_info_ref_lock);
+	if (g_atomic_int_dec_and_test ((gint *) &info->refcount)) {
+		FileInfoHeader *header;
+
+		header = FILE_INFO_IN_ARENA (info) ? FILE_INFO_HEADER (info) : NULL;
 
-	if (info->refcount == 0) {
 		gnome_vfs_file_info_clear (info);
-		g_free (info);
+
+		if (header != NULL) {
+			arena_chunk_unref (header->chunk);
+		} else {
+			g_free (info);
+		}
 	}
 }
 
@@ -123,23 +302,30 @@ gnome_vfs_file_info_unref (GnomeVFSFileInfo *info)
 void
 gnome_vfs_file_info_clear (GnomeVFSFileInfo *info)
 {
-	guint old_refcount;
-	
+	FileInfoHeader *header;
+
 	g_return_if_fail (info != NULL);
 
-	g_free (info->name);
-	g_free (info->symlink_name);
-	g_free (info->mime_type);
-	g_free (info->selinux_context);
+	header = FILE_INFO_IN_ARENA (info) ? FILE_INFO_HEADER (info) : NULL;
 
-	/* Ensure the ref count is maintained correctly */
-	g_static_mutex_lock (&file_info_ref_lock);
+	/* strings stored with an arena info go with its chunk */
+	if (header == NULL || !FILE_INFO_OWNS_STRING (header, info, info->name))
+		g_free (info->name);
+	if (header == NULL || !FILE_INFO_OWNS_STRING (header, info, info->symlink_name))
+		g_free (info->symlink_name);
+	if (header == NULL || !FILE_INFO_OWNS_STRING (header, info, info->mime_type))
+		g_free (info->mime_type);
+	if (header == NULL || !FILE_INFO_OWNS_STRING (header, info, info->selinux_context))
+		g_free (info->selinux_context);
 
-	old_refcount = info->refcount;
-	memset (info, 0, sizeof (*info));
-	info->refcount = old_refcount;
+	/* Clear everything but the ref count, which other threads
+	 * may be changing at the same time.
+	 */
+	memset (info, 0, REFCOUNT_OFFSET);
+	memset ((char *) info + AFTER_REFCOUNT_OFFSET, 0,
+		sizeof (*info) - AFTER_REFCOUNT_OFFSET);
 
-	g_static_mutex_unlock (&file_info_ref_lock);
+	info->reserved1 = header;
 }
 
 
@@ -171,24 +357,26 @@ void
 gnome_vfs_file_info_copy (GnomeVFSFileInfo *dest,
 			  const GnomeVFSFileInfo *src)
 {
-	guint old_refcount;
+	gpointer mark;
 
 	g_return_if_fail (dest != NULL);
 	g_return_if_fail (src != NULL);
 
-	/* The primary purpose of this lock is to guarentee that the
-	 * refcount is correctly maintained, not to make the copy
-	 * atomic.  If you want to make the copy atomic, you probably
-	 * want serialize access differently (or perhaps you shouldn't
-	 * use copy)
-	 */
-	g_static_mutex_lock (&file_info_ref_lock);
+	mark = dest->reserved1;
 
-	old_refcount = dest->refcount;
+	/* Copy basic information all at once; we will fix pointers later.
+	 * The ref count of @dest is left alone so that it stays correct.
+	 * This doesn't make the copy atomic; if you need that, serialize
+	 * access to @dest differently (or perhaps you shouldn't use copy).
+	 */
 
-	/* Copy basic information all at once; we will fix pointers later.  */
+	memcpy (dest, src, REFCOUNT_OFFSET);
+	memcpy ((char *) dest + AFTER_REFCOUNT_OFFSET,
+		(const char *) src + AFTER_REFCOUNT_OFFSET,
+		sizeof (*src) - AFTER_REFCOUNT_OFFSET);
 
-	memcpy (dest, src, sizeof (*src));
+	/* whether @dest lives in an arena doesn't change */
+	dest->reserved1 = mark;
 
 	/* Duplicate dynamically allocated strings.  */
 
@@ -196,11 +384,6 @@ gnome_vfs_file_info_copy (GnomeVFSFileInfo *dest,
 	dest->symlink_name = g_strdup (src->symlink_name);
 	dest->mime_type = g_strdup (src->mime_type);
 	dest->selinux_context = g_strdup (src->selinux_context);
-
-	dest->refcount = old_refcount;
-
-	g_static_mutex_unlock (&file_info_ref_lock);
-
 }
 
 /**
@@ -350,6 +350,12 @@ typedef struct {
  * get the filename (if doing so is faster). Useful to e.g. count
  * the number of files.
  * @GNOME_VFS_FILE_INFO_GET_ACL: get ACLs for the file
+ * @GNOME_VFS_FILE_INFO_BULK: When loading a directory listing,
+ * allocate the file infos together in large blocks. Faster for big
+ * directories, but the strings of these file infos must not be freed
+ * and gnome_vfs_file_info_clear() must not be used on them. A block
+ * stays allocated while any of its file infos is alive, so use
+ * gnome_vfs_file_info_dup() on those that are kept for long.
  *
  * Packed boolean bitfield representing options that can
  * be passed into a gnome_vfs_get_file_info() call (or other
@@ -366,7 +372,8 @@ typedef enum {
 	GNOME_VFS_FILE_INFO_GET_ACCESS_RIGHTS = 1 << 4,
 	GNOME_VFS_FILE_INFO_NAME_ONLY = 1 << 5,
 	GNOME_VFS_FILE_INFO_GET_ACL = 1 << 6,
-	GNOME_VFS_FILE_INFO_GET_SELINUX_CONTEXT = 1 << 7
+	GNOME_VFS_FILE_INFO_GET_SELINUX_CONTEXT = 1 << 7,
+	GNOME_VFS_FILE_INFO_BULK = 1 << 8
 } GnomeVFSFileInfoOptions;
 
 /**
@@ -31,6 +31,7 @@ GnomeVFSHandle * _gnome_vfs_handle_new                (GnomeVFSURI             *
 						      GnomeVFSOpenMode         open_mode);
 void             _gnome_vfs_handle_destroy            (GnomeVFSHandle          *handle);
 GnomeVFSOpenMode _gnome_vfs_handle_get_open_mode      (GnomeVFSHandle          *handle);
+GnomeVFSURI *    _gnome_vfs_handle_get_uri            (GnomeVFSHandle          *handle);
 GnomeVFSResult   _gnome_vfs_handle_do_close           (GnomeVFSHandle          *handle,
 						      GnomeVFSContext         *context);
 GnomeVFSResult   _gnome_vfs_handle_do_read            (GnomeVFSHandle          *handle,
@@ -68,6 +69,11 @@ GnomeVFSResult   _gnome_vfs_handle_do_file_control    (GnomeVFSHandle          *
 GnomeVFSResult   _gnome_vfs_handle_forget_cache       (GnomeVFSHandle         *handle,
 						       GnomeVFSFileOffset      offset,
 						       GnomeVFSFileSize        size);
+GnomeVFSResult   _gnome_vfs_handle_do_copy_data       (GnomeVFSHandle          *target_handle,
+						      GnomeVFSHandle          *source_handle,
+						      GnomeVFSFileSize         num_bytes,
+						      GnomeVFSFileSize        *bytes_copied,
+						      GnomeVFSContext         *context);
 
 G_END_DECLS
 
@@ -105,6 +105,14 @@ _gnome_vfs_handle_get_open_mode (GnomeVFSHandle *handle)
 	return handle->open_mode;
 }
 
+GnomeVFSURI *
+_gnome_vfs_handle_get_uri (GnomeVFSHandle *handle)
+{
+	g_return_val_if_fail (handle != NULL, NULL);
+
+	return handle->uri;
+}
+
 
 /* Actions.  */
 
@@ -202,3 +210,30 @@ _gnome_vfs_handle_do_file_control  (GnomeVFSHandle          *handle,
 {
 	INVOKE_AND_RETURN (handle, file_control, (handle->uri->method, handle->method_handle, operation, operation_data, context));
 }
+
+/* Copies data between two handles without passing it through a user
+ * space buffer. This only works if both handles belong to the same method
+ * and that method implements copy_data, GNOME_VFS_ERROR_NOT_SUPPORTED is
+ * returned otherwise.
+ */
+GnomeVFSResult
+_gnome_vfs_handle_do_copy_data (GnomeVFSHandle *target_handle,
+				GnomeVFSHandle *source_handle,
+				GnomeVFSFileSize num_bytes,
+				GnomeVFSFileSize *bytes_copied,
+				GnomeVFSContext *context)
+{
+	*bytes_copied = 0;
+
+	CHECK_IF_OPEN (source_handle);
+	CHECK_IF_OPEN (target_handle);
+
+	if (source_handle->uri->method != target_handle->uri->method) {
+		return GNOME_VFS_ERROR_NOT_SUPPORTED;
+	}
+
+	INVOKE_AND_RETURN (target_handle, copy_data,
+			   (target_handle->uri->method, target_handle->method_handle,
+			    source_handle->method_handle, num_bytes, bytes_copied,
+			    context));
+}
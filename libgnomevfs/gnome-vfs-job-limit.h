@@ -26,7 +26,20 @@
 #ifndef GNOME_VFS_JOB_LIMIT_H
 #define GNOME_VFS_JOB_LIMIT_H
 
+#include <glib.h>
+
+G_BEGIN_DECLS
+
 void	      gnome_vfs_async_set_job_limit  (int              limit);
 int	      gnome_vfs_async_get_job_limit  (void);
 
+void	      gnome_vfs_async_set_host_job_limit (int          limit);
+int	      gnome_vfs_async_get_host_job_limit (void);
+
+int	      gnome_vfs_async_get_queue_depth    (void);
+guint64	      gnome_vfs_async_get_wait_time      (guint64     *average_usec,
+						  guint64     *max_usec);
+
+G_END_DECLS
+
 #endif /* GNOME_VFS_JOB_LIMIT_H */
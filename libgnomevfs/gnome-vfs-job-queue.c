@@ -25,6 +25,7 @@
 #include "gnome-vfs-job-queue.h"
 #include "gnome-vfs-async-job-map.h"
 #include <libgnomevfs/gnome-vfs-job-limit.h>
+#include "gnome-vfs-handle-private.h"
 
 #ifndef DEFAULT_THREAD_COUNT_LIMIT
 #define DEFAULT_THREAD_COUNT_LIMIT 10
@@ -34,17 +35,320 @@
 #define MIN_THREADS 2
 #endif
 
+/* Number of jobs that may run at the same time against one remote
+ * host, so that a few slow servers can't occupy every thread.
+ */
+#ifndef DEFAULT_HOST_JOB_LIMIT
+#define DEFAULT_HOST_JOB_LIMIT 4
+#endif
+
+/* Threads that jobs moving file data (reads, writes, channels, directory
+ * loads, xfers) can never take, so quick metadata jobs always get through.
+ */
+#define METADATA_RESERVED_THREADS 1
+
+/* A job waiting in the queue gains one priority level per this period,
+ * so low priority jobs still run eventually.
+ */
+#define AGING_PERIOD_USEC (250 * 1000)
+
+typedef enum {
+	JOB_LANE_METADATA,
+	JOB_LANE_DATA
+} JobLane;
+
+typedef struct {
+	GnomeVFSJob *job;
+	JobLane lane;
+	char *host_key;		/* NULL for jobs not tied to a remote host */
+	GTimeVal queued_time;
+	guint sequence;
+} QueuedJob;
+
 static GThreadPool *thread_pool = NULL;
 
+/* Protects everything below. */
+static GMutex *queue_lock = NULL;
+
+static GQueue *job_queue = NULL;
+static guint job_sequence = 0;
+
+static int thread_count_limit = DEFAULT_THREAD_COUNT_LIMIT;
+static int host_job_limit = DEFAULT_HOST_JOB_LIMIT;
+
+static int running_count = 0;
+static int running_data_count = 0;
+static GHashTable *running_host_counts = NULL;	/* host key -> count */
+
+static guint64 started_count = 0;
+static guint64 total_wait_usec = 0;
+static guint64 max_wait_usec = 0;
+
 static volatile gboolean gnome_vfs_quitting = FALSE;
 
+static gint64
+time_diff_usec (const GTimeVal *later,
+		const GTimeVal *earlier)
+{
+	return (gint64) (later->tv_sec - earlier->tv_sec) * G_USEC_PER_SEC
+		+ (later->tv_usec - earlier->tv_usec);
+}
+
+static JobLane
+get_job_lane (GnomeVFSOpType type)
+{
+	switch (type) {
+	case GNOME_VFS_OP_OPEN_AS_CHANNEL:
+	case GNOME_VFS_OP_CREATE_AS_CHANNEL:
+	case GNOME_VFS_OP_READ:
+	case GNOME_VFS_OP_WRITE:
+	case GNOME_VFS_OP_LOAD_DIRECTORY:
+	case GNOME_VFS_OP_XFER:
+		return JOB_LANE_DATA;
+	default:
+		return JOB_LANE_METADATA;
+	}
+}
+
+static GnomeVFSURI *
+get_job_uri (GnomeVFSJob *job)
+{
+	GnomeVFSSpecificOp *specifics;
+	GList *uris;
+
+	specifics = &job->op->specifics;
+	uris = NULL;
+
+	switch (job->op->type) {
+	case GNOME_VFS_OP_OPEN:
+		return specifics->open.uri;
+	case GNOME_VFS_OP_OPEN_AS_CHANNEL:
+		return specifics->open_as_channel.uri;
+	case GNOME_VFS_OP_CREATE:
+		return specifics->create.uri;
+	case GNOME_VFS_OP_CREATE_SYMBOLIC_LINK:
+		return specifics->create_symbolic_link.uri;
+	case GNOME_VFS_OP_CREATE_AS_CHANNEL:
+		return specifics->create_as_channel.uri;
+	case GNOME_VFS_OP_LOAD_DIRECTORY:
+		return specifics->load_directory.uri;
+	case GNOME_VFS_OP_SET_FILE_INFO:
+		return specifics->set_file_info.uri;
+	case GNOME_VFS_OP_GET_FILE_INFO:
+		uris = specifics->get_file_info.uris;
+		break;
+	case GNOME_VFS_OP_FIND_DIRECTORY:
+		uris = specifics->find_directory.uris;
+		break;
+	case GNOME_VFS_OP_XFER:
+		uris = specifics->xfer.source_uri_list;
+		break;
+	case GNOME_VFS_OP_CLOSE:
+	case GNOME_VFS_OP_READ:
+	case GNOME_VFS_OP_WRITE:
+	case GNOME_VFS_OP_SEEK:
+	case GNOME_VFS_OP_FILE_CONTROL:
+		if (job->handle != NULL) {
+			return _gnome_vfs_handle_get_uri (job->handle);
+		}
+		break;
+	default:
+		break;
+	}
+
+	return uris != NULL ? uris->data : NULL;
+}
+
+/* Jobs that hold their thread for as long as the application wants: a
+ * channel is served until it is closed, a directory load waits for its
+ * batches to be released and an xfer can wait for the user. Counting
+ * them against the host limit would let a few of them keep every other
+ * job to that host waiting, for good if the application waits for one
+ * of those before letting go of them.
+ */
+static gboolean
+job_is_long_lived (GnomeVFSOpType type)
+{
+	switch (type) {
+	case GNOME_VFS_OP_OPEN_AS_CHANNEL:
+	case GNOME_VFS_OP_CREATE_AS_CHANNEL:
+	case GNOME_VFS_OP_LOAD_DIRECTORY:
+	case GNOME_VFS_OP_XFER:
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+/* Jobs for the same method and host share a concurrency limit. */
+static char *
+get_job_host_key (GnomeVFSJob *job)
+{
+	GnomeVFSURI *uri;
+	const char *host_name;
+
+	if (job_is_long_lived (job->op->type)) {
+		return NULL;
+	}
+
+	uri = get_job_uri (job);
+	if (uri == NULL) {
+		return NULL;
+	}
+
+	host_name = gnome_vfs_uri_get_host_name (uri);
+	if (host_name == NULL || host_name[0] == '\0') {
+		return NULL;
+	}
+
+	return g_strconcat (gnome_vfs_uri_get_scheme (uri), "://", host_name, NULL);
+}
+
+static gboolean
+queued_job_can_run (QueuedJob *queued)
+{
+	int host_count;
+
+	if (queued->lane == JOB_LANE_DATA &&
+	    running_data_count >= thread_count_limit - METADATA_RESERVED_THREADS) {
+		return FALSE;
+	}
+
+	if (queued->host_key != NULL) {
+		host_count = GPOINTER_TO_INT (g_hash_table_lookup (running_host_counts,
+								   queued->host_key));
+		if (host_count >= host_job_limit) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/* Higher runs first. Every AGING_PERIOD_USEC spent waiting is worth one
+ * priority level.
+ */
+static gint64
+queued_job_get_rank (QueuedJob *queued,
+		     const GTimeVal *now)
+{
+	return (gint64) queued->job->priority * AGING_PERIOD_USEC
+		+ time_diff_usec (now, &queued->queued_time);
+}
+
+/* Must be called with queue_lock held. */
 static void
-thread_entry_point (gpointer data, gpointer user_data)
+dispatch_jobs (void)
+{
+	GError *err;
+	GList *node;
+	GList *best_node;
+	QueuedJob *queued;
+	QueuedJob *best;
+	GTimeVal now;
+	gint64 rank;
+	gint64 best_rank;
+	guint64 wait_usec;
+	int host_count;
+
+	while (running_count < thread_count_limit) {
+		g_get_current_time (&now);
+
+		best_node = NULL;
+		best = NULL;
+		best_rank = 0;
+		for (node = job_queue->head; node != NULL; node = node->next) {
+			queued = node->data;
+			if (!queued_job_can_run (queued)) {
+				continue;
+			}
+			rank = queued_job_get_rank (queued, &now);
+			if (best == NULL || rank > best_rank ||
+			    (rank == best_rank && queued->sequence < best->sequence)) {
+				best_node = node;
+				best = queued;
+				best_rank = rank;
+			}
+		}
+
+		if (best == NULL) {
+			break;
+		}
+
+		g_queue_delete_link (job_queue, best_node);
+
+		running_count++;
+		if (best->lane == JOB_LANE_DATA) {
+			running_data_count++;
+		}
+		if (best->host_key != NULL) {
+			host_count = GPOINTER_TO_INT (g_hash_table_lookup (running_host_counts,
+									   best->host_key));
+			g_hash_table_insert (running_host_counts,
+					     g_strdup (best->host_key),
+					     GINT_TO_POINTER (host_count + 1));
+		}
+
+		wait_usec = MAX (time_diff_usec (&now, &best->queued_time), 0);
+		started_count++;
+		total_wait_usec += wait_usec;
+		max_wait_usec = MAX (max_wait_usec, wait_usec);
+
+		JOB_DEBUG (("dispatching job %u after %lu usec, %d running",
+			    GPOINTER_TO_UINT (best->job->job_handle),
+			    (gulong) wait_usec, running_count));
+
+		/* Can only fail to start a new thread, in which case the
+		 * job still waits in the pool's own queue.
+		 */
+		err = NULL;
+		g_thread_pool_push (thread_pool, best, &err);
+		if (G_UNLIKELY (err != NULL)) {
+			g_warning ("Could not push thread %s into pool\n",
+				   err->message);
+			g_error_free (err);
+		}
+	}
+}
+
+static void
+queued_job_finished (QueuedJob *queued)
+{
+	int host_count;
+
+	g_mutex_lock (queue_lock);
+
+	running_count--;
+	if (queued->lane == JOB_LANE_DATA) {
+		running_data_count--;
+	}
+	if (queued->host_key != NULL) {
+		host_count = GPOINTER_TO_INT (g_hash_table_lookup (running_host_counts,
+								   queued->host_key));
+		if (host_count <= 1) {
+			g_hash_table_remove (running_host_counts, queued->host_key);
+		} else {
+			g_hash_table_insert (running_host_counts,
+					     g_strdup (queued->host_key),
+					     GINT_TO_POINTER (host_count - 1));
+		}
+	}
+
+	if (!gnome_vfs_quitting) {
+		dispatch_jobs ();
+	}
+
+	g_mutex_unlock (queue_lock);
+
+	g_free (queued->host_key);
+	g_free (queued);
+}
+
+static void
+run_job (GnomeVFSJob *job)
 {
-	GnomeVFSJob *job;
 	gboolean complete;
 
-	job = (GnomeVFSJob *) data;
 	/* job map must always be locked before the job_lock
 	 * if both locks are needed */
 	_gnome_vfs_async_job_map_lock ();
@@ -78,45 +382,15 @@ thread_entry_point (gpointer data, gpointer user_data)
 	}
 }
 
-static gint
-prioritize_threads (gconstpointer a,
-		    gconstpointer b,
-		    gpointer      user_data)
+static void
+thread_entry_point (gpointer data, gpointer user_data)
 {
-	GnomeVFSJob *job_a;
-	GnomeVFSJob *job_b;
-	int          prio_a;
-	int          prio_b;
-	int          retval;
-	
-	job_a = (GnomeVFSJob *) a;
-	job_b = (GnomeVFSJob *) b;
-
-	prio_a = job_a->priority;
-	prio_b = job_b->priority;
-
-	/* From glib gtk-doc:
-	 * 
-	 * a negative value if the first task should be processed 
-	 * before the second or a positive value if the 
-	 * second task should be processed first. 
-	 *
-	 */
-	
-	if (prio_a > prio_b) {
-		return -1;
-	} else if (prio_a < prio_b) {
-		return 1;
-	}
+	QueuedJob *queued;
 
-	/* Since job_handles are just increasing u-ints
-	 * we return a negative value if job_a->job_handle >
-	 * job_b->job_handle so we have sort the old job
-	 * before the newer one  */
-	retval = GPOINTER_TO_UINT (job_a->job_handle) -
-		 GPOINTER_TO_UINT (job_b->job_handle);
+	queued = (QueuedJob *) data;
 
-	return retval;
+	run_job (queued->job);
+	queued_job_finished (queued);
 }
 
 void
@@ -124,6 +398,9 @@ _gnome_vfs_job_queue_init (void)
 {
 	GError *err = NULL;
 
+	/* The pool never gets more jobs than it has threads for, the
+	 * ordering is all done in dispatch_jobs().
+	 */
 	thread_pool = g_thread_pool_new (thread_entry_point,
 					 NULL,
 					 DEFAULT_THREAD_COUNT_LIMIT,
@@ -134,17 +411,18 @@ _gnome_vfs_job_queue_init (void)
 		g_error ("Could not create threadpool: %s",
 			 err->message);
 	}
-	
-	g_thread_pool_set_sort_function (thread_pool,
-					 prioritize_threads,
-					 NULL);
+
+	queue_lock = g_mutex_new ();
+	job_queue = g_queue_new ();
+	running_host_counts = g_hash_table_new_full (g_str_hash, g_str_equal,
+						     g_free, NULL);
 }
 
 
 gboolean
 _gnome_vfs_job_schedule (GnomeVFSJob *job)
 {
-	GError *err = NULL;
+	QueuedJob *queued;
 	
 	if (G_UNLIKELY (gnome_vfs_quitting)) {
 		/* The application is quitting, the threadpool might already
@@ -155,17 +433,17 @@ _gnome_vfs_job_schedule (GnomeVFSJob *job)
 		return FALSE;
 	}
 
-	g_thread_pool_push (thread_pool, job, &err);
+	queued = g_new0 (QueuedJob, 1);
+	queued->job = job;
+	queued->lane = get_job_lane (job->op->type);
+	queued->host_key = get_job_host_key (job);
+	g_get_current_time (&queued->queued_time);
 
-	if (G_UNLIKELY (err != NULL)) {
-		g_warning ("Could not push thread %s into pool\n",
-			   err->message);
-
-		/* thread did not start up, remove the job from the hash table */
-		_gnome_vfs_async_job_completed (job->job_handle);
-		
-		return FALSE;
-	}
+	g_mutex_lock (queue_lock);
+	queued->sequence = job_sequence++;
+	g_queue_push_tail (job_queue, queued);
+	dispatch_jobs ();
+	g_mutex_unlock (queue_lock);
 
 	return TRUE;	
 }
@@ -187,6 +465,11 @@ gnome_vfs_async_set_job_limit (int limit)
 	}
 
 	g_thread_pool_set_max_threads (thread_pool, limit, NULL);
+
+	g_mutex_lock (queue_lock);
+	thread_count_limit = limit;
+	dispatch_jobs ();
+	g_mutex_unlock (queue_lock);
 }
 
 /**
@@ -200,15 +483,138 @@ gnome_vfs_async_set_job_limit (int limit)
 int
 gnome_vfs_async_get_job_limit (void)
 {
-	return g_thread_pool_get_max_threads (thread_pool);
+	int limit;
+
+	g_mutex_lock (queue_lock);
+	limit = thread_count_limit;
+	g_mutex_unlock (queue_lock);
+
+	return limit;
+}
+
+/**
+ * gnome_vfs_async_set_host_job_limit:
+ * @limit: maximum number of async operations per host.
+ *
+ * Restrict the number of async operations running at the same time
+ * against a single remote host (for a given method) to @limit. Further
+ * operations for that host wait in the queue, leaving the worker threads
+ * to operations on other hosts and on local files.
+ *
+ * Channels, directory loads and transfers can run for as long as the
+ * application keeps them going and don't count against this limit.
+ *
+ * Since: 2.26
+ */
+void
+gnome_vfs_async_set_host_job_limit (int limit)
+{
+	g_return_if_fail (limit >= 1);
+
+	g_mutex_lock (queue_lock);
+	host_job_limit = limit;
+	dispatch_jobs ();
+	g_mutex_unlock (queue_lock);
+}
+
+/**
+ * gnome_vfs_async_get_host_job_limit:
+ *
+ * Get the current maximum number of async operations that may run
+ * at the same time against a single remote host.
+ *
+ * Return value: current maximum number of operations per host.
+ *
+ * Since: 2.26
+ */
+int
+gnome_vfs_async_get_host_job_limit (void)
+{
+	int limit;
+
+	g_mutex_lock (queue_lock);
+	limit = host_job_limit;
+	g_mutex_unlock (queue_lock);
+
+	return limit;
+}
+
+/**
+ * gnome_vfs_async_get_queue_depth:
+ *
+ * Get the number of async operations that are waiting for a worker
+ * thread, not counting the ones that are running.
+ *
+ * Return value: number of queued operations.
+ *
+ * Since: 2.26
+ */
+int
+gnome_vfs_async_get_queue_depth (void)
+{
+	int depth;
+
+	g_mutex_lock (queue_lock);
+	depth = g_queue_get_length (job_queue);
+	g_mutex_unlock (queue_lock);
+
+	return depth;
+}
+
+/**
+ * gnome_vfs_async_get_wait_time:
+ * @average_usec: return location for the average wait time, or %NULL.
+ * @max_usec: return location for the longest wait time, or %NULL.
+ *
+ * Get how long async operations have waited in the queue before a worker
+ * thread started them, in microseconds, over all operations started so far.
+ *
+ * Return value: number of operations the statistics are based on.
+ *
+ * Since: 2.26
+ */
+guint64
+gnome_vfs_async_get_wait_time (guint64 *average_usec,
+			       guint64 *max_usec)
+{
+	guint64 count;
+
+	g_mutex_lock (queue_lock);
+	count = started_count;
+	if (average_usec != NULL) {
+		*average_usec = count > 0 ? total_wait_usec / count : 0;
+	}
+	if (max_usec != NULL) {
+		*max_usec = max_wait_usec;
+	}
+	g_mutex_unlock (queue_lock);
+
+	return count;
 }
 
 void
 _gnome_vfs_job_queue_shutdown (void)
 {
-	g_thread_pool_free (thread_pool, FALSE, FALSE);
+	QueuedJob *queued;
 
+	g_mutex_lock (queue_lock);
 	gnome_vfs_quitting = TRUE;
+	_gnome_vfs_job_load_directory_shutdown ();
+	/* Hand what's still queued to the pool, which finishes it before
+	 * going away.
+	 */
+	while ((queued = g_queue_pop_head (job_queue)) != NULL) {
+		running_count++;
+		if (queued->lane == JOB_LANE_DATA) {
+			running_data_count++;
+		}
+		g_free (queued->host_key);
+		queued->host_key = NULL;
+		g_thread_pool_push (thread_pool, queued, NULL);
+	}
+	g_mutex_unlock (queue_lock);
+
+	g_thread_pool_free (thread_pool, FALSE, FALSE);
 
 	while (gnome_vfs_job_get_count () != 0) {
 		
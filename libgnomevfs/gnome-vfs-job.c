@@ -31,6 +31,8 @@ System (version for POSIX threads).
 #include "gnome-vfs-job.h"
 
 #include "gnome-vfs-async-job-map.h"
+#include "gnome-vfs-block-sizer.h"
+#include "gnome-vfs-file-info-arena.h"
 #include "gnome-vfs-job-queue.h"
 #include "gnome-vfs-private-utils.h"
 #include "gnome-vfs-module-callback-private.h"
@@ -69,6 +71,35 @@ GStaticMutex debug_mutex = G_STATIC_MUTEX_INIT;
 
 static int job_count = 0;
 
+/* Number of batches a directory load may have waiting for its callback,
+ * or held by it, before the worker stops reading the directory. Together
+ * with items_per_notification this bounds the memory a load can use no
+ * matter how slow the main loop is.
+ */
+#define LOAD_DIRECTORY_MAX_PENDING_BATCHES 4
+
+struct GnomeVFSLoadDirectoryFlow {
+	GnomeVFSAsyncHandle *job_handle;
+	guint refcount;
+
+	/* batches notified but not acknowledged yet */
+	guint pending;
+	/* of these, batches the callback held on to */
+	guint held;
+
+	/* signalled when a batch is acknowledged or the job cancelled */
+	GCond *cond;
+	gboolean cancelled;
+};
+
+static GStaticMutex load_directory_flow_lock = G_STATIC_MUTEX_INIT;
+/* job handle -> flow of the directory loads in progress */
+static GHashTable *load_directory_flows;
+static gboolean load_directory_flow_shutting_down = FALSE;
+
+/* The load directory result whose callback is running, main thread only. */
+static GnomeVFSNotifyResult *current_load_directory_result;
+
 static void     gnome_vfs_op_destroy                (GnomeVFSOp           *op);
 static void     _gnome_vfs_job_destroy_notify_result (GnomeVFSNotifyResult *notify_result);
 static gboolean dispatch_job_callback               (gpointer              data);
@@ -233,11 +264,19 @@ dispatch_seek_callback (GnomeVFSNotifyResult *notify_result)
 static void
 dispatch_load_directory_callback (GnomeVFSNotifyResult *notify_result)
 {
+	GnomeVFSNotifyResult *previous_result;
+
+	/* callbacks can run nested main loops */
+	previous_result = current_load_directory_result;
+	current_load_directory_result = notify_result;
+
 	(* notify_result->specifics.load_directory.callback) (notify_result->job_handle,
 							      notify_result->specifics.load_directory.result,
 							      notify_result->specifics.load_directory.list,
 							      notify_result->specifics.load_directory.entries_read,
 							      notify_result->specifics.load_directory.callback_data);
+
+	current_load_directory_result = previous_result;
 }
 
 static void
@@ -355,6 +394,182 @@ free_find_directory_notify_result (GnomeVFSFindDirectoryOpResult *notify_result)
 	g_list_free (notify_result->result_list);
 }
 
+static GnomeVFSLoadDirectoryFlow *
+load_directory_flow_new (GnomeVFSAsyncHandle *job_handle)
+{
+	GnomeVFSLoadDirectoryFlow *flow;
+
+	flow = g_new0 (GnomeVFSLoadDirectoryFlow, 1);
+	flow->job_handle = job_handle;
+	flow->refcount = 1;
+	flow->cond = g_cond_new ();
+
+	g_static_mutex_lock (&load_directory_flow_lock);
+	if (load_directory_flows == NULL) {
+		load_directory_flows = g_hash_table_new (NULL, NULL);
+	}
+	g_hash_table_insert (load_directory_flows, job_handle, flow);
+	g_static_mutex_unlock (&load_directory_flow_lock);
+
+	return flow;
+}
+
+/* Called with load_directory_flow_lock held. */
+static void
+load_directory_flow_unref_locked (GnomeVFSLoadDirectoryFlow *flow)
+{
+	g_assert (flow->refcount > 0);
+
+	if (--flow->refcount == 0) {
+		g_cond_free (flow->cond);
+		g_free (flow);
+	}
+}
+
+/* Called by the worker once it won't notify any more batches. */
+static void
+load_directory_flow_finish (GnomeVFSLoadDirectoryFlow *flow)
+{
+	g_static_mutex_lock (&load_directory_flow_lock);
+	g_hash_table_remove (load_directory_flows, flow->job_handle);
+	load_directory_flow_unref_locked (flow);
+	g_static_mutex_unlock (&load_directory_flow_lock);
+}
+
+/* Waits until the worker may notify another batch and accounts for it.
+ * Returns FALSE if the job was cancelled while waiting.
+ */
+static gboolean
+load_directory_flow_wait (GnomeVFSLoadDirectoryFlow *flow,
+			  GnomeVFSContext *context)
+{
+	gboolean cancelled;
+
+	cancelled = FALSE;
+
+	g_static_mutex_lock (&load_directory_flow_lock);
+	while (flow->pending >= LOAD_DIRECTORY_MAX_PENDING_BATCHES
+	       && !load_directory_flow_shutting_down) {
+		/* load_directory_flow_cancel() sets the flag after the
+		 * context, under the lock, so checking both here can't
+		 * miss a cancel that comes in before the wait */
+		if (flow->cancelled
+		    || gnome_vfs_context_check_cancellation (context)) {
+			cancelled = TRUE;
+			break;
+		}
+		g_cond_wait (flow->cond,
+			     g_static_mutex_get_mutex (&load_directory_flow_lock));
+	}
+	if (!cancelled) {
+		flow->pending++;
+		flow->refcount++;
+	}
+	g_static_mutex_unlock (&load_directory_flow_lock);
+
+	return !cancelled;
+}
+
+/* The batch of notify_result has been handed to the callback or
+ * dropped; lets the worker go on, unless the callback held the batch.
+ */
+static void
+load_directory_flow_ack (GnomeVFSLoadDirectoryOpResult *result)
+{
+	GnomeVFSLoadDirectoryFlow *flow;
+
+	flow = result->flow;
+	result->flow = NULL;
+
+	g_static_mutex_lock (&load_directory_flow_lock);
+	if (result->held) {
+		flow->held++;
+	} else {
+		flow->pending--;
+		g_cond_signal (flow->cond);
+	}
+	load_directory_flow_unref_locked (flow);
+	g_static_mutex_unlock (&load_directory_flow_lock);
+}
+
+gboolean
+_gnome_vfs_job_load_directory_hold (GnomeVFSAsyncHandle *job_handle)
+{
+	GnomeVFSNotifyResult *notify_result;
+
+	notify_result = current_load_directory_result;
+	if (notify_result == NULL
+	    || notify_result->job_handle != job_handle
+	    || notify_result->specifics.load_directory.flow == NULL) {
+		return FALSE;
+	}
+
+	notify_result->specifics.load_directory.held = TRUE;
+	return TRUE;
+}
+
+void
+_gnome_vfs_job_load_directory_release (GnomeVFSAsyncHandle *job_handle)
+{
+	GnomeVFSLoadDirectoryFlow *flow;
+
+	g_static_mutex_lock (&load_directory_flow_lock);
+	flow = NULL;
+	if (load_directory_flows != NULL) {
+		flow = g_hash_table_lookup (load_directory_flows, job_handle);
+	}
+	/* Once the load is over there is nobody left to wake up. */
+	if (flow != NULL && flow->held > 0) {
+		flow->held--;
+		flow->pending--;
+		g_cond_signal (flow->cond);
+	}
+	g_static_mutex_unlock (&load_directory_flow_lock);
+}
+
+/* Wakes up the worker of job_handle if it waits for the callback, after
+ * its context has been cancelled. */
+static void
+load_directory_flow_cancel (GnomeVFSAsyncHandle *job_handle)
+{
+	GnomeVFSLoadDirectoryFlow *flow;
+
+	g_static_mutex_lock (&load_directory_flow_lock);
+	flow = NULL;
+	if (load_directory_flows != NULL) {
+		flow = g_hash_table_lookup (load_directory_flows, job_handle);
+	}
+	if (flow != NULL) {
+		flow->cancelled = TRUE;
+		g_cond_signal (flow->cond);
+	}
+	g_static_mutex_unlock (&load_directory_flow_lock);
+}
+
+static void
+load_directory_flow_wake (gpointer key, gpointer value, gpointer user_data)
+{
+	GnomeVFSLoadDirectoryFlow *flow;
+
+	flow = value;
+	g_cond_signal (flow->cond);
+}
+
+void
+_gnome_vfs_job_load_directory_shutdown (void)
+{
+	/* Batches held by callbacks may never be released, don't let
+	 * that keep shutdown waiting for the jobs.
+	 */
+	g_static_mutex_lock (&load_directory_flow_lock);
+	load_directory_flow_shutting_down = TRUE;
+	if (load_directory_flows != NULL) {
+		g_hash_table_foreach (load_directory_flows,
+				      load_directory_flow_wake, NULL);
+	}
+	g_static_mutex_unlock (&load_directory_flow_lock);
+}
+
 static void
 _gnome_vfs_job_destroy_notify_result (GnomeVFSNotifyResult *notify_result)
 {
@@ -398,6 +613,9 @@ _gnome_vfs_job_destroy_notify_result (GnomeVFSNotifyResult *notify_result)
 		
 	case GNOME_VFS_OP_LOAD_DIRECTORY:
 		gnome_vfs_file_info_list_free (notify_result->specifics.load_directory.list);
+		if (notify_result->specifics.load_directory.flow != NULL) {
+			load_directory_flow_ack (&notify_result->specifics.load_directory);
+		}
 		g_free (notify_result);
 		break;
 
@@ -769,12 +987,19 @@ serve_channel_read (GnomeVFSHandle *handle,
 	guint filled_bytes_in_buffer;
 	guint written_bytes_in_buffer;
 	guint current_buffer_size;
+	guint block_size;
+	GnomeVFSBlockSizer sizer;
 	
 	if (advised_block_size == 0) {
 		advised_block_size = DEFAULT_BUFFER_SIZE;
 	}
 
-	current_buffer_size = advised_block_size;
+	/* The advised block size is only where we start; the sizer grows
+	   it while the method keeps up, e.g. for network methods that
+	   advise small blocks. */
+	_gnome_vfs_block_sizer_init (&sizer, advised_block_size);
+
+	current_buffer_size = _gnome_vfs_block_sizer_get_size (&sizer);
 	buffer = g_malloc(current_buffer_size);
 	filled_bytes_in_buffer = 0;
 	written_bytes_in_buffer = 0;
@@ -788,13 +1013,28 @@ serve_channel_read (GnomeVFSHandle *handle,
 		
 		g_assert(filled_bytes_in_buffer <= current_buffer_size);
 		g_assert(written_bytes_in_buffer == 0);
-		
+
+		block_size = _gnome_vfs_block_sizer_get_size (&sizer);
+		if (filled_bytes_in_buffer == 0 && current_buffer_size < block_size) {
+			current_buffer_size = block_size;
+			g_free (buffer);
+			buffer = g_malloc (current_buffer_size);
+		}
+		block_size = MIN (block_size, current_buffer_size - filled_bytes_in_buffer);
+
+		_gnome_vfs_block_sizer_begin (&sizer);
 		result = gnome_vfs_read_cancellable (handle,
 						     (char *) buffer + filled_bytes_in_buffer,
-						     MIN (advised_block_size, (current_buffer_size
-						     	- filled_bytes_in_buffer)),
+						     block_size,
 						     &bytes_read, context);
 
+		/* Reads topping up a partially drained buffer are shorter
+		   than the block size, don't let them skew the measurement. */
+		if (result == GNOME_VFS_OK &&
+		    block_size == _gnome_vfs_block_sizer_get_size (&sizer)) {
+			_gnome_vfs_block_sizer_end (&sizer, block_size, bytes_read);
+		}
+
 		if (result == GNOME_VFS_ERROR_INTERRUPTED) {
 			continue;
 		} else if (result != GNOME_VFS_OK && result != GNOME_VFS_ERROR_EOF) {
@@ -895,12 +1135,24 @@ static void
 serve_channel_write (GnomeVFSHandle *handle,
 		     GIOChannel *channel_in,
 		     GIOChannel *channel_out,
+		     gulong advised_block_size,
 		     GnomeVFSContext *context)
 {
-	gchar buffer[DEFAULT_BUFFER_SIZE];
+	gchar *buffer;
 	guint buffer_size;
+	guint block_size;
+	GnomeVFSBlockSizer sizer;
+
+	if (advised_block_size == 0) {
+		advised_block_size = DEFAULT_BUFFER_SIZE;
+	}
+
+	/* As in serve_channel_read (), but only the writes to the method
+	   are measured; how fast the pipe fills is up to the application. */
+	_gnome_vfs_block_sizer_init (&sizer, advised_block_size);
 
-	buffer_size = DEFAULT_BUFFER_SIZE;
+	buffer_size = _gnome_vfs_block_sizer_get_size (&sizer);
+	buffer = g_malloc (buffer_size);
 
 	while (1) {
 		GnomeVFSResult result;
@@ -910,7 +1162,14 @@ serve_channel_write (GnomeVFSHandle *handle,
 		GnomeVFSFileSize bytes_written;
 		gchar *p;
 
-		io_result = g_io_channel_read_chars (channel_in, buffer, buffer_size,
+		block_size = _gnome_vfs_block_sizer_get_size (&sizer);
+		if (buffer_size < block_size) {
+			buffer_size = block_size;
+			g_free (buffer);
+			buffer = g_malloc (buffer_size);
+		}
+
+		io_result = g_io_channel_read_chars (channel_in, buffer, block_size,
 						     &bytes_read, NULL);
                 
 		if (io_result == G_IO_STATUS_AGAIN)
@@ -921,6 +1180,7 @@ serve_channel_write (GnomeVFSHandle *handle,
 		p = buffer;
 		bytes_to_write = bytes_read;
 		while (bytes_to_write > 0) {
+			_gnome_vfs_block_sizer_begin (&sizer);
 			result = gnome_vfs_write_cancellable (handle,
 							      p,
 							      bytes_to_write,
@@ -929,6 +1189,12 @@ serve_channel_write (GnomeVFSHandle *handle,
 			if (result == GNOME_VFS_ERROR_INTERRUPTED) {
 				continue;
 			}
+
+			/* Only whole blocks count, like the reads on the
+			   other side. */
+			if (result == GNOME_VFS_OK && bytes_to_write == block_size) {
+				_gnome_vfs_block_sizer_end (&sizer, block_size, bytes_written);
+			}
 			
 			if (result != GNOME_VFS_OK || bytes_written == 0) {
 				goto end;
@@ -940,6 +1206,7 @@ serve_channel_write (GnomeVFSHandle *handle,
 	}
 
  end:
+	g_free (buffer);
 	g_io_channel_shutdown (channel_in, TRUE, NULL);
 	g_io_channel_unref (channel_in);
 	g_io_channel_unref (channel_out);
@@ -1061,6 +1328,7 @@ execute_open_as_channel (GnomeVFSJob *job)
 				    job->op->context);
 	} else {
 		serve_channel_write (handle, channel_in, channel_out,
+				     open_as_channel_op->advised_block_size,
 				     job->op->context);
 	}
 }
@@ -1193,7 +1461,7 @@ execute_create_as_channel (GnomeVFSJob *job)
 
 	job_notify (job, notify_result);
 
-	serve_channel_write (handle, channel_in, channel_out, job->op->context);
+	serve_channel_write (handle, channel_in, channel_out, 0, job->op->context);
 }
 
 static void
@@ -1427,7 +1695,10 @@ load_directory_details (GnomeVFSJob *job)
 {
 	GnomeVFSLoadDirectoryOp *load_directory_op;
 	GnomeVFSDirectoryHandle *handle;
+	GnomeVFSLoadDirectoryFlow *flow;
 	GList *directory_list;
+	GnomeVFSFileInfoArena *arena;
+	GnomeVFSFileInfo *read_info;
 	GnomeVFSFileInfo *info;
 	GnomeVFSResult result;
 	guint count;
@@ -1442,7 +1713,7 @@ load_directory_details (GnomeVFSJob *job)
 		result = gnome_vfs_directory_open_from_uri_cancellable
 			(&handle,
 			 load_directory_op->uri,
-			 load_directory_op->options,
+			 load_directory_op->options & ~GNOME_VFS_FILE_INFO_BULK,
 			 job->op->context);
 	}
 
@@ -1460,6 +1731,22 @@ load_directory_details (GnomeVFSJob *job)
 
 	directory_list = NULL;
 
+	/* At most LOAD_DIRECTORY_MAX_PENDING_BATCHES batches are on their
+	 * way to the callback at any time; reading stops until the oldest
+	 * one has been dispatched (or released, if the callback held it).
+	 */
+	flow = load_directory_flow_new (job->job_handle);
+
+	/* With GNOME_VFS_FILE_INFO_BULK, each entry is read into the same
+	 * info and copied, with its strings, into the arena.
+	 */
+	arena = NULL;
+	read_info = NULL;
+	if (load_directory_op->options & GNOME_VFS_FILE_INFO_BULK) {
+		arena = _gnome_vfs_file_info_arena_new ();
+		read_info = gnome_vfs_file_info_new ();
+	}
+
 	count = 0;
 	while (1) {
 		if (gnome_vfs_context_check_cancellation (job->op->context)) {
@@ -1471,21 +1758,34 @@ load_directory_details (GnomeVFSJob *job)
 			break;
 		}
 
-		info = gnome_vfs_file_info_new ();
+		info = arena != NULL ? read_info : gnome_vfs_file_info_new ();
 
 		result = gnome_vfs_directory_read_next_cancellable
 			(handle, info, job->op->context);
 
 		if (result == GNOME_VFS_OK) {
+			if (arena != NULL) {
+				info = _gnome_vfs_file_info_arena_add (arena, read_info);
+				gnome_vfs_file_info_clear (read_info);
+			}
 			directory_list = g_list_prepend (directory_list, info);
 			count++;
-		} else {
+		} else if (arena == NULL) {
 			gnome_vfs_file_info_unref (info);
 		}
 
 		if (count == load_directory_op->items_per_notification
 			|| result != GNOME_VFS_OK) {
 
+			if (!load_directory_flow_wait (flow, job->op->context)) {
+				JOB_DEBUG (("cancelled while waiting, bailing %u",
+					    GPOINTER_TO_UINT (job->job_handle)));
+				gnome_vfs_file_info_list_free (directory_list);
+				directory_list = NULL;
+				result = GNOME_VFS_ERROR_CANCELLED;
+				break;
+			}
+
 			notify_result = g_new0 (GnomeVFSNotifyResult, 1);
 			notify_result->job_handle = job->job_handle;
 			notify_result->type = job->op->type;
@@ -1497,6 +1797,7 @@ load_directory_details (GnomeVFSJob *job)
 				(GnomeVFSAsyncDirectoryLoadCallback) job->op->callback;
 			notify_result->specifics.load_directory.callback_data =
 				job->op->callback_data;
+			notify_result->specifics.load_directory.flow = flow;
 
 			job_oneway_notify (job, notify_result);
 
@@ -1510,6 +1811,11 @@ load_directory_details (GnomeVFSJob *job)
 	}
 
 	g_assert (directory_list == NULL);
+	load_directory_flow_finish (flow);
+	if (arena != NULL) {
+		_gnome_vfs_file_info_arena_free (arena);
+		gnome_vfs_file_info_unref (read_info);
+	}
 	gnome_vfs_directory_close (handle);
 }
 
@@ -1720,6 +2026,10 @@ _gnome_vfs_job_module_cancel (GnomeVFSJob *job)
 		gnome_vfs_cancellation_cancel (cancellation);
 	}
 
+	if (job->op->type == GNOME_VFS_OP_LOAD_DIRECTORY) {
+		load_directory_flow_cancel (job->job_handle);
+	}
+
 #ifdef OLD_CONTEXT_DEPRECATED	
 	gnome_vfs_context_emit_message (job->op->context, _("Operation stopped"));
 #endif /* OLD_CONTEXT_DEPRECATED */
@@ -258,12 +258,19 @@ typedef struct {
 	guint items_per_notification;
 } GnomeVFSLoadDirectoryOp;
 
+typedef struct GnomeVFSLoadDirectoryFlow GnomeVFSLoadDirectoryFlow;
+
 typedef struct {
 	GnomeVFSAsyncDirectoryLoadCallback callback;
 	void *callback_data;
 	GnomeVFSResult result;
 	GList *list;
 	guint entries_read;
+	/* Flow control shared with the job; the batch counts as
+	 * outstanding until this result is destroyed (or released, if
+	 * the callback held it). */
+	GnomeVFSLoadDirectoryFlow *flow;
+	gboolean held;
 } GnomeVFSLoadDirectoryOpResult;
 
 typedef struct {
@@ -434,4 +441,11 @@ int          	 gnome_vfs_job_get_count 	  (void);
 G_GNUC_INTERNAL
 gboolean	 _gnome_vfs_job_complete	  (GnomeVFSJob 		*job);
 
+G_GNUC_INTERNAL
+gboolean	 _gnome_vfs_job_load_directory_hold    (GnomeVFSAsyncHandle *job_handle);
+G_GNUC_INTERNAL
+void		 _gnome_vfs_job_load_directory_release (GnomeVFSAsyncHandle *job_handle);
+G_GNUC_INTERNAL
+void		 _gnome_vfs_job_load_directory_shutdown (void);
+
 #endif /* GNOME_VFS_JOB_H */
@@ -227,6 +227,14 @@ typedef GnomeVFSResult (* GnomeVFSMethodGetVolumeFreeSpaceFunc)
      					(GnomeVFSMethod *method,
 					 const GnomeVFSURI *uri,
 				 	 GnomeVFSFileSize *free_space);
+
+typedef GnomeVFSResult (* GnomeVFSMethodCopyDataFunc)
+     					(GnomeVFSMethod *method,
+      					 GnomeVFSMethodHandle *target_method_handle,
+      					 GnomeVFSMethodHandle *source_method_handle,
+					 GnomeVFSFileSize num_bytes,
+					 GnomeVFSFileSize *bytes_copied_return,
+					 GnomeVFSContext *context);
 
 
 /* Use this macro to test whether a given function is implemented in
@@ -268,6 +276,7 @@ struct GnomeVFSMethod {
 	GnomeVFSMethodFileControlFunc file_control;
 	GnomeVFSMethodForgetCacheFunc forget_cache;
 	GnomeVFSMethodGetVolumeFreeSpaceFunc get_volume_free_space;
+	GnomeVFSMethodCopyDataFunc copy_data;
 };
 
 gboolean	   gnome_vfs_method_init   (void);
@@ -36,8 +36,10 @@
 #include <config.h>
 #include "gnome-vfs-xfer.h"
 
+#include "gnome-vfs-block-sizer.h"
 #include "gnome-vfs-cancellable-ops.h"
 #include "gnome-vfs-directory.h"
+#include "gnome-vfs-handle-private.h"
 #include "gnome-vfs-ops.h"
 #include "gnome-vfs-utils.h"
 #include "gnome-vfs-private-utils.h"
@@ -1200,33 +1202,394 @@ create_directory (GnomeVFSURI *dir_uri,
 	return result;
 }
 
-/* Copy the data of a single file. */
+/* Files at least this large are copied by a separate reader thread
+ * feeding a ring of buffers, so that reading the source and writing
+ * the target can overlap. Smaller files (and files of unknown size
+ * below one block) are not worth the thread start-up.
+ */
+#define PIPELINE_SIZE_LIMIT (256 * 1024)
+
+/* Number of buffers in the ring shared by the reader and the writer. */
+#define PIPELINE_BUFFER_COUNT 4
+
+/* Amount of data handed to the method's copy_data at once. Small enough
+ * that the progress callback still gets called about every UPDATE_PERIOD
+ * on slow disks.
+ */
+#define COPY_DATA_CHUNK_SIZE (8 * 1024 * 1024)
+
+typedef struct {
+	gpointer data;
+	guint size;
+	GnomeVFSFileSize bytes_read;
+	GnomeVFSResult result;
+} CopyPipelineBuffer;
+
+typedef struct {
+	GnomeVFSHandle *source_handle;
+	GnomeVFSContext *context;
+	GnomeVFSBlockSizer sizer;
+	gboolean forget_cache;
+
+	GMutex *lock;
+	GCond *cond;
+
+	CopyPipelineBuffer buffers[PIPELINE_BUFFER_COUNT];
+	guint head;	/* next buffer to be written */
+	guint count;	/* number of buffers filled by the reader */
+
+	/* Set by the writer. The reader stops after a read error until
+	 * the writer has asked the user whether to retry it.
+	 */
+	gboolean stop;
+	gboolean retry_read;
+} CopyPipeline;
+
+static gpointer
+copy_pipeline_reader (gpointer data)
+{
+	CopyPipeline *pipeline;
+	CopyPipelineBuffer *buffer;
+	GnomeVFSFileSize total_bytes_read;
+	GnomeVFSFileSize last_cache_drop_point;
+	GnomeVFSFileSize bytes_read;
+	GnomeVFSResult result;
+	guint block_size;
+
+	pipeline = data;
+	total_bytes_read = 0;
+	last_cache_drop_point = 0;
+
+	g_mutex_lock (pipeline->lock);
+	while (!pipeline->stop) {
+		if (pipeline->count == PIPELINE_BUFFER_COUNT) {
+			g_cond_wait (pipeline->cond, pipeline->lock);
+			continue;
+		}
+		buffer = &pipeline->buffers[(pipeline->head + pipeline->count) % PIPELINE_BUFFER_COUNT];
+		g_mutex_unlock (pipeline->lock);
+
+		/* The buffer is ours until it is handed to the writer. */
+		block_size = _gnome_vfs_block_sizer_get_size (&pipeline->sizer);
+		if (buffer->size < block_size) {
+			g_free (buffer->data);
+			buffer->data = g_malloc (block_size);
+			buffer->size = block_size;
+		}
+
+		_gnome_vfs_block_sizer_begin (&pipeline->sizer);
+		result = gnome_vfs_read_cancellable (pipeline->source_handle,
+						     buffer->data,
+						     block_size,
+						     &bytes_read,
+						     pipeline->context);
+		if (result == GNOME_VFS_OK) {
+			_gnome_vfs_block_sizer_end (&pipeline->sizer,
+						    block_size, bytes_read);
+			total_bytes_read += bytes_read;
+			if (pipeline->forget_cache &&
+			    total_bytes_read - last_cache_drop_point > DROP_CACHE_BATCH_SIZE) {
+				gnome_vfs_forget_cache (pipeline->source_handle,
+							last_cache_drop_point,
+							total_bytes_read - last_cache_drop_point);
+				last_cache_drop_point = total_bytes_read;
+			}
+		}
+
+		g_mutex_lock (pipeline->lock);
+		buffer->result = result;
+		buffer->bytes_read = result == GNOME_VFS_OK ? bytes_read : 0;
+		pipeline->count++;
+		g_cond_broadcast (pipeline->cond);
+
+		if (result == GNOME_VFS_ERROR_EOF ||
+		    (result == GNOME_VFS_OK && bytes_read == 0)) {
+			break;
+		}
+
+		if (result != GNOME_VFS_OK) {
+			/* wait for the writer to handle the error */
+			while (!pipeline->stop && !pipeline->retry_read) {
+				g_cond_wait (pipeline->cond, pipeline->lock);
+			}
+			pipeline->retry_read = FALSE;
+		}
+	}
+	g_mutex_unlock (pipeline->lock);
+
+	return NULL;
+}
+
+/* Copy the data of a single file, reading the source on a separate thread
+ * while the calling thread writes the target, reports progress and handles
+ * errors.
+ */
 static GnomeVFSResult
-copy_file_data (GnomeVFSHandle *target_handle,
-		GnomeVFSHandle *source_handle,
-		GnomeVFSProgressCallbackState *progress,
-		GnomeVFSXferOptions xfer_options,
-		GnomeVFSXferErrorMode *error_mode,
-		guint source_block_size,
-		guint target_block_size,
-		gboolean *skip)
+copy_file_data_pipelined (GnomeVFSHandle *target_handle,
+			  GnomeVFSHandle *source_handle,
+			  GnomeVFSProgressCallbackState *progress,
+			  GnomeVFSXferErrorMode *error_mode,
+			  guint block_size,
+			  gboolean *skip)
 {
+	CopyPipeline pipeline;
+	CopyPipelineBuffer *buffer;
+	GThread *reader;
 	GnomeVFSResult result;
-	gpointer buffer;
 	const char *write_buffer;
-	GnomeVFSFileSize total_bytes_read;
+	GnomeVFSFileSize total_bytes_written;
 	GnomeVFSFileSize last_cache_drop_point;
-	gboolean forget_cache;
-	guint block_size;
+	gboolean interrupted;
+	guint i;
+
+	memset (&pipeline, 0, sizeof (pipeline));
+	pipeline.source_handle = source_handle;
+	pipeline.context = (GnomeVFSContext *) gnome_vfs_context_peek_current ();
+	_gnome_vfs_block_sizer_init (&pipeline.sizer, block_size);
+	pipeline.forget_cache = progress->progress_info->bytes_total >= DROP_CACHE_SIZE_LIMIT;
+	pipeline.lock = g_mutex_new ();
+	pipeline.cond = g_cond_new ();
+	for (i = 0; i < PIPELINE_BUFFER_COUNT; i++) {
+		pipeline.buffers[i].data = g_malloc (block_size);
+		pipeline.buffers[i].size = block_size;
+	}
+
+	reader = g_thread_create (copy_pipeline_reader, &pipeline, TRUE, NULL);
+	if (reader == NULL) {
+		for (i = 0; i < PIPELINE_BUFFER_COUNT; i++) {
+			g_free (pipeline.buffers[i].data);
+		}
+		g_cond_free (pipeline.cond);
+		g_mutex_free (pipeline.lock);
+		return GNOME_VFS_ERROR_TOO_MANY_OPEN_FILES;
+	}
 
-	*skip = FALSE;
+	total_bytes_written = 0;
+	last_cache_drop_point = 0;
+	interrupted = FALSE;
+	result = GNOME_VFS_OK;
 
-	if (call_progress_often (progress, GNOME_VFS_XFER_PHASE_COPYING) == 0) {
+	do {
+		GnomeVFSFileSize bytes_to_write;
+		GnomeVFSFileSize bytes_written;
+		gboolean retry;
+
+		progress->progress_info->status = GNOME_VFS_XFER_PROGRESS_STATUS_OK;
+		progress->progress_info->vfs_status = GNOME_VFS_OK;
+
+		progress->progress_info->phase = GNOME_VFS_XFER_PHASE_READSOURCE;
+
+		g_mutex_lock (pipeline.lock);
+		while (pipeline.count == 0) {
+			g_cond_wait (pipeline.cond, pipeline.lock);
+		}
+		buffer = &pipeline.buffers[pipeline.head];
+		g_mutex_unlock (pipeline.lock);
+
+		result = buffer->result;
+		if (result != GNOME_VFS_OK && result != GNOME_VFS_ERROR_EOF) {
+			retry = handle_error (&result, progress,
+					      error_mode, skip);
+
+			g_mutex_lock (pipeline.lock);
+			pipeline.head = (pipeline.head + 1) % PIPELINE_BUFFER_COUNT;
+			pipeline.count--;
+			pipeline.retry_read = retry;
+			g_cond_broadcast (pipeline.cond);
+			g_mutex_unlock (pipeline.lock);
+
+			if (retry) {
+				/* the loop condition would end the copy */
+				result = GNOME_VFS_OK;
+				continue;
+			}
+		}
+
+		if (result != GNOME_VFS_OK || buffer->bytes_read == 0 || *skip) {
+			break;
+		}
+
+		bytes_to_write = buffer->bytes_read;
+
+		progress->progress_info->phase = GNOME_VFS_XFER_PHASE_WRITETARGET;
+
+		write_buffer = buffer->data;
+		do {
+			retry = FALSE;
+
+			result = gnome_vfs_write (target_handle, write_buffer,
+						  bytes_to_write,
+						  &bytes_written);
+
+			if (result != GNOME_VFS_OK) {
+				retry = handle_error (&result, progress, error_mode, skip);
+			}
+
+			bytes_to_write -= bytes_written;
+			write_buffer += bytes_written;
+		} while ((result == GNOME_VFS_OK && bytes_to_write > 0) || retry);
+
+		total_bytes_written += buffer->bytes_read;
+
+		if (pipeline.forget_cache && bytes_to_write == 0 &&
+		    total_bytes_written - last_cache_drop_point > DROP_CACHE_BATCH_SIZE) {
+			gnome_vfs_forget_cache (target_handle,
+						last_cache_drop_point,
+						total_bytes_written - last_cache_drop_point);
+
+			last_cache_drop_point = total_bytes_written;
+		}
+
+		progress->progress_info->phase = GNOME_VFS_XFER_PHASE_COPYING;
+
+		progress->progress_info->bytes_copied += buffer->bytes_read;
+		progress->progress_info->total_bytes_copied += buffer->bytes_read;
+
+		/* hand the buffer back to the reader */
+		g_mutex_lock (pipeline.lock);
+		pipeline.head = (pipeline.head + 1) % PIPELINE_BUFFER_COUNT;
+		pipeline.count--;
+		g_cond_broadcast (pipeline.cond);
+		g_mutex_unlock (pipeline.lock);
+
+		if (call_progress_often (progress, GNOME_VFS_XFER_PHASE_COPYING) == 0) {
+			interrupted = TRUE;
+			break;
+		}
+
+		if (*skip) {
+			break;
+		}
+
+	} while (result == GNOME_VFS_OK);
+
+	g_mutex_lock (pipeline.lock);
+	pipeline.stop = TRUE;
+	g_cond_broadcast (pipeline.cond);
+	g_mutex_unlock (pipeline.lock);
+
+	g_thread_join (reader);
+
+	for (i = 0; i < PIPELINE_BUFFER_COUNT; i++) {
+		g_free (pipeline.buffers[i].data);
+	}
+	g_cond_free (pipeline.cond);
+	g_mutex_free (pipeline.lock);
+
+	if (interrupted) {
 		return GNOME_VFS_ERROR_INTERRUPTED;
 	}
 
-	block_size = MAX (source_block_size, target_block_size);
-	buffer = g_malloc (block_size);
+	return result;
+}
+
+/* Copy the data of a single file without passing it through our own
+ * buffers, if the method of both handles can do that (e.g. in the kernel
+ * for local files). Returns GNOME_VFS_ERROR_NOT_SUPPORTED if the rest of
+ * the file has to be copied by reading and writing it.
+ */
+static GnomeVFSResult
+copy_file_data_direct (GnomeVFSHandle *target_handle,
+		       GnomeVFSHandle *source_handle,
+		       GnomeVFSProgressCallbackState *progress,
+		       GnomeVFSXferErrorMode *error_mode,
+		       gboolean *skip)
+{
+	GnomeVFSResult result;
+	GnomeVFSFileSize total_bytes_copied;
+	GnomeVFSFileSize last_cache_drop_point;
+	gboolean forget_cache;
+
+	total_bytes_copied = 0;
+	last_cache_drop_point = 0;
+
+	forget_cache = progress->progress_info->bytes_total >= DROP_CACHE_SIZE_LIMIT;
+
+	do {
+		GnomeVFSFileSize bytes_copied;
+		gboolean retry;
+
+		progress->progress_info->status = GNOME_VFS_XFER_PROGRESS_STATUS_OK;
+		progress->progress_info->vfs_status = GNOME_VFS_OK;
+
+		progress->progress_info->phase = GNOME_VFS_XFER_PHASE_WRITETARGET;
+
+		do {
+			retry = FALSE;
+
+			result = _gnome_vfs_handle_do_copy_data (target_handle, source_handle,
+								 COPY_DATA_CHUNK_SIZE,
+								 &bytes_copied, NULL);
+			if (result != GNOME_VFS_OK &&
+			    result != GNOME_VFS_ERROR_EOF &&
+			    result != GNOME_VFS_ERROR_NOT_SUPPORTED) {
+				retry = handle_error (&result, progress,
+						      error_mode, skip);
+			}
+		} while (retry);
+
+		if (!*skip && total_bytes_copied == 0 &&
+		    (result == GNOME_VFS_ERROR_EOF || bytes_copied == 0)) {
+			/* Some files (e.g. in /proc) claim to be empty to the
+			 * kernel copy but not to read(), let read() decide.
+			 */
+			return GNOME_VFS_ERROR_NOT_SUPPORTED;
+		}
+
+		if (result != GNOME_VFS_OK || bytes_copied == 0 || *skip) {
+			break;
+		}
+
+		total_bytes_copied += bytes_copied;
+
+		if (forget_cache &&
+		    total_bytes_copied - last_cache_drop_point > DROP_CACHE_BATCH_SIZE) {
+			gnome_vfs_forget_cache (source_handle,
+						last_cache_drop_point,
+						total_bytes_copied - last_cache_drop_point);
+			gnome_vfs_forget_cache (target_handle,
+						last_cache_drop_point,
+						total_bytes_copied - last_cache_drop_point);
+
+			last_cache_drop_point = total_bytes_copied;
+		}
+
+		progress->progress_info->phase = GNOME_VFS_XFER_PHASE_COPYING;
+
+		progress->progress_info->bytes_copied += bytes_copied;
+		progress->progress_info->total_bytes_copied += bytes_copied;
+
+		if (call_progress_often (progress, GNOME_VFS_XFER_PHASE_COPYING) == 0) {
+			return GNOME_VFS_ERROR_INTERRUPTED;
+		}
+	} while (!*skip);
+
+	return result;
+}
+
+/* Copy the data of a single file, alternating reads and writes on the
+ * calling thread.
+ */
+static GnomeVFSResult
+copy_file_data_serial (GnomeVFSHandle *target_handle,
+		       GnomeVFSHandle *source_handle,
+		       GnomeVFSProgressCallbackState *progress,
+		       GnomeVFSXferErrorMode *error_mode,
+		       guint block_size,
+		       gboolean *skip)
+{
+	GnomeVFSResult result;
+	gpointer buffer;
+	const char *write_buffer;
+	GnomeVFSFileSize total_bytes_read;
+	GnomeVFSFileSize last_cache_drop_point;
+	GnomeVFSBlockSizer sizer;
+	guint buffer_size;
+	gboolean forget_cache;
+
+	_gnome_vfs_block_sizer_init (&sizer, block_size);
+	buffer_size = _gnome_vfs_block_sizer_get_size (&sizer);
+	buffer = g_malloc (buffer_size);
 	total_bytes_read = 0;
 	last_cache_drop_point = 0;
 
@@ -1237,6 +1600,7 @@ copy_file_data (GnomeVFSHandle *target_handle,
 		GnomeVFSFileSize bytes_read;
 		GnomeVFSFileSize bytes_to_write;
 		GnomeVFSFileSize bytes_written;
+		gboolean measured;
 		gboolean retry;
 
 		progress->progress_info->status = GNOME_VFS_XFER_PROGRESS_STATUS_OK;
@@ -1244,14 +1608,29 @@ copy_file_data (GnomeVFSHandle *target_handle,
 
 		progress->progress_info->phase = GNOME_VFS_XFER_PHASE_READSOURCE;
 
+		block_size = _gnome_vfs_block_sizer_get_size (&sizer);
+		if (buffer_size < block_size) {
+			g_free (buffer);
+			buffer = g_malloc (block_size);
+			buffer_size = block_size;
+		}
+
+		/* Both the read and the write count towards the time spent
+		 * on a block, unless we had to ask the user about an error.
+		 */
+		_gnome_vfs_block_sizer_begin (&sizer);
+		measured = TRUE;
+
 		do {
 			retry = FALSE;
 
 			result = gnome_vfs_read (source_handle, buffer,
 						 block_size, &bytes_read);
-			if (result != GNOME_VFS_OK && result != GNOME_VFS_ERROR_EOF)
+			if (result != GNOME_VFS_OK && result != GNOME_VFS_ERROR_EOF) {
 				retry = handle_error (&result, progress,
 						      error_mode, skip);
+				measured = FALSE;
+			}
 		} while (retry);
 
 		if (result != GNOME_VFS_OK || bytes_read == 0 || *skip) {
@@ -1273,11 +1652,16 @@ copy_file_data (GnomeVFSHandle *target_handle,
 
 			if (result != GNOME_VFS_OK) {
 				retry = handle_error (&result, progress, error_mode, skip);
+				measured = FALSE;
 			}
 
 			bytes_to_write -= bytes_written;
 			write_buffer += bytes_written;
 		} while ((result == GNOME_VFS_OK && bytes_to_write > 0) || retry);
+
+		if (result == GNOME_VFS_OK && measured) {
+			_gnome_vfs_block_sizer_end (&sizer, block_size, bytes_read);
+		}
 		
 		if (forget_cache && bytes_to_write == 0 &&
 		    total_bytes_read - last_cache_drop_point > DROP_CACHE_BATCH_SIZE) {
@@ -1307,6 +1691,53 @@ copy_file_data (GnomeVFSHandle *target_handle,
 
 	} while (result == GNOME_VFS_OK);
 
+	g_free (buffer);
+
+	return result;
+}
+
+/* Copy the data of a single file. */
+static GnomeVFSResult
+copy_file_data (GnomeVFSHandle *target_handle,
+		GnomeVFSHandle *source_handle,
+		GnomeVFSProgressCallbackState *progress,
+		GnomeVFSXferOptions xfer_options,
+		GnomeVFSXferErrorMode *error_mode,
+		guint source_block_size,
+		guint target_block_size,
+		gboolean *skip)
+{
+	GnomeVFSResult result;
+	guint block_size;
+
+	*skip = FALSE;
+
+	if (call_progress_often (progress, GNOME_VFS_XFER_PHASE_COPYING) == 0) {
+		return GNOME_VFS_ERROR_INTERRUPTED;
+	}
+
+	block_size = MAX (source_block_size, target_block_size);
+
+	result = copy_file_data_direct (target_handle, source_handle,
+					progress, error_mode, skip);
+
+	if (result == GNOME_VFS_ERROR_NOT_SUPPORTED && !*skip) {
+		if (g_thread_supported () &&
+		    progress->progress_info->file_size >= PIPELINE_SIZE_LIMIT) {
+			result = copy_file_data_pipelined (target_handle, source_handle,
+							   progress, error_mode,
+							   block_size, skip);
+		} else {
+			result = copy_file_data_serial (target_handle, source_handle,
+							progress, error_mode,
+							block_size, skip);
+		}
+	}
+
+	if (result == GNOME_VFS_ERROR_INTERRUPTED) {
+		return result;
+	}
+
 	if (result == GNOME_VFS_ERROR_EOF) {
 		result = GNOME_VFS_OK;
 	}
@@ -1320,8 +1751,6 @@ copy_file_data (GnomeVFSHandle *target_handle,
 		call_progress_often (progress, GNOME_VFS_XFER_PHASE_COPYING);
 	}
 
-	g_free (buffer);
-
 	return result;
 }
 
@@ -1471,6 +1900,29 @@ copy_symlink (GnomeVFSURI *source_uri,
 	return result;
 }
 
+/* Copy the owner, permissions and times of @info to the copied @target_uri. */
+static void
+set_target_file_info (GnomeVFSURI *target_uri,
+		      GnomeVFSFileInfo *info,
+		      GnomeVFSXferOptions xfer_options)
+{
+	if (!(xfer_options & GNOME_VFS_XFER_TARGET_DEFAULT_PERMS)) {
+		/* FIXME the modules should ignore setting of permissions if
+		 * "valid_fields & GNOME_VFS_FILE_INFO_FIELDS_PERMISSIONS" is clear
+		 * for now, make sure permissions aren't set to 000
+		 */
+		if ((info->valid_fields & GNOME_VFS_FILE_INFO_FIELDS_PERMISSIONS) != 0) {
+			/* Call this separately from the time one, since one of them may fail,
+			   making the other not run. */
+			gnome_vfs_set_file_info_uri (target_uri, info, 
+						     GNOME_VFS_SET_FILE_INFO_OWNER | GNOME_VFS_SET_FILE_INFO_PERMISSIONS);
+		}
+	}
+
+	/* Call this last so nothing else changes the times */
+	gnome_vfs_set_file_info_uri (target_uri, info, GNOME_VFS_SET_FILE_INFO_TIME);
+}
+
 static GnomeVFSResult
 copy_file (GnomeVFSFileInfo *info,
 	   GnomeVFSFileInfo *target_dir_info,
@@ -1552,22 +2004,7 @@ copy_file (GnomeVFSFileInfo *info,
 
 	if (result == GNOME_VFS_OK) {
 		/* ignore errors while setting file info attributes at this point */
-		
-		if (!(xfer_options & GNOME_VFS_XFER_TARGET_DEFAULT_PERMS)) {
-			/* FIXME the modules should ignore setting of permissions if
-			 * "valid_fields & GNOME_VFS_FILE_INFO_FIELDS_PERMISSIONS" is clear
-			 * for now, make sure permissions aren't set to 000
-			 */
-			if ((info->valid_fields & GNOME_VFS_FILE_INFO_FIELDS_PERMISSIONS) != 0) {
-				/* Call this separately from the time one, since one of them may fail,
-				   making the other not run. */
-				gnome_vfs_set_file_info_uri (target_uri, info, 
-							     GNOME_VFS_SET_FILE_INFO_OWNER | GNOME_VFS_SET_FILE_INFO_PERMISSIONS);
-			}
-		}
-		
-		/* Call this last so nothing else changes the times */
-		gnome_vfs_set_file_info_uri (target_uri, info, GNOME_VFS_SET_FILE_INFO_TIME);
+		set_target_file_info (target_uri, info, xfer_options);
 	}
 
 	if (*skip) {
@@ -1577,6 +2014,556 @@ copy_file (GnomeVFSFileInfo *info,
 	return result;
 }
 
+/* Parallel copying of the regular files inside directories
+ * (GNOME_VFS_XFER_PARALLEL).
+ *
+ * The directory walk stays on the xfer thread and hands each regular file
+ * to a pool of workers. The workers copy without any user interaction: a
+ * file that can't be copied that way (name conflict, error, ...) is
+ * given back to the xfer thread, which copies it again with copy_file()
+ * so that the error mode, overwrite mode and progress callback behave
+ * exactly as in a serial transfer.
+ */
+
+#define DEFAULT_PARALLEL_LIMIT 4
+
+/* Jobs queued per worker before the directory walk waits for some of them
+ * to finish, so that huge trees don't pile up in memory.
+ */
+#define PARALLEL_JOBS_PER_WORKER 16
+
+static volatile gint parallel_limit = DEFAULT_PARALLEL_LIMIT;
+
+typedef struct {
+	GThreadPool *pool;
+	GnomeVFSXferOptions xfer_options;
+	GnomeVFSContext *context;	/* of the xfer, for the workers */
+	guint max_pending;
+
+	GMutex *lock;
+	GCond *cond;
+	guint pending;			/* jobs pushed and not finished yet */
+	GList *failed;			/* finished jobs to be redone serially */
+	gint64 bytes_copied;		/* by the workers, since the last collect */
+	volatile gint cancelled;
+
+	/* Target directories and the info to set on them once all the
+	 * files have been copied, deepest first.
+	 */
+	GList *directories;
+} XferScheduler;
+
+typedef struct {
+	GnomeVFSURI *source_uri;
+	GnomeVFSURI *target_uri;
+	GnomeVFSFileInfo *info;
+	GnomeVFSFileInfo *target_dir_info;
+	GnomeVFSXferOverwriteMode overwrite_mode;
+	GnomeVFSResult result;
+} XferParallelJob;
+
+typedef struct {
+	GnomeVFSURI *uri;
+	GnomeVFSFileInfo *info;
+} XferDeferredDirectory;
+
+static void
+parallel_job_free (XferParallelJob *job)
+{
+	gnome_vfs_uri_unref (job->source_uri);
+	gnome_vfs_uri_unref (job->target_uri);
+	gnome_vfs_file_info_unref (job->info);
+	if (job->target_dir_info != NULL) {
+		gnome_vfs_file_info_unref (job->target_dir_info);
+	}
+	g_free (job);
+}
+
+/* Runs on a worker thread. Notices the cancellation of the whole xfer
+ * as well as that of the scheduler.
+ */
+static gboolean
+xfer_scheduler_cancelled (XferScheduler *scheduler)
+{
+	if (gnome_vfs_context_check_cancellation (scheduler->context)) {
+		g_atomic_int_set (&scheduler->cancelled, TRUE);
+	}
+	return g_atomic_int_get (&scheduler->cancelled);
+}
+
+static void
+xfer_scheduler_add_bytes (XferScheduler *scheduler,
+			  gint64 bytes)
+{
+	g_mutex_lock (scheduler->lock);
+	scheduler->bytes_copied += bytes;
+	g_mutex_unlock (scheduler->lock);
+}
+
+static GnomeVFSResult
+parallel_copy_file_data (XferScheduler *scheduler,
+			 GnomeVFSHandle *target_handle,
+			 GnomeVFSHandle *source_handle,
+			 guint block_size,
+			 gint64 *bytes_reported)
+{
+	GnomeVFSResult result;
+	GnomeVFSFileSize bytes_read;
+	GnomeVFSFileSize bytes_written;
+	GnomeVFSFileSize bytes_copied;
+	const char *write_buffer;
+	GnomeVFSBlockSizer sizer;
+	guint buffer_size;
+	gpointer buffer;
+
+	do {
+		result = _gnome_vfs_handle_do_copy_data (target_handle, source_handle,
+							 COPY_DATA_CHUNK_SIZE,
+							 &bytes_copied,
+							 scheduler->context);
+		if (result == GNOME_VFS_OK) {
+			xfer_scheduler_add_bytes (scheduler, bytes_copied);
+			*bytes_reported += bytes_copied;
+		}
+		if (xfer_scheduler_cancelled (scheduler)) {
+			return GNOME_VFS_ERROR_INTERRUPTED;
+		}
+	} while (result == GNOME_VFS_OK && bytes_copied > 0);
+
+	if (result == GNOME_VFS_ERROR_EOF && *bytes_reported > 0) {
+		return GNOME_VFS_OK;
+	}
+	if (result != GNOME_VFS_ERROR_EOF && result != GNOME_VFS_ERROR_NOT_SUPPORTED) {
+		return result;
+	}
+
+	_gnome_vfs_block_sizer_init (&sizer, block_size);
+	buffer_size = _gnome_vfs_block_sizer_get_size (&sizer);
+	buffer = g_malloc (buffer_size);
+
+	do {
+		block_size = _gnome_vfs_block_sizer_get_size (&sizer);
+		if (buffer_size < block_size) {
+			g_free (buffer);
+			buffer = g_malloc (block_size);
+			buffer_size = block_size;
+		}
+
+		_gnome_vfs_block_sizer_begin (&sizer);
+		result = gnome_vfs_read_cancellable (source_handle, buffer,
+						     block_size, &bytes_read,
+						     scheduler->context);
+		if (result != GNOME_VFS_OK) {
+			break;
+		}
+
+		bytes_copied = bytes_read;
+		write_buffer = buffer;
+		while (result == GNOME_VFS_OK && bytes_read > 0) {
+			result = gnome_vfs_write_cancellable (target_handle, write_buffer,
+							      bytes_read, &bytes_written,
+							      scheduler->context);
+			bytes_read -= bytes_written;
+			write_buffer += bytes_written;
+		}
+
+		if (result == GNOME_VFS_OK) {
+			_gnome_vfs_block_sizer_end (&sizer, block_size, bytes_copied);
+			xfer_scheduler_add_bytes (scheduler, bytes_copied);
+			*bytes_reported += bytes_copied;
+		}
+
+		if (xfer_scheduler_cancelled (scheduler)) {
+			result = GNOME_VFS_ERROR_INTERRUPTED;
+		}
+	} while (result == GNOME_VFS_OK);
+
+	g_free (buffer);
+
+	if (result == GNOME_VFS_ERROR_EOF) {
+		result = GNOME_VFS_OK;
+	}
+
+	return result;
+}
+
+/* Runs on a worker thread. */
+static void
+parallel_copy_file (gpointer data,
+		    gpointer user_data)
+{
+	XferParallelJob *job;
+	XferScheduler *scheduler;
+	GnomeVFSHandle *source_handle;
+	GnomeVFSHandle *target_handle;
+	GnomeVFSResult result;
+	GnomeVFSResult close_result;
+	gint64 bytes_reported;
+	guint block_size;
+
+	job = data;
+	scheduler = user_data;
+	bytes_reported = 0;
+
+	if (xfer_scheduler_cancelled (scheduler)) {
+		result = GNOME_VFS_ERROR_INTERRUPTED;
+	} else {
+		result = gnome_vfs_open_uri_cancellable (&source_handle, job->source_uri,
+							 GNOME_VFS_OPEN_READ,
+							 scheduler->context);
+	}
+
+	if (result == GNOME_VFS_OK) {
+		result = gnome_vfs_create_uri_cancellable (&target_handle, job->target_uri,
+							   GNOME_VFS_OPEN_WRITE,
+							   job->overwrite_mode != GNOME_VFS_XFER_OVERWRITE_MODE_REPLACE,
+							   0666, scheduler->context);
+		if (result == GNOME_VFS_OK) {
+			/* same defaults as copy_file() */
+			block_size = 8192;
+			if (job->info->valid_fields & GNOME_VFS_FILE_INFO_FIELDS_IO_BLOCK_SIZE &&
+			    job->info->io_block_size > 0) {
+				block_size = job->info->io_block_size;
+			}
+			if (job->target_dir_info != NULL &&
+			    job->target_dir_info->valid_fields & GNOME_VFS_FILE_INFO_FIELDS_IO_BLOCK_SIZE &&
+			    job->target_dir_info->io_block_size > block_size) {
+				block_size = job->target_dir_info->io_block_size;
+			}
+
+			result = parallel_copy_file_data (scheduler, target_handle, source_handle,
+							  block_size, &bytes_reported);
+
+			close_result = gnome_vfs_close (target_handle);
+			if (result == GNOME_VFS_OK) {
+				result = close_result;
+			}
+			if (result != GNOME_VFS_OK) {
+				/* leave a clean slate for the serial retry */
+				gnome_vfs_unlink_from_uri (job->target_uri);
+			}
+		}
+		gnome_vfs_close (source_handle);
+	}
+
+	if (result != GNOME_VFS_OK && xfer_scheduler_cancelled (scheduler)) {
+		/* not to be copied again */
+		result = GNOME_VFS_ERROR_INTERRUPTED;
+	}
+
+	if (result == GNOME_VFS_OK) {
+		set_target_file_info (job->target_uri, job->info, scheduler->xfer_options);
+	}
+
+	g_mutex_lock (scheduler->lock);
+	if (result == GNOME_VFS_OK) {
+		/* see copy_file_data () */
+		scheduler->bytes_copied += DEFAULT_SIZE_OVERHEAD;
+	} else {
+		/* the retry will report these bytes again */
+		scheduler->bytes_copied -= bytes_reported;
+		job->result = result;
+		scheduler->failed = g_list_prepend (scheduler->failed, job);
+		job = NULL;
+	}
+	scheduler->pending--;
+	g_cond_broadcast (scheduler->cond);
+	g_mutex_unlock (scheduler->lock);
+
+	if (job != NULL) {
+		parallel_job_free (job);
+	}
+}
+
+static XferScheduler *
+xfer_scheduler_new (GnomeVFSXferOptions xfer_options)
+{
+	XferScheduler *scheduler;
+	gint limit;
+
+	limit = gnome_vfs_xfer_get_parallel_limit ();
+
+	if ((xfer_options & GNOME_VFS_XFER_PARALLEL) == 0 ||
+	    limit < 2 || !g_thread_supported ()) {
+		return NULL;
+	}
+
+	scheduler = g_new0 (XferScheduler, 1);
+	scheduler->xfer_options = xfer_options;
+	scheduler->context = (GnomeVFSContext *) gnome_vfs_context_peek_current ();
+	scheduler->max_pending = limit * PARALLEL_JOBS_PER_WORKER;
+	scheduler->lock = g_mutex_new ();
+	scheduler->cond = g_cond_new ();
+	scheduler->pool = g_thread_pool_new (parallel_copy_file, scheduler,
+					     limit, FALSE, NULL);
+	if (scheduler->pool == NULL) {
+		g_cond_free (scheduler->cond);
+		g_mutex_free (scheduler->lock);
+		g_free (scheduler);
+		return NULL;
+	}
+
+	return scheduler;
+}
+
+static void
+xfer_scheduler_push (XferScheduler *scheduler,
+		     GnomeVFSFileInfo *info,
+		     GnomeVFSFileInfo *target_dir_info,
+		     GnomeVFSURI *source_uri,
+		     GnomeVFSURI *target_uri,
+		     GnomeVFSXferOverwriteMode overwrite_mode)
+{
+	XferParallelJob *job;
+
+	job = g_new0 (XferParallelJob, 1);
+	job->source_uri = gnome_vfs_uri_ref (source_uri);
+	job->target_uri = gnome_vfs_uri_ref (target_uri);
+	gnome_vfs_file_info_ref (info);
+	job->info = info;
+	if (target_dir_info != NULL) {
+		gnome_vfs_file_info_ref (target_dir_info);
+	}
+	job->target_dir_info = target_dir_info;
+	job->overwrite_mode = overwrite_mode;
+
+	g_mutex_lock (scheduler->lock);
+	scheduler->pending++;
+	g_mutex_unlock (scheduler->lock);
+
+	g_thread_pool_push (scheduler->pool, job, NULL);
+}
+
+static void
+xfer_scheduler_defer_directory (XferScheduler *scheduler,
+				GnomeVFSURI *uri,
+				GnomeVFSFileInfo *info)
+{
+	XferDeferredDirectory *directory;
+
+	directory = g_new (XferDeferredDirectory, 1);
+	directory->uri = gnome_vfs_uri_ref (uri);
+	gnome_vfs_file_info_ref (info);
+	directory->info = info;
+
+	/* directories are finished children first, so prepending keeps
+	 * the deepest ones at the head
+	 */
+	scheduler->directories = g_list_prepend (scheduler->directories, directory);
+}
+
+/* Adds the progress made by the workers and copies the files they gave
+ * back. Waits until no more than @max_pending jobs are outstanding,
+ * calling the progress callback meanwhile.
+ */
+static GnomeVFSResult
+xfer_scheduler_collect (XferScheduler *scheduler,
+			guint max_pending,
+			GnomeVFSXferErrorMode *error_mode,
+			GnomeVFSXferOverwriteMode *overwrite_mode,
+			GnomeVFSProgressCallbackState *progress,
+			gboolean *skip)
+{
+	XferParallelJob *job;
+	GnomeVFSResult result;
+	GList *failed, *kept, *node;
+	GTimeVal timeout;
+	gint64 bytes_copied;
+	gboolean skip_file;
+	guint pending;
+
+	result = GNOME_VFS_OK;
+
+	do {
+		g_mutex_lock (scheduler->lock);
+		if (scheduler->pending > max_pending && scheduler->failed == NULL) {
+			/* wake up now and then to report progress */
+			g_get_current_time (&timeout);
+			g_time_val_add (&timeout, UPDATE_PERIOD);
+			g_cond_timed_wait (scheduler->cond, scheduler->lock, &timeout);
+		}
+		failed = g_list_reverse (scheduler->failed);
+		scheduler->failed = NULL;
+		bytes_copied = scheduler->bytes_copied;
+		scheduler->bytes_copied = 0;
+		pending = scheduler->pending;
+		g_mutex_unlock (scheduler->lock);
+
+		progress->progress_info->total_bytes_copied += bytes_copied;
+
+		kept = NULL;
+		for (node = failed; node != NULL; node = node->next) {
+			job = node->data;
+
+			if (result == GNOME_VFS_OK &&
+			    job->result == GNOME_VFS_ERROR_INTERRUPTED) {
+				/* the xfer was cancelled */
+				result = GNOME_VFS_ERROR_INTERRUPTED;
+			}
+			if (result == GNOME_VFS_OK) {
+				result = copy_file (job->info, job->target_dir_info,
+						    job->source_uri, job->target_uri,
+						    scheduler->xfer_options, error_mode,
+						    overwrite_mode, progress, &skip_file);
+				if (skip_file) {
+					*skip = TRUE;
+				}
+			}
+
+			if (result == GNOME_VFS_OK) {
+				parallel_job_free (job);
+			} else {
+				/* see xfer_scheduler_set_directory_infos () */
+				kept = g_list_prepend (kept, job);
+			}
+		}
+		g_list_free (failed);
+
+		if (kept != NULL) {
+			g_mutex_lock (scheduler->lock);
+			scheduler->failed = g_list_concat (kept, scheduler->failed);
+			g_mutex_unlock (scheduler->lock);
+		}
+
+		if (result == GNOME_VFS_OK &&
+		    call_progress_often (progress, GNOME_VFS_XFER_PHASE_COPYING) == 0) {
+			result = GNOME_VFS_ERROR_INTERRUPTED;
+		}
+	} while (result == GNOME_VFS_OK && pending > max_pending);
+
+	return result;
+}
+
+/* Stops the workers after the transfer failed. The files they didn't
+ * copy are left in scheduler->failed.
+ */
+static void
+xfer_scheduler_stop (XferScheduler *scheduler)
+{
+	g_atomic_int_set (&scheduler->cancelled, TRUE);
+
+	g_mutex_lock (scheduler->lock);
+	while (scheduler->pending > 0) {
+		g_cond_wait (scheduler->cond, scheduler->lock);
+	}
+	g_mutex_unlock (scheduler->lock);
+
+	/* the scheduler can be used again, e.g. for a unique name */
+	g_atomic_int_set (&scheduler->cancelled, FALSE);
+}
+
+static gboolean
+xfer_scheduler_directory_failed (XferScheduler *scheduler,
+				 GnomeVFSURI *uri)
+{
+	XferParallelJob *job;
+	GnomeVFSURI *parent;
+	gboolean failed;
+	GList *node;
+
+	for (node = scheduler->failed; node != NULL; node = node->next) {
+		job = node->data;
+
+		parent = gnome_vfs_uri_get_parent (job->target_uri);
+		failed = parent != NULL && gnome_vfs_uri_equal (parent, uri);
+		if (parent != NULL) {
+			gnome_vfs_uri_unref (parent);
+		}
+		if (failed) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/* Sets the info of the directories created meanwhile, once no worker is
+ * left writing into them. As in a serial transfer, a directory doesn't
+ * get its info if one of its files couldn't be copied.
+ */
+static void
+xfer_scheduler_set_directory_infos (XferScheduler *scheduler)
+{
+	XferDeferredDirectory *directory;
+	GList *node;
+
+	for (node = scheduler->directories; node != NULL; node = node->next) {
+		directory = node->data;
+
+		if (!xfer_scheduler_directory_failed (scheduler, directory->uri)) {
+			set_target_file_info (directory->uri, directory->info,
+					      scheduler->xfer_options);
+		}
+
+		gnome_vfs_uri_unref (directory->uri);
+		gnome_vfs_file_info_unref (directory->info);
+		g_free (directory);
+	}
+	g_list_free (scheduler->directories);
+	scheduler->directories = NULL;
+
+	for (node = scheduler->failed; node != NULL; node = node->next) {
+		parallel_job_free (node->data);
+	}
+	g_list_free (scheduler->failed);
+	scheduler->failed = NULL;
+}
+
+/* Waits for all the files to be copied, or stops the workers if @result
+ * (that of copying the tree) is an error, then sets the info of the
+ * directories.
+ */
+static GnomeVFSResult
+xfer_scheduler_finish (XferScheduler *scheduler,
+		       GnomeVFSResult result,
+		       GnomeVFSXferErrorMode *error_mode,
+		       GnomeVFSXferOverwriteMode *overwrite_mode,
+		       GnomeVFSProgressCallbackState *progress,
+		       gboolean *skip)
+{
+	if (result == GNOME_VFS_OK) {
+		result = xfer_scheduler_collect (scheduler, 0, error_mode,
+						 overwrite_mode, progress, skip);
+	}
+	if (result != GNOME_VFS_OK) {
+		xfer_scheduler_stop (scheduler);
+	}
+
+	xfer_scheduler_set_directory_infos (scheduler);
+
+	return result;
+}
+
+/* Cancels whatever is still outstanding. */
+static void
+xfer_scheduler_destroy (XferScheduler *scheduler)
+{
+	XferDeferredDirectory *directory;
+	GList *node;
+
+	g_atomic_int_set (&scheduler->cancelled, TRUE);
+
+	/* the queued jobs see the cancellation and return right away */
+	g_thread_pool_free (scheduler->pool, FALSE, TRUE);
+
+	for (node = scheduler->failed; node != NULL; node = node->next) {
+		parallel_job_free (node->data);
+	}
+	g_list_free (scheduler->failed);
+
+	for (node = scheduler->directories; node != NULL; node = node->next) {
+		directory = node->data;
+		gnome_vfs_uri_unref (directory->uri);
+		gnome_vfs_file_info_unref (directory->info);
+		g_free (directory);
+	}
+	g_list_free (scheduler->directories);
+
+	g_cond_free (scheduler->cond);
+	g_mutex_free (scheduler->lock);
+	g_free (scheduler);
+}
+
 static GnomeVFSResult
 copy_directory (GnomeVFSFileInfo *source_file_info,
 		GnomeVFSURI *source_dir_uri,
@@ -1585,6 +2572,7 @@ copy_directory (GnomeVFSFileInfo *source_file_info,
 		GnomeVFSXferErrorMode *error_mode,
 		GnomeVFSXferOverwriteMode *overwrite_mode,
 		GnomeVFSProgressCallbackState *progress,
+		XferScheduler *scheduler,
 		gboolean *skip)
 {
 	GnomeVFSResult result;
@@ -1655,6 +2643,7 @@ copy_directory (GnomeVFSFileInfo *source_file_info,
 
 			source_uri = NULL;
 			dest_uri = NULL;
+			skip_child = FALSE;
 			info = gnome_vfs_file_info_new ();
 
 			result = gnome_vfs_directory_read_next (source_directory_handle, info);
@@ -1675,7 +2664,13 @@ copy_directory (GnomeVFSFileInfo *source_file_info,
 				dest_uri = gnome_vfs_uri_append_file_name (target_dir_uri, info->name);
 				progress_set_source_target_uris (progress, source_uri, dest_uri);
 
-				if (info->type == GNOME_VFS_FILE_TYPE_REGULAR) {
+				if (info->type == GNOME_VFS_FILE_TYPE_REGULAR && scheduler != NULL) {
+					xfer_scheduler_push (scheduler, info, target_dir_info,
+							     source_uri, dest_uri, *overwrite_mode);
+					result = xfer_scheduler_collect (scheduler, scheduler->max_pending,
+									 error_mode, overwrite_mode,
+									 progress, &skip_child);
+				} else if (info->type == GNOME_VFS_FILE_TYPE_REGULAR) {
 					result = copy_file (info, target_dir_info,
 							    source_uri, dest_uri, 
 							    xfer_options, error_mode, overwrite_mode, 
@@ -1683,7 +2678,7 @@ copy_directory (GnomeVFSFileInfo *source_file_info,
 				} else if (info->type == GNOME_VFS_FILE_TYPE_DIRECTORY) {
 					result = copy_directory (info, source_uri, dest_uri, 
 								 xfer_options, error_mode, overwrite_mode, 
-								 progress, &skip_child);
+								 progress, scheduler, &skip_child);
 				} else if (info->type == GNOME_VFS_FILE_TYPE_SYMBOLIC_LINK) {
 					if (xfer_options & GNOME_VFS_XFER_FOLLOW_LINKS_RECURSIVE) {
 						GnomeVFSFileInfo *symlink_target_info = gnome_vfs_file_info_new ();
@@ -1740,23 +2735,14 @@ copy_directory (GnomeVFSFileInfo *source_file_info,
 			info = source_file_info;
 		}
 
-		if (!(xfer_options & GNOME_VFS_XFER_TARGET_DEFAULT_PERMS)) {
-			/* FIXME the modules should ignore setting of permissions if
-			 * "valid_fields & GNOME_VFS_FILE_INFO_FIELDS_PERMISSIONS" is clear
-			 * for now, make sure permissions aren't set to 000
+		if (scheduler != NULL) {
+			/* files may still be written into the directory,
+			 * which would change its times again
 			 */
-			if ((info->valid_fields & GNOME_VFS_FILE_INFO_FIELDS_PERMISSIONS) != 0) {
-				
-				/* Call this separately from the time one, since one of them may fail,
-				   making the other not run. */
-				gnome_vfs_set_file_info_uri (target_dir_uri, info, 
-							     GNOME_VFS_SET_FILE_INFO_OWNER | 
-							     GNOME_VFS_SET_FILE_INFO_PERMISSIONS);
-			}
+			xfer_scheduler_defer_directory (scheduler, target_dir_uri, info);
+		} else {
+			set_target_file_info (target_dir_uri, info, xfer_options);
 		}
-		
-		/* Call this last so nothing else changes the times */
-		gnome_vfs_set_file_info_uri (target_dir_uri, info, GNOME_VFS_SET_FILE_INFO_TIME);
 		gnome_vfs_file_info_unref (info);
 	}
 	
@@ -1778,8 +2764,10 @@ copy_items (const GList *source_uri_list,
 {
 	GnomeVFSResult result;
 	const GList *source_item, *target_item;
+	XferScheduler *scheduler;
 	
 	result = GNOME_VFS_OK;
+	scheduler = xfer_scheduler_new (xfer_options);
 
 	/* go through the list of names */
 	for (source_item = source_uri_list, target_item = target_uri_list; source_item != NULL;) {
@@ -1857,7 +2845,13 @@ copy_items (const GList *source_uri_list,
 					result = copy_directory (info, source_uri, target_uri, 
 								 xfer_options, error_mode,
 								 &overwrite_mode_abort,
-								 progress, &skip);
+								 progress, scheduler, &skip);
+					if (scheduler != NULL) {
+						result = xfer_scheduler_finish (scheduler, result,
+										error_mode,
+										&overwrite_mode_abort,
+										progress, &skip);
+					}
                                 } else if (info->type == GNOME_VFS_FILE_TYPE_SYMBOLIC_LINK) {
 					result = copy_symlink (source_uri, target_uri, info->symlink_name,
 							       error_mode, &overwrite_mode_abort,
@@ -1926,6 +2920,10 @@ copy_items (const GList *source_uri_list,
 		g_assert ((source_item != NULL) == (target_item != NULL));
 	}
 
+	if (scheduler != NULL) {
+		xfer_scheduler_destroy (scheduler);
+	}
+
 	return result;
 }
 
@@ -2700,6 +3698,38 @@ _gnome_vfs_xfer_private (const GList *source_uri_list,
 	return result;
 }
 
+/**
+ * gnome_vfs_xfer_set_parallel_limit:
+ * @limit: maximum number of files copied at the same time.
+ *
+ * Set the number of worker threads used to copy files by transfers
+ * started with #GNOME_VFS_XFER_PARALLEL. With a @limit below 2 such
+ * transfers copy one file at a time.
+ *
+ * Since: 2.26
+ */
+void
+gnome_vfs_xfer_set_parallel_limit (int limit)
+{
+	g_atomic_int_set (&parallel_limit, limit);
+}
+
+/**
+ * gnome_vfs_xfer_get_parallel_limit:
+ *
+ * Get the number of worker threads used to copy files by transfers
+ * started with #GNOME_VFS_XFER_PARALLEL.
+ *
+ * Return value: current maximum number of files copied at the same time.
+ *
+ * Since: 2.26
+ */
+int
+gnome_vfs_xfer_get_parallel_limit (void)
+{
+	return g_atomic_int_get (&parallel_limit);
+}
+
 /**
  * gnome_vfs_xfer_uri_list:
  * @source_uri_list: A #GList of source #GnomeVFSURIs.
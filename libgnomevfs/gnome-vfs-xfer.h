@@ -75,6 +75,13 @@ G_BEGIN_DECLS
  * 					 permissions as the source file, but will instead have
  * 					 the default permissions of the destination location.
  * 					 This is useful when copying from read-only locations (CDs).
+ * @GNOME_VFS_XFER_PARALLEL: When copying recursively, copy the regular files
+ * 			      inside directories concurrently on a pool of worker
+ * 			      threads. Directories are still created in order, and
+ * 			      files that need user interaction (name conflicts,
+ * 			      errors) are handled one at a time as usual. The
+ * 			      number of workers is set with
+ * 			      gnome_vfs_xfer_set_parallel_limit().
  * @GNOME_VFS_XFER_UNUSED_1: Unused.
  * @GNOME_VFS_XFER_UNUSED_2: Unused.
  *
@@ -172,7 +179,8 @@ typedef enum {
 	GNOME_VFS_XFER_USE_UNIQUE_NAMES = 1 << 9,
 	GNOME_VFS_XFER_LINK_ITEMS = 1 << 10,
 	GNOME_VFS_XFER_FOLLOW_LINKS_RECURSIVE = 1 << 11,
-	GNOME_VFS_XFER_TARGET_DEFAULT_PERMS = 1 << 12
+	GNOME_VFS_XFER_TARGET_DEFAULT_PERMS = 1 << 12,
+	GNOME_VFS_XFER_PARALLEL = 1 << 13
 } GnomeVFSXferOptions;
 
 /**
@@ -549,6 +557,9 @@ GnomeVFSResult gnome_vfs_xfer_delete_list (const GList                  *source_
 					   GnomeVFSXferProgressCallback  progress_callback,
 					   gpointer                      data);
 
+void           gnome_vfs_xfer_set_parallel_limit (int             limit);
+int            gnome_vfs_xfer_get_parallel_limit (void);
+
 G_END_DECLS
 
 #endif /* GNOME_VFS_XFER_H */
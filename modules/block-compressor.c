@@ -0,0 +1,346 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 8; tab-width: 8 -*- */
+/* block-compressor.c - Parallel block compression for the compressing
+   methods.
+
+   Copyright (C) 2026 Free Software Foundation
+
+   The Gnome Library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   The Gnome Library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with the Gnome Library; see the file COPYING.LIB.  If not,
+   write to the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, USA.
+*/
+
+/* Each block is filled in a buffer with room in front for the
+ * dictionary, which is copied there from the end of the previous block
+ * when the block is started. A full block is queued as a job and pushed
+ * to the thread pool; the writer then writes out the finished jobs at
+ * the head of its queue, and waits for the head when too many jobs are
+ * queued, which bounds the memory used to a few blocks per thread.
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "block-compressor.h"
+
+/* Blocks a compressor may have queued for each compressing thread */
+#define BLOCKS_PER_THREAD 2
+
+#define MAX_THREADS 64
+
+typedef struct {
+	BlockCompressor *compressor;
+	CompressorBlock  block;
+	guchar          *buffer;
+	GByteArray      *out;
+	GnomeVFSResult   result;
+	gboolean         done;
+} BlockJob;
+
+struct _BlockCompressor {
+	gsize                block_size;
+	gsize                dictionary_size;
+	CompressorBlockFunc  compress_func;
+	CompressorWriteFunc  write_func;
+	gpointer             user_data;
+
+	/* The block being filled, after dictionary_size bytes of room */
+	guchar              *buffer;
+	gsize                buffer_len;
+	gsize                dictionary_len;
+	gboolean             started;
+
+	GMutex              *lock;
+	GCond               *cond;
+	/* BlockJobs in stream order, protected by lock */
+	GQueue              *jobs;
+	guint                max_jobs;
+	GnomeVFSResult       result;
+};
+
+static GThreadPool *pool = NULL;
+G_LOCK_DEFINE_STATIC (pool);
+
+guint
+block_compressor_get_threads (void)
+{
+	static volatile gint threads = 0;
+	const char *value;
+	long n;
+
+	if (g_atomic_int_get (&threads) == 0) {
+		n = 0;
+		value = getenv ("GNOME_VFS_COMPRESS_THREADS");
+		if (value != NULL) {
+			n = strtol (value, NULL, 10);
+		}
+		if (n < 1) {
+			n = sysconf (_SC_NPROCESSORS_ONLN);
+		}
+		if (n < 1) {
+			n = 1;
+		}
+		g_atomic_int_set (&threads, (gint) MIN (n, MAX_THREADS));
+	}
+
+	return g_atomic_int_get (&threads);
+}
+
+static void
+compress_job (gpointer data,
+	      gpointer user_data)
+{
+	BlockJob *job;
+	BlockCompressor *compressor;
+
+	job = data;
+	compressor = job->compressor;
+
+	job->result = compressor->compress_func (&job->block, job->out,
+						 compressor->user_data);
+
+	g_mutex_lock (compressor->lock);
+	job->done = TRUE;
+	g_cond_broadcast (compressor->cond);
+	g_mutex_unlock (compressor->lock);
+}
+
+static GThreadPool *
+get_pool (void)
+{
+	GThreadPool *ret;
+
+	G_LOCK (pool);
+	if (pool == NULL) {
+		pool = g_thread_pool_new (compress_job, NULL,
+					  block_compressor_get_threads (),
+					  FALSE, NULL);
+	}
+	ret = pool;
+	G_UNLOCK (pool);
+
+	return ret;
+}
+
+static void
+block_job_free (BlockJob *job)
+{
+	g_byte_array_free (job->out, TRUE);
+	g_free (job->buffer);
+	g_free (job);
+}
+
+BlockCompressor *
+block_compressor_new (gsize               block_size,
+		      gsize               dictionary_size,
+		      CompressorBlockFunc compress_func,
+		      CompressorWriteFunc write_func,
+		      gpointer            user_data)
+{
+	BlockCompressor *compressor;
+
+	compressor = g_new0 (BlockCompressor, 1);
+	compressor->block_size = block_size;
+	compressor->dictionary_size = dictionary_size;
+	compressor->compress_func = compress_func;
+	compressor->write_func = write_func;
+	compressor->user_data = user_data;
+
+	compressor->buffer = g_malloc (dictionary_size + block_size);
+
+	compressor->lock = g_mutex_new ();
+	compressor->cond = g_cond_new ();
+	compressor->jobs = g_queue_new ();
+	compressor->max_jobs = BLOCKS_PER_THREAD * block_compressor_get_threads ();
+	compressor->result = GNOME_VFS_OK;
+
+	return compressor;
+}
+
+/* Queues the block being filled and starts the next one */
+static void
+submit_block (BlockCompressor *compressor,
+	      gboolean last)
+{
+	BlockJob *job;
+	guchar *data;
+	gsize tail;
+
+	data = compressor->buffer + compressor->dictionary_size;
+
+	job = g_new0 (BlockJob, 1);
+	job->compressor = compressor;
+	job->buffer = compressor->buffer;
+	job->block.data = data;
+	job->block.len = compressor->buffer_len;
+	if (compressor->dictionary_len > 0) {
+		job->block.dictionary = data - compressor->dictionary_len;
+		job->block.dictionary_len = compressor->dictionary_len;
+	}
+	job->block.first = !compressor->started;
+	job->block.last = last;
+	job->out = g_byte_array_new ();
+	job->result = GNOME_VFS_OK;
+
+	compressor->started = TRUE;
+	if (last) {
+		compressor->buffer = NULL;
+	} else {
+		/* The dictionary of the next block is the end of the data
+		 * up to here, which lies in one piece in this buffer */
+		tail = MIN (compressor->dictionary_size,
+			    compressor->dictionary_len + compressor->buffer_len);
+		compressor->buffer = g_malloc (compressor->dictionary_size
+					       + compressor->block_size);
+		memcpy (compressor->buffer + compressor->dictionary_size - tail,
+			data + compressor->buffer_len - tail, tail);
+		compressor->dictionary_len = tail;
+	}
+	compressor->buffer_len = 0;
+
+	g_mutex_lock (compressor->lock);
+	g_queue_push_tail (compressor->jobs, job);
+	g_mutex_unlock (compressor->lock);
+
+	g_thread_pool_push (get_pool (), job, NULL);
+}
+
+/* Writes out the compressed blocks at the head of the queue, waiting
+ * for them while more than max_pending blocks are queued */
+static GnomeVFSResult
+write_blocks (BlockCompressor *compressor,
+	      guint max_pending)
+{
+	BlockJob *job;
+	GnomeVFSResult result;
+
+	for (;;) {
+		g_mutex_lock (compressor->lock);
+		job = g_queue_peek_head (compressor->jobs);
+		if (job == NULL) {
+			g_mutex_unlock (compressor->lock);
+			break;
+		}
+		if (!job->done) {
+			if (g_queue_get_length (compressor->jobs) <= max_pending) {
+				g_mutex_unlock (compressor->lock);
+				break;
+			}
+			while (!job->done) {
+				g_cond_wait (compressor->cond, compressor->lock);
+			}
+		}
+		g_queue_pop_head (compressor->jobs);
+		g_mutex_unlock (compressor->lock);
+
+		result = job->result;
+		if (result == GNOME_VFS_OK && job->out->len > 0) {
+			result = compressor->write_func (job->out->data,
+							 job->out->len,
+							 compressor->user_data);
+		}
+		block_job_free (job);
+
+		if (result != GNOME_VFS_OK) {
+			return result;
+		}
+	}
+
+	return GNOME_VFS_OK;
+}
+
+GnomeVFSResult
+block_compressor_write (BlockCompressor *compressor,
+			gconstpointer    data,
+			gsize            len)
+{
+	const guchar *p;
+	gsize count;
+
+	if (compressor->result != GNOME_VFS_OK) {
+		return compressor->result;
+	}
+	g_return_val_if_fail (compressor->buffer != NULL, GNOME_VFS_ERROR_INTERNAL);
+
+	p = data;
+	while (len > 0) {
+		count = MIN (len, compressor->block_size - compressor->buffer_len);
+		memcpy (compressor->buffer + compressor->dictionary_size
+			+ compressor->buffer_len, p, count);
+		compressor->buffer_len += count;
+		p += count;
+		len -= count;
+
+		if (compressor->buffer_len == compressor->block_size) {
+			submit_block (compressor, FALSE);
+			compressor->result = write_blocks (compressor,
+							   compressor->max_jobs);
+			if (compressor->result != GNOME_VFS_OK) {
+				return compressor->result;
+			}
+		}
+	}
+
+	return GNOME_VFS_OK;
+}
+
+GnomeVFSResult
+block_compressor_finish (BlockCompressor *compressor)
+{
+	if (compressor->result != GNOME_VFS_OK) {
+		return compressor->result;
+	}
+	g_return_val_if_fail (compressor->buffer != NULL, GNOME_VFS_ERROR_INTERNAL);
+
+	submit_block (compressor, TRUE);
+	compressor->result = write_blocks (compressor, 0);
+
+	return compressor->result;
+}
+
+void
+block_compressor_free (BlockCompressor *compressor)
+{
+	BlockJob *job;
+
+	g_mutex_lock (compressor->lock);
+	while ((job = g_queue_pop_head (compressor->jobs)) != NULL) {
+		while (!job->done) {
+			g_cond_wait (compressor->cond, compressor->lock);
+		}
+		block_job_free (job);
+	}
+	g_mutex_unlock (compressor->lock);
+
+	g_queue_free (compressor->jobs);
+	g_cond_free (compressor->cond);
+	g_mutex_free (compressor->lock);
+	g_free (compressor->buffer);
+	g_free (compressor);
+}
+
+void
+block_compressor_shutdown (void)
+{
+	G_LOCK (pool);
+	if (pool != NULL) {
+		g_thread_pool_free (pool, FALSE, TRUE);
+		pool = NULL;
+	}
+	G_UNLOCK (pool);
+}
@@ -0,0 +1,80 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 8; tab-width: 8 -*- */
+/* block-compressor.h - Parallel block compression for the compressing
+   methods.
+
+   Copyright (C) 2026 Free Software Foundation
+
+   The Gnome Library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   The Gnome Library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with the Gnome Library; see the file COPYING.LIB.  If not,
+   write to the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, USA.
+*/
+
+#ifndef BLOCK_COMPRESSOR_H
+#define BLOCK_COMPRESSOR_H
+
+#include <glib.h>
+#include <libgnomevfs/gnome-vfs-result.h>
+
+/* Data written to a compressor is cut into blocks of a fixed size that
+ * are compressed independently on a pool of threads shared by all the
+ * compressors of the method. The compressed blocks are handed back in
+ * order, on the writing thread, from block_compressor_write () and
+ * block_compressor_finish ().
+ */
+
+typedef struct _BlockCompressor BlockCompressor;
+
+typedef struct {
+	const guchar *data;
+	gsize         len;
+	/* The data just before this block, if the compressor was asked
+	 * to keep some */
+	const guchar *dictionary;
+	gsize         dictionary_len;
+	gboolean      first;
+	gboolean      last;
+} CompressorBlock;
+
+/* Runs on a pool thread; appends the compressed block to out */
+typedef GnomeVFSResult (* CompressorBlockFunc) (const CompressorBlock *block,
+						GByteArray            *out,
+						gpointer               user_data);
+
+/* Runs on the writing thread, once per block, in order */
+typedef GnomeVFSResult (* CompressorWriteFunc) (const guchar *data,
+						gsize         len,
+						gpointer      user_data);
+
+/* The number of compressing threads from GNOME_VFS_COMPRESS_THREADS,
+ * the number of processors by default. Methods compress on the
+ * writing thread as before when this is 1. */
+guint            block_compressor_get_threads (void);
+
+BlockCompressor *block_compressor_new         (gsize                block_size,
+					       gsize                dictionary_size,
+					       CompressorBlockFunc  compress_func,
+					       CompressorWriteFunc  write_func,
+					       gpointer             user_data);
+GnomeVFSResult   block_compressor_write       (BlockCompressor     *compressor,
+					       gconstpointer        data,
+					       gsize                len);
+/* Compresses the last block, which may be empty, and writes out
+ * everything */
+GnomeVFSResult   block_compressor_finish      (BlockCompressor     *compressor);
+/* Waits for the blocks still being compressed and drops them */
+void             block_compressor_free        (BlockCompressor     *compressor);
+
+void             block_compressor_shutdown    (void);
+
+#endif /* BLOCK_COMPRESSOR_H */
@@ -36,15 +36,27 @@
 
 #include <bzlib.h>
 
+#include "block-compressor.h"
+
 #ifdef HAVE_OLDER_BZIP2
 #define BZ2_bzDecompressInit  bzDecompressInit
+#define BZ2_bzDecompressEnd   bzDecompressEnd
 #define BZ2_bzCompressInit    bzCompressInit
 #define BZ2_bzDecompress      bzDecompress
 #define BZ2_bzCompress        bzCompress
+#define BZ2_bzBuffToBuffCompress bzBuffToBuffCompress
 #endif
 
 #define BZ_BUFSIZE   5000
 
+/* FIXME bugzilla.eazel.com 1174: We want this to be user configurable.  */
+#define BZ_BLOCK_SIZE_100K 3
+#define BZ_WORK_FACTOR     30
+
+/* Input compressed by each thread when writing on several, as in
+ * pbzip2; one bzip2 block */
+#define PARALLEL_BLOCK_SIZE (BZ_BLOCK_SIZE_100K * 100000)
+
 struct _Bzip2MethodHandle {
 	GnomeVFSURI      *uri;
 	GnomeVFSHandle   *parent_handle;
@@ -55,6 +67,9 @@ struct _Bzip2MethodHandle {
 	gint             last_bz_result;
 	bz_stream        bzstream;
 	guchar           *buffer;
+
+	/* Writing on several threads; bzstream isn't used then */
+	BlockCompressor  *compressor;
 };
 
 typedef struct _Bzip2MethodHandle Bzip2MethodHandle;
@@ -143,7 +158,7 @@ bzip2_method_handle_new (GnomeVFSHandle *parent_handle,
 {
 	Bzip2MethodHandle *new;
 
-	new = g_new (Bzip2MethodHandle, 1);
+	new = g_new0 (Bzip2MethodHandle, 1);
 
 	new->parent_handle = parent_handle;
 	new->uri = gnome_vfs_uri_ref (uri);
@@ -157,6 +172,8 @@ bzip2_method_handle_new (GnomeVFSHandle *parent_handle,
 static void
 bzip2_method_handle_destroy (Bzip2MethodHandle *handle)
 {
+	if (handle->compressor != NULL)
+		block_compressor_free (handle->compressor);
 	gnome_vfs_uri_unref (handle->uri);
 	g_free (handle->buffer);
 	g_free (handle);
@@ -187,9 +204,6 @@ bzip2_method_handle_init_for_decompress (Bzip2MethodHandle *handle)
 	return TRUE;
 }
 
-static gboolean
-bzip2_method_handle_init_for_compress (Bzip2MethodHandle *handle) G_GNUC_UNUSED;
-
 static gboolean
 bzip2_method_handle_init_for_compress (Bzip2MethodHandle *handle)
 {
@@ -203,8 +217,8 @@ bzip2_method_handle_init_for_compress (Bzip2MethodHandle *handle)
 	handle->bzstream.next_out = (char *)handle->buffer;
 	handle->bzstream.avail_out = BZ_BUFSIZE;
 
-	/* FIXME bugzilla.eazel.com 1174: We want this to be user configurable.  */
-	if (BZ2_bzCompressInit (&handle->bzstream, 3, 0, 30) != BZ_OK) {
+	if (BZ2_bzCompressInit (&handle->bzstream, BZ_BLOCK_SIZE_100K, 0,
+				BZ_WORK_FACTOR) != BZ_OK) {
 		g_free (handle->buffer);
 		return FALSE;
 	}
@@ -220,6 +234,9 @@ result_from_bz_result (gint bz_result)
 {
 	switch (bz_result) {
 	case BZ_OK:
+	case BZ_RUN_OK:
+	case BZ_FLUSH_OK:
+	case BZ_FINISH_OK:
 	case BZ_STREAM_END:
 		return GNOME_VFS_OK;
 
@@ -258,7 +275,8 @@ flush_write (Bzip2MethodHandle *bzip2_handle)
 
 	done = FALSE;
 	bz_result = BZ_OK;
-	while (bz_result == BZ_OK || bz_result == BZ_STREAM_END) {
+	while (bz_result == BZ_OK || bz_result == BZ_FINISH_OK
+	       || bz_result == BZ_STREAM_END) {
 		GnomeVFSFileSize bytes_written;
 		GnomeVFSFileSize len;
 
@@ -279,10 +297,59 @@ flush_write (Bzip2MethodHandle *bzip2_handle)
 		done = (bzstream->avail_out != 0 || bz_result == BZ_STREAM_END);
 	}
 
-	if (bz_result == BZ_OK || bz_result == BZ_STREAM_END)
+	return result_from_bz_result (bz_result);
+}
+
+/* Parallel compression.  Every block becomes a bzip2 stream of its
+ * own; bzip2 reads the streams one after the other as a single file.  */
+
+static GnomeVFSResult
+compress_block (const CompressorBlock *block,
+		GByteArray *out,
+		gpointer user_data)
+{
+	unsigned int len;
+	gint bz_result;
+
+	/* An empty file still needs a stream, a last empty block doesn't */
+	if (block->len == 0 && !block->first)
 		return GNOME_VFS_OK;
-	else
-		return result_from_bz_result (bz_result);
+
+	/* bzip2 grows data by at most 1% and 600 bytes */
+	len = block->len + block->len / 100 + 600;
+	g_byte_array_set_size (out, len);
+
+	bz_result = BZ2_bzBuffToBuffCompress ((char *) out->data, &len,
+					      (char *) block->data, block->len,
+					      BZ_BLOCK_SIZE_100K, 0,
+					      BZ_WORK_FACTOR);
+	if (bz_result != BZ_OK)
+		len = 0;
+	g_byte_array_set_size (out, len);
+
+	return result_from_bz_result (bz_result);
+}
+
+static GnomeVFSResult
+write_to_parent (const guchar *data,
+		 gsize len,
+		 gpointer user_data)
+{
+	Bzip2MethodHandle *bzip2_handle;
+	GnomeVFSFileSize bytes_written;
+
+	bzip2_handle = user_data;
+
+	while (len > 0) {
+		RETURN_IF_FAIL (gnome_vfs_write (bzip2_handle->parent_handle,
+						 data, len, &bytes_written));
+		if (bytes_written == 0)
+			return GNOME_VFS_ERROR_IO;
+		data += bytes_written;
+		len -= bytes_written;
+	}
+
+	return GNOME_VFS_OK;
 }
 
 /* Open */
@@ -306,7 +373,7 @@ do_open (GnomeVFSMethod *method,
 	/* Check that the URI is valid.  */
 	if (!VALID_URI(uri)) return GNOME_VFS_ERROR_INVALID_URI;
 
-	if (open_mode & GNOME_VFS_OPEN_WRITE)
+	if ((open_mode & GNOME_VFS_OPEN_READ) && (open_mode & GNOME_VFS_OPEN_WRITE))
 		return GNOME_VFS_ERROR_INVALID_OPEN_MODE;
 
 	parent_uri = uri->parent;
@@ -319,13 +386,19 @@ do_open (GnomeVFSMethod *method,
 
 	bzip2_handle = bzip2_method_handle_new (parent_handle, uri, open_mode);
 
-	if (result != GNOME_VFS_OK) {
-		gnome_vfs_close (parent_handle);
-		bzip2_method_handle_destroy (bzip2_handle);
-		return result;
-	}
-
-	if (!bzip2_method_handle_init_for_decompress (bzip2_handle)) {
+	if (open_mode & GNOME_VFS_OPEN_WRITE) {
+		if (block_compressor_get_threads () > 1)
+			bzip2_handle->compressor = block_compressor_new (PARALLEL_BLOCK_SIZE,
+									 0,
+									 compress_block,
+									 write_to_parent,
+									 bzip2_handle);
+		else if (!bzip2_method_handle_init_for_compress (bzip2_handle)) {
+			gnome_vfs_close (parent_handle);
+			bzip2_method_handle_destroy (bzip2_handle);
+			return GNOME_VFS_ERROR_INTERNAL;
+		}
+	} else if (!bzip2_method_handle_init_for_decompress (bzip2_handle)) {
 		gnome_vfs_close (parent_handle);
 		bzip2_method_handle_destroy (bzip2_handle);
 		return GNOME_VFS_ERROR_INTERNAL;
@@ -367,7 +440,9 @@ do_close (GnomeVFSMethod *method,
 
 	bzip2_handle = (Bzip2MethodHandle *) method_handle;
 
-	if (bzip2_handle->open_mode & GNOME_VFS_OPEN_WRITE)
+	if (bzip2_handle->compressor != NULL)
+		result = block_compressor_finish (bzip2_handle->compressor);
+	else if (bzip2_handle->open_mode & GNOME_VFS_OPEN_WRITE)
 		result = flush_write (bzip2_handle);
 	else
 		result = GNOME_VFS_OK;
@@ -412,7 +487,42 @@ fill_buffer (Bzip2MethodHandle *bzip2_handle,
 	return GNOME_VFS_OK;
 }
 
-/* TODO: Concatenated Bzip2 file handling. */
+/* Starts decompressing the next of several concatenated streams.
+ * Returns FALSE at the end of the file.  */
+static gboolean
+next_stream (Bzip2MethodHandle *bzip2_handle)
+{
+	bz_stream *bzstream;
+	bz_stream saved;
+	GnomeVFSFileSize count;
+
+	bzstream = &bzip2_handle->bzstream;
+
+	if (bzstream->avail_in == 0) {
+		if (gnome_vfs_read (bzip2_handle->parent_handle,
+				    bzip2_handle->buffer, BZ_BUFSIZE,
+				    &count) != GNOME_VFS_OK
+		    || count == 0)
+			return FALSE;
+		bzstream->next_in = (char *)bzip2_handle->buffer;
+		bzstream->avail_in = count;
+	}
+
+	/* Like bzip2, ignore anything after the streams */
+	if (bzstream->next_in[0] != 'B')
+		return FALSE;
+
+	saved = *bzstream;
+	BZ2_bzDecompressEnd (bzstream);
+	if (BZ2_bzDecompressInit (bzstream, 0, 0) != BZ_OK)
+		return FALSE;
+	bzstream->next_in = saved.next_in;
+	bzstream->avail_in = saved.avail_in;
+	bzstream->next_out = saved.next_out;
+	bzstream->avail_out = saved.avail_out;
+
+	return TRUE;
+}
 
 static GnomeVFSResult
 do_read (GnomeVFSMethod *method,
@@ -448,23 +558,36 @@ do_read (GnomeVFSMethod *method,
 		result = fill_buffer (bzip2_handle, num_bytes);
 		RETURN_IF_FAIL (result);
 
-		bz_result = BZ2_bzDecompress (&bzip2_handle->bzstream);
-
-		if (bzip2_handle->last_bz_result != BZ_OK
-		    && bzstream->avail_out == num_bytes) {
-			bzip2_handle->last_bz_result = bz_result;
-			return result_from_bz_result (bzip2_handle->last_bz_result);
+		/* The file ended, or reading it failed, in the middle of
+		   a stream */
+		if (bzstream->avail_in == 0) {
+			if (bzstream->avail_out == num_bytes)
+				return GNOME_VFS_ERROR_CORRUPTED_DATA;
+			break;
 		}
 
-		*bytes_read = num_bytes - bzstream->avail_out;
+		bz_result = BZ2_bzDecompress (&bzip2_handle->bzstream);
 
 		if (bz_result == BZ_STREAM_END) {
+			if (next_stream (bzip2_handle))
+				continue;
 			bzip2_handle->last_bz_result = bz_result;
 			break;
 		}
 
+		if (bz_result != BZ_OK) {
+			bzip2_handle->last_bz_result = bz_result;
+			if (bzstream->avail_out == num_bytes)
+				return result_from_bz_result (bz_result);
+			break;
+		}
 	}
 
+	*bytes_read = num_bytes - bzstream->avail_out;
+
+	if (*bytes_read == 0 && bzip2_handle->last_bz_result == BZ_STREAM_END)
+		return GNOME_VFS_ERROR_EOF;
+
 	return GNOME_VFS_OK;
 }
 
@@ -486,6 +609,13 @@ do_write (GnomeVFSMethod *method,
 	bzip2_handle = (Bzip2MethodHandle *) method_handle;
 	bzstream = &bzip2_handle->bzstream;
 
+	if (bzip2_handle->compressor != NULL) {
+		result = block_compressor_write (bzip2_handle->compressor,
+						 buffer, num_bytes);
+		*bytes_written = result == GNOME_VFS_OK ? num_bytes : 0;
+		return result;
+	}
+
 	bzstream->next_in = (gpointer) buffer;
 	bzstream->avail_in = num_bytes;
 
@@ -568,5 +698,5 @@ vfs_module_init (const char *method_name, const char *args)
 void
 vfs_module_shutdown (GnomeVFSMethod *method)
 {
-	return;
+	block_compressor_shutdown ();
 }
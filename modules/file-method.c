@@ -56,6 +56,12 @@
 #endif
 #include <utime.h>
 #include <string.h>
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+#ifdef HAVE_SYS_SYSCALL_H
+#include <sys/syscall.h>
+#endif
 #ifdef HAVE_FAM
 #include <fam.h>
 #endif
@@ -93,6 +99,25 @@
 #define DIR_SEPARATORS "/"
 #endif
 
+/* On Linux, read directories in batches straight from the kernel into a
+ * buffer of the directory handle.
+ */
+#if defined (__linux__) && defined (SYS_getdents64) && \
+    defined (HAVE_DIRFD) && defined (HAVE_STRUCT_DIRENT_D_TYPE)
+#define USE_GETDENTS64 1
+
+/* What getdents64 returns; glibc doesn't export this. */
+struct linux_dirent64 {
+	guint64 d_ino;
+	gint64 d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[1];
+};
+
+#define DENTS_BUFFER_SIZE (32 * 1024)
+#endif
+
 typedef struct {
 	GnomeVFSMethodMonitorCancelFunc cancel_func;  /* Must be first */
 } AnyFileMonitorHandle;
@@ -482,6 +507,83 @@ do_write (GnomeVFSMethod *method,
 	}
 }
 
+#if defined(HAVE_COPY_FILE_RANGE) || (defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H))
+#define HAVE_KERNEL_COPY 1
+#endif
+
+/* Copy data between two local files inside the kernel. copy_file_range()
+ * also lets file systems that support it share the extents (reflink)
+ * instead of copying them.
+ */
+static GnomeVFSResult
+do_copy_data (GnomeVFSMethod *method,
+	      GnomeVFSMethodHandle *target_method_handle,
+	      GnomeVFSMethodHandle *source_method_handle,
+	      GnomeVFSFileSize num_bytes,
+	      GnomeVFSFileSize *bytes_copied,
+	      GnomeVFSContext *context)
+{
+#ifdef HAVE_KERNEL_COPY
+	FileHandle *target_handle, *source_handle;
+	gssize copy_val;
+
+	g_return_val_if_fail (target_method_handle != NULL, GNOME_VFS_ERROR_INTERNAL);
+	g_return_val_if_fail (source_method_handle != NULL, GNOME_VFS_ERROR_INTERNAL);
+
+	target_handle = (FileHandle *) target_method_handle;
+	source_handle = (FileHandle *) source_method_handle;
+
+	*bytes_copied = 0;
+
+	do {
+		copy_val = -1;
+#ifdef HAVE_COPY_FILE_RANGE
+		copy_val = copy_file_range (source_handle->fd, NULL,
+					    target_handle->fd, NULL,
+					    num_bytes, 0);
+#else
+		errno = ENOSYS;
+#endif
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+		/* copy_file_range() refuses to copy across file systems on
+		 * older kernels, sendfile() can still do that in the kernel.
+		 */
+		if (copy_val == -1 &&
+		    (errno == ENOSYS || errno == EXDEV || errno == EINVAL)) {
+			copy_val = sendfile (target_handle->fd, source_handle->fd,
+					     NULL, num_bytes);
+		}
+#endif
+	} while (copy_val == -1
+		 && errno == EINTR
+		 && ! gnome_vfs_context_check_cancellation (context));
+
+	if (copy_val == -1) {
+		/* Nothing has been copied yet, let the caller fall back
+		 * to read() and write().
+		 */
+		if (errno == ENOSYS || errno == EXDEV || errno == EINVAL
+#ifdef EOPNOTSUPP
+		    || errno == EOPNOTSUPP
+#endif
+		    ) {
+			return GNOME_VFS_ERROR_NOT_SUPPORTED;
+		}
+		return gnome_vfs_result_from_errno ();
+	}
+
+	*bytes_copied = copy_val;
+
+	if (copy_val == 0) {
+		return GNOME_VFS_ERROR_EOF;
+	}
+
+	return GNOME_VFS_OK;
+#else
+	return GNOME_VFS_ERROR_NOT_SUPPORTED;
+#endif
+}
+
 
 static gint
 seek_position_to_unix (GnomeVFSSeekPosition position)
@@ -612,6 +714,13 @@ typedef struct {
 #ifndef G_OS_WIN32
 	DIR *dir;
 	struct dirent *current_entry;
+	/* for stat'ing entries relative to the directory, or -1 */
+	int dir_fd;
+#ifdef USE_GETDENTS64
+	char *dents_buffer;
+	long dents_size;
+	long dents_offset;
+#endif
 #else
 	GDir *dir;
 #endif
@@ -640,6 +749,16 @@ directory_handle_new (GnomeVFSURI *uri,
 #ifndef G_OS_WIN32
 	/* Reserve extra space for readdir_r, see man page */
 	result->current_entry = g_malloc (sizeof (struct dirent) + GET_PATH_MAX() + 1);
+#if defined (HAVE_FSTATAT) && defined (HAVE_DIRFD)
+	result->dir_fd = dirfd (dir);
+#else
+	result->dir_fd = -1;
+#endif
+#ifdef USE_GETDENTS64
+	result->dents_buffer = g_malloc (DENTS_BUFFER_SIZE);
+	result->dents_size = 0;
+	result->dents_offset = 0;
+#endif
 #endif
 
 	full_name = get_path_from_uri (uri);
@@ -668,6 +787,9 @@ directory_handle_destroy (DirectoryHandle *directory_handle)
 	g_free (directory_handle->name_buffer);
 #ifndef G_OS_WIN32
 	g_free (directory_handle->current_entry);
+#endif
+#ifdef USE_GETDENTS64
+	g_free (directory_handle->dents_buffer);
 #endif
 	g_free (directory_handle);
 }
@@ -866,11 +988,35 @@ get_access_info (GnomeVFSFileInfo *file_info,
      file_info->valid_fields |= GNOME_VFS_FILE_INFO_FIELDS_ACCESS;
 }
 
+/* Stat @name in the directory @dir_fd if we can, so the kernel doesn't
+ * have to look up the whole of @full_name again.
+ */
+static int
+stat_at (int dir_fd,
+	 const gchar *name,
+	 const gchar *full_name,
+	 struct stat *statptr,
+	 gboolean follow_links)
+{
+#ifdef HAVE_FSTATAT
+	if (dir_fd >= 0) {
+		return fstatat (dir_fd, name, statptr,
+				follow_links ? 0 : AT_SYMLINK_NOFOLLOW);
+	}
+#endif
+	if (follow_links) {
+		return g_stat (full_name, statptr);
+	}
+	return g_lstat (full_name, statptr);
+}
+
 static GnomeVFSResult
-get_stat_info (GnomeVFSFileInfo *file_info,
-	       const gchar *full_name,
-	       GnomeVFSFileInfoOptions options,
-	       struct stat *statptr)
+get_stat_info_at (GnomeVFSFileInfo *file_info,
+		  int dir_fd,
+		  const gchar *name,
+		  const gchar *full_name,
+		  GnomeVFSFileInfoOptions options,
+		  struct stat *statptr)
 {
 	struct stat statbuf;
 #ifndef G_OS_WIN32
@@ -890,7 +1036,7 @@ get_stat_info (GnomeVFSFileInfo *file_info,
 		statptr = &statbuf;
 	}
 
-	if (g_lstat (full_name, statptr) != 0) {
+	if (stat_at (dir_fd, name, full_name, statptr, FALSE) != 0) {
 		return gnome_vfs_result_from_errno ();
 	}
 
@@ -899,7 +1045,7 @@ get_stat_info (GnomeVFSFileInfo *file_info,
 	is_symlink = S_ISLNK (statptr->st_mode);
 
 	if ((options & GNOME_VFS_FILE_INFO_FOLLOW_LINKS) && is_symlink) {
-		if (g_stat (full_name, statptr) != 0) {
+		if (stat_at (dir_fd, name, full_name, statptr, TRUE) != 0) {
 			if (errno == ELOOP) {
 				recursive = TRUE;
 			}
@@ -907,7 +1053,7 @@ get_stat_info (GnomeVFSFileInfo *file_info,
 			/* It's a broken symlink, revert to the lstat. This is sub-optimal but
 			 * acceptable because it's not a common case.
 			 */
-			if (g_lstat (full_name, statptr) != 0) {
+			if (stat_at (dir_fd, name, full_name, statptr, FALSE) != 0) {
 				return gnome_vfs_result_from_errno ();
 			}
 		}
@@ -970,6 +1116,52 @@ get_stat_info (GnomeVFSFileInfo *file_info,
 	return GNOME_VFS_OK;
 }
 
+static GnomeVFSResult
+get_stat_info (GnomeVFSFileInfo *file_info,
+	       const gchar *full_name,
+	       GnomeVFSFileInfoOptions options,
+	       struct stat *statptr)
+{
+	return get_stat_info_at (file_info, -1, NULL, full_name, options, statptr);
+}
+
+#ifdef HAVE_STRUCT_DIRENT_D_TYPE
+static gboolean
+get_type_from_dirent (GnomeVFSFileInfo *file_info,
+		      struct dirent *entry)
+{
+	switch (entry->d_type) {
+	case DT_REG:
+		file_info->type = GNOME_VFS_FILE_TYPE_REGULAR;
+		break;
+	case DT_DIR:
+		file_info->type = GNOME_VFS_FILE_TYPE_DIRECTORY;
+		break;
+	case DT_LNK:
+		file_info->type = GNOME_VFS_FILE_TYPE_SYMBOLIC_LINK;
+		break;
+	case DT_FIFO:
+		file_info->type = GNOME_VFS_FILE_TYPE_FIFO;
+		break;
+	case DT_SOCK:
+		file_info->type = GNOME_VFS_FILE_TYPE_SOCKET;
+		break;
+	case DT_CHR:
+		file_info->type = GNOME_VFS_FILE_TYPE_CHARACTER_DEVICE;
+		break;
+	case DT_BLK:
+		file_info->type = GNOME_VFS_FILE_TYPE_BLOCK_DEVICE;
+		break;
+	default:
+		/* DT_UNKNOWN, the file system doesn't tell */
+		return FALSE;
+	}
+
+	file_info->valid_fields |= GNOME_VFS_FILE_INFO_FIELDS_TYPE;
+	return TRUE;
+}
+#endif
+
 static GnomeVFSResult
 get_stat_info_from_handle (GnomeVFSFileInfo *file_info,
 			   FileHandle *handle,
@@ -1047,8 +1239,48 @@ do_close_directory (GnomeVFSMethod *method,
 	return GNOME_VFS_OK;
 }
 
-#ifndef HAVE_READDIR_R
-G_LOCK_DEFINE_STATIC (readdir);
+#ifdef USE_GETDENTS64
+/* Returns the next entry in handle->current_entry, refilling the
+ * handle's buffer from the kernel when it runs empty. Unlike readdir()
+ * this needs no locking, and it takes one system call per few hundred
+ * entries.
+ */
+static GnomeVFSResult
+read_directory_entry (DirectoryHandle *handle,
+		      struct dirent **entry)
+{
+	struct linux_dirent64 *dent;
+	long count;
+
+	if (handle->dents_offset >= handle->dents_size) {
+		do {
+			count = syscall (SYS_getdents64, dirfd (handle->dir),
+					 handle->dents_buffer, DENTS_BUFFER_SIZE);
+		} while (count < 0 && errno == EINTR);
+
+		if (count < 0) {
+			return gnome_vfs_result_from_errno ();
+		}
+		if (count == 0) {
+			*entry = NULL;
+			return GNOME_VFS_OK;
+		}
+
+		handle->dents_size = count;
+		handle->dents_offset = 0;
+	}
+
+	dent = (struct linux_dirent64 *) (handle->dents_buffer + handle->dents_offset);
+	handle->dents_offset += dent->d_reclen;
+
+	handle->current_entry->d_ino = dent->d_ino;
+	handle->current_entry->d_type = dent->d_type;
+	g_strlcpy (handle->current_entry->d_name, dent->d_name,
+		   GET_PATH_MAX () + 1);
+
+	*entry = handle->current_entry;
+	return GNOME_VFS_OK;
+}
 #endif
 
 static GnomeVFSResult
@@ -1065,11 +1297,17 @@ do_read_directory (GnomeVFSMethod *method,
 	struct stat statbuf;
 	gchar *full_name;
 	DirectoryHandle *handle;
+	GnomeVFSResult stat_result;
 
 	handle = (DirectoryHandle *) method_handle;
 	
 	errno = 0;
-#ifdef HAVE_READDIR_R	
+#if defined (USE_GETDENTS64)
+	stat_result = read_directory_entry (handle, &result);
+	if (stat_result != GNOME_VFS_OK) {
+		return stat_result;
+	}
+#elif defined (HAVE_READDIR_R)
 	if (readdir_r (handle->dir, handle->current_entry, &result) != 0) {
 		/* Work around a Solaris bug.
 		 * readdir64_r returns -1 instead of 0 at EOF.
@@ -1080,8 +1318,9 @@ do_read_directory (GnomeVFSMethod *method,
 		return gnome_vfs_result_from_errno ();
 	}
 #else
-	G_LOCK (readdir);
-	errno = 0;
+	/* A directory stream is only ever used by one thread at a time,
+	 * and readdir() on different streams doesn't need locking.
+	 */
 #ifndef G_OS_WIN32
 	result = readdir (handle->dir);
 #else
@@ -1089,17 +1328,9 @@ do_read_directory (GnomeVFSMethod *method,
 #endif
 
 	if (result == NULL && errno != 0) {
-		GnomeVFSResult ret = gnome_vfs_result_from_errno ();
-		G_UNLOCK (readdir);
-		return ret;
-	}
-#ifndef G_OS_WIN32
-	if (result != NULL) {
-		memcpy (handle->current_entry, result, sizeof (struct dirent));
+		return gnome_vfs_result_from_errno ();
 	}
 #endif
-	G_UNLOCK (readdir);
-#endif
 	
 	if (result == NULL) {
 		return GNOME_VFS_ERROR_EOF;
@@ -1115,6 +1346,15 @@ do_read_directory (GnomeVFSMethod *method,
 	full_name = handle->name_buffer;
 
 	if (handle->options & GNOME_VFS_FILE_INFO_NAME_ONLY) {
+#ifdef HAVE_STRUCT_DIRENT_D_TYPE
+		/* The type comes for free with the name on most file
+		 * systems; following links would need a stat though.
+		 */
+		if (!(handle->options & GNOME_VFS_FILE_INFO_FOLLOW_LINKS) ||
+		    result->d_type != DT_LNK) {
+			get_type_from_dirent (file_info, result);
+		}
+#endif
 		return GNOME_VFS_OK;
 	}
 
@@ -1124,7 +1364,13 @@ do_read_directory (GnomeVFSMethod *method,
 		get_selinux_context(file_info, full_name, handle->options);
 	}
 		
-	if (get_stat_info (file_info, full_name, handle->options, &statbuf) != GNOME_VFS_OK) {
+#ifndef G_OS_WIN32
+	stat_result = get_stat_info_at (file_info, handle->dir_fd, result->d_name,
+					full_name, handle->options, &statbuf);
+#else
+	stat_result = get_stat_info (file_info, full_name, handle->options, &statbuf);
+#endif
+	if (stat_result != GNOME_VFS_OK) {
 		/* Return OK - this should not terminate the directory iteration
 		 * and we will know from the valid_fields that we don't have the
 		 * stat info.
@@ -2866,7 +3112,8 @@ static GnomeVFSMethod method = {
 	do_monitor_cancel,
 	do_file_control,
 	do_forget_cache,
-	do_get_volume_free_space
+	do_get_volume_free_space,
+	do_copy_data
 };
 
 GnomeVFSMethod *
@@ -76,6 +76,19 @@
 #define CONNECTION_CACHE_MIN_LIFETIME (30 * 1000) /* milliseconds */
 #define DIRLIST_CACHE_TIMEOUT 30 /* seconds */
 
+/* Size of the chunks directory listings are read in */
+#define LISTING_BUFFER_SIZE (32 * 1024)
+
+/* Files bigger than this are downloaded as segments over several
+ * connections, if PARALLEL_SEGMENTS_VARIABLE asks for it */
+#define FTP_SEGMENTS_THRESHOLD (16 * 1024 * 1024)
+
+/* Size of each of those segments; every one costs a RETR of its own */
+#define FTP_SEGMENT_SIZE (4 * 1024 * 1024)
+
+/* Segments fetched ahead of the reader, per connection */
+#define FTP_SEGMENTS_AHEAD 2
+
 /* maximum size of response we're expecting to get */
 #define MAX_RESPONSE_SIZE 4096 
 
@@ -99,13 +112,56 @@ typedef struct {
 	int num_monitors;
 	
 	GHashTable *cached_dirlists; /* path -> FtpCachedDirlist */
+
+	/* what the server told us in response to FEAT */
+	gboolean features_checked;
+	gboolean has_mlst;
+	gboolean has_epsv;
 } FtpConnectionPool;
 
 typedef struct {
 	char *dirlist;
+	gboolean mlsd; /* dirlist is MLSD output rather than LIST output */
 	time_t read_time;
 } FtpCachedDirlist;
 
+typedef struct {
+	GnomeVFSFileOffset start;
+	GnomeVFSFileSize   len;
+	guint8            *data;
+
+	/* Bytes received so far */
+	GnomeVFSFileSize   filled;
+	gboolean           done;
+	GnomeVFSResult     result;
+} FtpSegment;
+
+/* Downloads a file as consecutive segments, each one a REST and RETR
+ * on a connection of its own from the pool, and hands them to
+ * do_read () in order */
+typedef struct {
+	GnomeVFSURI       *uri;
+	GnomeVFSFileSize   size;
+
+	GMutex            *lock;
+	GCond             *cond;
+
+	GThread          **threads;
+	guint              n_threads;
+	/* Threads that still have a connection to fetch segments over */
+	guint              n_running;
+	/* Why the last of them gave up */
+	GnomeVFSResult     result;
+
+	/* Segments being fetched or waiting for the reader, in order */
+	GQueue            *segments;
+	guint              max_segments;
+	/* Where the next segment starts */
+	GnomeVFSFileOffset next_start;
+	gboolean           failed;
+	gboolean           cancelled;
+} FtpSegmentReader;
+
 typedef struct {
 	GnomeVFSMethodHandle method_handle;
 	GnomeVFSSocketBuffer *socket_buf;
@@ -127,6 +183,11 @@ typedef struct {
 	GnomeVFSResult fivefifty; /* the result to return for an FTP 550 */
 
 	const char *list_cmd; /* the command to be used for LIST */
+	gboolean use_mlst; /* MLST and MLSD instead of LIST */
+	gboolean use_epsv; /* EPSV instead of PASV */
+
+	/* set while a read is spread over other connections */
+	FtpSegmentReader *segments;
 
 #ifdef HAVE_GSSAPI
 	gboolean use_gssapi;
@@ -142,6 +203,7 @@ typedef struct {
 	gchar *dirlist;
 	gchar *dirlistptr;
 	gchar *server_type; /* the response from TYPE */
+	gboolean mlsd;
 	GnomeVFSFileInfoOptions file_info_options;
 } FtpDirHandle;
 
@@ -189,6 +251,12 @@ static const int   control_port = 21;
 static gchar *proxy_host = NULL;
 static int proxy_port = 0;
 
+/* Number of connections big downloads are spread over, see
+ * ftp_start_segments (). Off unless set, servers often limit the
+ * connections per client. */
+#define PARALLEL_SEGMENTS_VARIABLE "GNOME_VFS_FTP_PARALLEL_SEGMENTS"
+static guint parallel_segments = 0;
+
 /* A GHashTable of FtpConnectionPool */
 
 static GHashTable *connection_pools = NULL;
@@ -425,8 +493,11 @@ read_response_line (FtpConnection *conn, gchar **line,
 	return result;
 }
 
+/* Reads the response to the last command. The lines of a multi-line
+ * response before the final one are appended to lines, if not NULL. */
 static GnomeVFSResult
-get_response (FtpConnection *conn, GnomeVFSCancellation *cancellation)
+get_response_lines (FtpConnection *conn, GString *lines,
+		    GnomeVFSCancellation *cancellation)
 {
 	/* all that should be pending is a response to the last command */
 	GnomeVFSResult result;
@@ -498,6 +569,10 @@ get_response (FtpConnection *conn, GnomeVFSCancellation *cancellation)
 		}
 
 		/* hmm - not a valid line - lets ignore it :-) */
+		if (lines != NULL) {
+			g_string_append (lines, g_strchomp (line));
+			g_string_append_c (lines, '\n');
+		}
 		g_free (line);
 
 	}
@@ -506,6 +581,12 @@ get_response (FtpConnection *conn, GnomeVFSCancellation *cancellation)
 
 }
 
+static GnomeVFSResult
+get_response (FtpConnection *conn, GnomeVFSCancellation *cancellation)
+{
+	return get_response_lines (conn, NULL, cancellation);
+}
+
 static GnomeVFSResult do_control_write (FtpConnection *conn, 
 					gchar *command,
 					GnomeVFSCancellation *cancellation) 
@@ -663,6 +744,31 @@ do_path_command_completely (gchar *command,
 	return result;
 }
 
+/* Gets the port out of "229 Entering Extended Passive Mode (|||port|)",
+ * see RFC 2428 */
+static gboolean
+parse_epsv_response (const char *response, gint *port)
+{
+	const char *ptr;
+	char *end;
+	char delimiter;
+
+	ptr = strchr (response, '(');
+	if (ptr == NULL || ptr[1] == '\0') {
+		return FALSE;
+	}
+
+	delimiter = ptr[1];
+	if (ptr[2] != delimiter || ptr[3] != delimiter) {
+		return FALSE;
+	}
+
+	*port = strtol (ptr + 4, &end, 10);
+
+	return end != ptr + 4 && *end == delimiter &&
+		*port > 0 && *port < 65536;
+}
+
 static GnomeVFSResult
 do_transfer_command (FtpConnection *conn, gchar *command, GnomeVFSContext *context) 
 {
@@ -686,15 +792,35 @@ do_transfer_command (FtpConnection *conn, gchar *command, GnomeVFSContext *conte
 
 	/* FIXME bugzilla.eazel.com 1464: implement non-PASV mode */
 
-	/* send PASV */
-	result = do_basic_command (conn, "PASV", cancellation);
+	if (conn->use_epsv) {
+		result = do_basic_command (conn, "EPSV", cancellation);
+
+		if (result == GNOME_VFS_OK &&
+		    parse_epsv_response (conn->response_message, &port)) {
+			/* the data connection goes to the host we are
+			 * already talking to */
+			host = g_strdup (conn->pool->ip != NULL ? conn->pool->ip :
+					 gnome_vfs_uri_get_host_name (conn->uri));
+		} else {
+			/* don't bother this server with it again */
+			conn->use_epsv = FALSE;
+			G_LOCK (connection_pools);
+			conn->pool->has_epsv = FALSE;
+			G_UNLOCK (connection_pools);
+		}
+	}
+
+	if (host == NULL) {
+		/* send PASV */
+		result = do_basic_command (conn, "PASV", cancellation);
 	
-	if (result != GNOME_VFS_OK) {
-		return result;
+		if (result != GNOME_VFS_OK) {
+			return result;
+		}
 	}
 
 	/* parse response */
-	{
+	if (host == NULL) {
 	        gint a1, a2, a3, a4, p1, p2;
 		gchar *ptr, *response = g_strdup (conn->response_message);
 		ptr = strchr (response, '(');
@@ -1302,6 +1428,33 @@ static void toggle_winnt_into_unix_mode(FtpConnection *conn,
 	/* server should now be in unix directory style */
 }
 
+/* Call with lock held */
+static void
+parse_features (FtpConnectionPool *pool, const char *features)
+{
+	char **lines;
+	char *feature;
+	int i;
+
+	/* one feature per line, each indented by a space */
+	lines = g_strsplit (features, "\n", 0);
+	for (i = 0; lines[i] != NULL; i++) {
+		if (lines[i][0] != ' ') {
+			continue;
+		}
+
+		feature = g_strstrip (lines[i]);
+		if (g_ascii_strncasecmp (feature, "MLST", 4) == 0 &&
+		    (feature[4] == '\0' || feature[4] == ' ')) {
+			/* MLSD comes with it */
+			pool->has_mlst = TRUE;
+		} else if (g_ascii_strcasecmp (feature, "EPSV") == 0) {
+			pool->has_epsv = TRUE;
+		}
+	}
+	g_strfreev (lines);
+}
+
 static GnomeVFSResult 
 ftp_connection_create (FtpConnectionPool *pool,
 		       FtpConnection **connptr,
@@ -1483,6 +1636,23 @@ ftp_connection_create (FtpConnectionPool *pool,
 
 	conn->server_type = g_strdup (pool->server_type);
 
+	/* Find out about MLST and EPSV */
+
+	if (!pool->features_checked) {
+		GString *features = g_string_new (NULL);
+
+		if (do_control_write (conn, "FEAT", cancellation) == GNOME_VFS_OK &&
+		    get_response_lines (conn, features, cancellation) == GNOME_VFS_OK) {
+			parse_features (pool, features->str);
+		}
+		g_string_free (features, TRUE);
+
+		pool->features_checked = TRUE;
+	}
+
+	conn->use_mlst = pool->has_mlst;
+	conn->use_epsv = pool->has_epsv;
+
 	*connptr = conn;
 
 	ftp_debug (conn, g_strdup ("created"));
@@ -1615,6 +1785,28 @@ ftp_connection_pool_lookup (GnomeVFSURI *uri)
 	return pool;
 }
 
+/* Call with lock held */
+static FtpCachedDirlist *
+ftp_cached_dirlist_lookup (FtpConnectionPool *pool,
+			   GnomeVFSURI *uri)
+{
+	FtpCachedDirlist *cached_dirlist;
+	struct timeval tv;
+
+	cached_dirlist = g_hash_table_lookup (pool->cached_dirlists,
+					      uri->text != NULL ? uri->text : "/");
+	if (cached_dirlist != NULL) {
+		gettimeofday (&tv, NULL);
+
+		if (tv.tv_sec >= cached_dirlist->read_time &&
+		    tv.tv_sec <= (cached_dirlist->read_time + DIRLIST_CACHE_TIMEOUT)) {
+			return cached_dirlist;
+		}
+	}
+
+	return NULL;
+}
+
 static void
 invalidate_dirlist_cache (GnomeVFSURI *uri)
 {
@@ -1814,6 +2006,328 @@ do_is_local (GnomeVFSMethod *method,
 }
 
 
+/* Fetches one segment with a RETR from its start. Unless the segment
+ * runs to the end of the file, the transfer is cut off once it has been
+ * received; healthy tells whether the connection can be used again. */
+static GnomeVFSResult
+ftp_segment_fetch (FtpSegmentReader *reader,
+		   FtpConnection    *conn,
+		   FtpSegment       *segment,
+		   gboolean         *healthy)
+{
+	GnomeVFSResult   result, end_result;
+	GnomeVFSFileSize filled, bytes_read;
+	gboolean         cancelled;
+
+	*healthy = FALSE;
+
+	conn->operation = FTP_READ;
+	conn->offset = segment->start;
+	result = do_path_transfer_command (conn, "RETR", reader->uri, NULL);
+	if (result != GNOME_VFS_OK) {
+		return result;
+	}
+
+	filled = 0;
+	cancelled = FALSE;
+
+	while (filled < segment->len && !cancelled) {
+		result = gnome_vfs_socket_buffer_read (conn->data_socketbuf,
+						       segment->data + filled,
+						       segment->len - filled,
+						       &bytes_read, NULL);
+		if (result == GNOME_VFS_OK && bytes_read == 0) {
+			/* the file got shorter under us */
+			result = GNOME_VFS_ERROR_CORRUPTED_DATA;
+		}
+		if (result != GNOME_VFS_OK) {
+			break;
+		}
+
+		filled += bytes_read;
+
+		g_mutex_lock (reader->lock);
+		segment->filled = filled;
+		cancelled = reader->cancelled;
+		g_cond_broadcast (reader->cond);
+		g_mutex_unlock (reader->lock);
+	}
+
+	/* A transfer cut short is answered with a 426, one that got to
+	 * the end of the file with a 226 */
+	end_result = end_transfer (conn, NULL);
+	*healthy = result == GNOME_VFS_OK &&
+		(end_result == GNOME_VFS_OK ||
+		 end_result == GNOME_VFS_ERROR_CANCELLED);
+
+	return result;
+}
+
+static gpointer
+ftp_segment_reader_thread (gpointer data)
+{
+	FtpSegmentReader *reader;
+	FtpConnection    *conn;
+	FtpSegment       *segment;
+	GnomeVFSResult    result;
+	gboolean          healthy;
+
+	reader = data;
+	conn = NULL;
+	result = GNOME_VFS_OK;
+
+	for (;;) {
+		if (conn == NULL) {
+			result = ftp_connection_acquire (reader->uri, &conn, NULL);
+			if (result != GNOME_VFS_OK) {
+				/* most likely the server won't take any more
+				 * connections; leave the rest to the others */
+				conn = NULL;
+				break;
+			}
+		}
+
+		g_mutex_lock (reader->lock);
+
+		while (! reader->cancelled && ! reader->failed &&
+		       reader->next_start < reader->size &&
+		       g_queue_get_length (reader->segments) >= reader->max_segments) {
+			g_cond_wait (reader->cond, reader->lock);
+		}
+
+		if (reader->cancelled || reader->failed ||
+		    reader->next_start >= reader->size) {
+			g_mutex_unlock (reader->lock);
+			break;
+		}
+
+		segment = g_new0 (FtpSegment, 1);
+		segment->start = reader->next_start;
+		segment->len = MIN (FTP_SEGMENT_SIZE, reader->size - segment->start);
+		segment->data = g_malloc (segment->len);
+
+		reader->next_start += segment->len;
+		g_queue_push_tail (reader->segments, segment);
+
+		g_mutex_unlock (reader->lock);
+
+		result = ftp_segment_fetch (reader, conn, segment, &healthy);
+		if (!healthy) {
+			ftp_connection_release (conn, TRUE);
+			conn = NULL;
+		}
+
+		g_mutex_lock (reader->lock);
+
+		segment->done = TRUE;
+		segment->result = result;
+
+		if (result != GNOME_VFS_OK) {
+			reader->failed = TRUE;
+		}
+
+		g_cond_broadcast (reader->cond);
+		g_mutex_unlock (reader->lock);
+	}
+
+	if (conn != NULL) {
+		ftp_connection_release (conn, FALSE);
+	}
+
+	g_mutex_lock (reader->lock);
+	reader->n_running--;
+	if (result != GNOME_VFS_OK) {
+		reader->result = result;
+	}
+	g_cond_broadcast (reader->cond);
+	g_mutex_unlock (reader->lock);
+
+	return NULL;
+}
+
+static void
+ftp_segment_reader_free (FtpSegmentReader *reader)
+{
+	FtpSegment *segment;
+	guint i;
+
+	g_mutex_lock (reader->lock);
+	reader->cancelled = TRUE;
+	g_cond_broadcast (reader->cond);
+	g_mutex_unlock (reader->lock);
+
+	for (i = 0; i < reader->n_threads; i++) {
+		g_thread_join (reader->threads[i]);
+	}
+
+	while ((segment = g_queue_pop_head (reader->segments)) != NULL) {
+		g_free (segment->data);
+		g_free (segment);
+	}
+
+	g_queue_free (reader->segments);
+	g_mutex_free (reader->lock);
+	g_cond_free (reader->cond);
+	gnome_vfs_uri_unref (reader->uri);
+	g_free (reader->threads);
+	g_free (reader);
+}
+
+static FtpSegmentReader *
+ftp_segment_reader_new (GnomeVFSURI        *uri,
+			GnomeVFSFileOffset  start,
+			GnomeVFSFileSize    size)
+{
+	FtpSegmentReader *reader;
+	GThread *thread;
+	guint i;
+
+	reader = g_new0 (FtpSegmentReader, 1);
+	reader->uri = gnome_vfs_uri_dup (uri);
+	reader->size = size;
+	reader->next_start = start;
+	reader->result = GNOME_VFS_ERROR_IO;
+
+	reader->lock = g_mutex_new ();
+	reader->cond = g_cond_new ();
+	reader->segments = g_queue_new ();
+	reader->max_segments = parallel_segments * FTP_SEGMENTS_AHEAD;
+	reader->threads = g_new0 (GThread *, parallel_segments);
+
+	g_mutex_lock (reader->lock);
+	for (i = 0; i < parallel_segments; i++) {
+		thread = g_thread_create (ftp_segment_reader_thread, reader,
+					  TRUE, NULL);
+
+		if (thread == NULL) {
+			break;
+		}
+
+		reader->threads[reader->n_threads++] = thread;
+		reader->n_running++;
+	}
+	g_mutex_unlock (reader->lock);
+
+	if (reader->n_threads == 0) {
+		ftp_segment_reader_free (reader);
+		return NULL;
+	}
+
+	return reader;
+}
+
+static GnomeVFSResult
+ftp_segment_reader_read (FtpSegmentReader   *reader,
+			 GnomeVFSFileOffset  offset,
+			 gpointer            buffer,
+			 GnomeVFSFileSize    num_bytes,
+			 GnomeVFSFileSize   *bytes_read)
+{
+	GnomeVFSResult    result;
+	FtpSegment       *segment;
+	GnomeVFSFileSize  skip;
+
+	*bytes_read = 0;
+
+	g_mutex_lock (reader->lock);
+
+	for (;;) {
+		segment = g_queue_peek_head (reader->segments);
+
+		if (segment == NULL) {
+			if (offset >= reader->size) {
+				result = GNOME_VFS_ERROR_EOF;
+				break;
+			} else if (reader->n_running == 0) {
+				/* nobody got a connection */
+				result = reader->result;
+				break;
+			}
+		} else if (offset >= segment->start + segment->len) {
+			/* done with it, make room for the next one */
+			g_queue_pop_head (reader->segments);
+			g_free (segment->data);
+			g_free (segment);
+			g_cond_broadcast (reader->cond);
+			continue;
+		} else {
+			skip = offset - segment->start;
+
+			if (segment->filled > skip) {
+				*bytes_read = MIN (segment->filled - skip, num_bytes);
+				memcpy (buffer, segment->data + skip, *bytes_read);
+				result = GNOME_VFS_OK;
+				break;
+			} else if (segment->done) {
+				result = segment->result;
+				break;
+			}
+		}
+
+		g_cond_wait (reader->cond, reader->lock);
+	}
+
+	g_mutex_unlock (reader->lock);
+
+	return result;
+}
+
+/* Asks for the size of a file, for which SIZE (RFC 3659) has to be
+ * supported */
+static GnomeVFSResult
+get_file_size (FtpConnection *conn,
+	       GnomeVFSURI *uri,
+	       GnomeVFSFileSize *size,
+	       GnomeVFSCancellation *cancellation)
+{
+	GnomeVFSResult result;
+	char *end;
+
+	result = do_path_command (conn, "SIZE", uri, cancellation);
+	if (result != GNOME_VFS_OK) {
+		return result;
+	}
+
+	if (conn->response_code != 213) {
+		return GNOME_VFS_ERROR_NOT_SUPPORTED;
+	}
+
+	*size = g_ascii_strtoull (conn->response_message, &end, 10);
+	if (end == conn->response_message) {
+		return GNOME_VFS_ERROR_CORRUPTED_DATA;
+	}
+
+	return GNOME_VFS_OK;
+}
+
+/* Instead of a RETR of its own, has a big file read from the current
+ * offset over parallel connections if parallel_segments asks for it.
+ * Returns FALSE if the caller has to RETR after all. */
+static gboolean
+ftp_start_segments (FtpConnection *conn,
+		    GnomeVFSContext *context)
+{
+	GnomeVFSFileSize size;
+
+	if (parallel_segments < 2) {
+		return FALSE;
+	}
+
+	if (get_file_size (conn, conn->uri, &size,
+			   get_cancellation (context)) != GNOME_VFS_OK) {
+		return FALSE;
+	}
+
+	if (size < conn->offset ||
+	    size - conn->offset < FTP_SEGMENTS_THRESHOLD) {
+		return FALSE;
+	}
+
+	conn->segments = ftp_segment_reader_new (conn->uri, conn->offset, size);
+
+	return conn->segments != NULL;
+}
+
 static GnomeVFSResult 
 do_open (GnomeVFSMethod *method,
 	 GnomeVFSMethodHandle **method_handle,
@@ -1838,7 +2352,11 @@ do_open (GnomeVFSMethod *method,
 
 	if (mode & GNOME_VFS_OPEN_READ) {
 		conn->operation = FTP_READ;
-		result = do_path_transfer_command (conn, "RETR", uri, context);
+		if (ftp_start_segments (conn, context)) {
+			result = GNOME_VFS_OK;
+		} else {
+			result = do_path_transfer_command (conn, "RETR", uri, context);
+		}
 	} else if (mode & GNOME_VFS_OPEN_WRITE) {
 
 		invalidate_parent_dirlist_cache (uri);
@@ -1924,7 +2442,16 @@ do_close (GnomeVFSMethod *method,
 	GnomeVFSCancellation *cancellation;
 	
 	cancellation = get_cancellation (context);
-	result = end_transfer (conn, cancellation);
+
+	if (conn->segments != NULL) {
+		/* there is no transfer of our own to end */
+		ftp_segment_reader_free (conn->segments);
+		conn->segments = NULL;
+		result = GNOME_VFS_OK;
+	} else {
+		result = end_transfer (conn, cancellation);
+	}
+
 	ftp_connection_release (conn, result != GNOME_VFS_OK);
 
 	return result;
@@ -1943,11 +2470,17 @@ do_read (GnomeVFSMethod *method,
 	GnomeVFSCancellation *cancellation;
 	
 	cancellation = get_cancellation (context);
-	result = gnome_vfs_socket_buffer_read (conn->data_socketbuf, buffer, num_bytes, bytes_read, cancellation);
 
- 	if (*bytes_read == 0) {
- 		result = GNOME_VFS_ERROR_EOF;
- 	}
+	if (conn->segments != NULL) {
+		result = ftp_segment_reader_read (conn->segments, conn->offset,
+						  buffer, num_bytes, bytes_read);
+	} else {
+		result = gnome_vfs_socket_buffer_read (conn->data_socketbuf, buffer, num_bytes, bytes_read, cancellation);
+
+	 	if (*bytes_read == 0) {
+	 		result = GNOME_VFS_ERROR_EOF;
+	 	}
+	}
 
 	if (result == GNOME_VFS_OK) {
 		conn->offset += *bytes_read;
@@ -2013,12 +2546,18 @@ do_seek (GnomeVFSMethod *method,
 			return GNOME_VFS_ERROR_GENERIC;
 	}
 
-	/* We need to stop the data transfer first */
-	result = end_transfer (conn, cancellation);
+	if (conn->segments != NULL) {
+		/* no transfer of our own to stop */
+		ftp_segment_reader_free (conn->segments);
+		conn->segments = NULL;
+	} else {
+		/* We need to stop the data transfer first */
+		result = end_transfer (conn, cancellation);
 
-	/* Do not check for result != GNOME_VFS_OK because we know the error:
-	 * 426 Failure writing network stream.
-	 */
+		/* Do not check for result != GNOME_VFS_OK because we know the error:
+		 * 426 Failure writing network stream.
+		 */
+	}
 
 	/* Save the original offset */
 	orig_offset = conn->offset;
@@ -2027,7 +2566,11 @@ do_seek (GnomeVFSMethod *method,
 	conn->offset = real_offset;
 	switch (conn->operation) {
 		case FTP_READ:
-			result = do_path_transfer_command (conn, "RETR", conn->uri, context);
+			if (ftp_start_segments (conn, context)) {
+				result = GNOME_VFS_OK;
+			} else {
+				result = do_path_transfer_command (conn, "RETR", conn->uri, context);
+			}
 			break;
 		case FTP_WRITE:
 			result = do_path_transfer_command (conn, "STOR", conn->uri, context);
@@ -2252,6 +2795,281 @@ unix_ls_to_file_info (gchar *ls, GnomeVFSFileInfo *file_info,
 	}
 }
 
+/* Seconds since the epoch of a UTC date and time, as timegm () would
+ * give them if it was portable */
+static time_t
+utc_to_time_t (int year, int month, int day,
+	       int hour, int minute, int second)
+{
+	glong days;
+	int era, year_of_era, day_of_year;
+
+	if (month <= 2) {
+		year--;
+	}
+	era = (year >= 0 ? year : year - 399) / 400;
+	year_of_era = year - era * 400;
+	day_of_year = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+	days = (glong) era * 146097 + year_of_era * 365 + year_of_era / 4
+		- year_of_era / 100 + day_of_year - 719468;
+
+	return (time_t) days * 86400 + hour * 3600 + minute * 60 + second;
+}
+
+/* parse one line of MLSD or MLST output (RFC 3659), "fact=value;...; name".
+ * return TRUE if a directory entry was found, FALSE for the "." and ".."
+ * entries and for lines that aren't facts at all
+ */
+static gboolean
+mlsx_to_file_info (const gchar *line, GnomeVFSFileInfo *file_info)
+{
+	const char *name;
+	const char *mime_type;
+	char *facts_str, *fact, *value, *end;
+	char **facts;
+	int i, year, month, day, hour, minute, second;
+	gboolean is_entry, has_uid, has_gid;
+	gulong n;
+
+	name = strchr (line, ' ');
+	if (name == NULL || name == line || name[1] == '\0') {
+		return FALSE;
+	}
+
+	facts_str = g_strndup (line, name - line);
+	facts = g_strsplit (facts_str, ";", 0);
+	g_free (facts_str);
+	name++;
+
+	file_info->valid_fields = 0;
+	is_entry = TRUE;
+	has_uid = has_gid = FALSE;
+
+	for (i = 0; facts[i] != NULL; i++) {
+		fact = facts[i];
+		value = strchr (fact, '=');
+		if (value == NULL) {
+			continue;
+		}
+		*value++ = '\0';
+
+		if (g_ascii_strcasecmp (fact, "type") == 0) {
+			file_info->valid_fields |= GNOME_VFS_FILE_INFO_FIELDS_TYPE;
+
+			if (g_ascii_strcasecmp (value, "file") == 0) {
+				file_info->type = GNOME_VFS_FILE_TYPE_REGULAR;
+			} else if (g_ascii_strcasecmp (value, "dir") == 0) {
+				file_info->type = GNOME_VFS_FILE_TYPE_DIRECTORY;
+			} else if (g_ascii_strcasecmp (value, "cdir") == 0 ||
+				   g_ascii_strcasecmp (value, "pdir") == 0) {
+				is_entry = FALSE;
+			} else if (g_ascii_strncasecmp (value, "OS.unix=slink", 13) == 0 ||
+				   g_ascii_strncasecmp (value, "OS.unix=symlink", 15) == 0) {
+				file_info->type = GNOME_VFS_FILE_TYPE_SYMBOLIC_LINK;
+				file_info->flags |= GNOME_VFS_FILE_FLAGS_SYMLINK;
+				file_info->valid_fields |= GNOME_VFS_FILE_INFO_FIELDS_FLAGS;
+
+				/* some servers name the target, "OS.unix=slink:target" */
+				end = strchr (value, ':');
+				if (end != NULL && end[1] != '\0') {
+					file_info->symlink_name = g_strdup (end + 1);
+					file_info->valid_fields |= GNOME_VFS_FILE_INFO_FIELDS_SYMLINK_NAME;
+				}
+			} else {
+				file_info->type = GNOME_VFS_FILE_TYPE_UNKNOWN;
+			}
+		} else if (g_ascii_strcasecmp (fact, "size") == 0) {
+			file_info->size = g_ascii_strtoull (value, NULL, 10);
+			file_info->valid_fields |= GNOME_VFS_FILE_INFO_FIELDS_SIZE;
+		} else if (g_ascii_strcasecmp (fact, "modify") == 0) {
+			/* YYYYMMDDHHMMSS[.sss], always in UTC */
+			if (sscanf (value, "%4d%2d%2d%2d%2d%2d", &year, &month, &day,
+				    &hour, &minute, &second) == 6) {
+				file_info->mtime = utc_to_time_t (year, month, day,
+								  hour, minute, second);
+				file_info->valid_fields |= GNOME_VFS_FILE_INFO_FIELDS_MTIME;
+			}
+		} else if (g_ascii_strcasecmp (fact, "UNIX.mode") == 0) {
+			n = strtoul (value, &end, 8);
+			if (end != value) {
+				file_info->permissions = n & 07777;
+				file_info->valid_fields |= GNOME_VFS_FILE_INFO_FIELDS_PERMISSIONS;
+			}
+		} else if (g_ascii_strcasecmp (fact, "UNIX.uid") == 0 ||
+			   g_ascii_strcasecmp (fact, "UNIX.owner") == 0) {
+			n = strtoul (value, &end, 10);
+			if (end != value && *end == '\0') {
+				file_info->uid = n;
+				has_uid = TRUE;
+			}
+		} else if (g_ascii_strcasecmp (fact, "UNIX.gid") == 0 ||
+			   g_ascii_strcasecmp (fact, "UNIX.group") == 0) {
+			n = strtoul (value, &end, 10);
+			if (end != value && *end == '\0') {
+				file_info->gid = n;
+				has_gid = TRUE;
+			}
+		}
+	}
+	g_strfreev (facts);
+
+	if (!is_entry ||
+	    !(file_info->valid_fields & GNOME_VFS_FILE_INFO_FIELDS_TYPE)) {
+		gnome_vfs_file_info_clear (file_info);
+		return FALSE;
+	}
+
+	if (has_uid && has_gid) {
+		file_info->valid_fields |= GNOME_VFS_FILE_INFO_FIELDS_IDS;
+	}
+
+	/* We want large reads on FTP */
+	file_info->valid_fields |= GNOME_VFS_FILE_INFO_FIELDS_IO_BLOCK_SIZE;
+	file_info->io_block_size = 32*1024;
+
+	/* MLST gives the whole path */
+	file_info->name = g_path_get_basename (name);
+
+	switch (file_info->type) {
+	case GNOME_VFS_FILE_TYPE_REGULAR:
+		mime_type = gnome_vfs_mime_type_from_name_or_default (file_info->name, GNOME_VFS_MIME_TYPE_UNKNOWN);
+		break;
+	case GNOME_VFS_FILE_TYPE_DIRECTORY:
+		mime_type = "x-directory/normal";
+		break;
+	case GNOME_VFS_FILE_TYPE_SYMBOLIC_LINK:
+		mime_type = "x-special/symlink";
+		break;
+	default:
+		mime_type = GNOME_VFS_MIME_TYPE_UNKNOWN;
+		break;
+	}
+	file_info->mime_type = g_strdup (mime_type);
+	file_info->valid_fields |= GNOME_VFS_FILE_INFO_FIELDS_MIME_TYPE;
+
+	return TRUE;
+}
+
+static gboolean
+mlsd_to_file_info (const gchar *mlsd, GnomeVFSFileInfo *file_info)
+{
+	char *line;
+	gboolean success;
+
+	line = g_strndup (mlsd, strcspn (mlsd, "\r\n"));
+	success = mlsx_to_file_info (line, file_info);
+	g_free (line);
+
+	return success;
+}
+
+/* Asks for the facts of a single file with MLST, which needs neither a
+ * data connection nor a listing of the whole parent directory. Returns
+ * FALSE if the caller has to list the parent after all: the server
+ * can't do MLST, the listing is cached anyway or a symlink has to be
+ * followed.
+ */
+static gboolean
+get_file_info_mlst (GnomeVFSURI *uri,
+		    GnomeVFSURI *parent,
+		    GnomeVFSFileInfo *file_info,
+		    GnomeVFSFileInfoOptions options,
+		    GnomeVFSContext *context,
+		    GnomeVFSResult *result)
+{
+	FtpConnectionPool *pool;
+	FtpConnection *conn;
+	GnomeVFSCancellation *cancellation;
+	GString *facts;
+	char *unescaped, *command, *line, *end;
+	gboolean use_mlst, answered, found;
+	int len;
+
+	G_LOCK (connection_pools);
+	pool = ftp_connection_pool_lookup (uri);
+	use_mlst = pool->has_mlst &&
+		ftp_cached_dirlist_lookup (pool, parent) == NULL;
+	G_UNLOCK (connection_pools);
+
+	if (!use_mlst) {
+		return FALSE;
+	}
+
+	cancellation = get_cancellation (context);
+
+	*result = ftp_connection_acquire (uri, &conn, context);
+	if (*result != GNOME_VFS_OK) {
+		return TRUE;
+	}
+
+	unescaped = gnome_vfs_unescape_string (uri->text, G_DIR_SEPARATOR_S);
+	if (unescaped == NULL || unescaped[0] == '\0') {
+		g_free (unescaped);
+		unescaped = g_strdup ("/");
+	}
+
+	/* Remove trailing slashes */
+	len = strlen (unescaped);
+	if (len > 1 && unescaped[len - 1] == '/') {
+		unescaped[len - 1] = '\0';
+	}
+
+	command = g_strconcat ("MLST ", unescaped, NULL);
+	g_free (unescaped);
+
+	facts = g_string_new (NULL);
+	conn->response_code = -1;
+	*result = do_control_write (conn, command, cancellation);
+	if (*result == GNOME_VFS_OK) {
+		*result = get_response_lines (conn, facts, cancellation);
+	}
+	g_free (command);
+
+	answered = conn->response_code != -1;
+	if (answered && (conn->response_code == 500 ||
+			 conn->response_code == 502)) {
+		/* it told us otherwise in FEAT */
+		conn->use_mlst = FALSE;
+		G_LOCK (connection_pools);
+		pool->has_mlst = FALSE;
+		G_UNLOCK (connection_pools);
+		ftp_connection_release (conn, FALSE);
+		g_string_free (facts, TRUE);
+		return FALSE;
+	}
+
+	ftp_connection_release (conn, !answered);
+
+	if (*result != GNOME_VFS_OK) {
+		g_string_free (facts, TRUE);
+		return TRUE;
+	}
+
+	/* the facts are on the line indented by a space */
+	found = FALSE;
+	for (line = facts->str; *line != '\0'; line = end + 1) {
+		end = strchr (line, '\n');
+		*end = '\0';
+
+		if (line[0] == ' ') {
+			found = mlsx_to_file_info (line + 1, file_info);
+			break;
+		}
+	}
+	g_string_free (facts, TRUE);
+
+	if (!found) {
+		return FALSE;
+	}
+
+	if ((options & GNOME_VFS_FILE_INFO_FOLLOW_LINKS) &&
+	    file_info->type == GNOME_VFS_FILE_TYPE_SYMBOLIC_LINK) {
+		gnome_vfs_file_info_clear (file_info);
+		return FALSE;
+	}
+
+	return TRUE;
+}
 
 #if 0
 static GnomeVFSResult
@@ -2367,6 +3185,13 @@ do_get_file_info (GnomeVFSMethod *method,
 			return GNOME_VFS_ERROR_NOT_SUPPORTED;
 		}
 
+		if (get_file_info_mlst (uri, parent, file_info, options,
+					context, &result)) {
+			gnome_vfs_uri_unref (parent);
+			g_free (name);
+			return result;
+		}
+
 		result = do_open_directory (method, &method_handle, parent,
 					    options, context);
 
@@ -2492,37 +3317,33 @@ do_open_directory (GnomeVFSMethod *method,
 		   GnomeVFSFileInfoOptions options,
 		   GnomeVFSContext *context)
 {
-#define BUFFER_SIZE 1024
 	FtpConnection *conn;
 	GnomeVFSResult result;
-	GnomeVFSFileSize num_bytes = BUFFER_SIZE, bytes_read;
-	gchar buffer[BUFFER_SIZE+1];
+	GnomeVFSFileSize num_bytes = LISTING_BUFFER_SIZE, bytes_read;
+	gchar *buffer;
 	GString *dirlist = g_string_new ("");
 	char *dirlist_str;
 	GnomeVFSCancellation *cancellation;
 	FtpDirHandle *handle;
 	char *server_type;
+	gboolean mlsd;
 	FtpConnectionPool *pool;
 	FtpCachedDirlist *cached_dirlist;
 	struct timeval tv;
 
 	dirlist_str = NULL;
 	server_type = NULL;
+	mlsd = FALSE;
 	cancellation = get_cancellation (context);
 
 	
 	G_LOCK (connection_pools);
 	pool = ftp_connection_pool_lookup (uri);
-	cached_dirlist = g_hash_table_lookup (pool->cached_dirlists,
-					      uri->text != NULL ? uri->text : "/");
+	cached_dirlist = ftp_cached_dirlist_lookup (pool, uri);
 	if (cached_dirlist != NULL) {
-		gettimeofday (&tv, NULL);
-
-		if (tv.tv_sec >= cached_dirlist->read_time &&
-		    tv.tv_sec <= (cached_dirlist->read_time + DIRLIST_CACHE_TIMEOUT)) {
-			dirlist_str = g_strdup (cached_dirlist->dirlist);
-			server_type = g_strdup (pool->server_type);
-		}
+		dirlist_str = g_strdup (cached_dirlist->dirlist);
+		server_type = g_strdup (pool->server_type);
+		mlsd = cached_dirlist->mlsd;
 	}
 	G_UNLOCK (connection_pools);
 	if (dirlist_str != NULL) {
@@ -2549,7 +3370,24 @@ do_open_directory (GnomeVFSMethod *method,
 		return result;
 	}
 
-	if (conn->list_cmd != NULL) {
+	if (conn->use_mlst) {
+		result = do_transfer_command (conn, "MLSD", context);
+
+		if (result == GNOME_VFS_OK) {
+			mlsd = TRUE;
+		} else if (result == GNOME_VFS_ERROR_INTERNAL ||
+			   result == GNOME_VFS_ERROR_BAD_PARAMETERS) {
+			/* it told us otherwise in FEAT, LIST it is */
+			conn->use_mlst = FALSE;
+			G_LOCK (connection_pools);
+			conn->pool->has_mlst = FALSE;
+			G_UNLOCK (connection_pools);
+		}
+	}
+
+	if (mlsd) {
+		/* the listing is on its way already */
+	} else if (conn->list_cmd != NULL) {
 		result = do_transfer_command (conn, (char *) conn->list_cmd, context);
 	} else {
 		result = get_list_command (conn, context);
@@ -2561,6 +3399,8 @@ do_open_directory (GnomeVFSMethod *method,
 		return result;
 	}
 
+	buffer = g_malloc (LISTING_BUFFER_SIZE + 1);
+
 	while (result == GNOME_VFS_OK) {
 		result = gnome_vfs_socket_buffer_read (conn->data_socketbuf, buffer, 
 						       num_bytes, &bytes_read,
@@ -2573,6 +3413,8 @@ do_open_directory (GnomeVFSMethod *method,
 		}
 	} 
 
+	g_free (buffer);
+
 	result = end_transfer (conn, cancellation);
 
 	dirlist_str = g_string_free (dirlist, FALSE);
@@ -2591,6 +3433,7 @@ do_open_directory (GnomeVFSMethod *method,
 
 	cached_dirlist = g_new0 (FtpCachedDirlist, 1);
 	cached_dirlist->dirlist = g_strdup (dirlist_str);
+	cached_dirlist->mlsd = mlsd;
 	gettimeofday (&tv, NULL);
 	cached_dirlist->read_time = tv.tv_sec;
 	
@@ -2610,6 +3453,7 @@ do_open_directory (GnomeVFSMethod *method,
 	handle->file_info_options = options;
 	handle->uri = gnome_vfs_uri_dup (uri);
 	handle->server_type = server_type;
+	handle->mlsd = mlsd;
 	
 	*method_handle = (GnomeVFSMethodHandle *)handle;
 
@@ -2647,17 +3491,21 @@ do_read_directory (GnomeVFSMethod *method,
 	while (TRUE) {
 		gboolean success;
                 
-		if (strncmp (handle->server_type, "NETWARE", 7) == 0) {
-			success = netware_ls_to_file_info (handle->dirlistptr, file_info,
-			                                   handle->file_info_options);
-		}
-		else {
-			success = unix_ls_to_file_info (handle->dirlistptr, file_info,
-			                                handle->file_info_options);
-		}
+		if (handle->mlsd) {
+			success = mlsd_to_file_info (handle->dirlistptr, file_info);
+		} else {
+			if (strncmp (handle->server_type, "NETWARE", 7) == 0) {
+				success = netware_ls_to_file_info (handle->dirlistptr, file_info,
+				                                   handle->file_info_options);
+			}
+			else {
+				success = unix_ls_to_file_info (handle->dirlistptr, file_info,
+				                                handle->file_info_options);
+			}
 
-		/* permissions aren't valid */
-		file_info->valid_fields &= ~GNOME_VFS_FILE_INFO_FIELDS_PERMISSIONS;
+			/* permissions aren't valid */
+			file_info->valid_fields &= ~GNOME_VFS_FILE_INFO_FIELDS_PERMISSIONS;
+		}
 
 		if (handle->file_info_options & GNOME_VFS_FILE_INFO_FOLLOW_LINKS &&
 		    file_info->type == GNOME_VFS_FILE_TYPE_SYMBOLIC_LINK) {
@@ -2982,6 +3830,7 @@ vfs_module_init (const char *method_name,
 		 const char *args)
 {
 	GConfClient *gclient;
+	const char *segments;
 
 	connection_pools = g_hash_table_new (ftp_connection_uri_hash, 
 					     ftp_connection_uri_equal);
@@ -3005,6 +3854,11 @@ vfs_module_init (const char *method_name,
 		} else proxy_host = NULL;
 	}
 
+	segments = getenv (PARALLEL_SEGMENTS_VARIABLE);
+	if (segments != NULL) {
+		parallel_segments = strtoul (segments, NULL, 10);
+	}
+
 	return &method;
 }
 
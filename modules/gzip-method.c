@@ -24,14 +24,44 @@
 #include <config.h>
 
 #include <glib.h>
+#include <libgnomevfs/gnome-vfs-cancellable-ops.h>
 #include <libgnomevfs/gnome-vfs-mime.h>
 #include <libgnomevfs/gnome-vfs-module.h>
 #include <libgnomevfs/gnome-vfs-ops.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <zlib.h>
 
+#include "block-compressor.h"
+
+/* Size of the deflate window, which is what inflation needs to resume
+ * in the middle of the stream */
+#define WINDOW_SIZE 32768
+
+/* A place to resume inflating at: the state of the stream at the end
+ * of a deflate block.  */
+typedef struct {
+	GnomeVFSFileSize out;		/* offset in the uncompressed data */
+	GnomeVFSFileSize in;		/* offset of the next whole byte in the file */
+	gint bits;			/* bits of the byte before that still to use */
+	guint window_len;
+	guchar *window;			/* the uncompressed data before out */
+} GZipCheckpoint;
+
+/* The checkpoints of one version of one file, shared by its handles
+ * through the index cache.  Checkpoints are only ever appended.  */
+typedef struct {
+	gchar *key;
+	GMutex *lock;
+	GPtrArray *checkpoints;
+	gboolean complete;
+	GnomeVFSFileSize size;		/* uncompressed size, once complete */
+	gsize memory;
+	gint ref_count;
+} GZipIndex;
+
 struct _GZipMethodHandle {
 	GnomeVFSURI *uri;
 	GnomeVFSHandle *parent_handle;
@@ -43,6 +73,19 @@ struct _GZipMethodHandle {
 	z_stream zstream;
 	guchar *buffer;
 	guint32 crc;
+
+	/* Writing on several threads; zstream isn't used then */
+	BlockCompressor *compressor;
+	GnomeVFSFileSize total_in;
+
+	/* Reading only */
+	GnomeVFSFileSize header_size;
+	GnomeVFSFileSize in_offset;	/* position in the parent */
+	GnomeVFSFileSize out_offset;	/* position in the uncompressed data */
+	GZipIndex *index;
+	guchar *window;			/* ring of the last uncompressed data */
+	guint window_pos;
+	guint window_filled;
 };
 typedef struct _GZipMethodHandle GZipMethodHandle;
 
@@ -62,6 +105,25 @@ typedef struct _GZipMethodHandle GZipMethodHandle;
 
 #define Z_BUFSIZE 16384
 
+/* Input deflated by each thread when writing on several, as in pigz */
+#define PARALLEL_BLOCK_SIZE (128 * 1024)
+
+/* Uncompressed distance between checkpoints, 0 to not index */
+#define CHECKPOINT_SPACING_VARIABLE "GNOME_VFS_GZIP_CHECKPOINT_SPACING"
+#define DEFAULT_CHECKPOINT_SPACING (1024 * 1024)
+
+/* Memory for the indexes kept after their handles are closed */
+#define INDEX_CACHE_SIZE_VARIABLE "GNOME_VFS_GZIP_INDEX_CACHE_SIZE"
+#define DEFAULT_INDEX_CACHE_SIZE (32 * 1024 * 1024)
+
+static GnomeVFSFileSize checkpoint_spacing = DEFAULT_CHECKPOINT_SPACING;
+static gsize index_cache_size = DEFAULT_INDEX_CACHE_SIZE;
+
+/* GZipIndex by key, and the keys from least to most recently used */
+static GHashTable *index_cache = NULL;
+static GQueue *index_queue = NULL;
+G_LOCK_DEFINE_STATIC (index_cache);
+
 
 static GnomeVFSResult	do_open		(GnomeVFSMethod *method,
 					 GnomeVFSMethodHandle **method_handle,
@@ -95,6 +157,16 @@ static GnomeVFSResult	do_write	(GnomeVFSMethod *method,
 					 GnomeVFSFileSize *bytes_written,
 					 GnomeVFSContext *context);
 
+static GnomeVFSResult	do_seek		(GnomeVFSMethod *method,
+					 GnomeVFSMethodHandle *method_handle,
+					 GnomeVFSSeekPosition whence,
+					 GnomeVFSFileOffset offset,
+					 GnomeVFSContext *context);
+
+static GnomeVFSResult	do_tell		(GnomeVFSMethod *method,
+					 GnomeVFSMethodHandle *method_handle,
+					 GnomeVFSFileSize *offset_return);
+
 static GnomeVFSResult	do_get_file_info(GnomeVFSMethod *method,
 	           			 GnomeVFSURI *uri,
 		   			 GnomeVFSFileInfo *file_info,
@@ -111,8 +183,8 @@ static GnomeVFSMethod method = {
 	do_close,
 	do_read,
 	do_write,
-	NULL,			/* seek */
-	NULL,			/* tell */
+	do_seek,
+	do_tell,
 	NULL,			/* truncate_handle FIXME bugzilla.eazel.com 1175 */
 	NULL,			/* open_directory */
 	NULL,			/* close_directory */
@@ -153,7 +225,7 @@ gzip_method_handle_new (GnomeVFSHandle *parent_handle,
 {
 	GZipMethodHandle *new;
 
-	new = g_new (GZipMethodHandle, 1);
+	new = g_new0 (GZipMethodHandle, 1);
 
 	new->parent_handle = parent_handle;
 	new->modification_time = modification_time;
@@ -166,14 +238,261 @@ gzip_method_handle_new (GnomeVFSHandle *parent_handle,
 	return new;
 }
 
+static void gzip_index_unref (GZipIndex *index);
+
 static void
 gzip_method_handle_destroy (GZipMethodHandle *handle)
 {
+	if (handle->index != NULL)
+		gzip_index_unref (handle->index);
+	if (handle->compressor != NULL)
+		block_compressor_free (handle->compressor);
 	gnome_vfs_uri_unref (handle->uri);
+	g_free (handle->window);
 	g_free (handle->buffer);
 	g_free (handle);
 }
 
+
+/* Checkpoint index, after zlib's zran example.  While a file is read
+   for the first time a checkpoint is taken at the end of a deflate
+   block every checkpoint_spacing bytes; seeking then only has to
+   inflate from the checkpoint before the target.  */
+
+static gsize
+gzip_index_memory (GZipIndex *index)
+{
+	gsize memory;
+
+	g_mutex_lock (index->lock);
+	memory = index->memory;
+	g_mutex_unlock (index->lock);
+
+	return memory;
+}
+
+static void
+gzip_index_free (GZipIndex *index)
+{
+	GZipCheckpoint *point;
+	guint i;
+
+	for (i = 0; i < index->checkpoints->len; i++) {
+		point = g_ptr_array_index (index->checkpoints, i);
+		g_free (point->window);
+		g_free (point);
+	}
+	g_ptr_array_free (index->checkpoints, TRUE);
+	g_mutex_free (index->lock);
+	g_free (index->key);
+	g_free (index);
+}
+
+/* Call with the index_cache lock held */
+static void
+gzip_index_unref_locked (GZipIndex *index)
+{
+	if (--index->ref_count == 0)
+		gzip_index_free (index);
+}
+
+static void
+gzip_index_unref (GZipIndex *index)
+{
+	G_LOCK (index_cache);
+	gzip_index_unref_locked (index);
+	G_UNLOCK (index_cache);
+}
+
+/* Drops the least recently used indexes until the cache fits, except
+   for keep.  Call with the index_cache lock held.  */
+static void
+index_cache_trim_locked (GZipIndex *keep)
+{
+	GZipIndex *index;
+	GList *node, *next;
+	gsize used;
+
+	used = 0;
+	for (node = index_queue->head; node != NULL; node = node->next)
+		used += gzip_index_memory (node->data);
+
+	for (node = index_queue->head; node != NULL && used > index_cache_size; node = next) {
+		next = node->next;
+		index = node->data;
+		if (index == keep)
+			continue;
+
+		used -= gzip_index_memory (index);
+		g_hash_table_remove (index_cache, index->key);
+		g_queue_delete_link (index_queue, node);
+		gzip_index_unref_locked (index);
+	}
+}
+
+/* Returns the index for key, a new one if there is none yet.  A NULL
+   key gets an index of its own that isn't cached.  */
+static GZipIndex *
+gzip_index_get (const gchar *key)
+{
+	GZipIndex *index;
+
+	G_LOCK (index_cache);
+
+	index = NULL;
+	if (key != NULL && index_cache != NULL)
+		index = g_hash_table_lookup (index_cache, key);
+
+	if (index == NULL) {
+		index = g_new0 (GZipIndex, 1);
+		index->key = g_strdup (key);
+		index->lock = g_mutex_new ();
+		index->checkpoints = g_ptr_array_new ();
+		index->ref_count = 1;
+
+		if (key != NULL && index_cache != NULL) {
+			g_hash_table_insert (index_cache, index->key, index);
+			g_queue_push_tail (index_queue, index);
+			index->ref_count++;
+		}
+	} else {
+		g_queue_remove (index_queue, index);
+		g_queue_push_tail (index_queue, index);
+		index->ref_count++;
+	}
+
+	if (index_cache != NULL)
+		index_cache_trim_locked (index);
+
+	G_UNLOCK (index_cache);
+
+	return index;
+}
+
+static gboolean
+gzip_index_is_complete (GZipIndex *index)
+{
+	gboolean complete;
+
+	g_mutex_lock (index->lock);
+	complete = index->complete;
+	g_mutex_unlock (index->lock);
+
+	return complete;
+}
+
+static void
+gzip_index_set_complete (GZipIndex *index,
+			 GnomeVFSFileSize size)
+{
+	g_mutex_lock (index->lock);
+	index->complete = TRUE;
+	index->size = size;
+	g_mutex_unlock (index->lock);
+}
+
+/* Returns the last checkpoint at or before offset, or NULL if the
+   start of the stream is closer.  */
+static GZipCheckpoint *
+gzip_index_lookup (GZipIndex *index,
+		   GnomeVFSFileSize offset)
+{
+	GZipCheckpoint *point;
+	guint low, high, middle;
+
+	g_mutex_lock (index->lock);
+
+	point = NULL;
+	low = 0;
+	high = index->checkpoints->len;
+	while (low < high) {
+		middle = (low + high) / 2;
+		if (((GZipCheckpoint *) g_ptr_array_index (index->checkpoints, middle))->out <= offset) {
+			point = g_ptr_array_index (index->checkpoints, middle);
+			low = middle + 1;
+		} else
+			high = middle;
+	}
+
+	g_mutex_unlock (index->lock);
+
+	return point;
+}
+
+static void
+window_append (GZipMethodHandle *gzip_handle,
+	       const guchar *data,
+	       gsize len)
+{
+	gsize count;
+
+	if (len >= WINDOW_SIZE) {
+		memcpy (gzip_handle->window, data + len - WINDOW_SIZE, WINDOW_SIZE);
+		gzip_handle->window_pos = 0;
+		gzip_handle->window_filled = WINDOW_SIZE;
+		return;
+	}
+
+	while (len > 0) {
+		count = MIN (len, WINDOW_SIZE - gzip_handle->window_pos);
+		memcpy (gzip_handle->window + gzip_handle->window_pos, data, count);
+		gzip_handle->window_pos = (gzip_handle->window_pos + count) % WINDOW_SIZE;
+		gzip_handle->window_filled = MIN (gzip_handle->window_filled + count, WINDOW_SIZE);
+		data += count;
+		len -= count;
+	}
+}
+
+/* Called at the end of each deflate block while the index is being
+   built.  */
+static void
+gzip_index_add (GZipIndex *index,
+		GZipMethodHandle *gzip_handle)
+{
+	GZipCheckpoint *point, *last;
+	z_stream *zstream;
+	guint tail;
+
+	zstream = &gzip_handle->zstream;
+
+	/* Not at the end of a block, or at the end of the last one */
+	if (!(zstream->data_type & 128) || (zstream->data_type & 64))
+		return;
+
+	g_mutex_lock (index->lock);
+
+	if (index->checkpoints->len > 0)
+		last = g_ptr_array_index (index->checkpoints, index->checkpoints->len - 1);
+	else
+		last = NULL;
+
+	if (gzip_handle->out_offset < (last != NULL ? last->out : 0) + checkpoint_spacing) {
+		g_mutex_unlock (index->lock);
+		return;
+	}
+
+	point = g_new (GZipCheckpoint, 1);
+	point->out = gzip_handle->out_offset;
+	point->in = gzip_handle->in_offset - zstream->avail_in;
+	point->bits = zstream->data_type & 7;
+	point->window_len = gzip_handle->window_filled;
+	point->window = g_malloc (point->window_len);
+
+	/* The ring starts at window_pos once it is full */
+	if (gzip_handle->window_filled < WINDOW_SIZE)
+		memcpy (point->window, gzip_handle->window, point->window_len);
+	else {
+		tail = WINDOW_SIZE - gzip_handle->window_pos;
+		memcpy (point->window, gzip_handle->window + gzip_handle->window_pos, tail);
+		memcpy (point->window + tail, gzip_handle->window, gzip_handle->window_pos);
+	}
+
+	g_ptr_array_add (index->checkpoints, point);
+	index->memory += sizeof (GZipCheckpoint) + point->window_len;
+
+	g_mutex_unlock (index->lock);
+}
+
 
 /* GZip method initialization for compression/decompression.  */
 
@@ -247,7 +566,8 @@ result_from_z_result (gint z_result)
 /* Functions to skip data in the file.  */
 
 static GnomeVFSResult
-skip_string (GnomeVFSHandle *handle)
+skip_string (GnomeVFSHandle *handle,
+	     GnomeVFSFileSize *count)
 {
 	GnomeVFSResult result;
 	guchar c;
@@ -259,12 +579,13 @@ skip_string (GnomeVFSHandle *handle)
 
 		if (bytes_read != 1)
 			return GNOME_VFS_ERROR_WRONG_FORMAT;
+		(*count)++;
 	} while (c != 0);
 
 	return GNOME_VFS_OK;
 }
 
-static gboolean
+static GnomeVFSResult
 skip (GnomeVFSHandle *handle,
       GnomeVFSFileSize num_bytes)
 {
@@ -280,7 +601,7 @@ skip (GnomeVFSHandle *handle,
 	if (bytes_read != num_bytes)
 		return GNOME_VFS_ERROR_WRONG_FORMAT;
 
-	return TRUE;
+	return GNOME_VFS_OK;
 }
 
 
@@ -307,7 +628,8 @@ write_guint32 (GnomeVFSHandle *handle,
 
 static GnomeVFSResult
 read_gzip_header (GnomeVFSHandle *handle,
-                  time_t *modification_time)
+                  time_t *modification_time,
+		  GnomeVFSFileSize *header_size)
 {
 	GnomeVFSResult result;
 	guchar buffer[GZIP_HEADER_SIZE];
@@ -334,6 +656,8 @@ read_gzip_header (GnomeVFSHandle *handle,
 	if (flags & GZIP_FLAG_RESERVED)
 		return GNOME_VFS_ERROR_WRONG_FORMAT;
 
+	*header_size = GZIP_HEADER_SIZE;
+
 	if (flags & GZIP_FLAG_EXTRA_FIELD) {
 		guchar tmp[2];
 		GnomeVFSFileSize bytes_read;
@@ -341,18 +665,20 @@ read_gzip_header (GnomeVFSHandle *handle,
 		if (gnome_vfs_read (handle, tmp, 2, &bytes_read)
 		    || bytes_read != 2)
 			return GNOME_VFS_ERROR_WRONG_FORMAT;
-		if (! skip (handle, tmp[0] | (tmp[0] << 8)))
-			return GNOME_VFS_ERROR_WRONG_FORMAT;
+		RETURN_IF_FAIL (skip (handle, tmp[0] | (tmp[1] << 8)));
+		*header_size += 2 + (tmp[0] | (tmp[1] << 8));
 	}
 
 	if (flags & GZIP_FLAG_ORIG_NAME)
-		RETURN_IF_FAIL (skip_string (handle));
+		RETURN_IF_FAIL (skip_string (handle, header_size));
 
 	if (flags & GZIP_FLAG_COMMENT)
-		RETURN_IF_FAIL (skip_string (handle));
+		RETURN_IF_FAIL (skip_string (handle, header_size));
 
-	if (flags & GZIP_FLAG_HEAD_CRC)
+	if (flags & GZIP_FLAG_HEAD_CRC) {
 		RETURN_IF_FAIL (skip (handle, 2));
+		*header_size += 2;
+	}
 
 	*modification_time = (buffer[4] | (buffer[5] << 8)
 			      | (buffer[6] << 16) | (buffer[7] << 24));
@@ -443,6 +769,116 @@ flush_write (GZipMethodHandle *gzip_handle)
 }
 
 
+/* Parallel compression.  Every block is deflated on its own, primed
+   with the 32K of input before it, and all but the last end with a
+   sync flush, which leaves them byte aligned; one after the other they
+   form a single deflate stream.  */
+
+static GnomeVFSResult
+deflate_block (const CompressorBlock *block,
+	       GByteArray *out,
+	       gpointer user_data)
+{
+	z_stream zstream;
+	gint z_result, flush;
+	guint used;
+
+	memset (&zstream, 0, sizeof (zstream));
+	if (deflateInit2 (&zstream, Z_DEFAULT_COMPRESSION,
+			  Z_DEFLATED, -MAX_WBITS, MAX_MEM_LEVEL,
+			  Z_DEFAULT_STRATEGY) != Z_OK)
+		return GNOME_VFS_ERROR_NO_MEMORY;
+
+	if (block->dictionary_len > 0)
+		deflateSetDictionary (&zstream, block->dictionary,
+				      block->dictionary_len);
+
+	zstream.next_in = (guchar *) block->data;
+	zstream.avail_in = block->len;
+	flush = block->last ? Z_FINISH : Z_SYNC_FLUSH;
+
+	used = 0;
+	do {
+		g_byte_array_set_size (out, used + Z_BUFSIZE);
+		zstream.next_out = out->data + used;
+		zstream.avail_out = Z_BUFSIZE;
+
+		z_result = deflate (&zstream, flush);
+		used += Z_BUFSIZE - zstream.avail_out;
+
+		if (z_result == Z_BUF_ERROR)
+			z_result = Z_OK;
+	} while (z_result == Z_OK
+		 && (zstream.avail_out == 0 || (block->last && z_result != Z_STREAM_END)));
+
+	g_byte_array_set_size (out, used);
+	deflateEnd (&zstream);
+
+	return result_from_z_result (z_result);
+}
+
+static GnomeVFSResult
+write_to_parent (const guchar *data,
+		 gsize len,
+		 gpointer user_data)
+{
+	GZipMethodHandle *gzip_handle;
+	GnomeVFSFileSize bytes_written;
+
+	gzip_handle = user_data;
+
+	while (len > 0) {
+		RETURN_IF_FAIL (gnome_vfs_write (gzip_handle->parent_handle,
+						 data, len, &bytes_written));
+		if (bytes_written == 0)
+			return GNOME_VFS_ERROR_IO;
+		data += bytes_written;
+		len -= bytes_written;
+	}
+
+	return GNOME_VFS_OK;
+}
+
+static GnomeVFSResult
+flush_parallel_write (GZipMethodHandle *gzip_handle)
+{
+	RETURN_IF_FAIL (block_compressor_finish (gzip_handle->compressor));
+
+	RETURN_IF_FAIL (write_guint32 (gzip_handle->parent_handle,
+				       gzip_handle->crc));
+
+	return write_guint32 (gzip_handle->parent_handle,
+			      (guint32) gzip_handle->total_in);
+}
+
+
+/* Indexes are shared by the handles on the same version of a file */
+static GZipIndex *
+gzip_index_get_for_uri (GnomeVFSURI *uri)
+{
+	GnomeVFSFileInfo *info;
+	GZipIndex *index;
+	gchar *uri_string, *key;
+
+	key = NULL;
+	info = gnome_vfs_file_info_new ();
+	if (gnome_vfs_get_file_info_uri (uri, info, GNOME_VFS_FILE_INFO_DEFAULT) == GNOME_VFS_OK
+	    && (info->valid_fields & GNOME_VFS_FILE_INFO_FIELDS_MTIME)
+	    && (info->valid_fields & GNOME_VFS_FILE_INFO_FIELDS_SIZE)) {
+		uri_string = gnome_vfs_uri_to_string (uri, GNOME_VFS_URI_HIDE_PASSWORD);
+		key = g_strdup_printf ("%ld %" GNOME_VFS_SIZE_FORMAT_STR " %s",
+				       (long) info->mtime, info->size, uri_string);
+		g_free (uri_string);
+	}
+	gnome_vfs_file_info_unref (info);
+
+	index = gzip_index_get (key);
+	g_free (key);
+
+	return index;
+}
+
+
 /* Open.  */
 
 /* TODO: 
@@ -468,14 +904,19 @@ do_open (GnomeVFSMethod *method,
 
 	parent_uri = uri->parent;
 
-	if (open_mode & GNOME_VFS_OPEN_RANDOM)
+	/* Reads can seek, writes can't */
+	if ((open_mode & GNOME_VFS_OPEN_RANDOM)
+	    && (open_mode & GNOME_VFS_OPEN_WRITE))
 		return GNOME_VFS_ERROR_NOT_SUPPORTED;
 
 	result = gnome_vfs_open_uri (&parent_handle, parent_uri, open_mode);
 	RETURN_IF_FAIL (result);
 
 	if (open_mode & GNOME_VFS_OPEN_READ) {
-		result = read_gzip_header (parent_handle, &modification_time);
+		GnomeVFSFileSize header_size;
+
+		result = read_gzip_header (parent_handle, &modification_time,
+					   &header_size);
 		if (result != GNOME_VFS_OK) {
 			gnome_vfs_close (parent_handle);
 			return result;
@@ -485,12 +926,19 @@ do_open (GnomeVFSMethod *method,
 						      modification_time,
 						      uri,
 						      open_mode);
+		gzip_handle->header_size = header_size;
+		gzip_handle->in_offset = header_size;
 
 		if (! gzip_method_handle_init_for_inflate (gzip_handle)) {
 			gnome_vfs_close (parent_handle);
 			gzip_method_handle_destroy (gzip_handle);
 			return GNOME_VFS_ERROR_INTERNAL;
 		}
+
+		if (checkpoint_spacing > 0) {
+			gzip_handle->index = gzip_index_get_for_uri (parent_uri);
+			gzip_handle->window = g_malloc (WINDOW_SIZE);
+		}
 	} else {                          /* GNOME_VFS_OPEN_WRITE */
 		modification_time = time (NULL);
 		result = write_gzip_header (parent_handle, modification_time);
@@ -502,7 +950,13 @@ do_open (GnomeVFSMethod *method,
 						      uri,
 						      open_mode);
 
-		if (! gzip_method_handle_init_for_deflate (gzip_handle)) {
+		if (block_compressor_get_threads () > 1)
+			gzip_handle->compressor = block_compressor_new (PARALLEL_BLOCK_SIZE,
+									WINDOW_SIZE,
+									deflate_block,
+									write_to_parent,
+									gzip_handle);
+		else if (! gzip_method_handle_init_for_deflate (gzip_handle)) {
 			gnome_vfs_close (parent_handle);
 			gzip_method_handle_destroy (gzip_handle);
 			return GNOME_VFS_ERROR_INTERNAL;
@@ -547,12 +1001,17 @@ do_close (GnomeVFSMethod *method,
 
 	gzip_handle = (GZipMethodHandle *) method_handle;
 
-	if (gzip_handle->open_mode & GNOME_VFS_OPEN_WRITE)
+	if (gzip_handle->compressor != NULL)
+		result = flush_parallel_write (gzip_handle);
+	else if (gzip_handle->open_mode & GNOME_VFS_OPEN_WRITE)
 		result = flush_write (gzip_handle);
-	else
+	else {
+		inflateEnd (&gzip_handle->zstream);
 		result = GNOME_VFS_OK;
+	}
 
-	if (result == GNOME_VFS_OK)
+	/* A failed seek can leave the parent closed */
+	if (result == GNOME_VFS_OK && gzip_handle->parent_handle != NULL)
 		result = gnome_vfs_close (gzip_handle->parent_handle);
 
 	gzip_method_handle_destroy (gzip_handle);
@@ -564,7 +1023,8 @@ do_close (GnomeVFSMethod *method,
 /* Read. */
 static GnomeVFSResult
 fill_buffer (GZipMethodHandle *gzip_handle,
-	     GnomeVFSFileSize num_bytes)
+	     GnomeVFSFileSize num_bytes,
+	     GnomeVFSContext *context)
 {
 	GnomeVFSResult result;
 	GnomeVFSFileSize count;
@@ -575,10 +1035,11 @@ fill_buffer (GZipMethodHandle *gzip_handle,
 	if (zstream->avail_in > 0)
 		return GNOME_VFS_OK;
 
-	result = gnome_vfs_read (gzip_handle->parent_handle,
-				 gzip_handle->buffer,
-				 Z_BUFSIZE,
-				 &count);
+	result = gnome_vfs_read_cancellable (gzip_handle->parent_handle,
+					     gzip_handle->buffer,
+					     Z_BUFSIZE,
+					     &count,
+					     context);
 
 	if (result != GNOME_VFS_OK) {
 		if (zstream->avail_out == num_bytes)
@@ -587,33 +1048,31 @@ fill_buffer (GZipMethodHandle *gzip_handle,
 	} else {
 		zstream->next_in = gzip_handle->buffer;
 		zstream->avail_in = count;
+		gzip_handle->in_offset += count;
 	}
 
 	return GNOME_VFS_OK;
 }
 
+/* Inflates up to num_bytes into buffer, taking checkpoints on the way
+   while the index isn't complete.  */
 /* FIXME bugzilla.eazel.com 1165: TODO:
    - Concatenated GZIP file handling.  */
 static GnomeVFSResult
-do_read (GnomeVFSMethod *method,
-	 GnomeVFSMethodHandle *method_handle,
-	 gpointer buffer,
-	 GnomeVFSFileSize num_bytes,
-	 GnomeVFSFileSize *bytes_read,
-	 GnomeVFSContext *context)
+inflate_data (GZipMethodHandle *gzip_handle,
+	      guchar *buffer,
+	      GnomeVFSFileSize num_bytes,
+	      GnomeVFSFileSize *bytes_read,
+	      GnomeVFSContext *context)
 {
-	GZipMethodHandle *gzip_handle;
 	GnomeVFSResult result;
 	z_stream *zstream;
+	gboolean indexing;
+	guchar *block_start;
 	int z_result;
-	guchar *crc_start;
 
 	*bytes_read = 0;
 
-	crc_start = buffer;
-
-	gzip_handle = (GZipMethodHandle *) method_handle;
-
 	zstream = &gzip_handle->zstream;
 
 	if (gzip_handle->last_z_result != Z_OK) {
@@ -626,37 +1085,328 @@ do_read (GnomeVFSMethod *method,
 		return gzip_handle->last_vfs_result;
 	}
 
+	indexing = gzip_handle->index != NULL
+		&& !gzip_index_is_complete (gzip_handle->index);
+
 	zstream->next_out = buffer;
 	zstream->avail_out = num_bytes;
 
 	while (zstream->avail_out != 0) {
-		result = fill_buffer (gzip_handle, num_bytes);
+		result = fill_buffer (gzip_handle, num_bytes, context);
 		RETURN_IF_FAIL (result);
 
-		z_result = inflate (&gzip_handle->zstream, Z_NO_FLUSH);
+		/* Z_BLOCK stops at the end of each block, where a
+		   checkpoint can be taken */
+		block_start = zstream->next_out;
+		z_result = inflate (&gzip_handle->zstream,
+				    indexing ? Z_BLOCK : Z_NO_FLUSH);
+		gzip_handle->out_offset += zstream->next_out - block_start;
+
+		if (indexing) {
+			window_append (gzip_handle, block_start,
+				       zstream->next_out - block_start);
+			if (z_result == Z_OK)
+				gzip_index_add (gzip_handle->index, gzip_handle);
+		}
+
 		if (z_result == Z_STREAM_END) {
 			gzip_handle->last_z_result = z_result;
+			if (gzip_handle->index != NULL)
+				gzip_index_set_complete (gzip_handle->index,
+							 gzip_handle->out_offset);
 			break;
 		} else if (z_result != Z_OK) {	
 			/* FIXME bugzilla.eazel.com 1165: Concatenated GZIP files?  */
 			gzip_handle->last_z_result = z_result;
 		}
 
-		if (gzip_handle->last_z_result != Z_OK
-		    && zstream->avail_out == num_bytes)
-			return result_from_z_result (gzip_handle->last_z_result);
+		if (gzip_handle->last_z_result != Z_OK) {
+			if (zstream->avail_out == num_bytes)
+				return result_from_z_result (gzip_handle->last_z_result);
+			break;
+		}
 	}
 
-	gzip_handle->crc = crc32 (gzip_handle->crc,
-				  crc_start,
-				  (guint) (zstream->next_out - crc_start));
-
 	*bytes_read = num_bytes - zstream->avail_out;
 
 	return GNOME_VFS_OK;
 }
 
-
+static GnomeVFSResult
+do_read (GnomeVFSMethod *method,
+	 GnomeVFSMethodHandle *method_handle,
+	 gpointer buffer,
+	 GnomeVFSFileSize num_bytes,
+	 GnomeVFSFileSize *bytes_read,
+	 GnomeVFSContext *context)
+{
+	GZipMethodHandle *gzip_handle;
+	GnomeVFSResult result;
+
+	gzip_handle = (GZipMethodHandle *) method_handle;
+
+	result = inflate_data (gzip_handle, buffer, num_bytes, bytes_read,
+			       context);
+	RETURN_IF_FAIL (result);
+
+	gzip_handle->crc = crc32 (gzip_handle->crc, buffer, (guint) *bytes_read);
+
+	return GNOME_VFS_OK;
+}
+
+
+/* Seek.  */
+
+/* Moves the parent to offset, reading forwards when it can't seek.  */
+static GnomeVFSResult
+seek_parent (GZipMethodHandle *gzip_handle,
+	     GnomeVFSFileSize offset,
+	     GnomeVFSContext *context)
+{
+	GnomeVFSResult result;
+	GnomeVFSFileSize bytes_read;
+
+	gzip_handle->zstream.avail_in = 0;
+
+	result = gnome_vfs_seek_cancellable (gzip_handle->parent_handle,
+					     GNOME_VFS_SEEK_START, offset,
+					     context);
+	if (result == GNOME_VFS_OK) {
+		gzip_handle->in_offset = offset;
+		return GNOME_VFS_OK;
+	}
+	if (result != GNOME_VFS_ERROR_NOT_SUPPORTED)
+		return result;
+
+	if (offset < gzip_handle->in_offset) {
+		gnome_vfs_close (gzip_handle->parent_handle);
+		gzip_handle->parent_handle = NULL;
+		result = gnome_vfs_open_uri_cancellable (&gzip_handle->parent_handle,
+							 gzip_handle->uri->parent,
+							 gzip_handle->open_mode,
+							 context);
+		RETURN_IF_FAIL (result);
+		gzip_handle->in_offset = 0;
+	}
+
+	while (gzip_handle->in_offset < offset) {
+		result = gnome_vfs_read_cancellable (gzip_handle->parent_handle,
+						     gzip_handle->buffer,
+						     MIN (offset - gzip_handle->in_offset, Z_BUFSIZE),
+						     &bytes_read,
+						     context);
+		RETURN_IF_FAIL (result);
+		if (bytes_read == 0)
+			return GNOME_VFS_ERROR_CORRUPTED_DATA;
+		gzip_handle->in_offset += bytes_read;
+	}
+
+	return GNOME_VFS_OK;
+}
+
+/* Gets inflation going again at point, or at the start of the stream
+   if point is NULL.  */
+static GnomeVFSResult
+restart_at (GZipMethodHandle *gzip_handle,
+	    GZipCheckpoint *point,
+	    GnomeVFSContext *context)
+{
+	GnomeVFSResult result;
+	GnomeVFSFileSize bytes_read;
+	z_stream *zstream;
+	guchar c;
+
+	zstream = &gzip_handle->zstream;
+
+	if (point != NULL)
+		result = seek_parent (gzip_handle,
+				      point->in - (point->bits ? 1 : 0),
+				      context);
+	else
+		result = seek_parent (gzip_handle, gzip_handle->header_size,
+				      context);
+	if (result != GNOME_VFS_OK) {
+		gzip_handle->last_vfs_result = result;
+		return result;
+	}
+
+	inflateReset (zstream);
+	gzip_handle->last_z_result = Z_OK;
+	gzip_handle->last_vfs_result = GNOME_VFS_OK;
+	gzip_handle->out_offset = 0;
+	gzip_handle->window_pos = 0;
+	gzip_handle->window_filled = 0;
+	gzip_handle->crc = crc32 (0, Z_NULL, 0);
+
+	if (point == NULL)
+		return GNOME_VFS_OK;
+
+	if (point->bits) {
+		/* The block starts in the middle of this byte */
+		result = gnome_vfs_read_cancellable (gzip_handle->parent_handle,
+						     &c, 1, &bytes_read,
+						     context);
+		if (result == GNOME_VFS_OK && bytes_read != 1)
+			result = GNOME_VFS_ERROR_CORRUPTED_DATA;
+		if (result != GNOME_VFS_OK) {
+			gzip_handle->last_vfs_result = result;
+			return result;
+		}
+		gzip_handle->in_offset++;
+		inflatePrime (zstream, point->bits, c >> (8 - point->bits));
+	}
+
+	inflateSetDictionary (zstream, point->window, point->window_len);
+	window_append (gzip_handle, point->window, point->window_len);
+	gzip_handle->out_offset = point->out;
+
+	return GNOME_VFS_OK;
+}
+
+/* Inflates and drops data up to offset, or to the end of the data if
+   that comes first.  */
+static GnomeVFSResult
+skip_to (GZipMethodHandle *gzip_handle,
+	 GnomeVFSFileSize offset,
+	 GnomeVFSContext *context)
+{
+	GnomeVFSResult result;
+	GnomeVFSFileSize bytes_read;
+	guchar *scratch;
+
+	scratch = g_malloc (Z_BUFSIZE);
+
+	result = GNOME_VFS_OK;
+	while (gzip_handle->out_offset < offset) {
+		result = inflate_data (gzip_handle, scratch,
+				       MIN (offset - gzip_handle->out_offset, Z_BUFSIZE),
+				       &bytes_read, context);
+		if (result == GNOME_VFS_ERROR_EOF) {
+			result = GNOME_VFS_OK;
+			break;
+		}
+		if (result != GNOME_VFS_OK)
+			break;
+	}
+
+	g_free (scratch);
+
+	return result;
+}
+
+static GnomeVFSResult
+seek_to (GZipMethodHandle *gzip_handle,
+	 GnomeVFSFileSize offset,
+	 GnomeVFSContext *context)
+{
+	GZipCheckpoint *point;
+	GnomeVFSResult result;
+
+	point = NULL;
+	if (gzip_handle->index != NULL)
+		point = gzip_index_lookup (gzip_handle->index, offset);
+
+	/* Go back to a checkpoint unless inflating from where we are is
+	   at least as quick */
+	if (offset < gzip_handle->out_offset
+	    || (point != NULL && point->out > gzip_handle->out_offset)
+	    || (gzip_handle->last_z_result != Z_OK
+		&& gzip_handle->last_z_result != Z_STREAM_END)
+	    || gzip_handle->last_vfs_result != GNOME_VFS_OK) {
+		result = restart_at (gzip_handle, point, context);
+		RETURN_IF_FAIL (result);
+	}
+
+	return skip_to (gzip_handle, offset, context);
+}
+
+static GnomeVFSResult
+get_uncompressed_size (GZipMethodHandle *gzip_handle,
+		       GnomeVFSFileSize *size,
+		       GnomeVFSContext *context)
+{
+	GnomeVFSFileSize offset;
+	GnomeVFSResult result;
+
+	if (gzip_handle->index != NULL) {
+		g_mutex_lock (gzip_handle->index->lock);
+		*size = gzip_handle->index->size;
+		result = gzip_handle->index->complete ? GNOME_VFS_OK : GNOME_VFS_ERROR_EOF;
+		g_mutex_unlock (gzip_handle->index->lock);
+		if (result == GNOME_VFS_OK)
+			return GNOME_VFS_OK;
+	}
+
+	/* The size is only known once the whole stream has been
+	   inflated, which also completes the index */
+	offset = gzip_handle->out_offset;
+	result = seek_to (gzip_handle, G_MAXUINT64, context);
+	RETURN_IF_FAIL (result);
+	*size = gzip_handle->out_offset;
+
+	return seek_to (gzip_handle, offset, context);
+}
+
+static GnomeVFSResult
+do_seek (GnomeVFSMethod *method,
+	 GnomeVFSMethodHandle *method_handle,
+	 GnomeVFSSeekPosition whence,
+	 GnomeVFSFileOffset offset,
+	 GnomeVFSContext *context)
+{
+	GZipMethodHandle *gzip_handle;
+	GnomeVFSFileSize size;
+	GnomeVFSFileOffset target;
+
+	gzip_handle = (GZipMethodHandle *) method_handle;
+
+	if (gzip_handle->open_mode & GNOME_VFS_OPEN_WRITE)
+		return GNOME_VFS_ERROR_NOT_SUPPORTED;
+
+	switch (whence) {
+	case GNOME_VFS_SEEK_START:
+		target = offset;
+		break;
+	case GNOME_VFS_SEEK_CURRENT:
+		target = gzip_handle->out_offset + offset;
+		break;
+	case GNOME_VFS_SEEK_END:
+		RETURN_IF_FAIL (get_uncompressed_size (gzip_handle, &size, context));
+		target = size + offset;
+		break;
+	default:
+		return GNOME_VFS_ERROR_BAD_PARAMETERS;
+	}
+
+	if (target < 0)
+		return GNOME_VFS_ERROR_BAD_PARAMETERS;
+
+	if ((GnomeVFSFileSize) target == gzip_handle->out_offset)
+		return GNOME_VFS_OK;
+
+	return seek_to (gzip_handle, target, context);
+}
+
+static GnomeVFSResult
+do_tell (GnomeVFSMethod *method,
+	 GnomeVFSMethodHandle *method_handle,
+	 GnomeVFSFileSize *offset_return)
+{
+	GZipMethodHandle *gzip_handle;
+
+	gzip_handle = (GZipMethodHandle *) method_handle;
+
+	if (gzip_handle->compressor != NULL)
+		*offset_return = gzip_handle->total_in;
+	else if (gzip_handle->open_mode & GNOME_VFS_OPEN_WRITE)
+		*offset_return = gzip_handle->zstream.total_in;
+	else
+		*offset_return = gzip_handle->out_offset;
+
+	return GNOME_VFS_OK;
+}
+
+
 /* Write.  */
 
 static GnomeVFSResult
@@ -675,6 +1425,20 @@ do_write (GnomeVFSMethod *method,
 	gzip_handle = (GZipMethodHandle *) method_handle;
 	zstream = &gzip_handle->zstream;
 
+	if (gzip_handle->compressor != NULL) {
+		result = block_compressor_write (gzip_handle->compressor,
+						 buffer, num_bytes);
+		if (result != GNOME_VFS_OK) {
+			*bytes_written = 0;
+			return result;
+		}
+
+		gzip_handle->crc = crc32 (gzip_handle->crc, buffer, num_bytes);
+		gzip_handle->total_in += num_bytes;
+		*bytes_written = num_bytes;
+		return GNOME_VFS_OK;
+	}
+
 	/* This cast sucks.  It is not my fault, though.  :-)  */
 	zstream->next_in = (gpointer) buffer;
 	zstream->avail_in = num_bytes;
@@ -758,11 +1522,42 @@ do_is_local (GnomeVFSMethod *method,
 GnomeVFSMethod *
 vfs_module_init (const char *method_name, const char *args)
 {
+	const char *value;
+
+	value = getenv (CHECKPOINT_SPACING_VARIABLE);
+	if (value != NULL)
+		checkpoint_spacing = g_ascii_strtoull (value, NULL, 10);
+
+	value = getenv (INDEX_CACHE_SIZE_VARIABLE);
+	if (value != NULL)
+		index_cache_size = strtoul (value, NULL, 10);
+
+	G_LOCK (index_cache);
+	if (checkpoint_spacing > 0 && index_cache_size > 0) {
+		index_cache = g_hash_table_new (g_str_hash, g_str_equal);
+		index_queue = g_queue_new ();
+	}
+	G_UNLOCK (index_cache);
+
 	return &method;
 }
 
 void
 vfs_module_shutdown (GnomeVFSMethod *method)
 {
+	GZipIndex *index;
+
+	G_LOCK (index_cache);
+	if (index_cache != NULL) {
+		while ((index = g_queue_pop_head (index_queue)) != NULL)
+			gzip_index_unref_locked (index);
+		g_queue_free (index_queue);
+		g_hash_table_destroy (index_cache);
+		index_queue = NULL;
+		index_cache = NULL;
+	}
+	G_UNLOCK (index_cache);
+
+	block_compressor_shutdown ();
 }
 
@@ -0,0 +1,1105 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 8; tab-width: 8 -*- */
+/* http-cache.c - Response and metadata cache for the HTTP method.
+
+   Copyright (C) 2026 Free Software Foundation
+
+   The Gnome Library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   The Gnome Library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with the Gnome Library; see the file COPYING.LIB.  If not,
+   write to the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, USA.
+*/
+
+/* Bodies are only cached if GNOME_VFS_HTTP_CACHE_SIZE is set, since
+ * that lets bodies without an explicit expiry be used for a while without
+ * asking the server again. File infos are always cached, but while bodies
+ * are not only for a few seconds and in a little memory, which is enough
+ * to answer the stats that follow a directory listing.
+ *
+ * Entries live in memory in a hash table and a most-recently-used list
+ * that is trimmed from the tail to GNOME_VFS_HTTP_CACHE_SIZE bytes.
+ *
+ * If GNOME_VFS_HTTP_CACHE_DIR is set, bodies are also written there, one
+ * file per key named by the MD5 of the key, so that they outlive both
+ * the memory cache and the process. Each file starts with a header of
+ * six lines: a magic string, the key, the ETag, the Last-Modified date,
+ * the MIME type and the expiry time, the latter zero padded so that it
+ * can be rewritten in place on revalidation. The directory is trimmed
+ * oldest file first to GNOME_VFS_HTTP_CACHE_DISK_SIZE bytes; files are
+ * touched whenever they are used.
+ */
+
+#include <config.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <libgnomevfs/gnome-vfs-private-utils.h>
+
+#include <ne_md5.h>
+
+#include "http-cache.h"
+
+/* Disk used by the cache unless GNOME_VFS_HTTP_CACHE_DISK_SIZE says
+ * otherwise */
+#define DEFAULT_DISK_LIMIT (64 * 1024 * 1024)
+
+/* Limits for file infos while bodies are not cached */
+#define INFO_ONLY_MEMORY_LIMIT (256 * 1024)
+#define INFO_ONLY_MAX_LIFETIME 5
+
+/* A single body may take this fraction of the memory or disk limit */
+#define BODY_SHARE 4
+
+/* Rough memory cost of an entry, besides its key and body data */
+#define ENTRY_COST 512
+
+/* Bodies on disk that entries in memory keep open */
+#define MAX_OPEN_FILES 64
+
+#define DISK_MAGIC       "gnome-vfs-http-cache 1"
+#define DISK_HEADER_MAX  8192
+#define DISK_TEMP_PREFIX "tmp-"
+/* Temporary files older than this were left behind by a crash */
+#define DISK_TEMP_MAX_AGE (60 * 60)
+
+typedef struct {
+	char             *key;
+	GList            *link;
+	gsize             cost;
+
+	GnomeVFSFileInfo *info;
+	time_t            info_expires;
+
+	HttpCacheBody    *body;
+} HttpCacheEntry;
+
+struct _HttpCacheBody {
+	volatile gint     ref_count;
+
+	GnomeVFSFileInfo *info;
+	char             *etag;
+	char             *last_modified;
+	GnomeVFSFileSize  size;
+
+	/* Protected by the cache lock */
+	time_t            expires;
+
+	/* The data is in memory, on disk, or both */
+	GByteArray       *data;
+	int               fd;
+	off_t             data_offset;
+	off_t             expires_offset;
+};
+
+struct _HttpCacheFill {
+	char             *key;
+	HttpCacheBody    *body;
+	char             *temp_path;
+};
+
+G_LOCK_DEFINE_STATIC (cache);
+
+/* key -> HttpCacheEntry; NULL before http_cache_init */
+static GHashTable       *entries = NULL;
+/* The entries, most recently used first */
+static GQueue           *lru = NULL;
+static gsize             memory_used;
+static gsize             memory_limit;
+static gboolean          bodies_cached;
+static guint             open_files;
+
+static char             *disk_dir = NULL;
+static GnomeVFSFileSize  disk_used;
+static GnomeVFSFileSize  disk_limit;
+static gboolean          disk_trimming;
+
+static GnomeVFSFileSize
+size_from_environment (const char *name, GnomeVFSFileSize default_size)
+{
+	const char *value;
+	char *end;
+	unsigned long long size;
+
+	value = getenv (name);
+
+	if (value == NULL || *value == '\0') {
+		return default_size;
+	}
+
+	size = strtoull (value, &end, 10);
+
+	if (*end != '\0') {
+		g_warning ("Ignoring invalid %s \"%s\"", name, value);
+		return default_size;
+	}
+
+	return size;
+}
+
+/* ************************************************************************** */
+/* Bodies */
+
+static HttpCacheBody *
+body_new (void)
+{
+	HttpCacheBody *body;
+
+	body = g_new0 (HttpCacheBody, 1);
+	body->ref_count = 1;
+	body->info = gnome_vfs_file_info_new ();
+	body->fd = -1;
+
+	return body;
+}
+
+static HttpCacheBody *
+body_ref (HttpCacheBody *body)
+{
+	g_atomic_int_inc (&body->ref_count);
+	return body;
+}
+
+void
+http_cache_body_unref (HttpCacheBody *body)
+{
+	if (! g_atomic_int_dec_and_test (&body->ref_count)) {
+		return;
+	}
+
+	if (body->fd >= 0) {
+		close (body->fd);
+	}
+
+	if (body->data != NULL) {
+		g_byte_array_free (body->data, TRUE);
+	}
+
+	gnome_vfs_file_info_unref (body->info);
+	g_free (body->etag);
+	g_free (body->last_modified);
+	g_free (body);
+}
+
+const char *
+http_cache_body_get_etag (HttpCacheBody *body)
+{
+	return body->etag;
+}
+
+const char *
+http_cache_body_get_last_modified (HttpCacheBody *body)
+{
+	return body->last_modified;
+}
+
+const GnomeVFSFileInfo *
+http_cache_body_get_info (HttpCacheBody *body)
+{
+	return body->info;
+}
+
+GnomeVFSResult
+http_cache_body_read (HttpCacheBody    *body,
+		      GnomeVFSFileSize  offset,
+		      gpointer          buffer,
+		      GnomeVFSFileSize  num_bytes,
+		      GnomeVFSFileSize *bytes_read)
+{
+	ssize_t n;
+
+	*bytes_read = 0;
+
+	if (offset >= body->size) {
+		return GNOME_VFS_ERROR_EOF;
+	}
+
+	num_bytes = MIN (num_bytes, body->size - offset);
+
+	if (body->data != NULL) {
+		memcpy (buffer, body->data->data + offset, num_bytes);
+		*bytes_read = num_bytes;
+		return GNOME_VFS_OK;
+	}
+
+	do {
+		n = pread (body->fd, buffer, num_bytes,
+			   body->data_offset + offset);
+	} while (n < 0 && errno == EINTR);
+
+	if (n < 0) {
+		return gnome_vfs_result_from_errno ();
+	} else if (n == 0) {
+		/* somebody truncated the file */
+		return GNOME_VFS_ERROR_IO;
+	}
+
+	*bytes_read = n;
+	return GNOME_VFS_OK;
+}
+
+/* ************************************************************************** */
+/* Disk */
+
+static char *
+disk_path (const char *key)
+{
+	struct ne_md5_ctx ctx;
+	unsigned char md5[16];
+	char name[33];
+
+	ne_md5_init_ctx (&ctx);
+	ne_md5_process_bytes (key, strlen (key), &ctx);
+	ne_md5_finish_ctx (&ctx, md5);
+	ne_md5_to_ascii (md5, name);
+
+	return g_build_filename (disk_dir, name, NULL);
+}
+
+static gboolean
+disk_write_all (int fd, gconstpointer data, gsize len)
+{
+	const char *p;
+	ssize_t n;
+
+	p = data;
+
+	while (len > 0) {
+		n = write (fd, p, len);
+
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return FALSE;
+		}
+
+		p += n;
+		len -= n;
+	}
+
+	return TRUE;
+}
+
+static gboolean
+disk_write_expires (HttpCacheBody *body, time_t expires)
+{
+	char line[21];
+	ssize_t n;
+
+	g_snprintf (line, sizeof (line), "%020ld", (long) expires);
+
+	do {
+		n = pwrite (body->fd, line, 20, body->expires_offset);
+	} while (n < 0 && errno == EINTR);
+
+	return n == 20;
+}
+
+/* Writes the header of a new body file, recording where the data and
+ * the expiry time go */
+static gboolean
+disk_write_header (HttpCacheBody *body, const char *key)
+{
+	char *header;
+	char expires[22];
+	gboolean res;
+
+	header = g_strdup_printf (DISK_MAGIC "\n%s\n%s\n%s\n%s\n",
+				  key,
+				  body->etag ? body->etag : "",
+				  body->last_modified ? body->last_modified : "",
+				  body->info->mime_type ? body->info->mime_type : "");
+	g_snprintf (expires, sizeof (expires), "%020ld\n", (long) body->expires);
+
+	body->expires_offset = strlen (header);
+	body->data_offset = body->expires_offset + strlen (expires);
+
+	res = disk_write_all (body->fd, header, strlen (header)) &&
+		disk_write_all (body->fd, expires, strlen (expires));
+
+	g_free (header);
+	return res;
+}
+
+static HttpCacheBody *
+disk_load (const char *key)
+{
+	HttpCacheBody *body;
+	struct stat st;
+	char buf[DISK_HEADER_MAX];
+	char *lines[6];
+	char *path, *p, *nl;
+	ssize_t len;
+	time_t mtime;
+	int fd, i;
+
+	/* read-write, as the expiry time is updated in place */
+	path = disk_path (key);
+	fd = open (path, O_RDWR);
+
+	if (fd < 0) {
+		g_free (path);
+		return NULL;
+	}
+
+	do {
+		len = pread (fd, buf, sizeof (buf), 0);
+	} while (len < 0 && errno == EINTR);
+
+	if (len <= 0 || fstat (fd, &st) != 0) {
+		goto fail;
+	}
+
+	p = buf;
+	for (i = 0; i < 6; i++) {
+		nl = memchr (p, '\n', buf + len - p);
+
+		if (nl == NULL) {
+			goto fail;
+		}
+
+		*nl = '\0';
+		lines[i] = p;
+		p = nl + 1;
+	}
+
+	/* a different key means a hash collision */
+	if (strcmp (lines[0], DISK_MAGIC) != 0 ||
+	    strcmp (lines[1], key) != 0 ||
+	    st.st_size < p - buf) {
+		goto fail;
+	}
+
+	body = body_new ();
+	body->fd = fd;
+	body->etag = lines[2][0] ? g_strdup (lines[2]) : NULL;
+	body->last_modified = lines[3][0] ? g_strdup (lines[3]) : NULL;
+	body->expires = strtol (lines[5], NULL, 10);
+	body->expires_offset = lines[5] - buf;
+	body->data_offset = p - buf;
+	body->size = st.st_size - body->data_offset;
+
+	body->info->size = body->size;
+	body->info->valid_fields |= GNOME_VFS_FILE_INFO_FIELDS_SIZE;
+
+	if (lines[4][0]) {
+		body->info->mime_type = g_strdup (lines[4]);
+		body->info->valid_fields |= GNOME_VFS_FILE_INFO_FIELDS_MIME_TYPE;
+	}
+
+	if (body->last_modified != NULL &&
+	    gnome_vfs_atotm (body->last_modified, &mtime)) {
+		body->info->mtime = mtime;
+		body->info->valid_fields |= GNOME_VFS_FILE_INFO_FIELDS_MTIME;
+	}
+
+	/* recently used files are trimmed last */
+	utime (path, NULL);
+
+	g_free (path);
+	return body;
+
+ fail:
+	close (fd);
+	g_free (path);
+	return NULL;
+}
+
+typedef struct {
+	char      *path;
+	time_t     mtime;
+	off_t      size;
+} DiskFile;
+
+static gint
+disk_file_compare (gconstpointer a, gconstpointer b)
+{
+	const DiskFile *fa = a, *fb = b;
+
+	if (fa->mtime < fb->mtime) {
+		return -1;
+	}
+
+	return fa->mtime > fb->mtime;
+}
+
+/* Returns the files in the cache directory, oldest first, and their
+ * total size. Removes temporary files left behind by crashes on the
+ * way. */
+static GList *
+disk_scan (GnomeVFSFileSize *total)
+{
+	DIR *dir;
+	struct dirent *dirent;
+	struct stat st;
+	DiskFile *file;
+	GList *files;
+	char *path;
+	time_t now;
+
+	*total = 0;
+	files = NULL;
+
+	dir = opendir (disk_dir);
+
+	if (dir == NULL) {
+		return NULL;
+	}
+
+	now = time (NULL);
+
+	while ((dirent = readdir (dir)) != NULL) {
+		if (dirent->d_name[0] == '.') {
+			continue;
+		}
+
+		path = g_build_filename (disk_dir, dirent->d_name, NULL);
+
+		if (stat (path, &st) != 0 || ! S_ISREG (st.st_mode)) {
+			g_free (path);
+			continue;
+		}
+
+		if (g_str_has_prefix (dirent->d_name, DISK_TEMP_PREFIX)) {
+			if (now - st.st_mtime > DISK_TEMP_MAX_AGE) {
+				g_unlink (path);
+			}
+			g_free (path);
+			continue;
+		}
+
+		file = g_new (DiskFile, 1);
+		file->path = path;
+		file->mtime = st.st_mtime;
+		file->size = st.st_size;
+
+		files = g_list_prepend (files, file);
+		*total += st.st_size;
+	}
+
+	closedir (dir);
+
+	return g_list_sort (files, disk_file_compare);
+}
+
+static void
+disk_files_free (GList *files)
+{
+	GList *l;
+
+	for (l = files; l != NULL; l = l->next) {
+		DiskFile *file = l->data;
+
+		g_free (file->path);
+		g_free (file);
+	}
+
+	g_list_free (files);
+}
+
+/* Removes the oldest files until the directory is down to three
+ * quarters of its limit, so that this doesn't happen on every store.
+ * Bodies still open keep working off their unlinked files. */
+static void
+disk_trim (void)
+{
+	GnomeVFSFileSize total;
+	GList *files, *l;
+
+	files = disk_scan (&total);
+
+	for (l = files; l != NULL && total > disk_limit / 4 * 3; l = l->next) {
+		DiskFile *file = l->data;
+
+		if (g_unlink (file->path) == 0) {
+			total -= file->size;
+		}
+	}
+
+	disk_files_free (files);
+
+	G_LOCK (cache);
+	disk_used = total;
+	disk_trimming = FALSE;
+	G_UNLOCK (cache);
+}
+
+/* ************************************************************************** */
+/* Entries, all called with the cache lock held */
+
+static void
+entry_update_cost (HttpCacheEntry *entry)
+{
+	memory_used -= entry->cost;
+
+	entry->cost = ENTRY_COST + strlen (entry->key);
+
+	if (entry->body != NULL && entry->body->data != NULL) {
+		entry->cost += entry->body->data->len;
+	}
+
+	memory_used += entry->cost;
+}
+
+static void
+entry_set_body (HttpCacheEntry *entry, HttpCacheBody *body)
+{
+	if (entry->body != NULL) {
+		if (entry->body->fd >= 0) {
+			open_files--;
+		}
+		http_cache_body_unref (entry->body);
+	}
+
+	entry->body = body;
+
+	if (body != NULL && body->fd >= 0) {
+		open_files++;
+	}
+
+	entry_update_cost (entry);
+}
+
+static void
+entry_remove (HttpCacheEntry *entry)
+{
+	g_hash_table_remove (entries, entry->key);
+	g_queue_delete_link (lru, entry->link);
+
+	entry_set_body (entry, NULL);
+	memory_used -= entry->cost;
+
+	if (entry->info != NULL) {
+		gnome_vfs_file_info_unref (entry->info);
+	}
+
+	g_free (entry->key);
+	g_free (entry);
+}
+
+/* Returns the entry for key, creating it if needed, and marks it as
+ * most recently used */
+static HttpCacheEntry *
+entry_get (const char *key)
+{
+	HttpCacheEntry *entry;
+
+	entry = g_hash_table_lookup (entries, key);
+
+	if (entry != NULL) {
+		g_queue_unlink (lru, entry->link);
+		g_queue_push_head_link (lru, entry->link);
+		return entry;
+	}
+
+	entry = g_new0 (HttpCacheEntry, 1);
+	entry->key = g_strdup (key);
+
+	g_hash_table_insert (entries, entry->key, entry);
+	g_queue_push_head (lru, entry);
+	entry->link = lru->head;
+
+	entry_update_cost (entry);
+
+	return entry;
+}
+
+/* Evicts least recently used entries, but never keep */
+static void
+entries_trim (HttpCacheEntry *keep)
+{
+	HttpCacheEntry *entry;
+
+	while ((memory_used > memory_limit || open_files > MAX_OPEN_FILES) &&
+	       lru->tail != NULL) {
+		entry = lru->tail->data;
+
+		if (entry == keep) {
+			break;
+		}
+
+		entry_remove (entry);
+	}
+}
+
+static void
+entries_remove_below (const char *key)
+{
+	HttpCacheEntry *entry;
+	GList *l, *next;
+	char *prefix;
+
+	if (g_str_has_suffix (key, "/")) {
+		prefix = g_strdup (key);
+	} else {
+		prefix = g_strconcat (key, "/", NULL);
+	}
+
+	for (l = lru->head; l != NULL; l = next) {
+		next = l->next;
+		entry = l->data;
+
+		if (g_str_has_prefix (entry->key, prefix)) {
+			entry_remove (entry);
+		}
+	}
+
+	g_free (prefix);
+}
+
+/* ************************************************************************** */
+/* Public API */
+
+gboolean
+http_cache_lookup_info (const char *key, GnomeVFSFileInfo *info)
+{
+	HttpCacheEntry *entry;
+	gboolean found;
+
+	if (entries == NULL) {
+		return FALSE;
+	}
+
+	found = FALSE;
+
+	G_LOCK (cache);
+
+	entry = g_hash_table_lookup (entries, key);
+
+	if (entry != NULL && entry->info != NULL &&
+	    time (NULL) < entry->info_expires) {
+		entry = entry_get (key);
+
+		gnome_vfs_file_info_clear (info);
+		gnome_vfs_file_info_copy (info, entry->info);
+		found = TRUE;
+	}
+
+	G_UNLOCK (cache);
+
+	return found;
+}
+
+void
+http_cache_store_info (const char             *key,
+		       const GnomeVFSFileInfo *info,
+		       glong                   lifetime)
+{
+	HttpCacheEntry *entry;
+
+	if (entries == NULL) {
+		return;
+	}
+
+	G_LOCK (cache);
+
+	entry = g_hash_table_lookup (entries, key);
+
+	if (lifetime <= 0) {
+		if (entry != NULL && entry->info != NULL) {
+			gnome_vfs_file_info_unref (entry->info);
+			entry->info = NULL;
+		}
+	} else {
+		if (! bodies_cached) {
+			lifetime = MIN (lifetime, INFO_ONLY_MAX_LIFETIME);
+		}
+
+		entry = entry_get (key);
+
+		if (entry->info != NULL) {
+			gnome_vfs_file_info_unref (entry->info);
+		}
+
+		entry->info = gnome_vfs_file_info_dup (info);
+		entry->info_expires = time (NULL) + lifetime;
+
+		entries_trim (entry);
+	}
+
+	G_UNLOCK (cache);
+}
+
+void
+http_cache_invalidate (const char *key)
+{
+	HttpCacheEntry *entry;
+	const char *host_end, *slash;
+	char *parent, *path;
+
+	if (entries == NULL) {
+		return;
+	}
+
+	/* keys look like scheme://user@host:port/path */
+	host_end = strstr (key, "://");
+	host_end = host_end ? strchr (host_end + 3, '/') : NULL;
+	slash = strrchr (key, '/');
+
+	if (slash == NULL || host_end == NULL || slash[1] == '\0') {
+		parent = NULL;
+	} else if (slash == host_end) {
+		parent = g_strndup (key, slash - key + 1);
+	} else {
+		parent = g_strndup (key, slash - key);
+	}
+
+	G_LOCK (cache);
+
+	entry = g_hash_table_lookup (entries, key);
+	if (entry != NULL) {
+		entry_remove (entry);
+	}
+
+	entries_remove_below (key);
+
+	if (parent != NULL) {
+		entry = g_hash_table_lookup (entries, parent);
+		if (entry != NULL) {
+			entry_remove (entry);
+		}
+	}
+
+	G_UNLOCK (cache);
+
+	/* Files of resources below key that are not in memory stay
+	 * around; they are only used while fresh, as any cache would. */
+	if (disk_dir != NULL) {
+		path = disk_path (key);
+		g_unlink (path);
+		g_free (path);
+
+		if (parent != NULL) {
+			path = disk_path (parent);
+			g_unlink (path);
+			g_free (path);
+		}
+	}
+
+	g_free (parent);
+}
+
+HttpCacheBody *
+http_cache_lookup_body (const char *key, gboolean *fresh)
+{
+	HttpCacheEntry *entry;
+	HttpCacheBody *body, *loaded;
+
+	*fresh = FALSE;
+
+	if (entries == NULL || ! bodies_cached) {
+		return NULL;
+	}
+
+	body = NULL;
+
+	G_LOCK (cache);
+
+	entry = g_hash_table_lookup (entries, key);
+
+	if (entry != NULL && entry->body != NULL) {
+		entry_get (key);
+		body = body_ref (entry->body);
+		*fresh = time (NULL) < body->expires;
+	}
+
+	G_UNLOCK (cache);
+
+	if (body != NULL || disk_dir == NULL) {
+		return body;
+	}
+
+	loaded = disk_load (key);
+
+	if (loaded == NULL) {
+		return NULL;
+	}
+
+	G_LOCK (cache);
+
+	entry = entry_get (key);
+
+	/* somebody else may have been quicker */
+	if (entry->body == NULL) {
+		entry_set_body (entry, body_ref (loaded));
+		entries_trim (entry);
+	}
+
+	body = body_ref (entry->body);
+	*fresh = time (NULL) < body->expires;
+
+	G_UNLOCK (cache);
+
+	http_cache_body_unref (loaded);
+
+	return body;
+}
+
+void
+http_cache_body_refresh (const char *key, HttpCacheBody *body, glong lifetime)
+{
+	time_t expires;
+	char *path;
+
+	expires = time (NULL) + MAX (lifetime, 0);
+
+	G_LOCK (cache);
+	body->expires = expires;
+	G_UNLOCK (cache);
+
+	/* a file that may now say anything about its expiry is better
+	 * gone; the body keeps working off it */
+	if (body->fd >= 0 && ! disk_write_expires (body, expires)) {
+		path = disk_path (key);
+		g_unlink (path);
+		g_free (path);
+	}
+}
+
+static void
+fill_drop_disk (HttpCacheFill *fill)
+{
+	close (fill->body->fd);
+	fill->body->fd = -1;
+
+	g_unlink (fill->temp_path);
+	g_free (fill->temp_path);
+	fill->temp_path = NULL;
+}
+
+HttpCacheFill *
+http_cache_fill_new (const char             *key,
+		     const GnomeVFSFileInfo *info,
+		     const char             *etag,
+		     const char             *last_modified,
+		     glong                   lifetime)
+{
+	HttpCacheFill *fill;
+	HttpCacheBody *body;
+
+	if (entries == NULL || ! bodies_cached || lifetime < 0) {
+		return NULL;
+	}
+
+	/* never fresh, and nothing to revalidate with */
+	if (lifetime == 0 && etag == NULL && last_modified == NULL) {
+		return NULL;
+	}
+
+	body = body_new ();
+	gnome_vfs_file_info_copy (body->info, info);
+	body->etag = g_strdup (etag);
+	body->last_modified = g_strdup (last_modified);
+	body->expires = time (NULL) + lifetime;
+	body->data = g_byte_array_new ();
+
+	fill = g_new0 (HttpCacheFill, 1);
+	fill->key = g_strdup (key);
+	fill->body = body;
+
+	if (disk_dir != NULL) {
+		fill->temp_path = g_build_filename (disk_dir,
+						    DISK_TEMP_PREFIX "XXXXXX",
+						    NULL);
+		body->fd = g_mkstemp (fill->temp_path);
+
+		if (body->fd < 0) {
+			g_free (fill->temp_path);
+			fill->temp_path = NULL;
+		} else if (! disk_write_header (body, key)) {
+			fill_drop_disk (fill);
+		}
+	}
+
+	return fill;
+}
+
+gboolean
+http_cache_fill_append (HttpCacheFill *fill, gconstpointer data, gsize len)
+{
+	HttpCacheBody *body;
+
+	body = fill->body;
+
+	if (body->data != NULL &&
+	    body->size + len > memory_limit / BODY_SHARE) {
+		/* too big for memory, carry on on disk if we can */
+		g_byte_array_free (body->data, TRUE);
+		body->data = NULL;
+	}
+
+	if (body->fd >= 0 &&
+	    (body->size + len > disk_limit / BODY_SHARE ||
+	     ! disk_write_all (body->fd, data, len))) {
+		fill_drop_disk (fill);
+	}
+
+	if (body->data == NULL && body->fd < 0) {
+		return FALSE;
+	}
+
+	if (body->data != NULL) {
+		g_byte_array_append (body->data, data, len);
+	}
+
+	body->size += len;
+
+	return TRUE;
+}
+
+void
+http_cache_fill_commit (HttpCacheFill *fill)
+{
+	HttpCacheEntry *entry;
+	HttpCacheBody *body;
+	gboolean trim;
+	char *path;
+
+	body = fill->body;
+	body->info->size = body->size;
+	body->info->valid_fields |= GNOME_VFS_FILE_INFO_FIELDS_SIZE;
+
+	if (body->fd >= 0) {
+		path = disk_path (fill->key);
+
+		if (rename (fill->temp_path, path) != 0) {
+			fill_drop_disk (fill);
+		}
+
+		g_free (path);
+	}
+
+	trim = FALSE;
+
+	if (entries != NULL && (body->data != NULL || body->fd >= 0)) {
+		G_LOCK (cache);
+
+		entry = entry_get (fill->key);
+		entry_set_body (entry, body_ref (body));
+		entries_trim (entry);
+
+		if (body->fd >= 0) {
+			disk_used += body->size;
+
+			if (disk_used > disk_limit && ! disk_trimming) {
+				disk_trimming = TRUE;
+				trim = TRUE;
+			}
+		}
+
+		G_UNLOCK (cache);
+	}
+
+	if (trim) {
+		disk_trim ();
+	}
+
+	http_cache_body_unref (body);
+	g_free (fill->temp_path);
+	g_free (fill->key);
+	g_free (fill);
+}
+
+void
+http_cache_fill_abandon (HttpCacheFill *fill)
+{
+	if (fill->body->fd >= 0) {
+		fill_drop_disk (fill);
+	}
+
+	http_cache_body_unref (fill->body);
+	g_free (fill->key);
+	g_free (fill);
+}
+
+void
+http_cache_init (void)
+{
+	const char *dir;
+	GList *files;
+
+	memory_limit = size_from_environment ("GNOME_VFS_HTTP_CACHE_SIZE", 0);
+	bodies_cached = memory_limit != 0;
+
+	if (! bodies_cached) {
+		memory_limit = INFO_ONLY_MEMORY_LIMIT;
+	}
+
+	entries = g_hash_table_new (g_str_hash, g_str_equal);
+	lru = g_queue_new ();
+	memory_used = 0;
+	open_files = 0;
+
+	if (! bodies_cached) {
+		return;
+	}
+
+	dir = getenv ("GNOME_VFS_HTTP_CACHE_DIR");
+
+	if (dir == NULL || *dir == '\0') {
+		return;
+	}
+
+	if (g_mkdir_with_parents (dir, 0700) != 0) {
+		g_warning ("Cannot create HTTP cache directory %s: %s",
+			   dir, g_strerror (errno));
+		return;
+	}
+
+	disk_dir = g_strdup (dir);
+	disk_limit = size_from_environment ("GNOME_VFS_HTTP_CACHE_DISK_SIZE",
+					    DEFAULT_DISK_LIMIT);
+	disk_trimming = FALSE;
+
+	files = disk_scan (&disk_used);
+	disk_files_free (files);
+
+	if (disk_used > disk_limit) {
+		disk_trimming = TRUE;
+		disk_trim ();
+	}
+}
+
+void
+http_cache_shutdown (void)
+{
+	if (entries == NULL) {
+		return;
+	}
+
+	G_LOCK (cache);
+
+	while (lru->head != NULL) {
+		entry_remove (lru->head->data);
+	}
+
+	g_hash_table_destroy (entries);
+	entries = NULL;
+	g_queue_free (lru);
+	lru = NULL;
+
+	G_UNLOCK (cache);
+
+	g_free (disk_dir);
+	disk_dir = NULL;
+}
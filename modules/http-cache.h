@@ -0,0 +1,87 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 8; tab-width: 8 -*- */
+/* http-cache.h - Response and metadata cache for the HTTP method.
+
+   Copyright (C) 2026 Free Software Foundation
+
+   The Gnome Library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   The Gnome Library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with the Gnome Library; see the file COPYING.LIB.  If not,
+   write to the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, USA.
+*/
+
+#ifndef HTTP_CACHE_H
+#define HTTP_CACHE_H
+
+#include <glib.h>
+#include <time.h>
+#include <libgnomevfs/gnome-vfs-file-info.h>
+#include <libgnomevfs/gnome-vfs-result.h>
+
+/* Entries are keyed by a string naming the resource, built by the
+ * method from the scheme, user, host, port and path. All functions are
+ * thread safe. The body functions do nothing (or find nothing) unless
+ * bodies are cached.
+ */
+
+typedef struct _HttpCacheBody HttpCacheBody;
+typedef struct _HttpCacheFill HttpCacheFill;
+
+void              http_cache_init            (void);
+void              http_cache_shutdown        (void);
+
+/* File information, from PROPFIND or HEAD */
+gboolean          http_cache_lookup_info     (const char             *key,
+					      GnomeVFSFileInfo       *info);
+void              http_cache_store_info      (const char             *key,
+					      const GnomeVFSFileInfo *info,
+					      glong                   lifetime);
+
+/* Drops everything known about key, the resources below it and its
+ * parent collection */
+void              http_cache_invalidate      (const char             *key);
+
+/* Bodies of GET responses. lookup_body () returns a reference whether
+ * or not the body is still fresh; a stale one can be revalidated with
+ * its validators and refresh ()ed when the server answers 304. */
+HttpCacheBody    *http_cache_lookup_body     (const char             *key,
+					      gboolean               *fresh);
+void              http_cache_body_unref      (HttpCacheBody          *body);
+const char       *http_cache_body_get_etag   (HttpCacheBody          *body);
+const char       *http_cache_body_get_last_modified
+					     (HttpCacheBody          *body);
+const GnomeVFSFileInfo *
+		  http_cache_body_get_info   (HttpCacheBody          *body);
+void              http_cache_body_refresh    (const char             *key,
+					      HttpCacheBody          *body,
+					      glong                   lifetime);
+GnomeVFSResult    http_cache_body_read       (HttpCacheBody          *body,
+					      GnomeVFSFileSize        offset,
+					      gpointer                buffer,
+					      GnomeVFSFileSize        num_bytes,
+					      GnomeVFSFileSize       *bytes_read);
+
+/* Stores a body while it is being downloaded. append () returns FALSE
+ * once the body is too big to be cached; the fill must then be
+ * abandoned. */
+HttpCacheFill    *http_cache_fill_new        (const char             *key,
+					      const GnomeVFSFileInfo *info,
+					      const char             *etag,
+					      const char             *last_modified,
+					      glong                   lifetime);
+gboolean          http_cache_fill_append     (HttpCacheFill          *fill,
+					      gconstpointer           data,
+					      gsize                   len);
+void              http_cache_fill_commit     (HttpCacheFill          *fill);
+void              http_cache_fill_abandon    (HttpCacheFill          *fill);
+
+#endif /* HTTP_CACHE_H */
@@ -61,12 +61,18 @@
 #include <stdio.h>
 
 #include "http-proxy.h"
+#include "http-cache.h"
 
 #define DEFAULT_USER_AGENT         "gnome-vfs/" VERSION
 
 /* Custom User-Agent environment variable */
 #define CUSTOM_USER_AGENT_VARIABLE "GNOME_VFS_HTTP_USER_AGENT"
 
+/* Number of connections big downloads are spread over, see
+ * http_transfer_start_ranges () */
+#define PARALLEL_RANGES_VARIABLE "GNOME_VFS_HTTP_PARALLEL_RANGES"
+static guint parallel_ranges = 4;
+
 /* Standard HTTP[S] port.  */
 #define DEFAULT_HTTP_PORT 	80
 #define DEFAULT_HTTPS_PORT 	443
@@ -1119,6 +1125,104 @@ std_headers_to_file_info (ne_request *req, GnomeVFSFileInfo *info)
 	}
 }
 
+/* How long file information from PROPFIND and HEAD is trusted when the
+ * response doesn't say */
+#define HTTP_CACHE_INFO_LIFETIME 5
+
+/* Bodies without an explicit expiry stay fresh for a tenth of the time
+ * since they were last modified, as RFC 2616 suggests, but no longer
+ * than this */
+#define HTTP_CACHE_MAX_HEURISTIC_LIFETIME (60 * 60)
+
+/* Returns the number of seconds the response may be used without
+ * asking the server again according to its Cache-Control, Pragma and
+ * Expires headers, default_lifetime if they don't say, or -1 if it must
+ * not be stored at all */
+static glong
+http_response_lifetime (ne_request *req, glong default_lifetime)
+{
+	const char *value;
+	char *directives, *max_age;
+	time_t date, expires;
+	glong lifetime;
+	gboolean found;
+
+	value = ne_get_response_header (req, "Cache-Control");
+
+	if (value != NULL) {
+		directives = g_ascii_strdown (value, -1);
+		max_age = strstr (directives, "max-age=");
+		found = TRUE;
+		lifetime = 0;
+
+		if (strstr (directives, "no-store") != NULL) {
+			lifetime = -1;
+		} else if (strstr (directives, "no-cache") != NULL) {
+			lifetime = 0;
+		} else if (max_age != NULL) {
+			lifetime = MAX (strtol (max_age + 8, NULL, 10), 0);
+		} else {
+			found = FALSE;
+		}
+
+		g_free (directives);
+
+		if (found) {
+			return lifetime;
+		}
+	}
+
+	value = ne_get_response_header (req, "Pragma");
+
+	if (value != NULL && g_ascii_strncasecmp (value, "no-cache", 8) == 0) {
+		return 0;
+	}
+
+	value = ne_get_response_header (req, "Expires");
+
+	if (value != NULL) {
+		/* invalid dates mean "already expired" */
+		if (! gnome_vfs_atotm (value, &expires)) {
+			return 0;
+		}
+
+		value = ne_get_response_header (req, "Date");
+
+		if (value == NULL || ! gnome_vfs_atotm (value, &date)) {
+			date = time (NULL);
+		}
+
+		return MAX (expires - date, 0);
+	}
+
+	return default_lifetime;
+}
+
+static glong
+http_heuristic_lifetime (ne_request *req)
+{
+	const char *value;
+	time_t date, modified;
+
+	value = ne_get_response_header (req, "Last-Modified");
+
+	if (value == NULL || ! gnome_vfs_atotm (value, &modified)) {
+		return 0;
+	}
+
+	value = ne_get_response_header (req, "Date");
+
+	if (value == NULL || ! gnome_vfs_atotm (value, &date)) {
+		date = time (NULL);
+	}
+
+	if (date <= modified) {
+		return 0;
+	}
+
+	return MIN ((date - modified) / 10, HTTP_CACHE_MAX_HEURISTIC_LIFETIME);
+}
+
 /* ************************************************************************** */
 /* Propfind request handlers */
 static const ne_propname file_info_props[] = {
@@ -1141,6 +1245,9 @@ typedef struct {
 	GList *children;
 	
 	char *etag;
+
+	/* How long the result may be cached */
+	glong lifetime;
 	
 } PropfindContext;
 
@@ -1153,6 +1260,7 @@ propfind_context_init (PropfindContext *pfctx)
 	pfctx->include_target = TRUE;
 	pfctx->children = NULL;
 	pfctx->etag = NULL;
+	pfctx->lifetime = 0;
 	
 }
 
@@ -1774,6 +1882,66 @@ http_context_open (GnomeVFSURI *uri, HttpContext **context)
 	return GNOME_VFS_OK;
 }
 
+/* Names the resource the context points at in the response cache.
+ * PROPFIND and HEAD tell different stories about collections, so what
+ * dav and plain http URIs found out about a resource is kept apart. */
+static char *
+http_context_cache_key (HttpContext *context, gboolean dav)
+{
+	const char *user;
+	char *path, *key;
+	gsize len;
+
+	path = g_strdup (context->path);
+	len = strlen (path);
+
+	while (len > 1 && path[len - 1] == '/') {
+		path[--len] = '\0';
+	}
+
+	user = gnome_vfs_uri_get_user_name (context->uri);
+	key = g_strdup_printf ("%s%s://%s%s%s:%u%s",
+			       dav ? "dav+" : "",
+			       context->scheme,
+			       user != NULL ? user : "",
+			       user != NULL ? "@" : "",
+			       gnome_vfs_uri_get_host_name (context->uri),
+			       gnome_vfs_uri_get_host_port (context->uri),
+			       path);
+	g_free (path);
+
+	return key;
+}
+
+static void
+http_context_invalidate_cache (HttpContext *context)
+{
+	char *key;
+
+	key = http_context_cache_key (context, FALSE);
+	http_cache_invalidate (key);
+	g_free (key);
+
+	key = http_context_cache_key (context, TRUE);
+	http_cache_invalidate (key);
+	g_free (key);
+}
+
+static void
+http_uri_invalidate_cache (GnomeVFSURI *uri)
+{
+	HttpContext context = { NULL };
+
+	http_context_set_uri (&context, uri);
+
+	if (context.scheme != NULL) {
+		http_context_invalidate_cache (&context);
+	}
+
+	gnome_vfs_uri_unref (context.uri);
+	g_free (context.path);
+}
+
 static gboolean
 http_context_host_matches (HttpContext *context, const char *glob)
 {
@@ -1844,7 +2012,8 @@ http_follow_redirect (HttpContext *context)
 /* Http operations */
 
 static GnomeVFSResult
-http_get_file_info (HttpContext *context, GnomeVFSFileInfo *info)
+http_fetch_file_info (HttpContext *context, GnomeVFSFileInfo *info,
+		      glong *lifetime)
 {
 	GnomeVFSResult result;
 	PropfindContext pfctx;
@@ -1881,6 +2050,7 @@ http_get_file_info (HttpContext *context, GnomeVFSFileInfo *info)
 
 	req = ne_propfind_get_request (pfh);
 	result = resolve_result (res, req);
+	*lifetime = http_response_lifetime (req, HTTP_CACHE_INFO_LIFETIME);
 	DEBUG_HTTP ("%d, %d", res, ne_get_status (req)->code);
 	ne_propfind_destroy (pfh);
 
@@ -1954,6 +2124,7 @@ http_get_file_info (HttpContext *context, GnomeVFSFileInfo *info)
 		info->valid_fields |= GNOME_VFS_FILE_INFO_FIELDS_TYPE;
 
 		std_headers_to_file_info (req, info);
+		*lifetime = http_response_lifetime (req, HTTP_CACHE_INFO_LIFETIME);
 		
 		/* work-around for broken icecast server */
 		if (info->valid_fields & GNOME_VFS_FILE_INFO_FIELDS_MIME_TYPE
@@ -1968,6 +2139,33 @@ http_get_file_info (HttpContext *context, GnomeVFSFileInfo *info)
 	return result;
 }
 
+static GnomeVFSResult
+http_get_file_info (HttpContext *context, GnomeVFSFileInfo *info)
+{
+	GnomeVFSResult result;
+	glong lifetime;
+	char *key;
+
+	/* keyed by the URI asked for, not where it redirects to */
+	key = http_context_cache_key (context, context->dav_mode);
+
+	if (http_cache_lookup_info (key, info)) {
+		DEBUG_HTTP ("[Cache] info hit for %s", key);
+		g_free (key);
+		return GNOME_VFS_OK;
+	}
+
+	lifetime = 0;
+	result = http_fetch_file_info (context, info, &lifetime);
+
+	if (result == GNOME_VFS_OK) {
+		http_cache_store_info (key, info, lifetime);
+	}
+
+	g_free (key);
+	return result;
+}
+
 static void assure_trailing_slash (HttpContext *context)
 {
 	char *tofree;
@@ -2013,6 +2211,7 @@ http_list_directory (HttpContext *context, PropfindContext *pfctx)
 	
 	req 	= ne_propfind_get_request (pfh);
 	result 	= resolve_result (res, req);
+	pfctx->lifetime = http_response_lifetime (req, HTTP_CACHE_INFO_LIFETIME);
 	
 	ne_propfind_destroy (pfh);
 
@@ -2024,6 +2223,49 @@ http_list_directory (HttpContext *context, PropfindContext *pfctx)
 }
 
 
+/* Remembers what a Depth: 1 PROPFIND said about a collection and its
+ * members, so that stat'ing each of them after a listing, as xfer and
+ * directory visits do, doesn't cost a PROPFIND apiece */
+static void
+http_cache_listing (HttpContext *context, PropfindContext *pfctx)
+{
+	HttpContext       child = { NULL };
+	GnomeVFSFileInfo *info;
+	GnomeVFSURI      *child_uri;
+	GList            *l;
+	char             *key;
+
+	if (pfctx->lifetime <= 0) {
+		return;
+	}
+
+	key = http_context_cache_key (context, TRUE);
+	http_cache_store_info (key, pfctx->target, pfctx->lifetime);
+	g_free (key);
+
+	for (l = pfctx->children; l != NULL; l = l->next) {
+		info = l->data;
+
+		if (info->name == NULL || info->name[0] == '\0') {
+			continue;
+		}
+
+		/* key them like the URIs callers build for the members */
+		child_uri = gnome_vfs_uri_append_file_name (context->uri, info->name);
+		http_context_set_uri (&child, child_uri);
+		gnome_vfs_uri_unref (child_uri);
+
+		key = http_context_cache_key (&child, TRUE);
+		http_cache_store_info (key, info, pfctx->lifetime);
+		g_free (key);
+	}
+
+	if (child.uri != NULL) {
+		gnome_vfs_uri_unref (child.uri);
+		g_free (child.path);
+	}
+}
+
 static GnomeVFSResult
 http_options (HttpContext *hctx)
 {
@@ -2124,6 +2366,95 @@ dav_request (ne_request *req, gboolean allow_redirect)
 /* ************************************************************************** */
 /* File operations */
 
+/* Uploads that grow past this are streamed to the server while they
+ * are being written, using chunked transfer-encoding, instead of being
+ * held in memory until close. Smaller ones go out in one PUT with a
+ * Content-Length, which every server understands. */
+#define HTTP_PUT_STREAM_THRESHOLD (1024 * 1024)
+
+/* How far do_write () can get ahead of the network when streaming */
+#define HTTP_PUT_PIPE_SIZE (256 * 1024)
+
+/* How often a do_write () waiting for the network checks for
+ * cancellation */
+#define HTTP_PUT_WAIT_USECS 100000
+
+/* Resources bigger than this are downloaded over several connections
+ * at once when the server takes ranges */
+#define HTTP_RANGES_THRESHOLD (8 * 1024 * 1024)
+
+/* Size of each of those ranges */
+#define HTTP_RANGE_SIZE (1024 * 1024)
+
+/* Ranges fetched ahead of the reader, per connection */
+#define HTTP_RANGES_AHEAD 2
+
+typedef struct {
+	GnomeVFSFileOffset start;
+	GnomeVFSFileSize   len;
+	guint8            *data;
+
+	/* Bytes received so far */
+	GnomeVFSFileSize   filled;
+	gboolean           done;
+	GnomeVFSResult     result;
+} HttpRange;
+
+/* Fetches a resource as consecutive ranges over parallel connections
+ * and hands them to do_read () in order */
+typedef struct {
+	GnomeVFSURI       *uri;
+	GnomeVFSFileSize   size;
+	/* Validators making sure all ranges are of the same entity */
+	char              *etag;
+	char              *last_modified;
+
+	GMutex            *lock;
+	GCond             *cond;
+
+	GThread          **threads;
+	guint              n_threads;
+
+	/* Ranges being fetched or waiting for the reader, in order */
+	GQueue            *ranges;
+	guint              max_ranges;
+	/* Where the next range starts */
+	GnomeVFSFileOffset next_start;
+	gboolean           failed;
+	gboolean           cancelled;
+} HttpRangeReader;
+
+/* Hands the data of a streamed upload from do_write () to the thread
+ * running the PUT */
+typedef struct {
+
+	HttpContext    *context;
+	GThread        *thread;
+	
+	GMutex         *lock;
+	GCond          *cond;
+
+	/* What was written before streaming started, sent first */
+	GByteArray     *head;
+	guint           head_sent;
+
+	guint8         *ring;
+	gsize           ring_start;
+	gsize           ring_len;
+
+	/* Bytes written into the pipe so far */
+	GnomeVFSFileSize length;
+	/* Whether neon has been given any data yet */
+	gboolean        taken;
+	/* No more data is coming */
+	gboolean        closed;
+	gboolean        cancelled;
+
+	/* The PUT is over, with result */
+	gboolean        done;
+	GnomeVFSResult  result;
+	
+} HttpPutPipe;
 
 typedef struct {
 	
@@ -2153,6 +2484,17 @@ typedef struct {
 	} transfer_state;
 	
 	GnomeVFSResult last_error;
+
+	/* Set once a sequential upload is being streamed */
+	HttpPutPipe *put_pipe;
+
+	/* Set when reading from the response cache instead of a GET */
+	HttpCacheBody *cache_body;
+	/* Set while the body of a GET is being copied into the cache */
+	HttpCacheFill *cache_fill;
+
+	/* Set while reading over parallel connections */
+	HttpRangeReader *ranges;
 	
 } HttpFileHandle;
 
@@ -2182,24 +2524,557 @@ http_file_handle_new (GnomeVFSURI *uri,
 	return GNOME_VFS_OK;
 }
 
+static ssize_t
+http_put_pipe_provide (void *userdata, char *buffer, size_t buflen)
+{
+	HttpPutPipe *pipe;
+	ssize_t      ret;
+	gsize        n, first;
+
+	pipe = userdata;
+
+	g_mutex_lock (pipe->lock);
+
+	if (buflen == 0) {
+		/* neon rewinds before sending the body, and again when it
+		 * has to send it once more; what was sent is gone by then */
+		if (pipe->taken) {
+			ne_set_error (pipe->context->session,
+				      "Streamed request body cannot be sent again");
+			ret = -1;
+		} else {
+			ret = 0;
+		}
+
+		g_mutex_unlock (pipe->lock);
+		return ret;
+	}
+
+	while (pipe->head == NULL && pipe->ring_len == 0 &&
+	       !pipe->closed && !pipe->cancelled) {
+		g_cond_wait (pipe->cond, pipe->lock);
+	}
+
+	if (pipe->cancelled) {
+		ne_set_error (pipe->context->session, "Upload cancelled");
+		ret = -1;
+	} else if (pipe->head != NULL) {
+		n = MIN (buflen, pipe->head->len - pipe->head_sent);
+		memcpy (buffer, pipe->head->data + pipe->head_sent, n);
+		pipe->head_sent += n;
+
+		if (pipe->head_sent == pipe->head->len) {
+			g_byte_array_free (pipe->head, TRUE);
+			pipe->head = NULL;
+		}
+		ret = n;
+	} else if (pipe->ring_len > 0) {
+		n = MIN (buflen, pipe->ring_len);
+		first = MIN (n, HTTP_PUT_PIPE_SIZE - pipe->ring_start);
+		memcpy (buffer, pipe->ring + pipe->ring_start, first);
+		memcpy (buffer + first, pipe->ring, n - first);
+		pipe->ring_start = (pipe->ring_start + n) % HTTP_PUT_PIPE_SIZE;
+		pipe->ring_len -= n;
+
+		/* do_write () may be waiting for room */
+		g_cond_broadcast (pipe->cond);
+		ret = n;
+	} else {
+		/* closed, end of body */
+		ret = 0;
+	}
+
+	if (ret > 0)
+		pipe->taken = TRUE;
+
+	g_mutex_unlock (pipe->lock);
+
+	return ret;
+}
+
+static gpointer
+http_put_pipe_thread (gpointer data)
+{
+	HttpPutPipe    *pipe;
+	HttpContext    *hctx;
+	ne_request     *req;
+	GnomeVFSResult  result;
+	int             res;
+
+	pipe = data;
+	hctx = pipe->context;
+
+	req = ne_request_create (hctx->session, "PUT", hctx->path);
+	ne_set_request_body_provider (req, -1, http_put_pipe_provide, pipe);
+
+	res = ne_request_dispatch (req);
+	result = resolve_result (res, req);
+
+	DEBUG_HTTP ("[PUT] streamed %" GNOME_VFS_SIZE_FORMAT_STR
+		    " bytes, returned: %d, %d (%s)",
+		    pipe->length, res, ne_get_status (req)->code,
+		    gnome_vfs_result_to_string (result));
+
+	ne_request_destroy (req);
+
+	g_mutex_lock (pipe->lock);
+	pipe->done = TRUE;
+	pipe->result = result;
+	g_cond_broadcast (pipe->cond);
+	g_mutex_unlock (pipe->lock);
+
+	return NULL;
+}
+
+/* Starts a chunked PUT of what has been written so far and of what
+ * is still to come */
+static GnomeVFSResult
+http_put_pipe_start (HttpFileHandle *handle)
+{
+	HttpPutPipe *pipe;
+	GError      *error;
+
+	pipe = g_new0 (HttpPutPipe, 1);
+	pipe->context = handle->context;
+	pipe->lock = g_mutex_new ();
+	pipe->cond = g_cond_new ();
+	pipe->ring = g_malloc (HTTP_PUT_PIPE_SIZE);
+	pipe->length = handle->transfer.write->len;
+	if (handle->transfer.write->len > 0)
+		pipe->head = handle->transfer.write;
+	else
+		g_byte_array_free (handle->transfer.write, TRUE);
+	
+	/* A PUT on a persistent connection the server has dropped gets
+	 * sent again, which a stream can't be; start on a fresh one.
+	 * Authentication was settled by the requests of do_open () or
+	 * do_create (), so neon has no reason to resend for that. */
+	ne_close_connection (handle->context->session);
+
+	error = NULL;
+	pipe->thread = g_thread_create (http_put_pipe_thread, pipe, TRUE, &error);
+	
+	if (pipe->thread == NULL) {
+		g_warning ("Could not start HTTP upload thread: %s", error->message);
+		g_error_free (error);
+
+		/* keep on buffering */
+		handle->transfer.write = pipe->head != NULL ? pipe->head : g_byte_array_new ();
+		g_free (pipe->ring);
+		g_cond_free (pipe->cond);
+		g_mutex_free (pipe->lock);
+		g_free (pipe);
+		return GNOME_VFS_ERROR_INTERNAL;
+	}
+
+	DEBUG_HTTP ("[PUT] streaming, %" GNOME_VFS_SIZE_FORMAT_STR " bytes buffered",
+		    pipe->length);
+
+	handle->transfer.write = NULL;
+	handle->put_pipe = pipe;
+
+	return GNOME_VFS_OK;
+}
+
+static GnomeVFSResult
+http_put_pipe_write (HttpPutPipe      *pipe,
+		     const guint8     *buffer,
+		     GnomeVFSFileSize  num_bytes,
+		     GnomeVFSFileSize *bytes_written,
+		     GnomeVFSContext  *context)
+{
+	GnomeVFSResult result;
+	GTimeVal       timeout;
+	gsize          end, n;
+
+	result = GNOME_VFS_OK;
+	*bytes_written = 0;
+
+	g_mutex_lock (pipe->lock);
+
+	while (*bytes_written < num_bytes) {
+		while (pipe->ring_len == HTTP_PUT_PIPE_SIZE && !pipe->done) {
+			g_get_current_time (&timeout);
+			g_time_val_add (&timeout, HTTP_PUT_WAIT_USECS);
+			g_cond_timed_wait (pipe->cond, pipe->lock, &timeout);
+
+			if (gnome_vfs_context_check_cancellation (context)) {
+				result = GNOME_VFS_ERROR_CANCELLED;
+				goto out;
+			}
+		}
+
+		if (pipe->done) {
+			/* the PUT ended before its body did */
+			result = pipe->result != GNOME_VFS_OK ? pipe->result : GNOME_VFS_ERROR_IO;
+			break;
+		}
+
+		end = (pipe->ring_start + pipe->ring_len) % HTTP_PUT_PIPE_SIZE;
+		n = MIN (num_bytes - *bytes_written, HTTP_PUT_PIPE_SIZE - pipe->ring_len);
+		n = MIN (n, HTTP_PUT_PIPE_SIZE - end);
+		memcpy (pipe->ring + end, buffer + *bytes_written, n);
+		pipe->ring_len += n;
+		pipe->length += n;
+		*bytes_written += n;
+
+		g_cond_broadcast (pipe->cond);
+	}
+
+ out:
+	g_mutex_unlock (pipe->lock);
+
+	return result;
+}
+
+/* Ends the body, or with cancel aborts the upload, and waits for the
+ * PUT to finish */
+static GnomeVFSResult
+http_put_pipe_finish (HttpPutPipe *pipe, gboolean cancel)
+{
+	GnomeVFSResult result;
+
+	g_mutex_lock (pipe->lock);
+	pipe->closed = TRUE;
+	if (cancel)
+		pipe->cancelled = TRUE;
+	g_cond_broadcast (pipe->cond);
+	g_mutex_unlock (pipe->lock);
+
+	g_thread_join (pipe->thread);
+
+	result = pipe->result;
+
+	if (pipe->head != NULL)
+		g_byte_array_free (pipe->head, TRUE);
+	g_free (pipe->ring);
+	g_cond_free (pipe->cond);
+	g_mutex_free (pipe->lock);
+	g_free (pipe);
+
+	return result;
+}
+
+static GnomeVFSResult
+http_range_fetch (HttpRangeReader *reader,
+		  HttpContext     *context,
+		  HttpRange       *range)
+{
+	GnomeVFSResult   result;
+	const ne_status *status;
+	ne_request      *req;
+	ssize_t          n;
+	char             extra;
+	int              res;
+
+	req = ne_request_create (context->session, "GET", context->path);
+
+	ne_print_request_header (req, "Range",
+				 "bytes=%" GNOME_VFS_OFFSET_FORMAT_STR
+				 "-%" GNOME_VFS_OFFSET_FORMAT_STR,
+				 range->start, range->start + range->len - 1);
+
+	if (reader->etag != NULL) {
+		ne_add_request_header (req, "If-Match", reader->etag);
+	} else if (reader->last_modified != NULL) {
+		ne_add_request_header (req, "If-Unmodified-Since",
+				       reader->last_modified);
+	}
+
+ retry:
+	res = ne_begin_request (req);
+	status = ne_get_status (req);
+
+	if (res == NE_OK && IS_AUTH_REQ (status->code) &&
+	    ne_discard_response (req) >= 0 &&
+	    ne_end_request (req) == NE_RETRY) {
+		goto retry;
+	}
+
+	if (res != NE_OK || status->code != 206) {
+		/* a 200 or 412 means the resource changed under us */
+		result = resolve_result (res, req);
+
+		if (result == GNOME_VFS_OK) {
+			result = GNOME_VFS_ERROR_IO;
+		}
+
+		ne_close_connection (context->session);
+		ne_request_destroy (req);
+		return result;
+	}
+
+	result = GNOME_VFS_OK;
+
+	while (range->filled < range->len) {
+		n = ne_read_response_block (req, (char *) range->data + range->filled,
+					    range->len - range->filled);
+
+		if (n <= 0) {
+			result = GNOME_VFS_ERROR_IO;
+			break;
+		}
+
+		g_mutex_lock (reader->lock);
+
+		range->filled += n;
+		g_cond_broadcast (reader->cond);
+
+		if (reader->cancelled) {
+			result = GNOME_VFS_ERROR_CANCELLED;
+		}
+
+		g_mutex_unlock (reader->lock);
+
+		if (result != GNOME_VFS_OK) {
+			break;
+		}
+	}
+
+	if (result == GNOME_VFS_OK &&
+	    ne_read_response_block (req, &extra, 1) == 0) {
+		ne_end_request (req);
+	} else {
+		if (result == GNOME_VFS_OK) {
+			/* more than we asked for */
+			result = GNOME_VFS_ERROR_IO;
+		}
+
+		ne_close_connection (context->session);
+	}
+
+	ne_request_destroy (req);
+	return result;
+}
+
+static gpointer
+http_range_reader_thread (gpointer data)
+{
+	HttpRangeReader *reader;
+	HttpContext     *context;
+	HttpRange       *range;
+	GnomeVFSResult   open_result, result;
+
+	reader = data;
+
+	/* every thread brings its own session */
+	context = NULL;
+	open_result = http_context_open (reader->uri, &context);
+
+	g_mutex_lock (reader->lock);
+
+	for (;;) {
+		while (! reader->cancelled && ! reader->failed &&
+		       reader->next_start < reader->size &&
+		       g_queue_get_length (reader->ranges) >= reader->max_ranges) {
+			g_cond_wait (reader->cond, reader->lock);
+		}
+
+		if (reader->cancelled || reader->failed ||
+		    reader->next_start >= reader->size) {
+			break;
+		}
+
+		range = g_new0 (HttpRange, 1);
+		range->start = reader->next_start;
+		range->len = MIN (HTTP_RANGE_SIZE, reader->size - range->start);
+		range->data = g_malloc (range->len);
+
+		reader->next_start += range->len;
+		g_queue_push_tail (reader->ranges, range);
+
+		g_mutex_unlock (reader->lock);
+
+		if (open_result == GNOME_VFS_OK) {
+			result = http_range_fetch (reader, context, range);
+		} else {
+			result = open_result;
+		}
+
+		g_mutex_lock (reader->lock);
+
+		range->done = TRUE;
+		range->result = result;
+
+		if (result != GNOME_VFS_OK) {
+			reader->failed = TRUE;
+		}
+
+		g_cond_broadcast (reader->cond);
+	}
+
+	g_mutex_unlock (reader->lock);
+
+	if (context != NULL) {
+		http_context_free (context);
+	}
+
+	return NULL;
+}
+
+static void
+http_range_reader_free (HttpRangeReader *reader)
+{
+	HttpRange *range;
+	guint i;
+
+	g_mutex_lock (reader->lock);
+	reader->cancelled = TRUE;
+	g_cond_broadcast (reader->cond);
+	g_mutex_unlock (reader->lock);
+
+	for (i = 0; i < reader->n_threads; i++) {
+		g_thread_join (reader->threads[i]);
+	}
+
+	while ((range = g_queue_pop_head (reader->ranges)) != NULL) {
+		g_free (range->data);
+		g_free (range);
+	}
+
+	g_queue_free (reader->ranges);
+	g_mutex_free (reader->lock);
+	g_cond_free (reader->cond);
+	gnome_vfs_uri_unref (reader->uri);
+	g_free (reader->etag);
+	g_free (reader->last_modified);
+	g_free (reader->threads);
+	g_free (reader);
+}
+
+static HttpRangeReader *
+http_range_reader_new (HttpContext        *context,
+		       GnomeVFSFileOffset  start,
+		       GnomeVFSFileSize    size,
+		       const char         *etag,
+		       const char         *last_modified)
+{
+	HttpRangeReader *reader;
+	GThread *thread;
+	guint i;
+
+	reader = g_new0 (HttpRangeReader, 1);
+	reader->uri = gnome_vfs_uri_ref (context->uri);
+	reader->size = size;
+	reader->next_start = start;
+
+	/* If-Match wants a strong ETag */
+	if (etag != NULL && ! g_str_has_prefix (etag, "W/")) {
+		reader->etag = g_strdup (etag);
+	} else {
+		reader->last_modified = g_strdup (last_modified);
+	}
+
+	reader->lock = g_mutex_new ();
+	reader->cond = g_cond_new ();
+	reader->ranges = g_queue_new ();
+	reader->max_ranges = parallel_ranges * HTTP_RANGES_AHEAD;
+	reader->threads = g_new0 (GThread *, parallel_ranges);
+
+	for (i = 0; i < parallel_ranges; i++) {
+		thread = g_thread_create (http_range_reader_thread, reader,
+					  TRUE, NULL);
+
+		if (thread == NULL) {
+			break;
+		}
+
+		reader->threads[reader->n_threads++] = thread;
+	}
+
+	if (reader->n_threads == 0) {
+		http_range_reader_free (reader);
+		return NULL;
+	}
+
+	return reader;
+}
+
+static GnomeVFSResult
+http_range_reader_read (HttpRangeReader    *reader,
+			GnomeVFSFileOffset  offset,
+			gpointer            buffer,
+			GnomeVFSFileSize    num_bytes,
+			GnomeVFSFileSize   *bytes_read)
+{
+	GnomeVFSResult    result;
+	HttpRange        *range;
+	GnomeVFSFileSize  skip;
+
+	*bytes_read = 0;
+
+	g_mutex_lock (reader->lock);
+
+	for (;;) {
+		range = g_queue_peek_head (reader->ranges);
+
+		if (range == NULL) {
+			if (offset >= reader->size) {
+				result = GNOME_VFS_ERROR_EOF;
+				break;
+			}
+		} else if (offset >= range->start + range->len) {
+			/* done with it, make room for the next one */
+			g_queue_pop_head (reader->ranges);
+			g_free (range->data);
+			g_free (range);
+			g_cond_broadcast (reader->cond);
+			continue;
+		} else {
+			skip = offset - range->start;
+
+			if (range->filled > skip) {
+				*bytes_read = MIN (range->filled - skip, num_bytes);
+				memcpy (buffer, range->data + skip, *bytes_read);
+				result = GNOME_VFS_OK;
+				break;
+			} else if (range->done) {
+				result = range->result;
+				break;
+			}
+		}
+
+		g_cond_wait (reader->cond, reader->lock);
+	}
+
+	g_mutex_unlock (reader->lock);
+
+	return result;
+}
+
 static void
 http_transfer_abort (HttpFileHandle *handle)
 {
 	
 	if (handle->transfer_state == TRANSFER_READ) {
+
+		if (handle->cache_fill != NULL) {
+			http_cache_fill_abandon (handle->cache_fill);
+			handle->cache_fill = NULL;
+		}
 	
-		ne_end_request (handle->transfer.read);
+		if (handle->ranges != NULL) {
+			http_range_reader_free (handle->ranges);
+			handle->ranges = NULL;
+		} else {
+			ne_end_request (handle->transfer.read);
 		
-		/* We need a new connection :( */
-		ne_close_connection(handle->context->session);
-		ne_request_destroy (handle->transfer.read);
+			/* We need a new connection :( */
+			ne_close_connection(handle->context->session);
+			ne_request_destroy (handle->transfer.read);
+		}
 		
 		handle->transfer_state = TRANSFER_IDLE;
 		handle->transfer.read = NULL;
 		
 	} else if (handle->transfer_state == TRANSFER_WRITE) {
-		
-		g_byte_array_free (handle->transfer.write, TRUE);
+
+		if (handle->put_pipe != NULL) {
+			http_put_pipe_finish (handle->put_pipe, TRUE);
+			handle->put_pipe = NULL;
+		} else {
+			g_byte_array_free (handle->transfer.write, TRUE);
+		}
 	}
 }
 
@@ -2216,6 +3091,10 @@ http_file_handle_destroy (HttpFileHandle *handle)
 	if (handle->context) {
 		http_context_free (handle->context);
 	}
+
+	if (handle->cache_body != NULL) {
+		http_cache_body_unref (handle->cache_body);
+	}
 	
 	gnome_vfs_file_info_unref (handle->info);
 	
@@ -2260,22 +3139,162 @@ http_transfer_start_write (HttpFileHandle *handle)
 }
 
 
+/* Reads body instead of the network from now on; takes over the
+ * reference */
+static void
+http_transfer_use_cache (HttpFileHandle *handle, HttpCacheBody *body)
+{
+	gnome_vfs_file_info_clear (handle->info);
+	gnome_vfs_file_info_copy (handle->info, http_cache_body_get_info (body));
+
+	handle->cache_body = body;
+	handle->can_range = TRUE;
+}
+
+static gboolean
+http_parse_content_range (ne_request       *req,
+			  GnomeVFSFileSize *first,
+			  GnomeVFSFileSize *last,
+			  GnomeVFSFileSize *total)
+{
+	const char *value;
+
+	value = ne_get_response_header (req, "Content-Range");
+
+	return value != NULL &&
+		sscanf (value, "bytes %" GNOME_VFS_SIZE_FORMAT_STR
+			"-%" GNOME_VFS_SIZE_FORMAT_STR
+			"/%" GNOME_VFS_SIZE_FORMAT_STR, first, last, total) == 3;
+}
+
+/* Whether a 206 answer to "Range: bytes=0-" holds the whole entity */
+static gboolean
+http_range_is_whole (ne_request *req)
+{
+	GnomeVFSFileSize first, last, total;
+
+	return http_parse_content_range (req, &first, &last, &total) &&
+		first == 0 && last + 1 == total;
+}
+
+/* Switches to fetching the rest of a big resource over several
+ * connections if the server takes ranges */
+static gboolean
+http_transfer_start_ranges (HttpFileHandle *handle, ne_request *req)
+{
+	const ne_status  *status;
+	const char       *value;
+	GnomeVFSFileSize  first, last, total;
+	gulong            length;
+
+	/* use_range is off for servers known to mess ranges up */
+	if (parallel_ranges < 2 || ! handle->use_range) {
+		return FALSE;
+	}
+
+	status = ne_get_status (req);
+
+	if (status->code == 206) {
+		if (! http_parse_content_range (req, &first, &last, &total) ||
+		    first != handle->offset) {
+			return FALSE;
+		}
+	} else {
+		value = ne_get_response_header (req, "Accept-Ranges");
+
+		if (status->code != 200 || handle->offset != 0 ||
+		    value == NULL || g_ascii_strcasecmp (value, "bytes") != 0 ||
+		    ! header_value_to_number (ne_get_response_header (req, "Content-Length"),
+					      &length)) {
+			return FALSE;
+		}
+
+		total = length;
+	}
+
+	if (total < handle->offset + HTTP_RANGES_THRESHOLD) {
+		return FALSE;
+	}
+
+	DEBUG_HTTP ("[GET] %" GNOME_VFS_SIZE_FORMAT_STR " bytes over %d connections",
+		    total - handle->offset, parallel_ranges);
+
+	handle->ranges = http_range_reader_new (handle->context, handle->offset, total,
+						ne_get_response_header (req, "ETag"),
+						ne_get_response_header (req, "Last-Modified"));
+
+	return handle->ranges != NULL;
+}
+
+/* Starts copying the body of a GET into the cache if it is the whole
+ * entity and the server lets us keep it */
+static void
+http_transfer_start_fill (HttpFileHandle *handle, ne_request *req)
+{
+	const ne_status *status;
+	glong lifetime;
+	char *key;
+
+	status = ne_get_status (req);
+
+	if (handle->offset != 0 ||
+	    (status->code != 200 &&
+	     (status->code != 206 || ! http_range_is_whole (req)))) {
+		return;
+	}
+
+	lifetime = http_response_lifetime (req, http_heuristic_lifetime (req));
+	key = http_context_cache_key (handle->context, FALSE);
+
+	handle->cache_fill = http_cache_fill_new (key, handle->info,
+						  ne_get_response_header (req, "ETag"),
+						  ne_get_response_header (req, "Last-Modified"),
+						  lifetime);
+	g_free (key);
+}
+
 static GnomeVFSResult
 http_transfer_start_read (HttpFileHandle *handle)
 {
 	GnomeVFSResult result;
 	HttpContext *hctx;
+	HttpCacheBody *cached;
 	ne_request  *req;
 	int 	     res;
 	const ne_status *status;
+	gboolean     fresh;
+	char        *key;
 	
-	if (handle->transfer_state == TRANSFER_READ)
+	if (handle->transfer_state == TRANSFER_READ || handle->cache_body != NULL)
 		return GNOME_VFS_OK;
 	
 	hctx = handle->context;
+
+	key = http_context_cache_key (hctx, FALSE);
+	cached = http_cache_lookup_body (key, &fresh);
+	g_free (key);
+
+	if (cached != NULL && fresh) {
+		DEBUG_HTTP ("[GET] fresh in cache");
+		http_transfer_use_cache (handle, cached);
+		return GNOME_VFS_OK;
+	}
 	
 get_start:	
 	req = ne_request_create (hctx->session, "GET", hctx->path);
+
+	if (cached != NULL) {
+		/* stale, ask whether it is still good */
+		if (http_cache_body_get_etag (cached) != NULL) {
+			ne_add_request_header (req, "If-None-Match",
+					       http_cache_body_get_etag (cached));
+		}
+		
+		if (http_cache_body_get_last_modified (cached) != NULL) {
+			ne_add_request_header (req, "If-Modified-Since",
+					       http_cache_body_get_last_modified (cached));
+		}
+	}
 	
 	if (handle->use_range) {
 		
@@ -2295,12 +3314,26 @@ get_retry:
 	status = ne_get_status (req);
 	
 	DEBUG_HTTP ("[GET] %s, %d, %d", gnome_vfs_result_to_string (result), res, status->code);
+
+	if (res == NE_OK && status->code == 304 && cached != NULL) {
+		/* Not modified, so what we have is good */
+		ne_discard_response (req);
+		ne_end_request (req);
+
+		key = http_context_cache_key (hctx, FALSE);
+		http_cache_body_refresh (key, cached, http_response_lifetime (req, 0));
+		g_free (key);
+		ne_request_destroy (req);
+
+		http_transfer_use_cache (handle, cached);
+		return GNOME_VFS_OK;
+	}
 	
 	if (res != NE_OK && res != NE_REDIRECT) {
 		handle->transfer_state = TRANSFER_ERROR;
 		handle->last_error = result;
 		ne_request_destroy (req);
-		return result;
+		goto out;
 	}
 	
 	if (IS_REDIRECT (status->code) || IS_AUTH_REQ (status->code)) {
@@ -2312,7 +3345,7 @@ get_retry:
 			result = GNOME_VFS_ERROR_IO;
 			handle->last_error = result;
 			ne_request_destroy (req);
-			return result;
+			goto out;
 		}
 		
 		res = ne_end_request (req);
@@ -2325,6 +3358,12 @@ get_retry:
 		req = NULL;
 		
 		if (res == NE_REDIRECT) {
+			/* the validators are for the old location */
+			if (cached != NULL) {
+				http_cache_body_unref (cached);
+				cached = NULL;
+			}
+
 			result = http_follow_redirect (hctx);
 	
 			if (result == GNOME_VFS_OK)
@@ -2341,6 +3380,8 @@ get_retry:
 			DEBUG_HTTP ("[GET] {ranged} disabled");
 			handle->can_range = FALSE;
 		}
+
+		http_transfer_start_fill (handle, req);
 	
 		/* If we are in a GET we invoke the callback of received headers 
 		   right before reading the data because we might be in a 
@@ -2349,9 +3390,23 @@ get_retry:
 		neon_return_headers (req, NULL, status);
 
 		handle->transfer_state = TRANSFER_READ;
-		handle->transfer.read = req;
+
+		if (http_transfer_start_ranges (handle, req)) {
+			/* we only needed the headers */
+			ne_end_request (req);
+			ne_close_connection (hctx->session);
+			ne_request_destroy (req);
+			handle->transfer.read = NULL;
+		} else {
+			handle->transfer.read = req;
+		}
 	} 
 
+ out:
+	if (cached != NULL) {
+		http_cache_body_unref (cached);
+	}
+
 	return result;
 }
 
@@ -2521,6 +3576,8 @@ put_start:
 
 	result 	= resolve_result (res, req);
 	ne_request_destroy (req);
+
+	http_context_invalidate_cache (hctx);
 	
 	if (result == GNOME_VFS_OK && mode != GNOME_VFS_OPEN_NONE) {
 
@@ -2562,8 +3619,12 @@ do_close (GnomeVFSMethod 	*method,
 	ctx = handle->context;
 	result = GNOME_VFS_OK;
 	
-	if (handle->transfer_state == TRANSFER_WRITE &&
-	    handle->transfer.write->len != 0) {
+	if (handle->put_pipe != NULL) {
+		result = http_put_pipe_finish (handle->put_pipe, FALSE);
+		handle->put_pipe = NULL;
+		handle->transfer_state = TRANSFER_IDLE;
+	} else if (handle->transfer_state == TRANSFER_WRITE &&
+		   handle->transfer.write->len != 0) {
 		ne_request    		*req;
 		guint8			*data;
 		guint			 len;
@@ -2584,7 +3645,10 @@ do_close (GnomeVFSMethod 	*method,
 				gnome_vfs_result_to_string (result));
 		ne_request_destroy (req);
 	}
-	
+
+	if (handle->mode & GNOME_VFS_OPEN_WRITE) {
+		http_context_invalidate_cache (ctx);
+	}
 	
 	http_file_handle_destroy (handle);
 	DEBUG_HTTP_FUNC (0);
@@ -2615,28 +3679,64 @@ do_read (GnomeVFSMethod 	*method,
 		return handle->last_error;
 	}
 	
-	if (handle->transfer_state == TRANSFER_IDLE) {
+	if (handle->transfer_state == TRANSFER_IDLE && handle->cache_body == NULL) {
 		result = http_transfer_start (handle);
 		
 		if (result != GNOME_VFS_OK)
 			return result;
 	}
+
+	if (handle->cache_body != NULL) {
+		result = http_cache_body_read (handle->cache_body, handle->offset,
+					       buffer, num_bytes, bytes_read);
+		
+		if (result == GNOME_VFS_OK) {
+			handle->offset += *bytes_read;
+		}
+		
+		return result;
+	}
 	
-	n = ne_read_response_block (handle->transfer.read, buffer, num_bytes);
+	if (handle->ranges != NULL) {
+		result = http_range_reader_read (handle->ranges, handle->offset,
+						 buffer, num_bytes, bytes_read);
+		n = result == GNOME_VFS_OK ? (ssize_t) *bytes_read :
+			result == GNOME_VFS_ERROR_EOF ? 0 : -1;
+	} else {
+		n = ne_read_response_block (handle->transfer.read, buffer, num_bytes);
+	}
 
 	if (n < 1) {
+
+		if (handle->cache_fill != NULL) {
+			if (n == 0) {
+				http_cache_fill_commit (handle->cache_fill);
+			} else {
+				http_cache_fill_abandon (handle->cache_fill);
+			}
+			handle->cache_fill = NULL;
+		}
 				
 		if (n == 0) {
-			ne_end_request (handle->transfer.read);
+			if (handle->transfer.read != NULL) {
+				ne_end_request (handle->transfer.read);
+			}
 			
 			result = GNOME_VFS_ERROR_EOF;
 			handle->transfer_state = TRANSFER_IDLE;
 		} else {
-			result = GNOME_VFS_ERROR_IO;
+			if (result == GNOME_VFS_OK) {
+				result = GNOME_VFS_ERROR_IO;
+			}
 			handle->transfer_state = TRANSFER_ERROR;
 		}
-		
-		ne_request_destroy (handle->transfer.read);
+
+		if (handle->ranges != NULL) {
+			http_range_reader_free (handle->ranges);
+			handle->ranges = NULL;
+		} else {
+			ne_request_destroy (handle->transfer.read);
+		}
 		handle->transfer.read = NULL;
 		handle->last_error = result;
 		handle->offset = 0;
@@ -2652,6 +3752,12 @@ do_read (GnomeVFSMethod 	*method,
 	/* cast is valid because n must be greater than 0 */
 	*bytes_read = n;
 
+	if (handle->cache_fill != NULL &&
+	    ! http_cache_fill_append (handle->cache_fill, buffer, n)) {
+		http_cache_fill_abandon (handle->cache_fill);
+		handle->cache_fill = NULL;
+	}
+
 	DEBUG_HTTP ("[read] bytes read %" GNOME_VFS_SIZE_FORMAT_STR,
 	            *bytes_read);
 
@@ -2669,6 +3775,7 @@ do_write (GnomeVFSMethod 	*method,
 	  GnomeVFSContext 	*context)
 {
 	HttpFileHandle *handle;
+	GnomeVFSResult  result;
 	GByteArray     *ba;
 	const guint8   *pos;
 	gint		over_len;
@@ -2685,6 +3792,32 @@ do_write (GnomeVFSMethod 	*method,
 		return GNOME_VFS_OK;
 	
 	ba = handle->transfer.write;
+
+	/* Only an upload written front to back can be streamed, and
+	 * only HTTP/1.1 knows chunked request bodies */
+	if (handle->put_pipe == NULL &&
+	    !(handle->mode & GNOME_VFS_OPEN_RANDOM) &&
+	    handle->offset == ba->len &&
+	    ba->len + num_bytes > HTTP_PUT_STREAM_THRESHOLD &&
+	    !ne_version_pre_http11 (handle->context->session)) {
+		http_put_pipe_start (handle);
+	}
+
+	if (handle->put_pipe != NULL) {
+		GnomeVFSFileSize written;
+
+		if (handle->offset != handle->put_pipe->length)
+			return GNOME_VFS_ERROR_NOT_SUPPORTED;
+
+		result = http_put_pipe_write (handle->put_pipe, buffer, num_bytes,
+					      &written, context);
+		handle->offset += written;
+		
+		if (bytes_written != NULL)
+			*bytes_written = written;
+
+		return result;
+	}
 	
 	while (ba->len < handle->offset) {
 		guint8 null = 0;
@@ -2870,6 +4003,10 @@ do_open_directory (GnomeVFSMethod 	    *method,
 	pfctx = g_new0 (PropfindContext, 1);
 	
 	result = http_list_directory (hctx, pfctx);
+
+	if (result == GNOME_VFS_OK) {
+		http_cache_listing (hctx, pfctx);
+	}
 	
 	http_context_free (hctx);
 	
@@ -2977,7 +4114,10 @@ do_get_file_info_from_handle (GnomeVFSMethod 		*method,
 	
 	handle = (HttpFileHandle *) method_handle;
 	
-	if (handle->transfer_state == TRANSFER_READ) {
+	/* the session is busy with the upload, or the body came from the
+	 * cache along with its info */
+	if (handle->transfer_state == TRANSFER_READ || handle->put_pipe != NULL ||
+	    handle->cache_body != NULL) {
 		gnome_vfs_file_info_copy (file_info, handle->info);
 		return GNOME_VFS_OK;
 	}
@@ -3061,6 +4201,7 @@ do_make_directory (GnomeVFSMethod  *method,
 	}
 	
 	ne_request_destroy (req);
+	http_context_invalidate_cache (hctx);
 	
  out:	
 	gnome_vfs_uri_unref (uri_parent);
@@ -3114,6 +4255,7 @@ do_remove_directory (GnomeVFSMethod  *method,
 	
 	result = resolve_result (res, req);
 	ne_request_destroy (req);
+	http_context_invalidate_cache (hctx);
 	
  out:	
 	propfind_context_clear (&pfctx);
@@ -3190,7 +4332,10 @@ do_move (GnomeVFSMethod  *method,
 	}
 
 	ne_request_destroy (req);
+	http_context_invalidate_cache (hctx);
 	http_context_free (hctx);
+
+	http_uri_invalidate_cache (new_uri);
 	
 	DEBUG_HTTP_FUNC (0);
 	return result;
@@ -3230,6 +4375,7 @@ do_unlink (GnomeVFSMethod  *method,
 
 	result = resolve_result (res, req);
 	ne_request_destroy (req);
+	http_context_invalidate_cache (hctx);
 	
  out:	
 	http_context_free (hctx);
@@ -3378,12 +4524,20 @@ static GnomeVFSMethod http_method = {
 GnomeVFSMethod *
 vfs_module_init (const char *method_name, const char *args)
 {
+	const char *ranges;
+
 	if (module_refcount++ == 0) {
 		proxy_init ();
 		/* ne_debug_init (stdout, 0xfffe); */
 		neon_session_pool_init ();
 		http_auth_cache_init ();
 		quick_allow_lookup_init ();
+		http_cache_init ();
+
+		ranges = getenv (PARALLEL_RANGES_VARIABLE);
+		if (ranges != NULL) {
+			parallel_ranges = strtoul (ranges, NULL, 10);
+		}
 	}
 
 	return &http_method;
@@ -3393,6 +4547,7 @@ void
 vfs_module_shutdown (GnomeVFSMethod *method)
 {
 	if (--module_refcount == 0) {
+		http_cache_shutdown ();
 		quit_allow_lookup_destroy ();
 		http_auth_cache_shutdown ();
 		neon_session_pool_shutdown ();
@@ -77,11 +77,23 @@
 static size_t default_req_len = 32*1024;
 static guint max_req = 8;
 
+/* Seconds attributes from directory listings are trusted for, see
+ * sftp_connection_lookup_info () */
+static guint info_cache_ttl = 5;
+
 #ifdef HAVE_GRANTPT
 /* We only use this on systems with unix98 ptys */
 #define USE_PTY 1
 #endif
 
+typedef struct
+{
+	char  *base;
+	char  *read_ptr;
+	char  *write_ptr;
+	gint     alloc;
+} Buffer;
+
 typedef struct {
 	gchar         *hash_name;
 	gint           in_fd;
@@ -90,18 +102,43 @@ typedef struct {
 	GIOChannel    *error_channel;
 	pid_t          ssh_pid;
 
-	guint          msg_id;
+	volatile gint  msg_id;
 	guint          version;
 
 	guint          ref_count;
 	guint          close_timeout_id;
 
+	/* Protects ref_count, close_timeout_id and the reply table.
+	 * Requests are not serialized; any number of them can be in
+	 * flight, and reader_thread hands out the replies by id.
+	 */
 	GMutex        *mutex;
+	/* Held while a message is written to out_fd */
+	GMutex        *send_mutex;
+
+	GThread       *reader_thread;
+	/* message id -> SftpReply */
+	GHashTable    *replies;
+	GCond         *reply_cond;
+	/* Set by reader_thread when it stops reading */
+	GnomeVFSResult reader_result;
+
+	/* path -> SftpCachedInfo; protected by mutex */
+	GHashTable    *info_cache;
 
 	guint          event_id;
 	GnomeVFSResult status;
 } SftpConnection;
 
+/* Flow estimate for a pipeline of requests, see sftp_window_update () */
+typedef struct
+{
+	guint                 size;
+	guint64               delivered;
+	gdouble               max_rate;
+	gint64                min_rtt;
+} SftpWindow;
+
 typedef struct 
 {
 	GnomeVFSMethodHandle  method_handle;
@@ -115,6 +152,20 @@ typedef struct
 	guint                 info_write_ptr;
 	char                 *path;
 	GnomeVFSFileInfoOptions dir_options; 
+
+	/* Read-ahead, see do_read () */
+	GQueue               *read_requests;
+	guint64               read_request_offset;
+	Buffer                read_msg;
+	guint                 read_msg_left;
+	gboolean              read_eof;
+	gboolean              read_sequential;
+	SftpWindow            read_window;
+
+	/* Write-behind, see do_write () */
+	GQueue               *write_requests;
+	GnomeVFSResult        write_error;
+	SftpWindow            write_window;
 } SftpOpenHandle;
 
 static GHashTable *sftp_connection_table = NULL;
@@ -125,6 +176,10 @@ G_LOCK_DEFINE_STATIC (sftp_connection_table);
 #define SFTP_OPEN_HANDLE(p) ((SftpOpenHandle *) (p))
 
 #define SFTP_CLOSE_TIMEOUT (10 * 60 * 1000)      /* Ten minutes */
+#define WINDOW_MAX_REQUESTS 64                   /* 2 MB with the default request size */
+#define WINDOW_GAIN 2
+#define INFO_CACHE_TTL_VARIABLE "GNOME_VFS_SFTP_INFO_CACHE_TTL"
+#define INFO_CACHE_MAX_ENTRIES 8192
 #define INIT_DIR_INFO_ALLOC 16
 #define INIT_BUFFER_ALLOC   128
 
@@ -174,19 +229,13 @@ static GnomeVFSResult do_get_file_info_from_handle (GnomeVFSMethod          *met
 						    GnomeVFSContext         *context);
 
 static void sftp_connection_ref (SftpConnection *connection);
+static void sftp_connection_lock (SftpConnection *connection);
+static void sftp_connection_unlock (SftpConnection *connection);
 
 static gboolean sftp_connection_process_errors (GIOChannel *channel,
 						GIOCondition cond,
 						GnomeVFSResult *status);
 
-typedef struct
-{
-	char  *base;
-	char  *read_ptr;
-	char  *write_ptr;
-	gint     alloc;
-} Buffer;
-
 /* Inspired by atomicio() from OpenSSH */
 
 typedef ssize_t (*read_write_fn) (int, void *, size_t);
@@ -670,17 +719,361 @@ sftp_status_to_vfs_result (guint status)
 	}
 }
 
+/* Request/reply dispatching.
+ *
+ * Every thread sends its requests itself, under send_mutex so messages
+ * don't interleave. Only the connection's reader thread reads from
+ * in_fd; it files each reply under its message id, where the thread
+ * that sent the request picks it up with sftp_connection_recv().
+ */
+
+typedef struct {
+	Buffer   msg;
+	/* reply arrived (otherwise, someone is waiting for it) */
+	gboolean done;
+	/* nobody will pick it up, drop it on arrival */
+	gboolean abandoned;
+} SftpReply;
+
+static void
+sftp_reply_free (SftpReply *reply)
+{
+	if (reply->done)
+		buffer_free (&reply->msg);
+	g_free (reply);
+}
+
+static gpointer
+sftp_connection_reader (gpointer data)
+{
+	SftpConnection *conn;
+	SftpReply *reply;
+	GnomeVFSResult res;
+	Buffer msg;
+	char *start;
+	guint id;
+
+	conn = SFTP_CONNECTION (data);
+
+	while (1) {
+		buffer_init (&msg);
+		res = buffer_recv (&msg, conn->in_fd);
+
+		if (res != GNOME_VFS_OK) {
+			buffer_free (&msg);
+			break;
+		}
+
+		if (msg.write_ptr - msg.read_ptr < 5) {
+			g_warning ("Short message from server (%d bytes)",
+				   (int) (msg.write_ptr - msg.read_ptr));
+			buffer_free (&msg);
+			continue;
+		}
+
+		/* leave the message as buffer_recv() would have */
+		start = msg.read_ptr;
+		buffer_read_gchar (&msg);
+		id = buffer_read_gint32 (&msg);
+		msg.read_ptr = start;
+
+		DEBUG2 (g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, "%s: Reply to %u", G_STRFUNC, id));
+
+		g_mutex_lock (conn->mutex);
+
+		reply = g_hash_table_lookup (conn->replies, GUINT_TO_POINTER (id));
+		if (reply != NULL && reply->abandoned) {
+			g_hash_table_remove (conn->replies, GUINT_TO_POINTER (id));
+			g_free (reply);
+			buffer_free (&msg);
+		} else if (reply != NULL && reply->done) {
+			g_warning ("Duplicate reply to message %u", id);
+			buffer_free (&msg);
+		} else {
+			if (reply == NULL) {
+				reply = g_new0 (SftpReply, 1);
+				g_hash_table_insert (conn->replies, GUINT_TO_POINTER (id), reply);
+			}
+			reply->msg = msg;
+			reply->done = TRUE;
+			g_cond_broadcast (conn->reply_cond);
+		}
+
+		g_mutex_unlock (conn->mutex);
+	}
+
+	DEBUG (g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, "%s: Connection %p closed: %d",
+		      G_STRFUNC, conn, res));
+
+	g_mutex_lock (conn->mutex);
+	conn->reader_result = res;
+	g_cond_broadcast (conn->reply_cond);
+	g_mutex_unlock (conn->mutex);
+
+	return NULL;
+}
+
+static gboolean
+sftp_connection_start_reader (SftpConnection *conn)
+{
+	GError *error = NULL;
+
+	conn->replies = g_hash_table_new_full (NULL, NULL, NULL,
+					       (GDestroyNotify) sftp_reply_free);
+	conn->reply_cond = g_cond_new ();
+	conn->send_mutex = g_mutex_new ();
+	conn->reader_result = GNOME_VFS_OK;
+
+	conn->reader_thread = g_thread_create (sftp_connection_reader, conn, TRUE, &error);
+	if (conn->reader_thread == NULL) {
+		g_warning ("Could not start SFTP reader thread: %s", error->message);
+		g_error_free (error);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static GnomeVFSResult
+sftp_connection_send (SftpConnection *conn, Buffer *msg)
+{
+	GnomeVFSResult res;
+
+	g_mutex_lock (conn->send_mutex);
+	res = buffer_send (msg, conn->out_fd);
+	g_mutex_unlock (conn->send_mutex);
+
+	return res;
+}
+
+/* Waits for the reply to message id and puts it into buf, replacing
+ * whatever buf held. */
+static GnomeVFSResult
+sftp_connection_recv (SftpConnection *conn, Buffer *buf, guint id)
+{
+	SftpReply *reply;
+	GnomeVFSResult res;
+
+	g_mutex_lock (conn->mutex);
+
+	reply = g_hash_table_lookup (conn->replies, GUINT_TO_POINTER (id));
+	if (reply == NULL) {
+		reply = g_new0 (SftpReply, 1);
+		g_hash_table_insert (conn->replies, GUINT_TO_POINTER (id), reply);
+	}
+
+	while (!reply->done && conn->reader_result == GNOME_VFS_OK)
+		g_cond_wait (conn->reply_cond, conn->mutex);
+
+	if (reply->done) {
+		buffer_free (buf);
+		*buf = reply->msg;
+		reply->done = FALSE;
+		res = GNOME_VFS_OK;
+	} else {
+		res = conn->reader_result;
+	}
+	g_hash_table_remove (conn->replies, GUINT_TO_POINTER (id));
+
+	g_mutex_unlock (conn->mutex);
+
+	return res;
+}
+
+/* For requests whose reply won't be waited for */
+static void
+sftp_connection_forget_reply (SftpConnection *conn, guint id)
+{
+	SftpReply *reply;
+
+	g_mutex_lock (conn->mutex);
+
+	reply = g_hash_table_lookup (conn->replies, GUINT_TO_POINTER (id));
+	if (reply != NULL && reply->done) {
+		g_hash_table_remove (conn->replies, GUINT_TO_POINTER (id));
+	} else if (conn->reader_result == GNOME_VFS_OK) {
+		if (reply == NULL) {
+			reply = g_new0 (SftpReply, 1);
+			g_hash_table_insert (conn->replies, GUINT_TO_POINTER (id), reply);
+		}
+		reply->abandoned = TRUE;
+	}
+
+	g_mutex_unlock (conn->mutex);
+}
+
+/* Whether sftp_connection_recv () would return without waiting */
+static gboolean
+sftp_connection_reply_ready (SftpConnection *conn, guint id)
+{
+	SftpReply *reply;
+	gboolean ready;
+
+	g_mutex_lock (conn->mutex);
+
+	reply = g_hash_table_lookup (conn->replies, GUINT_TO_POINTER (id));
+	ready = (reply != NULL && reply->done) || conn->reader_result != GNOME_VFS_OK;
+
+	g_mutex_unlock (conn->mutex);
+
+	return ready;
+}
+
+/* Attribute cache.
+ *
+ * READDIR hands us the attributes of every entry anyway, and callers
+ * listing a directory tend to stat each entry right after. Those stats
+ * are answered from what the listing said, for info_cache_ttl seconds
+ * or until we change the file ourselves. Symlinks are left out since
+ * they need a READLINK round trip regardless.
+ */
+
+typedef struct {
+	GnomeVFSFileInfo *info;
+	glong             expires;
+} SftpCachedInfo;
+
+static void
+sftp_cached_info_free (SftpCachedInfo *cached)
+{
+	gnome_vfs_file_info_unref (cached->info);
+	g_free (cached);
+}
+
+static gboolean
+sftp_cached_info_expired (gpointer key, gpointer value, gpointer user_data)
+{
+	SftpCachedInfo *cached = value;
+	GTimeVal *now = user_data;
+
+	return cached->expires <= now->tv_sec;
+}
+
+/* Remembers the attributes the server sent for path, before the name
+ * and MIME type are filled in */
+static void
+sftp_connection_cache_info (SftpConnection *conn, const char *path, const GnomeVFSFileInfo *info)
+{
+	SftpCachedInfo *cached;
+	GTimeVal now;
+
+	if (info_cache_ttl == 0 ||
+	    (info->valid_fields & GNOME_VFS_FILE_INFO_FIELDS_TYPE) == 0 ||
+	    info->type == GNOME_VFS_FILE_TYPE_SYMBOLIC_LINK)
+		return;
+
+	g_get_current_time (&now);
+
+	cached = g_new (SftpCachedInfo, 1);
+	cached->info = gnome_vfs_file_info_dup (info);
+	cached->expires = now.tv_sec + info_cache_ttl;
+
+	g_free (cached->info->name);
+	cached->info->name = NULL;
+	g_free (cached->info->mime_type);
+	cached->info->mime_type = NULL;
+	g_free (cached->info->symlink_name);
+	cached->info->symlink_name = NULL;
+	cached->info->valid_fields &= ~(GNOME_VFS_FILE_INFO_FIELDS_MIME_TYPE |
+					GNOME_VFS_FILE_INFO_FIELDS_SYMLINK_NAME);
+
+	g_mutex_lock (conn->mutex);
+
+	if (g_hash_table_size (conn->info_cache) >= INFO_CACHE_MAX_ENTRIES) {
+		g_hash_table_foreach_remove (conn->info_cache, sftp_cached_info_expired, &now);
+		if (g_hash_table_size (conn->info_cache) >= INFO_CACHE_MAX_ENTRIES)
+			g_hash_table_remove_all (conn->info_cache);
+	}
+	g_hash_table_replace (conn->info_cache, g_strdup (path), cached);
+
+	g_mutex_unlock (conn->mutex);
+}
+
+/* Fills info from the cache if path is in it and hasn't expired */
+static gboolean
+sftp_connection_lookup_info (SftpConnection *conn, const char *path, GnomeVFSFileInfo *info)
+{
+	SftpCachedInfo *cached;
+	GTimeVal now;
+	gboolean found;
+
+	found = FALSE;
+	g_get_current_time (&now);
+
+	g_mutex_lock (conn->mutex);
+
+	cached = g_hash_table_lookup (conn->info_cache, path);
+	if (cached != NULL) {
+		if (cached->expires > now.tv_sec) {
+			gnome_vfs_file_info_clear (info);
+			gnome_vfs_file_info_copy (info, cached->info);
+			found = TRUE;
+		} else {
+			g_hash_table_remove (conn->info_cache, path);
+		}
+	}
+
+	g_mutex_unlock (conn->mutex);
+
+	return found;
+}
+
+typedef struct {
+	const char *path;
+	gsize       path_len;
+	char       *parent;
+} SftpForgetInfo;
+
+static gboolean
+sftp_cached_info_matches (gpointer key, gpointer value, gpointer user_data)
+{
+	SftpForgetInfo *forget = user_data;
+	const char *cached_path = key;
+
+	if (strcmp (cached_path, forget->parent) == 0)
+		return TRUE;
+
+	return strncmp (cached_path, forget->path, forget->path_len) == 0 &&
+		(cached_path[forget->path_len] == '\0' ||
+		 cached_path[forget->path_len] == '/');
+}
+
+/* Drops what is cached for path and anything below it, and for the
+ * directory containing it, whose size and times change along */
+static void
+sftp_connection_forget_info (SftpConnection *conn, const char *path)
+{
+	SftpForgetInfo forget;
+
+	forget.path = path;
+	forget.path_len = strlen (path);
+	/* a directory path may come with a trailing slash */
+	while (forget.path_len > 1 && path[forget.path_len - 1] == '/')
+		forget.path_len--;
+	forget.parent = g_path_get_dirname (path);
+
+	g_mutex_lock (conn->mutex);
+	g_hash_table_foreach_remove (conn->info_cache, sftp_cached_info_matches, &forget);
+	g_mutex_unlock (conn->mutex);
+
+	g_free (forget.parent);
+}
 
 /* Derived from OpenSSH, sftp-client.c:get_status */
 
 static GnomeVFSResult
-iobuf_read_result (int fd, guint expected_id)
+iobuf_read_result (SftpConnection *conn, guint expected_id)
 {
 	Buffer msg;
 	guint type, id, status;
+	GnomeVFSResult res;
 
 	buffer_init (&msg);
-	buffer_recv (&msg, fd);
+	res = sftp_connection_recv (conn, &msg, expected_id);
+	if (res != GNOME_VFS_OK) {
+		buffer_free (&msg);
+		return res;
+	}
 	type = buffer_read_gchar (&msg);
 	id = buffer_read_gint32 (&msg);
 
@@ -700,14 +1093,20 @@ iobuf_read_result (int fd, guint expected_id)
 /* Derived from OpenSSH, sftp-client.c:get_handle */
 
 static GnomeVFSResult
-iobuf_read_handle (int fd, gchar **handle, guint expected_id, guint32 *len)
+iobuf_read_handle (SftpConnection *conn, gchar **handle, guint expected_id, guint32 *len)
 {
 	Buffer msg;
 	gchar type;
 	guint id, status;
+	GnomeVFSResult res;
 
 	buffer_init (&msg);
-	buffer_recv (&msg, fd);
+	res = sftp_connection_recv (conn, &msg, expected_id);
+	if (res != GNOME_VFS_OK) {
+		*handle = NULL;
+		buffer_free (&msg);
+		return res;
+	}
 
 	type = buffer_read_gchar (&msg);
 	id = buffer_read_gint32 (&msg);
@@ -737,7 +1136,7 @@ iobuf_read_handle (int fd, gchar **handle, guint expected_id, guint32 *len)
 /* this neither includes the name nor the MIME type,
  * which are set in update_mime_type_and_name_from_path */
 static GnomeVFSResult
-iobuf_read_file_info (int fd, GnomeVFSFileInfo *info, guint expected_id)
+iobuf_read_file_info (SftpConnection *conn, GnomeVFSFileInfo *info, guint expected_id)
 {
 	Buffer msg;
 	gchar type;
@@ -745,7 +1144,11 @@ iobuf_read_file_info (int fd, GnomeVFSFileInfo *info, guint expected_id)
 	GnomeVFSResult res;
 
 	buffer_init (&msg);
-	buffer_recv (&msg, fd);
+	res = sftp_connection_recv (conn, &msg, expected_id);
+	if (res != GNOME_VFS_OK) {
+		buffer_free (&msg);
+		return res;
+	}
 
 	type = buffer_read_gchar (&msg);
 	id = buffer_read_gint32 (&msg);
@@ -776,7 +1179,7 @@ iobuf_read_file_info (int fd, GnomeVFSFileInfo *info, guint expected_id)
 /* Derived from OpenSSH, sftp-client.c:send_read_request */
 
 static GnomeVFSResult
-iobuf_send_read_request (int            fd,
+iobuf_send_read_request (SftpConnection *conn,
 			 guint          id,
 			 guint64        offset,
 			 guint          len,
@@ -793,7 +1196,7 @@ iobuf_send_read_request (int            fd,
 	buffer_write_block (&msg, handle, handle_len);
 	buffer_write_gint64 (&msg, offset);
 	buffer_write_gint32 (&msg, len);
-	res = buffer_send (&msg, fd);
+	res = sftp_connection_send (conn, &msg);
 
 	buffer_free (&msg);
 
@@ -803,7 +1206,7 @@ iobuf_send_read_request (int            fd,
 /* Derived from OpenSSH, sftp-client.c:send_string_request */
 
 static void
-iobuf_send_string_request (int            fd,
+iobuf_send_string_request (SftpConnection *conn,
 			   guint          id,
 			   guint          code,
 			   const char    *s,
@@ -816,7 +1219,7 @@ iobuf_send_string_request (int            fd,
 	buffer_write_gchar (&msg, code);
 	buffer_write_gint32 (&msg, id);
 	buffer_write_block (&msg, s, len);
-	buffer_send (&msg, fd);
+	sftp_connection_send (conn, &msg);
 
 	buffer_free (&msg);
 }
@@ -824,7 +1227,7 @@ iobuf_send_string_request (int            fd,
 /* Derived from OpenSSH, sftp-client.c:send_string_attrs_request */
 
 static void
-iobuf_send_string_request_with_file_info (int                      fd,
+iobuf_send_string_request_with_file_info (SftpConnection          *conn,
 					  guint                    id,
 					  guint                    code,
 					  const char              *s,
@@ -840,7 +1243,7 @@ iobuf_send_string_request_with_file_info (int                      fd,
 	buffer_write_gint32 (&msg, id);
 	buffer_write_block (&msg, s, len);
 	buffer_write_file_info (&msg, info, mask);
-	buffer_send (&msg, fd);
+	sftp_connection_send (conn, &msg);
 
 	buffer_free (&msg);
 }
@@ -1500,6 +1903,8 @@ tty_retry:
 		(*connection)->ssh_pid = ssh_pid;
 		(*connection)->version = buffer_read_gint32 (&msg);
 		(*connection)->mutex = g_mutex_new ();
+		(*connection)->info_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+								   (GDestroyNotify) sftp_cached_info_free);
 		(*connection)->msg_id = 1;
 		(*connection)->status = GNOME_VFS_OK;
 		(*connection)->event_id = g_io_add_watch ((*connection)->error_channel, G_IO_IN,
@@ -1509,6 +1914,18 @@ tty_retry:
 
 		DEBUG (g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, "Version is %d",
 			      (*connection)->version));
+
+		if (!sftp_connection_start_reader (*connection)) {
+			res = GNOME_VFS_ERROR_INTERNAL;
+			g_source_remove ((*connection)->event_id);
+			g_io_channel_unref ((*connection)->error_channel);
+			g_hash_table_destroy ((*connection)->replies);
+			g_cond_free ((*connection)->reply_cond);
+			g_mutex_free ((*connection)->send_mutex);
+			g_mutex_free ((*connection)->mutex);
+			g_hash_table_destroy ((*connection)->info_cache);
+			g_free (*connection);
+		}
 	}
 
  bail:
@@ -1588,7 +2005,6 @@ sftp_get_connection (SftpConnection **connection, const GnomeVFSURI *uri)
 				g_free (hash_name);
 				goto bail;
 			}
-			g_mutex_lock ((*connection)->mutex);
 			(*connection)->hash_name = hash_name;
 			g_hash_table_insert (sftp_connection_table, hash_name, *connection);
 		} else {
@@ -1608,14 +2024,12 @@ sftp_get_connection (SftpConnection **connection, const GnomeVFSURI *uri)
 	}
 #endif
 	else {
-		DEBUG (g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, "%s: Connection found. Locking",
+		DEBUG (g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, "%s: Connection found",
 			      G_STRFUNC));
 
-		g_mutex_lock ((*connection)->mutex);
-		sftp_connection_ref ((*connection));
-
-		DEBUG (g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, "%s: Lock acquired",
-			      G_STRFUNC));
+		sftp_connection_lock (*connection);
+		sftp_connection_ref (*connection);
+		sftp_connection_unlock (*connection);
 
 		g_free (hash_name);
 		res = GNOME_VFS_OK;
@@ -1632,14 +2046,23 @@ sftp_connection_close (SftpConnection *conn)
 {
 	DEBUG (g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, "Closing connection %p.", conn));
 
-	close (conn->in_fd);
+	/* The server goes away once its input is closed, which ends the
+	 * reader thread. */
 	close (conn->out_fd);
+	g_thread_join (conn->reader_thread);
+	close (conn->in_fd);
 	if (conn->tty_fd != -1)
 		close (conn->tty_fd);
 	g_source_remove (conn->event_id);
 	g_io_channel_shutdown (conn->error_channel, FALSE, NULL);
 	g_io_channel_unref (conn->error_channel);
 
+	g_hash_table_destroy (conn->replies);
+	g_cond_free (conn->reply_cond);
+	g_mutex_free (conn->send_mutex);
+	g_mutex_free (conn->mutex);
+	g_hash_table_destroy (conn->info_cache);
+
 	g_free (conn->hash_name);
 	g_free (conn);
 
@@ -1719,7 +2142,7 @@ sftp_connection_get_id (SftpConnection *conn)
 
 	g_return_val_if_fail (conn != NULL, 0);
 
-	id = conn->msg_id++;
+	id = g_atomic_int_exchange_and_add (&conn->msg_id, 1);
 	DEBUG (g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, "%s: Message id %d", G_STRFUNC, id));
 
 	return id;
@@ -1752,34 +2175,39 @@ sftp_connection_ref (SftpConnection *conn)
 static gboolean
 close_and_remove_connection (SftpConnection *conn)
 {
+	/* same order as sftp_get_connection() */
+	G_LOCK (sftp_connection_table);
 	sftp_connection_lock (conn);
 
 	conn->close_timeout_id = 0;
 
 	if (conn->ref_count != 0) {
 		sftp_connection_unlock (conn);
+		G_UNLOCK (sftp_connection_table);
 		return FALSE;
 	}
 
-	G_LOCK (sftp_connection_table);
 	g_hash_table_remove (sftp_connection_table, conn->hash_name);	
-	G_UNLOCK (sftp_connection_table);
 
 	sftp_connection_unlock (conn);
+	G_UNLOCK (sftp_connection_table);
 
 	sftp_connection_close (conn);
 
 	return FALSE;
 }
 
-/* caller must have a lock on the connection */
 static void
 sftp_connection_unref (SftpConnection *conn) 
 {
+	sftp_connection_lock (conn);
+
 	if (--conn->ref_count == 0 && conn->close_timeout_id == 0) {
 		conn->close_timeout_id
 			= g_timeout_add (SFTP_CLOSE_TIMEOUT, (GSourceFunc) close_and_remove_connection, conn);
 	}
+
+	sftp_connection_unlock (conn);
 }
 
 /* Portions of the below functions inspired by functions in OpenSSH sftp-client.c */
@@ -1796,11 +2224,11 @@ get_real_path (SftpConnection *conn, const gchar *path, gchar **realpath)
 
 	id = sftp_connection_get_id (conn);
 
-	iobuf_send_string_request (conn->out_fd, id, SSH2_FXP_REALPATH, path, strlen (path));
+	iobuf_send_string_request (conn, id, SSH2_FXP_REALPATH, path, strlen (path));
 
 	buffer_init (&msg);
 
-	res = buffer_recv (&msg, conn->in_fd);
+	res = sftp_connection_recv (conn, &msg, id);
 
 	if (res != GNOME_VFS_OK) {
 		g_critical ("Error receiving message: %d", res);
@@ -1897,10 +2325,13 @@ do_open (GnomeVFSMethod        *method,
 	memset (&info, 0, sizeof (GnomeVFSFileInfo));
 	buffer_write_file_info (&msg, &info, GNOME_VFS_SET_FILE_INFO_NONE);
 
-	buffer_send (&msg, conn->out_fd);
+	sftp_connection_send (conn, &msg);
 	buffer_free (&msg);
 	
-	res = iobuf_read_handle (conn->in_fd, &sftp_handle, id, (guint32 *)&sftp_handle_len);
+	res = iobuf_read_handle (conn, &sftp_handle, id, (guint32 *)&sftp_handle_len);
+
+	if (mode & GNOME_VFS_OPEN_WRITE)
+		sftp_connection_forget_info (conn, path);
 
 	if (res == GNOME_VFS_OK) {
 		handle = g_new0 (SftpOpenHandle, 1);
@@ -1910,8 +2341,6 @@ do_open (GnomeVFSMethod        *method,
 		handle->connection = conn;
 		*method_handle = (GnomeVFSMethodHandle *) handle;
 
-		sftp_connection_unlock (conn);
-
 		DEBUG (g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, "%s: Exit", G_STRFUNC));
 		return GNOME_VFS_OK;
 	} else {
@@ -1920,7 +2349,6 @@ do_open (GnomeVFSMethod        *method,
 		g_free (path);
 
 		sftp_connection_unref (conn);
-		sftp_connection_unlock (conn);
 
 		DEBUG (g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, "%s: Exit", G_STRFUNC));
 		return res;
@@ -1982,10 +2410,12 @@ do_create (GnomeVFSMethod        *method,
 	info.permissions = perm;
 	buffer_write_file_info (&msg, &info, GNOME_VFS_SET_FILE_INFO_PERMISSIONS);
 
-	buffer_send (&msg, conn->out_fd);
+	sftp_connection_send (conn, &msg);
 	buffer_free (&msg);
 
-	res = iobuf_read_handle (conn->in_fd, &sftp_handle, id, &sftp_handle_len);
+	res = iobuf_read_handle (conn, &sftp_handle, id, &sftp_handle_len);
+
+	sftp_connection_forget_info (conn, path);
 
 	if (res == GNOME_VFS_OK) {
 		handle = g_new0 (SftpOpenHandle, 1);
@@ -1995,8 +2425,6 @@ do_create (GnomeVFSMethod        *method,
 		handle->connection = conn;
 		*method_handle = (GnomeVFSMethodHandle *) handle;
 
-		sftp_connection_unlock (conn);
-
 		DEBUG (g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, "%s: Exit", G_STRFUNC));
 		return GNOME_VFS_OK;
 	} else {
@@ -2005,247 +2433,431 @@ do_create (GnomeVFSMethod        *method,
 		g_free (path);
 
 		sftp_connection_unref (conn);
-		sftp_connection_unlock (conn);
 		
 		DEBUG (g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, "%s: Exit", G_STRFUNC));
 		return res;
 	}
 }
 
-static GnomeVFSResult 
-do_close (GnomeVFSMethod       *method,
-	  GnomeVFSMethodHandle *method_handle,
-	  GnomeVFSContext      *context) 
-{
-	SftpOpenHandle *handle;
+/* Request windows.
+ *
+ * The number of requests read-ahead and write-behind keep in flight
+ * follows the bandwidth-delay product: the highest delivery rate seen
+ * times the shortest round trip seen, times WINDOW_GAIN so that the
+ * window keeps growing for as long as the delivery rate does.
+ */
 
-	guint id, status;
-	Buffer msg;
+typedef struct {
+	guint    id;
+	guint64  offset;
+	guint    len;
+	GTimeVal sent;
+	/* window->delivered when this was sent */
+	guint64  delivered;
+} SftpRequest;
 
-	guint i;
+static void
+sftp_window_init (SftpWindow *window)
+{
+	window->size = max_req;
+	window->delivered = 0;
+	window->max_rate = 0;
+	window->min_rtt = 0;
+}
 
-	DEBUG (g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, "%s: Enter", G_STRFUNC));
+/* Accounts for the len bytes of req having been delivered */
+static void
+sftp_window_update (SftpWindow *window, SftpRequest *req, guint len)
+{
+	GTimeVal now;
+	gint64 rtt;
+	gdouble rate;
+	gdouble size;
 
-	handle = SFTP_OPEN_HANDLE (method_handle);
+	window->delivered += len;
 
-	buffer_init (&msg);
+	g_get_current_time (&now);
+	rtt = (gint64) (now.tv_sec - req->sent.tv_sec) * G_USEC_PER_SEC
+		+ (now.tv_usec - req->sent.tv_usec);
+	if (rtt <= 0)
+		return;
 
-	sftp_connection_lock (handle->connection);
+	/* bytes per microsecond delivered while this request was out */
+	rate = (gdouble) (window->delivered - req->delivered) / rtt;
 
-	id = sftp_connection_get_id (handle->connection);
-	buffer_write_gchar (&msg, SSH2_FXP_CLOSE);
-	buffer_write_gint32 (&msg, id);
-	buffer_write_block (&msg, handle->sftp_handle, handle->sftp_handle_len);
-	buffer_send (&msg, handle->connection->out_fd);
+	window->max_rate = MAX (window->max_rate, rate);
+	if (window->min_rtt == 0 || rtt < window->min_rtt)
+		window->min_rtt = rtt;
 
-	status = iobuf_read_result (handle->connection->in_fd, id);
+	size = WINDOW_GAIN * window->max_rate * window->min_rtt
+		/ default_req_len + 1;
+	window->size = CLAMP (size, max_req, WINDOW_MAX_REQUESTS);
+}
 
-	buffer_free (&msg);
-	sftp_connection_unref (handle->connection);
-	sftp_connection_unlock (handle->connection);
+/* Read-ahead.
+ *
+ * Read requests are sent ahead of the caller and stay outstanding
+ * between do_read() calls as long as the file is read sequentially,
+ * so that each call doesn't have to wait for a full round trip to get
+ * the pipeline going again. Seeking or writing throws them away.
+ */
 
-	for (i = handle->info_read_ptr; i < handle->info_write_ptr; ++i)
-		g_free (handle->info[i].name);
+static void
+read_ahead_forget_requests (SftpOpenHandle *handle, guint64 next_offset)
+{
+	SftpRequest *req;
 
-	g_free (handle->info);
-	g_free (handle->sftp_handle);
-	g_free (handle->path);
-	g_free (handle);
+	while ((req = g_queue_pop_head (handle->read_requests)) != NULL) {
+		sftp_connection_forget_reply (handle->connection, req->id);
+		g_free (req);
+	}
 
-	DEBUG (g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, "%s: Exit", G_STRFUNC));
+	handle->read_request_offset = next_offset;
+}
 
-	return status;
+static void
+read_ahead_discard (SftpOpenHandle *handle)
+{
+	if (handle->read_requests == NULL)
+		return;
+
+	read_ahead_forget_requests (handle, handle->offset);
+
+	if (handle->read_msg.base != NULL)
+		buffer_free (&handle->read_msg);
+	handle->read_msg_left = 0;
+	handle->read_eof = FALSE;
+	handle->read_sequential = FALSE;
 }
 
-static GnomeVFSResult 
-do_read (GnomeVFSMethod       *method, 
-	 GnomeVFSMethodHandle *method_handle, 
-	 gpointer              buffer_in,
-	 GnomeVFSFileSize      num_bytes, 
-	 GnomeVFSFileSize     *bytes_read, 
-	 GnomeVFSContext      *context) 
+static void
+read_ahead_free (SftpOpenHandle *handle)
 {
-	SftpOpenHandle *handle;
-	Buffer msg;
-	char type;
-	int recv_id, status;
-	guint req_ptr, req_svc_ptr, req_svc;
-	guint len;
-	guchar *buffer;
-	guchar *curr_ptr;
-	GnomeVFSResult result;
-	gboolean got_eof;
-	guint outstanding;
-	int queue_len;
+	if (handle->read_requests == NULL)
+		return;
 
-	struct ReadRequest 
-	{
-		gint     id;
-		guint    req_len;
-		guchar  *ptr;
-	};
+	read_ahead_discard (handle);
+	g_queue_free (handle->read_requests);
+	handle->read_requests = NULL;
+}
 
-	struct ReadRequest *read_req;
+/* Sends requests until the window is full or limit is covered */
+static GnomeVFSResult
+read_ahead_send (SftpOpenHandle *handle, guint64 limit)
+{
+	SftpRequest *req;
+	GnomeVFSResult res;
 
-	DEBUG (g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, "%s: Enter", G_STRFUNC));
+	while (g_queue_get_length (handle->read_requests) < handle->read_window.size &&
+	       handle->read_request_offset < limit) {
+		req = g_new (SftpRequest, 1);
+		req->id = sftp_connection_get_id (handle->connection);
+		req->offset = handle->read_request_offset;
+		req->len = MIN (limit - req->offset, default_req_len);
+		req->delivered = handle->read_window.delivered;
+		g_get_current_time (&req->sent);
 
-	got_eof = FALSE;
-	
-	handle = SFTP_OPEN_HANDLE (method_handle);
-	*bytes_read = 0;
-	req_ptr = 0; /* Queue head */
-	req_svc_ptr = 0; /* Queue tail */
-	curr_ptr = buffer_in;
-	buffer = buffer_in;
-	outstanding = 0;
+		DEBUG (g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG,
+			      "%s: Sending read request %d, offset %" G_GUINT64_FORMAT ", length %d",
+			      G_STRFUNC, req->id, req->offset, req->len));
+
+		res = iobuf_send_read_request (handle->connection, req->id,
+					       req->offset, req->len,
+					       handle->sftp_handle, handle->sftp_handle_len);
+		if (res != GNOME_VFS_OK) {
+			g_free (req);
+			return res;
+		}
 
-	/* This must be at least one larger than max_req so we don't wrap around the compares.
-	 * This means we always leave one unused element between the head and tail. */
-	queue_len = max_req + 1;
-	read_req = g_new0 (struct ReadRequest, queue_len);
+		g_queue_push_tail (handle->read_requests, req);
+		handle->read_request_offset += req->len;
+	}
 
-	buffer_init (&msg);
+	return GNOME_VFS_OK;
+}
 
-	sftp_connection_lock (handle->connection);
+/* Waits for the reply to the oldest request */
+static GnomeVFSResult
+read_ahead_receive (SftpOpenHandle *handle)
+{
+	SftpRequest *req;
+	GnomeVFSResult res;
+	Buffer msg;
+	char type;
+	guint status, len;
 
-	while ((*bytes_read < num_bytes) ||
-	       (outstanding > 0)) {
-		/* Request as many blocks as we can without overfilling the queue (i.e. max_req) */
-		while (curr_ptr < buffer + num_bytes &&
-		       (req_ptr + 1) % queue_len != req_svc_ptr) {
-			read_req[req_ptr].id = sftp_connection_get_id (handle->connection);
-			read_req[req_ptr].req_len =
-				MIN ((buffer + num_bytes) - curr_ptr, default_req_len);
-			read_req[req_ptr].ptr = curr_ptr;
+	req = g_queue_pop_head (handle->read_requests);
+	g_assert (req != NULL);
 
-			DEBUG (g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG,
-				      "%s: (%d) Sending read request %d, length %d, pointer %p",
-				      G_STRFUNC, req_ptr, read_req[req_ptr].id,
-				      read_req[req_ptr].req_len, read_req[req_ptr].ptr));
+	buffer_init (&msg);
+	res = sftp_connection_recv (handle->connection, &msg, req->id);
+	if (res != GNOME_VFS_OK) {
+		buffer_free (&msg);
+		g_free (req);
+		read_ahead_discard (handle);
+		return res;
+	}
 
-			outstanding++;
-			iobuf_send_read_request (handle->connection->out_fd,
-						 read_req[req_ptr].id,
-						 handle->offset + (read_req[req_ptr].ptr - buffer),
-						 read_req[req_ptr].req_len,
-						 handle->sftp_handle, handle->sftp_handle_len);
+	type = buffer_read_gchar (&msg);
+	buffer_read_gint32 (&msg);
 
-			curr_ptr += read_req[req_ptr].req_len;
+	switch (type) {
+	    case SSH2_FXP_STATUS:
+		status = buffer_read_gint32 (&msg);
+		buffer_free (&msg);
 
-			req_ptr = (req_ptr + 1) % queue_len;
-		}
+		DEBUG (g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, "%s: Got status message %d",
+			      G_STRFUNC, status));
 
-		buffer_clear (&msg);
-		result = buffer_recv (&msg, handle->connection->in_fd);
-		outstanding--;
+		if (status == SSH2_FX_EOF) {
+			handle->read_eof = TRUE;
+			read_ahead_forget_requests (handle, req->offset);
+		} else {
+			res = sftp_status_to_vfs_result (status);
+			read_ahead_discard (handle);
+		}
+		break;
 
-		if (result != GNOME_VFS_OK) {
+	    case SSH2_FXP_DATA:
+		len = buffer_read_gint32 (&msg);
+		if (len > req->len || (gssize) len > msg.write_ptr - msg.read_ptr) {
 			buffer_free (&msg);
-			sftp_connection_unlock (handle->connection);
-			return result;
+			res = GNOME_VFS_ERROR_PROTOCOL_ERROR;
+			read_ahead_discard (handle);
+			break;
 		}
 
-		type = buffer_read_gchar (&msg);
-		recv_id = buffer_read_gint32 (&msg);
+		if (handle->read_msg.base != NULL)
+			buffer_free (&handle->read_msg);
+		handle->read_msg = msg;
+		handle->read_msg_left = len;
 
-		/* Look for the id received among sent ids */
-		for (req_svc = req_svc_ptr;
-		     req_svc != req_ptr;
-		     req_svc = (req_svc + 1) % queue_len) {
-			if (read_req[req_svc].id == recv_id) {
-				break;
-			}
-		}
+		sftp_window_update (&handle->read_window, req, len);
 
-		if (req_svc == req_ptr) { /* Didn't find the id -- unexpected reply */
-			DEBUG (g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, "%s: Unexpected id %d",
-				      G_STRFUNC, recv_id));
-			buffer_free (&msg);
-			g_free (read_req);
-			sftp_connection_unlock (handle->connection);
-			return GNOME_VFS_ERROR_PROTOCOL_ERROR;
+		if (len < req->len) {
+			/* Short read; the requests after this one would
+			 * leave a gap, start over where the data ends */
+			read_ahead_forget_requests (handle, req->offset + len);
 		}
+		break;
+
+	    default:
+		buffer_free (&msg);
+		res = GNOME_VFS_ERROR_PROTOCOL_ERROR;
+		read_ahead_discard (handle);
+		break;
+	}
+
+	g_free (req);
+
+	return res;
+}
+
+/* Write-behind.
+ *
+ * do_write() returns as soon as its requests are sent and only waits
+ * for acknowledgements when the window is full, so writes of the next
+ * block overlap with the round trips of the previous ones. The first
+ * failure is kept and returned by the next write, and by close.
+ * Anything that needs the data to have landed first -- reading,
+ * stat-ing the handle, closing -- waits for the outstanding requests.
+ */
+
+/* Waits for the acknowledgement of the oldest write request */
+static void
+write_behind_receive (SftpOpenHandle *handle)
+{
+	SftpRequest *req;
+	GnomeVFSResult res;
+	Buffer msg;
+	char type;
+	guint status;
+
+	req = g_queue_pop_head (handle->write_requests);
+	g_assert (req != NULL);
+
+	buffer_init (&msg);
+	res = sftp_connection_recv (handle->connection, &msg, req->id);
+	if (res == GNOME_VFS_OK) {
+		type = buffer_read_gchar (&msg);
+		buffer_read_gint32 (&msg);
 
-		switch (type) {
-		    case SSH2_FXP_STATUS:
+		if (type != SSH2_FXP_STATUS) {
+			res = GNOME_VFS_ERROR_PROTOCOL_ERROR;
+		} else {
 			status = buffer_read_gint32 (&msg);
+			res = sftp_status_to_vfs_result (status);
+		}
+	}
+	buffer_free (&msg);
 
-			DEBUG (g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, "%s: Got status message %d",
-				      G_STRFUNC, status));
+	DEBUG (g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG,
+		      "%s: Write request %d done: %s",
+		      G_STRFUNC, req->id, gnome_vfs_result_to_string (res)));
 
-			DEBUG (g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, "%s: req_svc = %d, req_ptr = %d",
-				      G_STRFUNC, req_svc, req_ptr));
+	if (res == GNOME_VFS_OK)
+		sftp_window_update (&handle->write_window, req, req->len);
+	else if (handle->write_error == GNOME_VFS_OK)
+		handle->write_error = res;
 
-			if (status != SSH2_FX_EOF) {
-				DEBUG (g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, "%s: status return %d",
-					      G_STRFUNC, sftp_status_to_vfs_result (status)));
-				buffer_free (&msg);
-				g_free (read_req);
-				sftp_connection_unlock (handle->connection);
-				return sftp_status_to_vfs_result (status);
-			}
+	g_free (req);
+}
 
-			if (read_req[req_svc].ptr == buffer)
-				got_eof = TRUE;
-			
-			/* We hit an EOF, so make sure we don't try any more reads after this */
-			num_bytes = MIN (num_bytes, read_req[req_svc].ptr - buffer);
+/* Takes the acknowledgements that have arrived; with wait, also waits
+ * for the rest */
+static GnomeVFSResult
+write_behind_collect (SftpOpenHandle *handle, gboolean wait)
+{
+	SftpRequest *req;
 
-			/* Kill this request */
-			read_req[req_svc].id = 0;
+	if (handle->write_requests == NULL)
+		return GNOME_VFS_OK;
 
+	while ((req = g_queue_peek_head (handle->write_requests)) != NULL) {
+		if (!wait && !sftp_connection_reply_ready (handle->connection, req->id))
 			break;
+		write_behind_receive (handle);
+	}
 
-		    case SSH2_FXP_DATA:
-			len = buffer_read_gint32 (&msg);
-			buffer_read (&msg, read_req[req_svc].ptr, len);
+	return handle->write_error;
+}
 
-			*bytes_read += len;
+static GnomeVFSResult
+write_behind_free (SftpOpenHandle *handle)
+{
+	GnomeVFSResult res;
 
-			if (len < read_req[req_svc].req_len) {
-				/* Missing data. Request that part */
-				read_req[req_svc].id = sftp_connection_get_id (handle->connection);
-				read_req[req_svc].req_len -= len;
-				read_req[req_svc].ptr += len;
-
-				outstanding++;
-				iobuf_send_read_request
-					(handle->connection->out_fd,
-					 read_req[req_svc].id,
-					 handle->offset + (read_req[req_svc].ptr - buffer),
-					 read_req[req_svc].req_len,
-					 handle->sftp_handle, handle->sftp_handle_len);
-			} else
-				read_req[req_svc].id = 0;
+	if (handle->write_requests == NULL)
+		return GNOME_VFS_OK;
 
-			break;
+	res = write_behind_collect (handle, TRUE);
+	g_queue_free (handle->write_requests);
+	handle->write_requests = NULL;
 
-		    default:
-			buffer_free (&msg);
-			g_free (read_req);
-			sftp_connection_unlock (handle->connection);
-			return GNOME_VFS_ERROR_PROTOCOL_ERROR;
-		}
+	return res;
+}
 
-		/* Pop finished requests from the tail */
-		while (req_svc_ptr != req_ptr && read_req[req_svc_ptr].id == 0) {
-			req_svc_ptr = (req_svc_ptr + 1) % queue_len;
-		}
-	}
+static GnomeVFSResult 
+do_close (GnomeVFSMethod       *method,
+	  GnomeVFSMethodHandle *method_handle,
+	  GnomeVFSContext      *context) 
+{
+	SftpOpenHandle *handle;
+	GnomeVFSResult write_result;
+
+	guint id, status;
+	Buffer msg;
+
+	guint i;
+
+	DEBUG (g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, "%s: Enter", G_STRFUNC));
+
+	handle = SFTP_OPEN_HANDLE (method_handle);
+
+	read_ahead_free (handle);
+	if (handle->write_requests != NULL)
+		sftp_connection_forget_info (handle->connection, handle->path);
+	write_result = write_behind_free (handle);
+
+	buffer_init (&msg);
 
-	handle->offset += *bytes_read;
+	id = sftp_connection_get_id (handle->connection);
+	buffer_write_gchar (&msg, SSH2_FXP_CLOSE);
+	buffer_write_gint32 (&msg, id);
+	buffer_write_block (&msg, handle->sftp_handle, handle->sftp_handle_len);
+	sftp_connection_send (handle->connection, &msg);
+
+	status = iobuf_read_result (handle->connection, id);
+	if (status == GNOME_VFS_OK)
+		status = write_result;
 
 	buffer_free (&msg);
-	g_free (read_req);
+	sftp_connection_unref (handle->connection);
+
+	for (i = handle->info_read_ptr; i < handle->info_write_ptr; ++i)
+		g_free (handle->info[i].name);
+
+	g_free (handle->info);
+	g_free (handle->sftp_handle);
+	g_free (handle->path);
+	g_free (handle);
 
 	DEBUG (g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, "%s: Exit", G_STRFUNC));
 
-	sftp_connection_unlock (handle->connection);
+	return status;
+}
 
-	if (got_eof)
+static GnomeVFSResult 
+do_read (GnomeVFSMethod       *method, 
+	 GnomeVFSMethodHandle *method_handle, 
+	 gpointer              buffer_in,
+	 GnomeVFSFileSize      num_bytes, 
+	 GnomeVFSFileSize     *bytes_read, 
+	 GnomeVFSContext      *context) 
+{
+	SftpOpenHandle *handle;
+	GnomeVFSResult result;
+	guchar *buffer;
+	guint64 limit;
+	guint len;
+
+	DEBUG (g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, "%s: Enter", G_STRFUNC));
+
+	handle = SFTP_OPEN_HANDLE (method_handle);
+	buffer = buffer_in;
+	*bytes_read = 0;
+
+	result = write_behind_collect (handle, TRUE);
+	if (result != GNOME_VFS_OK)
+		return result;
+
+	if (handle->read_requests == NULL) {
+		handle->read_requests = g_queue_new ();
+		handle->read_request_offset = handle->offset;
+		sftp_window_init (&handle->read_window);
+	}
+
+	/* Only read ahead of the caller once it has shown it reads the
+	 * file in order */
+	if (handle->read_sequential)
+		limit = G_MAXUINT64;
+	else
+		limit = handle->offset + num_bytes;
+
+	while (*bytes_read < num_bytes) {
+		if (handle->read_msg_left > 0) {
+			len = MIN (handle->read_msg_left, num_bytes - *bytes_read);
+			buffer_read (&handle->read_msg, buffer + *bytes_read, len);
+			handle->read_msg_left -= len;
+			handle->offset += len;
+			*bytes_read += len;
+			continue;
+		}
+
+		if (handle->read_eof)
+			break;
+
+		result = read_ahead_send (handle, limit);
+		if (result != GNOME_VFS_OK) {
+			read_ahead_discard (handle);
+			break;
+		}
+
+		result = read_ahead_receive (handle);
+		if (result != GNOME_VFS_OK)
+			break;
+	}
+
+	handle->read_sequential = (result == GNOME_VFS_OK);
+
+	DEBUG (g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, "%s: Exit", G_STRFUNC));
+
+	if (*bytes_read > 0)
+		return GNOME_VFS_OK;
+	if (result == GNOME_VFS_OK && handle->read_eof)
 		return GNOME_VFS_ERROR_EOF;
-	
-	return GNOME_VFS_OK;
+
+	return result;
 }
 
 static GnomeVFSResult 
@@ -2257,126 +2869,79 @@ do_write (GnomeVFSMethod       *method,
 	  GnomeVFSContext      *context) 
 {
 	SftpOpenHandle *handle;
+	SftpRequest *req;
 	Buffer msg;
-	char type;
-	int recv_id, status;
-	guint req_ptr, req_svc, req_svc_ptr;
-	guint curr_offset;
 	const guchar *buffer;
-	int queue_len;
-
-	struct WriteRequest 
-	{
-		gint   id;
-		guint  req_len;
-		guint  offset;
-	};
-
-	struct WriteRequest *write_req;
+	GnomeVFSResult result;
 
 	DEBUG (g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, "%s: Enter", G_STRFUNC));
 
 	handle = SFTP_OPEN_HANDLE (method_handle);
-
-	/* This must be at least one larger than max_req so we don't wrap around the compares.
-	 * This means we always leave one unused element between the head and tail. */
-	queue_len = max_req + 1;
-	write_req = g_new0 (struct WriteRequest, queue_len);
-	
-	buffer_init (&msg);
-	*bytes_written = 0;
-	curr_offset = 0;
 	buffer = buffer_in;
-	req_ptr = 0;
-	req_svc_ptr = 0;
+	*bytes_written = 0;
 
-	sftp_connection_lock (handle->connection);
+	read_ahead_discard (handle);
 
-	while (*bytes_written < num_bytes) {
-		while (curr_offset < num_bytes &&
-		       (req_ptr + 1) % queue_len != req_svc_ptr) {
-			write_req[req_ptr].id = sftp_connection_get_id (handle->connection);
-			write_req[req_ptr].req_len = MIN (num_bytes - curr_offset, default_req_len);
-			write_req[req_ptr].offset = curr_offset;
+	if (handle->write_requests == NULL) {
+		handle->write_requests = g_queue_new ();
+		sftp_window_init (&handle->write_window);
+	}
 
-			curr_offset += write_req[req_ptr].req_len;
+	/* Report a failure of an earlier write before taking more data */
+	result = write_behind_collect (handle, FALSE);
+	if (result != GNOME_VFS_OK)
+		return result;
 
-			DEBUG (g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG,
-				      "%s: (%d) Sending write request %d, length %d, offset %d",
-				      G_STRFUNC, req_ptr, write_req[req_ptr].id,
-				      write_req[req_ptr].req_len, write_req[req_ptr].offset));
-
-			buffer_clear (&msg);
-			buffer_write_gchar (&msg, SSH2_FXP_WRITE);
-			buffer_write_gint32 (&msg, write_req[req_ptr].id);
-			buffer_write_block (&msg, handle->sftp_handle, handle->sftp_handle_len);
-			buffer_write_gint64 (&msg, handle->offset + write_req[req_ptr].offset);
-			buffer_write_block (&msg, buffer + write_req[req_ptr].offset,
-					    write_req[req_ptr].req_len);
-			
-			buffer_send (&msg, handle->connection->out_fd);
+	buffer_init (&msg);
 
-			req_ptr = (req_ptr + 1) % queue_len;
-		}
+	while (*bytes_written < num_bytes) {
+		while (g_queue_get_length (handle->write_requests) >= handle->write_window.size)
+			write_behind_receive (handle);
 
-		buffer_clear (&msg);
-		buffer_recv (&msg, handle->connection->in_fd);
-		type = buffer_read_gchar (&msg);
-		recv_id = buffer_read_gint32 (&msg);
+		if (handle->write_error != GNOME_VFS_OK)
+			break;
 
-		if (type != SSH2_FXP_STATUS) {
-			buffer_free (&msg);
-			g_free (write_req);
-			sftp_connection_unlock (handle->connection);
-			return GNOME_VFS_ERROR_PROTOCOL_ERROR;
-		}
+		req = g_new (SftpRequest, 1);
+		req->id = sftp_connection_get_id (handle->connection);
+		req->offset = handle->offset;
+		req->len = MIN (num_bytes - *bytes_written, default_req_len);
+		req->delivered = handle->write_window.delivered;
+		g_get_current_time (&req->sent);
 
+		DEBUG (g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG,
+			      "%s: Sending write request %d, offset %" G_GUINT64_FORMAT ", length %d",
+			      G_STRFUNC, req->id, req->offset, req->len));
 
-		status = buffer_read_gint32 (&msg);
-		if (status != SSH2_FX_OK) {
-			buffer_free (&msg);
-			g_free (write_req);
-			sftp_connection_unlock (handle->connection);
-			return sftp_status_to_vfs_result (status);
-		}
+		/* The data is copied into the message, the caller gets its
+		 * buffer back even though the request is still in flight */
+		buffer_clear (&msg);
+		buffer_write_gchar (&msg, SSH2_FXP_WRITE);
+		buffer_write_gint32 (&msg, req->id);
+		buffer_write_block (&msg, handle->sftp_handle, handle->sftp_handle_len);
+		buffer_write_gint64 (&msg, req->offset);
+		buffer_write_block (&msg, buffer + *bytes_written, req->len);
 
-		/* Look for the id received among sent ids */
-		for (req_svc = req_svc_ptr;
-		     req_svc != req_ptr;
-		     req_svc = (req_svc + 1) % queue_len) {
-			if (write_req[req_svc].id == recv_id) {
-				break;
-			}
-		}
-		
-		if (req_svc == req_ptr) { /* Didn't find the id -- unexpected reply */
-			DEBUG (g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, "%s: Unexpected id %d",
-				      G_STRFUNC, recv_id));
-			buffer_free (&msg);
-			g_free (write_req);
-			sftp_connection_unlock (handle->connection);
-			return GNOME_VFS_ERROR_PROTOCOL_ERROR;
+		result = sftp_connection_send (handle->connection, &msg);
+		if (result != GNOME_VFS_OK) {
+			g_free (req);
+			handle->write_error = result;
+			break;
 		}
 
-		write_req[req_svc].id = 0;
-		*bytes_written += write_req[req_svc].req_len;
-
-		/* Pop finished requests from the tail */
-		while (req_svc_ptr != req_ptr && write_req[req_svc_ptr].id == 0) {
-			req_svc_ptr = (req_svc_ptr + 1) % queue_len;
-		}
+		g_queue_push_tail (handle->write_requests, req);
+		handle->offset += req->len;
+		*bytes_written += req->len;
 	}
 
-	handle->offset += *bytes_written;
-
 	buffer_free (&msg);
-	g_free (write_req);
 
 	DEBUG (g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, "%s: Exit", G_STRFUNC));
 
-	sftp_connection_unlock (handle->connection);
+	/* If some of the data went out, the error is for the next call */
+	if (*bytes_written > 0)
+		return GNOME_VFS_OK;
 
-	return GNOME_VFS_OK;
+	return handle->write_error;
 }
 
 static GnomeVFSResult
@@ -2389,10 +2954,12 @@ do_seek (GnomeVFSMethod       *method,
 	SftpOpenHandle *handle;
 	GnomeVFSFileInfo file_info = { 0, };
 	GnomeVFSResult res;
+	guint64 old_offset;
 
 	DEBUG (g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, "%s: Enter", G_STRFUNC));
 
 	handle = SFTP_OPEN_HANDLE (method_handle);
+	old_offset = handle->offset;
 
 	switch (whence) {
 	    case GNOME_VFS_SEEK_START:
@@ -2414,6 +2981,10 @@ do_seek (GnomeVFSMethod       *method,
 		break;
 	}
 
+	/* what was read ahead is for the old position */
+	if (handle->offset != old_offset)
+		read_ahead_discard (handle);
+
 	DEBUG (g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, "%s: Exit", G_STRFUNC));
 
 	return GNOME_VFS_OK;
@@ -2457,11 +3028,14 @@ sftp_readlink (SftpConnection *connection,
 	buffer_write_gchar (&msg, SSH2_FXP_READLINK);
 	buffer_write_gint32 (&msg, id);
 	buffer_write_string (&msg, path);
-	buffer_send (&msg, connection->out_fd);
+	sftp_connection_send (connection, &msg);
 
 	buffer_clear (&msg);
 
-	buffer_recv (&msg, connection->in_fd);
+	if (sftp_connection_recv (connection, &msg, id) != GNOME_VFS_OK) {
+		buffer_free (&msg);
+		return NULL;
+	}
 
 	type = buffer_read_gchar (&msg);
 	recv_id = buffer_read_gint32 (&msg);
@@ -2557,13 +3131,19 @@ get_file_info_for_path (SftpConnection          *conn,
 		return GNOME_VFS_ERROR_NOT_SUPPORTED;
 	}
 
+	if (sftp_connection_lookup_info (conn, path, file_info)) {
+		DEBUG (g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, "%s: Found %s in cache", G_STRFUNC, path));
+		update_mime_type_and_name_from_path (file_info, path, options);
+		return GNOME_VFS_OK;
+	}
+
 	id = sftp_connection_get_id (conn);
 
-	iobuf_send_string_request (conn->out_fd, id,
+	iobuf_send_string_request (conn, id,
 				   SSH2_FXP_LSTAT,
 				   path, strlen (path));
 
-	res = iobuf_read_file_info (conn->in_fd, file_info, id);
+	res = iobuf_read_file_info (conn, file_info, id);
 	if (res != GNOME_VFS_OK) return res;
 
 	if (options & GNOME_VFS_FILE_INFO_FOLLOW_LINKS &&
@@ -2617,11 +3197,11 @@ get_file_info_for_path (SftpConnection          *conn,
 			g_free (tmp);
 
 			id = sftp_connection_get_id (conn);
-			iobuf_send_string_request (conn->out_fd, id,
+			iobuf_send_string_request (conn, id,
 						   SSH2_FXP_LSTAT,
 						   target_path, strlen (target_path));
 
-			res = iobuf_read_file_info (conn->in_fd, target_info, id);
+			res = iobuf_read_file_info (conn, target_info, id);
 			if (res != GNOME_VFS_OK ||
 			    (target_info->valid_fields & GNOME_VFS_FILE_INFO_FIELDS_TYPE) == 0) {
 				DEBUG (g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG,
@@ -2698,7 +3278,6 @@ do_get_file_info (GnomeVFSMethod          *method,
 	g_free (path);
 
 	sftp_connection_unref (conn);
-	sftp_connection_unlock (conn);
 
 	return res;
 }
@@ -2716,6 +3295,12 @@ do_get_file_info_from_handle (GnomeVFSMethod          *method,
 
 	handle = SFTP_OPEN_HANDLE (method_handle);
 
+	/* the size has to include what is still being written */
+	if (handle->write_requests != NULL) {
+		write_behind_collect (handle, TRUE);
+		sftp_connection_forget_info (handle->connection, handle->path);
+	}
+
 	/* we can't use FSTAT, because it always follows the symlink, but doesn't return the target file name.
 	 * So we fall back to our home-brewn LSTAT/readlink code. */
 	return get_file_info_for_path (handle->connection,
@@ -2761,11 +3346,11 @@ do_open_directory (GnomeVFSMethod          *method,
 	buffer_write_gchar (&msg, SSH2_FXP_OPENDIR);
 	buffer_write_gint32 (&msg, id);
 	buffer_write_string (&msg, path);
-	buffer_send (&msg, conn->out_fd);
+	sftp_connection_send (conn, &msg);
 
 	buffer_free (&msg);
 
-	res = iobuf_read_handle (conn->in_fd, &sftp_handle, id, &sftp_handle_len);
+	res = iobuf_read_handle (conn, &sftp_handle, id, &sftp_handle_len);
 
 	DEBUG (g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, "%s: Result is %d", G_STRFUNC, res));
 
@@ -2782,8 +3367,6 @@ do_open_directory (GnomeVFSMethod          *method,
 		handle->dir_options = options;
 		*method_handle = (GnomeVFSMethodHandle *) handle;
 		
-		sftp_connection_unlock (conn);
-
 		DEBUG (g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, "%s: Opened directory %p",
 			      G_STRFUNC, handle));
 		DEBUG (g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, "%s: Exit", G_STRFUNC));
@@ -2796,7 +3379,6 @@ do_open_directory (GnomeVFSMethod          *method,
 		g_free (path);
 
 		sftp_connection_unref (conn);
-		sftp_connection_unlock (conn);
 
 		*method_handle = NULL;
 		DEBUG (g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, "%s: Exit", G_STRFUNC));
@@ -2840,8 +3422,6 @@ do_read_directory (GnomeVFSMethod       *method,
 		return GNOME_VFS_OK;
 	}
 
-	sftp_connection_lock (handle->connection);
-
 	DEBUG (g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, "%s: No entries in cache", G_STRFUNC));
 
 	id = sftp_connection_get_id (handle->connection);
@@ -2850,18 +3430,20 @@ do_read_directory (GnomeVFSMethod       *method,
 	buffer_write_gchar (&msg, SSH2_FXP_READDIR);
 	buffer_write_gint32 (&msg, id);
 	buffer_write_block (&msg, handle->sftp_handle, handle->sftp_handle_len);
-	buffer_send (&msg, handle->connection->out_fd);
+	sftp_connection_send (handle->connection, &msg);
 
 	buffer_clear (&msg);
 
-	buffer_recv (&msg, handle->connection->in_fd);
+	if (sftp_connection_recv (handle->connection, &msg, id) != GNOME_VFS_OK) {
+		buffer_free (&msg);
+		return GNOME_VFS_ERROR_IO;
+	}
 
 	type = buffer_read_gchar (&msg);
 	recv_id = buffer_read_gint32 (&msg);
 
 	if (recv_id != id) {
 		buffer_free (&msg);
-		sftp_connection_unlock (handle->connection);
 		return GNOME_VFS_ERROR_PROTOCOL_ERROR;
 	}
 
@@ -2873,13 +3455,10 @@ do_read_directory (GnomeVFSMethod       *method,
 			DEBUG (g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG,
 				      "%s: End of directory reached (EOF status)",
 				      G_STRFUNC));
-			sftp_connection_unlock (handle->connection);
 			return GNOME_VFS_ERROR_EOF;
 		} else {
 			DEBUG (g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, "%s: Error status %d",
 				      G_STRFUNC, status));
-			do_close (method, method_handle, context);
-			sftp_connection_unlock (handle->connection);
 			return sftp_status_to_vfs_result (status);
 		}
 	}
@@ -2890,7 +3469,6 @@ do_read_directory (GnomeVFSMethod       *method,
 				      "%s: End of directory reached (count 0)",
 				      G_STRFUNC));
 			buffer_free (&msg);
-			sftp_connection_unlock (handle->connection);
 			return GNOME_VFS_ERROR_EOF;
 		}
 
@@ -2930,14 +3508,17 @@ do_read_directory (GnomeVFSMethod       *method,
 			DEBUG (g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, "%s: %d, filename is %s",
 				      G_STRFUNC, i, filename));
 
+			path = g_build_filename (handle->path, filename, NULL);
 			if (info->valid_fields & GNOME_VFS_FILE_INFO_FIELDS_TYPE &&
 			    info->type == GNOME_VFS_FILE_TYPE_SYMBOLIC_LINK) {
-				path = g_build_filename (handle->path, filename, NULL);
 				get_file_info_for_path (handle->connection, path,
 							info, handle->dir_options);
-				g_free (path);
-			} else
+			} else {
+				if (strcmp (filename, ".") != 0 && strcmp (filename, "..") != 0)
+					sftp_connection_cache_info (handle->connection, path, info);
 				update_mime_type_and_name_from_path (info, filename, handle->dir_options);
+			}
+			g_free (path);
 
 			DEBUG (g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, "%s: %d, MIME type is %s",
 				      G_STRFUNC, i, info->mime_type));
@@ -2951,7 +3532,6 @@ do_read_directory (GnomeVFSMethod       *method,
 		DEBUG (g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, "%s: Got wrong packet type (%d)",
 			      G_STRFUNC, type));
 		buffer_free (&msg);
-		sftp_connection_unlock (handle->connection);
 		return GNOME_VFS_ERROR_PROTOCOL_ERROR;
 	}
 
@@ -2965,11 +3545,9 @@ do_read_directory (GnomeVFSMethod       *method,
 		handle->info[handle->info_read_ptr].mime_type = NULL;
 		handle->info_read_ptr++;
 		DEBUG (g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, "%s: Exit", G_STRFUNC));
-		sftp_connection_unlock (handle->connection);
 		return GNOME_VFS_OK;
 	} else {
 		DEBUG (g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, "%s: Exit", G_STRFUNC));
-		sftp_connection_unlock (handle->connection);
 		return GNOME_VFS_ERROR_EOF;
 	}
 }
@@ -2994,16 +3572,16 @@ do_make_directory (GnomeVFSMethod  *method,
 	URI_TO_PATH (uri, path);
 
 	memset (&info, 0, sizeof (GnomeVFSFileInfo));
-	iobuf_send_string_request_with_file_info (conn->out_fd, id, SSH2_FXP_MKDIR,
+	iobuf_send_string_request_with_file_info (conn, id, SSH2_FXP_MKDIR,
 						  path, strlen (path), &info,
 						  GNOME_VFS_SET_FILE_INFO_NONE);
 
-	g_free (path);
+	res = iobuf_read_result (conn, id);
 
-	res = iobuf_read_result (conn->in_fd, id);
+	sftp_connection_forget_info (conn, path);
+	g_free (path);
 
 	sftp_connection_unref (conn);
-	sftp_connection_unlock (conn);
 
 	if (res == GNOME_VFS_ERROR_GENERIC &&
 	    gnome_vfs_uri_exists (uri)) {
@@ -3029,13 +3607,14 @@ do_remove_directory (GnomeVFSMethod  *method,
 	id = sftp_connection_get_id (conn);
 
 	URI_TO_PATH (uri, path);
-	iobuf_send_string_request (conn->out_fd, id, SSH2_FXP_RMDIR, path, strlen (path));
-	g_free (path);
+	iobuf_send_string_request (conn, id, SSH2_FXP_RMDIR, path, strlen (path));
 
-	res = iobuf_read_result (conn->in_fd, id);
+	res = iobuf_read_result (conn, id);
+
+	sftp_connection_forget_info (conn, path);
+	g_free (path);
 
 	sftp_connection_unref (conn);
-	sftp_connection_unlock (conn);
 
 	return res;
 }
@@ -3072,12 +3651,12 @@ do_move (GnomeVFSMethod  *method,
 
 	/* if force_replace is specified, try to remove new_uri */
 	if (force_replace) {
-		iobuf_send_string_request (conn->out_fd,
+		iobuf_send_string_request (conn,
 					   id,
 					   SSH2_FXP_REMOVE,
 					   new_path,
 					   strlen (new_path));
-		res = iobuf_read_result (conn->in_fd, id);
+		res = iobuf_read_result (conn, id);
 		if (res != GNOME_VFS_OK && res != GNOME_VFS_ERROR_NOT_FOUND)
 			goto bail;
 	}
@@ -3087,17 +3666,19 @@ do_move (GnomeVFSMethod  *method,
 	buffer_write_gint32 (&msg, id);
 	buffer_write_string (&msg, old_path);
 	buffer_write_string (&msg, new_path);
-	buffer_send (&msg, conn->out_fd);
+	sftp_connection_send (conn, &msg);
 	buffer_free (&msg);
 
-	res = iobuf_read_result (conn->in_fd, id);
+	res = iobuf_read_result (conn, id);
 
  bail:
+	sftp_connection_forget_info (conn, old_path);
+	sftp_connection_forget_info (conn, new_path);
+
 	g_free (old_path);
 	g_free (new_path);
 
 	sftp_connection_unref (conn);
-	sftp_connection_unlock (conn);
 
 	return res;
 }
@@ -3128,7 +3709,6 @@ do_rename (GnomeVFSMethod  *method,
 	if (new_path == NULL) {
 		g_free (old_path);
 		sftp_connection_unref (conn);
-		sftp_connection_unlock (conn);
 		return GNOME_VFS_ERROR_INVALID_URI;
 	}
 
@@ -3141,16 +3721,18 @@ do_rename (GnomeVFSMethod  *method,
 	buffer_write_gint32 (&msg, id);
 	buffer_write_string (&msg, old_path);
 	buffer_write_string (&msg, new_path);
-	buffer_send (&msg, conn->out_fd);
+	sftp_connection_send (conn, &msg);
 	buffer_free (&msg);
 
+	res = iobuf_read_result (conn, id);
+
+	sftp_connection_forget_info (conn, old_path);
+	sftp_connection_forget_info (conn, new_path);
+
 	g_free (old_path);
 	g_free (new_path);
 
-	res = iobuf_read_result (conn->in_fd, id);
-
 	sftp_connection_unref (conn);
-	sftp_connection_unlock (conn);
 
 	return res;
 }
@@ -3171,13 +3753,14 @@ do_unlink (GnomeVFSMethod  *method,
 	id = sftp_connection_get_id (conn);
 
 	URI_TO_PATH (uri, path);
-	iobuf_send_string_request (conn->out_fd, id, SSH2_FXP_REMOVE, path, strlen (path));
-	g_free (path);
+	iobuf_send_string_request (conn, id, SSH2_FXP_REMOVE, path, strlen (path));
+
+	res = iobuf_read_result (conn, id);
 
-	res = iobuf_read_result (conn->in_fd, id);
+	sftp_connection_forget_info (conn, path);
+	g_free (path);
 
 	sftp_connection_unref (conn);
-	sftp_connection_unlock (conn);
 
 	return res;
 }
@@ -3257,14 +3840,15 @@ do_set_file_info (GnomeVFSMethod          *method,
 		id = sftp_connection_get_id (conn);
 
 		URI_TO_PATH (uri, path);
-		iobuf_send_string_request_with_file_info (conn->out_fd, id, SSH2_FXP_SETSTAT,
+		iobuf_send_string_request_with_file_info (conn, id, SSH2_FXP_SETSTAT,
 							  path, strlen (path), info, mask);
-		g_free (path);
 
-		res = iobuf_read_result (conn->in_fd, id);
+		res = iobuf_read_result (conn, id);
+
+		sftp_connection_forget_info (conn, path);
+		g_free (path);
 
 		sftp_connection_unref (conn);
-		sftp_connection_unlock (conn);
 	}
 
 	if (res == GNOME_VFS_OK && (mask & GNOME_VFS_SET_FILE_INFO_NAME))
@@ -3295,7 +3879,6 @@ do_create_symlink (GnomeVFSMethod   *method,
 
 	if (conn->version < 3) {
 		sftp_connection_unref (conn);
-		sftp_connection_unlock (conn);
 		return GNOME_VFS_ERROR_NOT_SUPPORTED;
 	}
 
@@ -3311,7 +3894,6 @@ do_create_symlink (GnomeVFSMethod   *method,
 			g_free (path);
 			gnome_vfs_uri_unref (target_uri);
 			sftp_connection_unref (conn);
-			sftp_connection_unlock (conn);
 			return GNOME_VFS_ERROR_NOT_SAME_FILE_SYSTEM;
 		}
 
@@ -3329,13 +3911,14 @@ do_create_symlink (GnomeVFSMethod   *method,
 	buffer_write_gint32 (&msg, id);
 	buffer_write_string (&msg, real_target);
 	buffer_write_string (&msg, path);
-	buffer_send (&msg, conn->out_fd);
+	sftp_connection_send (conn, &msg);
 	buffer_free (&msg);
 
-	res = iobuf_read_result (conn->in_fd, id);
+	res = iobuf_read_result (conn, id);
+
+	sftp_connection_forget_info (conn, path);
 
 	sftp_connection_unref (conn);
-	sftp_connection_unlock (conn);
 
 	if (res == GNOME_VFS_ERROR_GENERIC &&
 	    gnome_vfs_uri_exists (uri)) {
@@ -3382,6 +3965,12 @@ GnomeVFSMethod *
 vfs_module_init (const char *method_name, 
 		 const char *args)
 {
+	const char *ttl;
+
+	ttl = getenv (INFO_CACHE_TTL_VARIABLE);
+	if (ttl != NULL)
+		info_cache_ttl = strtoul (ttl, NULL, 10);
+
 	return &method;
 }
 
@@ -30,6 +30,7 @@
 
 /* libgen first for basename */
 #include <libgen.h>
+#include <stdlib.h>
 #include <string.h>
 #include <glib.h>
 #include <errno.h>
@@ -82,22 +83,81 @@ typedef struct {
         time_t stamp;
 } SmbCachedUser;
 
-static GMutex *smb_lock;
+typedef struct _SmbAuthContext SmbAuthContext;
 
-static SMBCCTX *smb_context = NULL;
+/* A libsmbclient context can only be used by one thread at a time, so
+ * each server gets a few of them, each with its own lock and its own
+ * cache of server connections. Handles keep using the context that
+ * opened them. Only a library made thread safe with smbc_thread_posix ()
+ * lets the contexts be used in parallel, see LOCK_LIBSMBCLIENT.
+ */
+typedef struct {
+	char *server;			/* Lowercase host name, "" for browsing */
+	SMBCCTX *context;
+	GMutex *lock;
+
+	GHashTable *server_cache;	/* SmbServerCacheEntry -> itself */
+	SmbAuthContext *auth_context;	/* Of the operation holding the lock */
+
+	guint users;			/* Handles and operations, under the connections lock */
+} SmbConnection;
+
+/* All SmbConnections. libsmbclient keeps its configuration in globals,
+ * so contexts are also created and freed under this lock. */
+static GList *connections = NULL;
+G_LOCK_DEFINE_STATIC (connections);
+
+/* The connection whose lock this thread holds, for the libsmbclient
+ * callbacks that aren't told */
+static GStaticPrivate current_connection = G_STATIC_PRIVATE_INIT;
+
+/* Without smbc_thread_posix (), libsmbclient shares state between all
+ * contexts without locking it, so only one thread at a time may call
+ * into it. Taken after the lock of a connection, and after the
+ * connections lock. */
+#ifdef HAVE_SMBC_THREAD_POSIX
+#define LOCK_LIBSMBCLIENT()
+#define UNLOCK_LIBSMBCLIENT()
+#else
+G_LOCK_DEFINE_STATIC (libsmbclient);
+#define LOCK_LIBSMBCLIENT()	G_LOCK (libsmbclient)
+#define UNLOCK_LIBSMBCLIENT()	G_UNLOCK (libsmbclient)
+#endif
 
-static GHashTable *server_cache = NULL;
+/* Contexts opened to a single server at most */
+#define CONTEXTS_PER_SERVER_VARIABLE "GNOME_VFS_SMB_CONTEXTS_PER_SERVER"
+#define DEFAULT_CONTEXTS_PER_SERVER 4
+static guint contexts_per_server = DEFAULT_CONTEXTS_PER_SERVER;
 
 static GHashTable *user_cache = NULL;
-
-#define SMB_BLOCK_SIZE (32*1024)
+G_LOCK_DEFINE_STATIC (user_cache);
+
+/* Bytes asked for in a single read or write. libsmbclient cuts them
+ * into requests of the size negotiated with the server and keeps
+ * several of those in flight, so this can be a lot more than one SMB
+ * request. Also advertised as io_block_size. */
+#define REQUEST_SIZE_VARIABLE "GNOME_VFS_SMB_REQUEST_SIZE"
+#define DEFAULT_REQUEST_SIZE (1024 * 1024)
+#define MIN_REQUEST_SIZE 4096
+static gsize request_size = DEFAULT_REQUEST_SIZE;
+
+/* Reads done ahead of, or writes done behind, sequential users of a
+ * handle, see SmbPipeline. 0 to only do what is asked for. */
+#define PIPELINE_DEPTH_VARIABLE "GNOME_VFS_SMB_PIPELINE_DEPTH"
+#define DEFAULT_PIPELINE_DEPTH 4
+static guint pipeline_depth = DEFAULT_PIPELINE_DEPTH;
+
+/* How often users waiting for the pipeline check for cancellation */
+#define PIPELINE_WAIT_USECS 100000
 
 /* Reap unused server connections and user cache after 30 minutes */
 #define CACHE_REAP_TIMEOUT (30 * 60)
 static guint cache_reap_timeout = 0;
+G_LOCK_DEFINE_STATIC (cache_reap_timeout);
 
 /* We load a default workgroup from gconf */
 #define PATH_GCONF_GNOME_VFS_SMB_WORKGROUP "/system/smb/workgroup"
+static char *default_workgroup = NULL;
 
 /* The magic "default workgroup" hostname */
 #define DEFAULT_WORKGROUP_NAME "X-GNOME-DEFAULT-WORKGROUP"
@@ -110,6 +170,7 @@ static guint cache_reap_timeout = 0;
 
 static GHashTable *workgroups = NULL;
 static time_t workgroups_timestamp = 0;
+G_LOCK_DEFINE_STATIC (workgroups);
 
 /* Authentication ----------------------------------------------------------- */
 
@@ -117,8 +178,9 @@ static time_t workgroups_timestamp = 0;
 #define SMB_AUTH_STATE_GUEST		0x00000020 	/* Have tried 'guest' authentication */
 #define SMB_AUTH_STATE_PROMPTED		0x00000040 	/* Have asked gnome-auth for to prompt user */
 
-typedef struct _SmbAuthContext {
+struct _SmbAuthContext {
 	
+	SmbConnection *connection;	/* Connection being worked with, locked */
 	GnomeVFSURI *uri;		/* Uri being worked with. Does not own this URI */
 	GnomeVFSResult res;		/* Current error code */
 	
@@ -144,13 +206,12 @@ typedef struct _SmbAuthContext {
 
 	guint prompt_flags;           	/* Various URI flags set by initial_authentication */
 	
-} SmbAuthContext;
+};
 
-static void init_authentication (SmbAuthContext *actx, GnomeVFSURI *uri);
+static void init_authentication (SmbAuthContext *actx, SmbConnection *connection,
+				 GnomeVFSURI *uri);
 static int  perform_authentication (SmbAuthContext *actx);
 
-static SmbAuthContext *current_auth_context = NULL;
-
 static void auth_callback (const char *server_name, const char *share_name,
 		     	   char *domain, int domainmaxlen,
 		     	   char *username, int unmaxlen,
@@ -167,14 +228,42 @@ static void auth_callback (const char *server_name, const char *share_name,
 #define DEBUG_SMB(x) 
 #endif
 
+static void
+connection_lock (SmbConnection *connection)
+{
+	g_mutex_lock (connection->lock);
+	LOCK_LIBSMBCLIENT ();
+	g_static_private_set (&current_connection, connection, NULL);
+}
+
+static void
+connection_unlock (SmbConnection *connection)
+{
+	g_static_private_set (&current_connection, NULL, NULL);
+	UNLOCK_LIBSMBCLIENT ();
+	g_mutex_unlock (connection->lock);
+}
+
 #ifdef DEBUG_SMB_LOCKS
-#define LOCK_SMB() 	{g_mutex_lock (smb_lock); g_print ("LOCK %s\n", G_STRFUNC);}
-#define UNLOCK_SMB() 	{g_print ("UNLOCK %s\n", G_STRFUNC); g_mutex_unlock (smb_lock);}
+#define LOCK_SMB(c) 	{connection_lock (c); g_print ("LOCK %s %s\n", G_STRFUNC, (c)->server);}
+#define UNLOCK_SMB(c) 	{g_print ("UNLOCK %s %s\n", G_STRFUNC, (c)->server); connection_unlock (c);}
 #else
-#define LOCK_SMB() 	g_mutex_lock (smb_lock)
-#define UNLOCK_SMB() 	g_mutex_unlock (smb_lock)
+#define LOCK_SMB(c) 	connection_lock (c)
+#define UNLOCK_SMB(c) 	connection_unlock (c)
 #endif
 
+static SmbConnection *
+get_current_connection (SMBCCTX *context)
+{
+	SmbConnection *connection;
+
+	connection = g_static_private_get (&current_connection);
+	g_assert (connection != NULL);
+	g_assert (context == NULL || connection->context == context);
+
+	return connection;
+}
+
 static gchar*
 string_dup_nzero (const gchar *s)
 {
@@ -307,42 +396,97 @@ reap_user (gpointer key, gpointer value, gpointer user_data)
         return FALSE;              
 }
 
+static void
+connection_free (SmbConnection *connection)
+{
+	g_hash_table_destroy (connection->server_cache);
+	g_mutex_free (connection->lock);
+	g_free (connection->server);
+	g_free (connection);
+}
+
+/* Call with the connection locked. Returns TRUE if the connection has
+ * nothing left and was freed. */
 static gboolean
-cache_reap_cb (void)
+reap_connection (SmbConnection *connection)
 {
 	GPtrArray *servers;
-        gboolean ret;
-        int size;
+	int size;
 	int i;
-        
-        /* Don't deadlock here, this is callback and we're not completely
-         * sure when we'll be called */
-        if (!g_mutex_trylock (smb_lock))
-                return TRUE;
-        DEBUG_SMB(("LOCK %s\n", G_STRFUNC));
 
-	size = g_hash_table_size (server_cache);
+	size = g_hash_table_size (connection->server_cache);
 	servers = g_ptr_array_sized_new (size);
 
 	/* The remove can change the hashtable, make a copy */
-	g_hash_table_foreach (server_cache, add_old_servers, servers);
+	g_hash_table_foreach (connection->server_cache, add_old_servers, servers);
 		
 	for (i = 0; i < servers->len; i++) {
-		smbc_remove_unused_server (smb_context,
+		smbc_remove_unused_server (connection->context,
 					   (SMBCSRV *)g_ptr_array_index (servers, i));
 	}
 
 	g_ptr_array_free (servers, TRUE);
+
+	/* Keep the browsing connections, see connection_get () */
+	if (connection->users > 0 ||
+	    connection->server[0] == 0 ||
+	    g_hash_table_size (connection->server_cache) > 0 ||
+	    smbc_free_context (connection->context, FALSE) != 0) {
+		return FALSE;
+	}
+
+	UNLOCK_SMB (connection);
+	connection_free (connection);
+	return TRUE;
+}
+
+static gboolean
+cache_reap_cb (void)
+{
+	SmbConnection *connection;
+	GList *l, *next;
+        gboolean ret;
+
+	ret = FALSE;
+
+	G_LOCK (connections);
+	for (l = connections; l != NULL; l = next) {
+		next = l->next;
+		connection = l->data;
+
+		/* Don't deadlock here, this is callback and we're not
+		 * completely sure when we'll be called */
+		if (!g_mutex_trylock (connection->lock)) {
+			ret = TRUE;
+			continue;
+		}
+		LOCK_LIBSMBCLIENT ();
+		g_static_private_set (&current_connection, connection, NULL);
+		DEBUG_SMB(("LOCK %s %s\n", G_STRFUNC, connection->server));
+
+		if (reap_connection (connection)) {
+			connections = g_list_delete_link (connections, l);
+			continue;
+		}
+
+		if (connection->server[0] != 0) {
+			ret = TRUE;
+		}
+		UNLOCK_SMB (connection);
+	}
+	G_UNLOCK (connections);
      
         /* Cleanup users */
+	G_LOCK (user_cache);
         g_hash_table_foreach_remove (user_cache, reap_user, NULL);
+	if (g_hash_table_size (user_cache) > 0)
+		ret = TRUE;
+	G_UNLOCK (user_cache);
 
-        ret = !(g_hash_table_size (server_cache) == 0 && 
-                g_hash_table_size (user_cache) == 0);
+	G_LOCK (cache_reap_timeout);
         if (!ret)
                 cache_reap_timeout = 0;
-
-        UNLOCK_SMB();
+	G_UNLOCK (cache_reap_timeout);
 
         return ret;        
 }
@@ -350,10 +494,12 @@ cache_reap_cb (void)
 static void
 schedule_cache_reap (void)
 {
+	G_LOCK (cache_reap_timeout);
 	if (cache_reap_timeout == 0) {
 		cache_reap_timeout = g_timeout_add (CACHE_REAP_TIMEOUT * 1000,
 						    (GSourceFunc)cache_reap_cb, NULL);
 	}
+	G_UNLOCK (cache_reap_timeout);
 }
 
 static int
@@ -361,8 +507,11 @@ add_cached_server (SMBCCTX *context, SMBCSRV *new,
 		   const char *server_name, const char *share_name, 
 		   const char *domain, const char *username)
 {
+	SmbConnection *connection;
 	SmbServerCacheEntry *entry = NULL;
 
+	connection = get_current_connection (context);
+
 	DEBUG_SMB(("[auth] adding cached server: server: %s, share: %s, domain: %s, user: %s\n",
 		   server_name ? server_name : "", 
 		   share_name ? share_name : "",
@@ -381,13 +530,15 @@ add_cached_server (SMBCCTX *context, SMBCSRV *new,
 	entry->username = string_dup_nzero (username);
 	entry->last_time = time (NULL);
 
-	g_hash_table_insert (server_cache, entry, entry);
-	current_auth_context->cache_added = TRUE;
+	g_hash_table_insert (connection->server_cache, entry, entry);
+	if (connection->auth_context != NULL)
+		connection->auth_context->cache_added = TRUE;
 	return 0;
 }
 
 static SMBCSRV *
-find_cached_server (const char *server_name, const char *share_name,
+find_cached_server (SmbConnection *connection,
+		    const char *server_name, const char *share_name,
                     const char *domain, const char *username)
 {
 	SmbServerCacheEntry entry;
@@ -405,7 +556,7 @@ find_cached_server (const char *server_name, const char *share_name,
 	entry.domain = (char *) string_nzero (domain);
 	entry.username = (char *) string_nzero (username);
 
-	res = g_hash_table_lookup (server_cache, &entry);
+	res = g_hash_table_lookup (connection->server_cache, &entry);
 
 	if (res != NULL) {
 		res->last_time = time (NULL);
@@ -420,16 +571,19 @@ get_cached_server (SMBCCTX * context,
 		   const char *server_name, const char *share_name,
 		   const char *domain, const char *username)
 {
+	SmbConnection *connection;
 	SMBCSRV *srv;
 	
-	srv = find_cached_server (server_name, share_name, domain, username);
+	connection = get_current_connection (context);
+	srv = find_cached_server (connection, server_name, share_name, domain, username);
 	if (srv != NULL) {
 		DEBUG_SMB(("got cached server: server: %s, share: %s, domain: %s, user: %s\n",
 		   	   server_name ? server_name : "", 
 			   share_name ? share_name : "",
 			   domain ? domain : "", 
 			   username ? username : ""));
-		current_auth_context->cache_used = TRUE;
+		if (connection->auth_context != NULL)
+			connection->auth_context->cache_used = TRUE;
 		return srv;
 	}
 	return NULL;
@@ -453,9 +607,11 @@ remove_server  (gpointer key,
 
 static int remove_cached_server(SMBCCTX * context, SMBCSRV * server)
 {
+	SmbConnection *connection;
 	int removed;
 	
-	removed = g_hash_table_foreach_remove (server_cache, remove_server, server);
+	connection = get_current_connection (context);
+	removed = g_hash_table_foreach_remove (connection->server_cache, remove_server, server);
 
 	/* return 1 if failed */
 	return removed == 0;
@@ -478,16 +634,18 @@ add_server (gpointer key,
 static int
 purge_cached(SMBCCTX * context)
 {
+	SmbConnection *connection;
 	int size;
 	GPtrArray *servers;
 	gboolean could_not_purge_all;
 	int i;
 
-	size = g_hash_table_size (server_cache);
+	connection = get_current_connection (context);
+	size = g_hash_table_size (connection->server_cache);
 	servers = g_ptr_array_sized_new (size);
 
 	/* The remove can change the hashtable, make a copy */
-	g_hash_table_foreach (server_cache, add_server, servers);
+	g_hash_table_foreach (connection->server_cache, add_server, servers);
 		
 	could_not_purge_all = FALSE;
 	for (i = 0; i < servers->len; i++) {
@@ -504,52 +662,192 @@ purge_cached(SMBCCTX * context)
 }
 
 
-static gboolean
-remove_all (gpointer  key,
-	    gpointer  value,
-	    gpointer  user_data)
+/* Call with the connections lock held */
+static SMBCCTX *
+create_context (void)
 {
-	return TRUE;
+	SMBCCTX *context;
+
+	LOCK_LIBSMBCLIENT ();
+
+	context = smbc_new_context ();
+	if (context == NULL) {
+		UNLOCK_LIBSMBCLIENT ();
+		return NULL;
+	}
+
+	context->debug = 0;
+	context->callbacks.auth_fn 		 = auth_callback;
+	context->callbacks.add_cached_srv_fn    = add_cached_server;
+	context->callbacks.get_cached_srv_fn    = get_cached_server;
+	context->callbacks.remove_cached_srv_fn = remove_cached_server;
+	context->callbacks.purge_cached_fn      = purge_cached;
+
+	/* libsmbclient frees this on it's own, so make sure 
+	 * to use simple system malloc */
+	if (default_workgroup != NULL)
+		context->workgroup = strdup (default_workgroup);
+
+	if (!smbc_init_context (context)) {
+		smbc_free_context (context, FALSE);
+		UNLOCK_LIBSMBCLIENT ();
+		return NULL;
+	}
+
+#if defined(HAVE_SAMBA_FLAGS) 
+#if defined(SMB_CTX_FLAG_USE_KERBEROS) && defined(SMB_CTX_FLAG_FALLBACK_AFTER_KERBEROS)
+	context->flags |= SMB_CTX_FLAG_USE_KERBEROS | SMB_CTX_FLAG_FALLBACK_AFTER_KERBEROS;
+#endif
+#if defined(SMBCCTX_FLAG_NO_AUTO_ANONYMOUS_LOGON)
+	context->flags |= SMBCCTX_FLAG_NO_AUTO_ANONYMOUS_LOGON;
+#endif
+#endif		
+
+	UNLOCK_LIBSMBCLIENT ();
+
+	return context;
+}
+
+/* Returns the least busy connection for server, adding one if they are
+ * all in use and there are fewer than contexts_per_server. When no
+ * context can be made it falls back to any other connection, since
+ * every context can reach every server; try_init () makes sure there is
+ * one. Give it back with connection_release ().
+ */
+static SmbConnection *
+connection_get (const char *server)
+{
+	SmbConnection *connection, *best, *any;
+	SMBCCTX *context;
+	guint count;
+	GList *l;
+
+	G_LOCK (connections);
+
+	best = NULL;
+	any = NULL;
+	count = 0;
+	for (l = connections; l != NULL; l = l->next) {
+		connection = l->data;
+		if (any == NULL || connection->users < any->users) {
+			any = connection;
+		}
+		if (strcmp (connection->server, server) != 0) {
+			continue;
+		}
+		count++;
+		if (best == NULL || connection->users < best->users) {
+			best = connection;
+		}
+	}
+
+	if ((best == NULL || best->users > 0) && count < contexts_per_server) {
+		context = create_context ();
+		if (context != NULL) {
+			DEBUG_SMB(("connection_get: new context %d for '%s'\n",
+				   count + 1, server));
+			best = g_new0 (SmbConnection, 1);
+			best->server = g_strdup (server);
+			best->context = context;
+			best->lock = g_mutex_new ();
+			best->server_cache = g_hash_table_new_full (server_hash, server_equal,
+								    (GDestroyNotify)server_free, NULL);
+			connections = g_list_prepend (connections, best);
+		}
+	}
+
+	if (best == NULL) {
+		best = any;
+	}
+	if (best != NULL) {
+		best->users++;
+	}
+
+	G_UNLOCK (connections);
+
+	return best;
+}
+
+static SmbConnection *
+connection_get_for_uri (GnomeVFSURI *uri, SmbUriType type)
+{
+	SmbConnection *connection;
+	const char *host_name;
+	char *unescaped, *server;
+
+	host_name = gnome_vfs_uri_get_host_name (uri);
+
+	/* Workgroup URIs have the workgroup in place of the host */
+	if (type == SMB_URI_WHOLE_NETWORK ||
+	    type == SMB_URI_WORKGROUP_LINK ||
+	    type == SMB_URI_WORKGROUP ||
+	    type == SMB_URI_SERVER_LINK ||
+	    host_name == NULL) {
+		return connection_get ("");
+	}
+
+	unescaped = gnome_vfs_unescape_string (host_name, G_DIR_SEPARATOR_S);
+	server = g_ascii_strdown (unescaped != NULL ? unescaped : host_name, -1);
+	connection = connection_get (server);
+	g_free (server);
+	g_free (unescaped);
+
+	return connection;
+}
+
+static void
+connection_release (SmbConnection *connection)
+{
+	G_LOCK (connections);
+	connection->users--;
+	G_UNLOCK (connections);
 }
 
 static void
 update_workgroup_cache (void)
 {
+	SmbConnection *connection;
 	SmbAuthContext actx;
 	SMBCFILE *dir = NULL;
+	GHashTable *found;
 	time_t t;
 	struct smbc_dirent *dirent;
 	
+	G_LOCK (workgroups);
 	t = time (NULL);
 
 	if (workgroups_timestamp != 0 &&
 	    workgroups_timestamp < t &&
 	    t < workgroups_timestamp + WORKGROUP_CACHE_TIMEOUT) {
 		/* Up to date */
+		G_UNLOCK (workgroups);
 		return;
 	}
 	workgroups_timestamp = t;
+	G_UNLOCK (workgroups);
 
 	DEBUG_SMB(("update_workgroup_cache: enumerating workgroups\n"));
 	
-	g_hash_table_foreach_remove (workgroups, remove_all, NULL);
-	
-	LOCK_SMB();
+	found = g_hash_table_new_full (g_str_hash, g_str_equal,
+				       g_free, NULL);
+
+	connection = connection_get ("");
+	LOCK_SMB (connection);
 	
-	init_authentication (&actx, NULL);
+	init_authentication (&actx, connection, NULL);
 	
 	/* Important: perform_authentication leaves and re-enters the lock! */
 	while (perform_authentication (&actx) > 0) {
-		dir = smb_context->opendir (smb_context, "smb://");
+		dir = connection->context->opendir (connection->context, "smb://");
 		actx.res = (dir != NULL) ? GNOME_VFS_OK : gnome_vfs_result_from_errno ();
 	}
 
 	if (dir != NULL) {
-		while ((dirent = smb_context->readdir (smb_context, dir)) != NULL) {
+		while ((dirent = connection->context->readdir (connection->context, dir)) != NULL) {
 			if (dirent->smbc_type == SMBC_WORKGROUP &&
 			    dirent->name != NULL &&
 			    strlen (dirent->name) > 0) {
-				g_hash_table_insert (workgroups,
+				g_hash_table_insert (found,
 						     g_ascii_strdown (dirent->name, -1),
 						     GINT_TO_POINTER (1));
 			} else {
@@ -557,9 +855,30 @@ update_workgroup_cache (void)
 			}
 		}
 
-		smb_context->closedir (smb_context, dir);
+		connection->context->closedir (connection->context, dir);
 	}
-	UNLOCK_SMB();
+	UNLOCK_SMB (connection);
+	connection_release (connection);
+
+	G_LOCK (workgroups);
+	g_hash_table_destroy (workgroups);
+	workgroups = found;
+	G_UNLOCK (workgroups);
+}
+
+static gboolean
+is_workgroup (const char *name)
+{
+	gboolean found;
+
+	if (!g_ascii_strcasecmp (name, DEFAULT_WORKGROUP_NAME))
+		return TRUE;
+
+	G_LOCK (workgroups);
+	found = g_hash_table_lookup (workgroups, name) != NULL;
+	G_UNLOCK (workgroups);
+
+	return found;
 }
 
 static SmbUriType
@@ -592,9 +911,7 @@ smb_uri_type (GnomeVFSURI *uri)
 		                                       G_DIR_SEPARATOR_S);
 		if (!host_name)
 			return SMB_URI_ERROR;
-		if (!g_ascii_strcasecmp(host_name,
-					DEFAULT_WORKGROUP_NAME) ||
-		    g_hash_table_lookup (workgroups, host_name)) {
+		if (is_workgroup (host_name)) {
 			g_free (host_name);
 			return SMB_URI_WORKGROUP;
 		} else {
@@ -610,9 +927,7 @@ smb_uri_type (GnomeVFSURI *uri)
 		                                       G_DIR_SEPARATOR_S);
 		if (!host_name)
 			return SMB_URI_ERROR;
-		if (!g_ascii_strcasecmp(host_name,
-					DEFAULT_WORKGROUP_NAME) ||
-		    g_hash_table_lookup (workgroups, host_name)) {
+		if (is_workgroup (host_name)) {
 			g_free (host_name);
 			return SMB_URI_SERVER_LINK;
 		} else {
@@ -624,6 +939,22 @@ smb_uri_type (GnomeVFSURI *uri)
 	return SMB_URI_SHARE_FILE;
 }
 
+/* Same as smb_uri_type () == SMB_URI_SHARE_FILE, but never needs the
+ * workgroup list, so it can be used with a connection locked */
+static gboolean
+smb_uri_is_share_file (GnomeVFSURI *uri)
+{
+	GnomeVFSToplevelURI *toplevel;
+
+	toplevel = (GnomeVFSToplevelURI *)uri;
+
+	return toplevel->host_name != NULL &&
+		toplevel->host_name[0] != 0 &&
+		uri->text != NULL &&
+		uri->text[0] != 0 &&
+		strchr (uri->text + 1, '/') != NULL;
+}
+
 
 
 static gboolean
@@ -655,13 +986,12 @@ is_hidden_entry (char *name)
 static gboolean
 try_init (void)
 {
+	SmbConnection *connection;
 	char *path;
 	GConfClient *gclient;
 	gchar *workgroup;
 	struct stat statbuf;
 
-	LOCK_SMB();
-
 	/* We used to create an empty ~/.smb/smb.conf to get
 	 * default settings, but this breaks a lot of smb.conf
 	 * configurations, so we remove this again. If you really
@@ -677,57 +1007,30 @@ try_init (void)
 	}
 	g_free (path);
 
-	smb_context = smbc_new_context ();
-	if (smb_context != NULL) {
-		smb_context->debug = 0;
-		smb_context->callbacks.auth_fn 		    = auth_callback;
-		smb_context->callbacks.add_cached_srv_fn    = add_cached_server;
-		smb_context->callbacks.get_cached_srv_fn    = get_cached_server;
-		smb_context->callbacks.remove_cached_srv_fn = remove_cached_server;
-		smb_context->callbacks.purge_cached_fn      = purge_cached;
-
-		gclient = gconf_client_get_default ();
-		if (gclient) {
-			workgroup = gconf_client_get_string (gclient, 
-					PATH_GCONF_GNOME_VFS_SMB_WORKGROUP, NULL);
-
-			/* libsmbclient frees this on it's own, so make sure 
-			 * to use simple system malloc */
-			if (workgroup && workgroup[0])
-				smb_context->workgroup = strdup (workgroup);
-			
-			g_free (workgroup);
-			g_object_unref (gclient);
-		}
-
-		if (!smbc_init_context (smb_context)) {
-			smbc_free_context (smb_context, FALSE);
-			smb_context = NULL;
-		}
+	gclient = gconf_client_get_default ();
+	if (gclient) {
+		workgroup = gconf_client_get_string (gclient, 
+				PATH_GCONF_GNOME_VFS_SMB_WORKGROUP, NULL);
 
-#if defined(HAVE_SAMBA_FLAGS) 
-#if defined(SMB_CTX_FLAG_USE_KERBEROS) && defined(SMB_CTX_FLAG_FALLBACK_AFTER_KERBEROS)
-		smb_context->flags |= SMB_CTX_FLAG_USE_KERBEROS | SMB_CTX_FLAG_FALLBACK_AFTER_KERBEROS;
-#endif
-#if defined(SMBCCTX_FLAG_NO_AUTO_ANONYMOUS_LOGON)
-		smb_context->flags |= SMBCCTX_FLAG_NO_AUTO_ANONYMOUS_LOGON;
-#endif
-#endif		
+		if (workgroup && workgroup[0])
+			default_workgroup = g_strdup (workgroup);
+			
+		g_free (workgroup);
+		g_object_unref (gclient);
 	}
 
-	server_cache = g_hash_table_new_full (server_hash, server_equal,
-					      (GDestroyNotify)server_free, NULL);
 	workgroups = g_hash_table_new_full (g_str_hash, g_str_equal,
 					    g_free, NULL);
 	user_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
                                             g_free, (GDestroyNotify)user_free);
-	
-	UNLOCK_SMB();
 
-	if (smb_context == NULL) {
+	/* The first browsing connection, which is kept until shutdown */
+	connection = connection_get ("");
+	if (connection == NULL) {
 		g_warning ("Could not initialize samba client library\n");
 		return FALSE;
 	}
+	connection_release (connection);
 
 	return TRUE;
 }
@@ -766,6 +1069,7 @@ update_user_cache (SmbAuthContext *actx, gboolean with_share)
         g_return_if_fail (actx->for_server != NULL);
         
         key = g_strdup_printf ("%s/%s", actx->for_server, with_share ? actx->for_share : "");
+	G_LOCK (user_cache);
         user = (SmbCachedUser*)g_hash_table_lookup (user_cache, key);
         
         DEBUG_SMB(("[auth] Saved in cache: %s = %s:%s@%s\n", key,
@@ -785,6 +1089,7 @@ update_user_cache (SmbAuthContext *actx, gboolean with_share)
         user->username = string_realloc (user->username, actx->use_user);
         user->password = string_realloc (user->password, actx->use_password);
         user->stamp = time (NULL);
+	G_UNLOCK (user_cache);
 }
 
 static gboolean
@@ -796,17 +1101,19 @@ lookup_user_cache (SmbAuthContext *actx, gboolean with_share)
         g_return_val_if_fail (actx->for_server != NULL, FALSE);
        
         key = g_strdup_printf ("%s/%s", actx->for_server, with_share ? actx->for_share : "");
+	G_LOCK (user_cache);
         user = (SmbCachedUser*)g_hash_table_lookup (user_cache, key);
         g_free (key);
        
         if (user) {
                 /* If we already have a user name or domain double check that... */
-		if (!(actx->prompt_flags & GNOME_VFS_MODULE_CALLBACK_FULL_AUTHENTICATION_NEED_USERNAME) &&
-		    !string_compare(user->username, actx->use_user))
-			return FALSE;
-		if (!(actx->prompt_flags & GNOME_VFS_MODULE_CALLBACK_FULL_AUTHENTICATION_NEED_DOMAIN) &&
-		    !string_compare(user->domain, actx->use_domain))
+		if ((!(actx->prompt_flags & GNOME_VFS_MODULE_CALLBACK_FULL_AUTHENTICATION_NEED_USERNAME) &&
+		     !string_compare(user->username, actx->use_user)) ||
+		    (!(actx->prompt_flags & GNOME_VFS_MODULE_CALLBACK_FULL_AUTHENTICATION_NEED_DOMAIN) &&
+		     !string_compare(user->domain, actx->use_domain))) {
+			G_UNLOCK (user_cache);
 			return FALSE;
+		}
 
                 actx->use_user = string_realloc (actx->use_user, user->username);
                 actx->use_domain = string_realloc (actx->use_domain, user->domain);
@@ -815,16 +1122,18 @@ lookup_user_cache (SmbAuthContext *actx, gboolean with_share)
 			   actx->use_user ? actx->use_user : "",
 			   actx->use_domain ? actx->use_domain : "",
 			   actx->use_password ? actx->use_password : ""));
+		G_UNLOCK (user_cache);
                 return TRUE;
         }
         
+	G_UNLOCK (user_cache);
         return FALSE;
 }      
 
 static gboolean
 initial_authentication (SmbAuthContext *actx)
 {
-	/* IMPORTANT: We are IN the lock at this point */
+	/* IMPORTANT: We are IN the connection lock at this point */
 	
 	GnomeVFSToplevelURI *toplevel_uri;
 	SmbServerCacheEntry server_lookup;
@@ -881,14 +1190,14 @@ initial_authentication (SmbAuthContext *actx)
         	server_lookup.username = (char*)actx->use_user;
         	server_lookup.domain = (char*)actx->use_domain;
         		
-        	server = g_hash_table_lookup (server_cache, &server_lookup);
+        	server = g_hash_table_lookup (actx->connection->server_cache, &server_lookup);
         	if (server == NULL) {
                  
                         /* If a blank user, try looking up 'guest' */
                         if (!actx->use_user) {
                                 server_lookup.username = GUEST_LOGIN;
                                 server_lookup.domain = NULL;
-                                server = g_hash_table_lookup (server_cache, &server_lookup);
+                                server = g_hash_table_lookup (actx->connection->server_cache, &server_lookup);
                         }
                 }
                 
@@ -1025,7 +1334,7 @@ prompt_authentication (SmbAuthContext *actx,
 	if (!in_args.default_user)
 		in_args.default_user = (char*)g_get_user_name ();
 	
-	in_args.default_domain = actx->use_domain ? actx->use_domain : smb_context->workgroup;
+	in_args.default_domain = actx->use_domain ? actx->use_domain : actx->connection->context->workgroup;
 	
 	memset (&out_args, 0, sizeof (out_args));
 
@@ -1149,7 +1458,7 @@ save_authentication (SmbAuthContext *actx)
 static void
 cleanup_authentication (SmbAuthContext *actx)
 {
-	/* IMPORTANT: We are IN the lock at this point */
+	/* IMPORTANT: We are IN the connection lock at this point */
 	
 	DEBUG_SMB(("[auth] Cleaning up Authentication\n"));
 	g_return_if_fail (actx != NULL);
@@ -1172,27 +1481,31 @@ cleanup_authentication (SmbAuthContext *actx)
 	g_free (actx->keyring);
 	actx->keyring = NULL;
 	
-	g_return_if_fail (current_auth_context == actx);
-	current_auth_context = NULL;
+	g_return_if_fail (actx->connection->auth_context == actx);
+	actx->connection->auth_context = NULL;
 }
 
 /* 
  * This is the workhorse of all the authentication and caching work.
- * It is called in a loop, and must be called from within the lock:
+ * It is called in a loop, and must be called from within the lock of the
+ * connection the operation runs on:
  * 
  * static GnomeVFSResult
  * function_xxxx (GnomeVFSURI* uri)
  * {
+ * 	SmbConnection *connection;
  * 	SmbAuthContext actx;
  * 
- * 	LOCK_SMB ();
- * 	init_authentication (&actx);
+ * 	connection = connection_get_for_uri (uri, type);
+ * 	LOCK_SMB (connection);
+ * 	init_authentication (&actx, connection, uri);
  * 
  * 	while (perform_authentication (&actx) > 0) {
  * 		actx.res = gnome_vfs_result_from_errno_code (the_operation_here ());
  * 	}
  * 
- * 	UNLOCK_SMB();
+ * 	UNLOCK_SMB (connection);
+ * 	connection_release (connection);
  * 
  * 	return actx.err;
  * }
@@ -1206,10 +1519,11 @@ cleanup_authentication (SmbAuthContext *actx)
  */
 
 static void 
-init_authentication (SmbAuthContext *actx, GnomeVFSURI *uri)
+init_authentication (SmbAuthContext *actx, SmbConnection *connection, GnomeVFSURI *uri)
 {
 	DEBUG_SMB(("[auth] Initializing Authentication\n"));
 	memset (actx, 0, sizeof(*actx));
+	actx->connection = connection;
 	actx->uri = uri;
 }
 
@@ -1219,7 +1533,7 @@ perform_authentication (SmbAuthContext *actx)
 	gboolean cont, auth_failed = FALSE, auth_cancelled = FALSE;
 	int ret = -1;
 	
-	/* IMPORTANT: We are IN the lock at this point */
+	/* IMPORTANT: We are IN the connection lock at this point */
 	DEBUG_SMB(("[auth] perform_authentication called.\n"));
 	
 	switch (actx->res) {
@@ -1248,9 +1562,9 @@ perform_authentication (SmbAuthContext *actx)
 
 		DEBUG_SMB(("[auth] First authentication pass\n"));
 	
-		/* Our auth context is the global one for the moment */
-		g_return_val_if_fail (current_auth_context == NULL, GNOME_VFS_ERROR_INTERNAL);
-		current_auth_context = actx;
+		/* Our auth context is the connection's one for the moment */
+		g_return_val_if_fail (actx->connection->auth_context == NULL, GNOME_VFS_ERROR_INTERNAL);
+		actx->connection->auth_context = actx;
 			
 		/* Continue with perform_authentication loop ... */
 		ret = 1;
@@ -1258,8 +1572,8 @@ perform_authentication (SmbAuthContext *actx)
 	/* Subsequent passes */
 	} else {
 
-		/* We should still be the global context at this point */
-		g_return_val_if_fail (current_auth_context == actx, GNOME_VFS_ERROR_INTERNAL);
+		/* We should still be the connection's context at this point */
+		g_return_val_if_fail (actx->connection->auth_context == actx, GNOME_VFS_ERROR_INTERNAL);
 		
 		/* A successful operation. Done! */
 		if (!auth_failed) {
@@ -1271,7 +1585,7 @@ perform_authentication (SmbAuthContext *actx)
 		/* If authentication failed, but we already have a connection 
 		   ... and access failed on a file, then we return the error */
 		} else if ((actx->cache_used && !actx->cache_added) && 
-			(!actx->uri || smb_uri_type (actx->uri) == SMB_URI_SHARE_FILE)) {
+			(!actx->uri || smb_uri_is_share_file (actx->uri))) {
 
 			DEBUG_SMB(("[auth] Not reauthenticating a open connection.\n"));
 			ret = -1;
@@ -1282,11 +1596,11 @@ perform_authentication (SmbAuthContext *actx)
 			/* We need a server to perform any authentication */
 			g_return_val_if_fail (actx->for_server != NULL, GNOME_VFS_ERROR_INTERNAL);
 			
-			/* We won't be the global context for now */
-			current_auth_context = NULL;
+			/* We won't be the connection's context for now */
+			actx->connection->auth_context = NULL;
 			cont = FALSE;
 			
-			UNLOCK_SMB();
+			UNLOCK_SMB (actx->connection);
 			
 				/* Do we have gnome-keyring credentials for this? */
 				if (!(actx->state & SMB_AUTH_STATE_PREFILLED)) {
@@ -1310,11 +1624,11 @@ perform_authentication (SmbAuthContext *actx)
 				if (!cont)
 					cont = prompt_authentication (actx, &auth_cancelled);
 				
-			LOCK_SMB();
+			LOCK_SMB (actx->connection);
 			
-			/* Claim the global context back */
-			g_return_val_if_fail (current_auth_context == NULL, GNOME_VFS_ERROR_INTERNAL);
-			current_auth_context = actx;
+			/* Claim the connection's context back */
+			g_return_val_if_fail (actx->connection->auth_context == NULL, GNOME_VFS_ERROR_INTERNAL);
+			actx->connection->auth_context = actx;
 			
 			if (cont)
 				ret = 1;
@@ -1350,7 +1664,8 @@ auth_callback (const char *server_name, const char *share_name,
 	       char *username_out, int unmaxlen,
 	       char *password_out, int pwmaxlen)
 {
-	/* IMPORTANT: We are IN the global lock */
+	/* IMPORTANT: We are IN the connection lock */
+	SmbConnection *connection;
 	SmbAuthContext *actx;
 	SMBCSRV *server;
 	
@@ -1358,8 +1673,9 @@ auth_callback (const char *server_name, const char *share_name,
 		    server_name ? server_name : "", 
 		    share_name ? share_name : ""));
 
-	g_return_if_fail (current_auth_context != NULL);
-	actx = current_auth_context;
+	connection = get_current_connection (NULL);
+	g_return_if_fail (connection->auth_context != NULL);
+	actx = connection->auth_context;
 	
 	/* We never authenticate for the toplevel (enumerating workgroups) */
 	if (!server_name || !server_name[0])
@@ -1402,8 +1718,8 @@ auth_callback (const char *server_name, const char *share_name,
 	}
 
 	/* Put in the default workgroup if none specified */
-	if (domain_out[0] == 0 && smb_context->workgroup)
-		strncpy (domain_out, smb_context->workgroup, domainmaxlen);
+	if (domain_out[0] == 0 && connection->context->workgroup)
+		strncpy (domain_out, connection->context->workgroup, domainmaxlen);
 
 	/* 
 	 * If authentication is requested a second time on a server we've 
@@ -1411,10 +1727,10 @@ auth_callback (const char *server_name, const char *share_name,
 	 * this doesn't make much sense, but such is life with libsmbclient.
 	 */
 	if ((actx->state & SMB_AUTH_STATE_PROMPTED) && actx->res != GNOME_VFS_OK) {
-		server = find_cached_server (server_name, share_name, domain_out, username_out);
+		server = find_cached_server (connection, server_name, share_name, domain_out, username_out);
 		if (server) {
 			DEBUG_SMB (("[auth] auth_callback. Remove the wrong server entry from server_cache.\n"));
-			g_hash_table_foreach_remove (server_cache, remove_server, server);
+			g_hash_table_foreach_remove (connection->server_cache, remove_server, server);
 		}
 	}
 }
@@ -1457,15 +1773,401 @@ get_base_from_uri (GnomeVFSURI const *uri)
 
 
 
+typedef struct _SmbPipeline SmbPipeline;
+
 typedef struct {
+	SmbConnection *connection;
 	SMBCFILE *file;
 	gboolean is_data;
 	char *file_data;
 	int fnum;
 	GnomeVFSFileOffset offset;
 	GnomeVFSFileOffset file_size;
+
+	GnomeVFSOpenMode mode;
+	/* Reads or writes since the last seek */
+	guint sequential_calls;
+	SmbPipeline *pipeline;
 } FileHandle;
 
+typedef struct {
+	guchar *data;
+	gsize len;
+} SmbPipelineBlock;
+
+/* Keeps the file of a handle busy while its user is doing something
+ * else: a thread reads up to pipeline_depth requests ahead of the user,
+ * or writes what do_write () queued behind it. The thread works on the
+ * handle's own connection and file, so whatever else is done with the
+ * handle has to pipeline_stop () it first.
+ */
+struct _SmbPipeline {
+	FileHandle *handle;
+	gboolean writing;
+
+	GMutex *lock;
+	GCond *cond;
+	GThread *thread;
+
+	/* Blocks read and not handed out yet, or queued for writing */
+	GQueue *blocks;
+	/* Bytes of the first block already handed out */
+	gsize head_offset;
+
+	gboolean stop;
+	/* Set when the thread gave up, with the reason */
+	gboolean done;
+	GnomeVFSResult result;
+};
+
+static void
+pipeline_block_free (SmbPipelineBlock *block)
+{
+	g_free (block->data);
+	g_free (block);
+}
+
+static gpointer
+pipeline_read_thread (gpointer data)
+{
+	SmbPipeline *pipeline;
+	SmbConnection *connection;
+	SmbPipelineBlock *block;
+	SmbAuthContext actx;
+	ssize_t n;
+
+	pipeline = data;
+	connection = pipeline->handle->connection;
+
+	for (;;) {
+		g_mutex_lock (pipeline->lock);
+		while (!pipeline->stop &&
+		       g_queue_get_length (pipeline->blocks) >= pipeline_depth) {
+			g_cond_wait (pipeline->cond, pipeline->lock);
+		}
+		if (pipeline->stop) {
+			g_mutex_unlock (pipeline->lock);
+			break;
+		}
+		g_mutex_unlock (pipeline->lock);
+
+		block = g_new (SmbPipelineBlock, 1);
+		block->data = g_malloc (request_size);
+		n = -1;
+
+		LOCK_SMB (connection);
+		init_authentication (&actx, connection, NULL);
+		
+		/* Important: perform_authentication leaves and re-enters the lock! */
+		while (perform_authentication (&actx) > 0) {
+			n = connection->context->read (connection->context, pipeline->handle->file,
+						       block->data, request_size);
+			actx.res = (n >= 0) ? GNOME_VFS_OK : gnome_vfs_result_from_errno ();
+		}
+		UNLOCK_SMB (connection);
+
+		g_mutex_lock (pipeline->lock);
+		if (n <= 0) {
+			pipeline_block_free (block);
+			pipeline->result = (n == 0) ? GNOME_VFS_ERROR_EOF : actx.res;
+			pipeline->done = TRUE;
+			g_cond_broadcast (pipeline->cond);
+			g_mutex_unlock (pipeline->lock);
+			break;
+		}
+		block->len = n;
+		g_queue_push_tail (pipeline->blocks, block);
+		g_cond_broadcast (pipeline->cond);
+		g_mutex_unlock (pipeline->lock);
+	}
+
+	return NULL;
+}
+
+static GnomeVFSResult
+write_block (SmbConnection *connection,
+	     SMBCFILE *file,
+	     SmbPipelineBlock *block)
+{
+	SmbAuthContext actx;
+	ssize_t written;
+	gsize done;
+
+	for (done = 0; done < block->len; done += written) {
+		written = -1;
+
+		LOCK_SMB (connection);
+		init_authentication (&actx, connection, NULL);
+
+		/* Important: perform_authentication leaves and re-enters the lock! */
+		while (perform_authentication (&actx) > 0) {
+			written = connection->context->write (connection->context, file,
+							      block->data + done, block->len - done);
+			actx.res = (written >= 0) ? GNOME_VFS_OK : gnome_vfs_result_from_errno ();
+		}
+		UNLOCK_SMB (connection);
+
+		if (written < 0) {
+			return actx.res;
+		}
+		if (written == 0) {
+			return GNOME_VFS_ERROR_IO;
+		}
+	}
+
+	return GNOME_VFS_OK;
+}
+
+static gpointer
+pipeline_write_thread (gpointer data)
+{
+	SmbPipeline *pipeline;
+	SmbPipelineBlock *block;
+	GnomeVFSResult result;
+
+	pipeline = data;
+
+	for (;;) {
+		g_mutex_lock (pipeline->lock);
+		while (!pipeline->stop &&
+		       g_queue_is_empty (pipeline->blocks)) {
+			g_cond_wait (pipeline->cond, pipeline->lock);
+		}
+		/* When stopped, the queue is still written out */
+		block = g_queue_pop_head (pipeline->blocks);
+		g_cond_broadcast (pipeline->cond);
+		g_mutex_unlock (pipeline->lock);
+
+		if (block == NULL) {
+			break;
+		}
+
+		result = write_block (pipeline->handle->connection,
+				      pipeline->handle->file, block);
+		pipeline_block_free (block);
+
+		if (result != GNOME_VFS_OK) {
+			g_mutex_lock (pipeline->lock);
+			pipeline->result = result;
+			pipeline->done = TRUE;
+			g_cond_broadcast (pipeline->cond);
+			g_mutex_unlock (pipeline->lock);
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static void
+pipeline_start (FileHandle *handle, gboolean writing)
+{
+	SmbPipeline *pipeline;
+
+	pipeline = g_new0 (SmbPipeline, 1);
+	pipeline->handle = handle;
+	pipeline->writing = writing;
+	pipeline->lock = g_mutex_new ();
+	pipeline->cond = g_cond_new ();
+	pipeline->blocks = g_queue_new ();
+	pipeline->result = GNOME_VFS_OK;
+
+	pipeline->thread = g_thread_create (writing ? pipeline_write_thread : pipeline_read_thread,
+					    pipeline, TRUE, NULL);
+	if (pipeline->thread == NULL) {
+		/* Do without */
+		g_queue_free (pipeline->blocks);
+		g_mutex_free (pipeline->lock);
+		g_cond_free (pipeline->cond);
+		g_free (pipeline);
+		return;
+	}
+
+	handle->pipeline = pipeline;
+}
+
+/* Waits for the thread, after it wrote out everything queued. Puts the
+ * file back at the offset the user is at, which reading ahead moved on.
+ * Returns the result of the queued writes. */
+static GnomeVFSResult
+pipeline_stop (FileHandle *handle)
+{
+	SmbPipeline *pipeline;
+	SmbConnection *connection;
+	SmbPipelineBlock *block;
+	SmbAuthContext actx;
+	GnomeVFSResult result;
+	off_t ret;
+
+	pipeline = handle->pipeline;
+	handle->pipeline = NULL;
+
+	g_mutex_lock (pipeline->lock);
+	pipeline->stop = TRUE;
+	g_cond_broadcast (pipeline->cond);
+	g_mutex_unlock (pipeline->lock);
+
+	g_thread_join (pipeline->thread);
+
+	result = GNOME_VFS_OK;
+	if (pipeline->writing && pipeline->done) {
+		result = pipeline->result;
+	}
+
+	while ((block = g_queue_pop_head (pipeline->blocks)) != NULL) {
+		pipeline_block_free (block);
+	}
+
+	if (!pipeline->writing) {
+		connection = handle->connection;
+		ret = (off_t) -1;
+
+		LOCK_SMB (connection);
+		init_authentication (&actx, connection, NULL);
+		
+		/* Important: perform_authentication leaves and re-enters the lock! */
+		while (perform_authentication (&actx) > 0) {
+			ret = connection->context->lseek (connection->context, handle->file,
+							  (off_t) handle->offset, SEEK_SET);
+			actx.res = (ret != (off_t) -1) ? GNOME_VFS_OK : gnome_vfs_result_from_errno ();
+		}
+		UNLOCK_SMB (connection);
+
+		result = actx.res;
+	}
+
+	g_queue_free (pipeline->blocks);
+	g_mutex_free (pipeline->lock);
+	g_cond_free (pipeline->cond);
+	g_free (pipeline);
+
+	return result;
+}
+
+static GnomeVFSResult
+pipeline_read (SmbPipeline *pipeline,
+	       gpointer buffer,
+	       GnomeVFSFileSize num_bytes,
+	       GnomeVFSFileSize *bytes_read,
+	       GnomeVFSContext *context)
+{
+	SmbPipelineBlock *block;
+	GnomeVFSResult result;
+	GTimeVal timeout;
+	gsize n;
+
+	*bytes_read = 0;
+
+	g_mutex_lock (pipeline->lock);
+
+	while (g_queue_is_empty (pipeline->blocks) && !pipeline->done) {
+		g_get_current_time (&timeout);
+		g_time_val_add (&timeout, PIPELINE_WAIT_USECS);
+		g_cond_timed_wait (pipeline->cond, pipeline->lock, &timeout);
+
+		/* the thread may be stuck on the server for a while */
+		if (gnome_vfs_context_check_cancellation (context)) {
+			g_mutex_unlock (pipeline->lock);
+			return GNOME_VFS_ERROR_CANCELLED;
+		}
+	}
+
+	block = g_queue_peek_head (pipeline->blocks);
+	if (block == NULL) {
+		/* The end of the file, or whatever stopped the thread */
+		result = pipeline->result;
+	} else {
+		n = MIN (num_bytes, block->len - pipeline->head_offset);
+		memcpy (buffer, block->data + pipeline->head_offset, n);
+		pipeline->head_offset += n;
+		*bytes_read = n;
+
+		if (pipeline->head_offset == block->len) {
+			g_queue_pop_head (pipeline->blocks);
+			pipeline_block_free (block);
+			pipeline->head_offset = 0;
+			g_cond_broadcast (pipeline->cond);
+		}
+		result = GNOME_VFS_OK;
+	}
+
+	g_mutex_unlock (pipeline->lock);
+
+	return result;
+}
+
+static GnomeVFSResult
+pipeline_write (SmbPipeline *pipeline,
+		gconstpointer buffer,
+		GnomeVFSFileSize num_bytes,
+		GnomeVFSContext *context)
+{
+	SmbPipelineBlock *block;
+	GnomeVFSResult result;
+	GTimeVal timeout;
+
+	g_mutex_lock (pipeline->lock);
+
+	while (!pipeline->done &&
+	       g_queue_get_length (pipeline->blocks) >= pipeline_depth) {
+		g_get_current_time (&timeout);
+		g_time_val_add (&timeout, PIPELINE_WAIT_USECS);
+		g_cond_timed_wait (pipeline->cond, pipeline->lock, &timeout);
+
+		/* nothing of this write has been queued yet */
+		if (gnome_vfs_context_check_cancellation (context)) {
+			g_mutex_unlock (pipeline->lock);
+			return GNOME_VFS_ERROR_CANCELLED;
+		}
+	}
+
+	if (pipeline->done) {
+		/* An earlier write failed */
+		result = pipeline->result;
+	} else {
+		/* Small writes are put together while the thread is busy */
+		block = g_queue_peek_tail (pipeline->blocks);
+		if (block == NULL || block->len + num_bytes > request_size) {
+			block = g_new (SmbPipelineBlock, 1);
+			block->data = g_malloc (MAX (request_size, num_bytes));
+			block->len = 0;
+			g_queue_push_tail (pipeline->blocks, block);
+		}
+		memcpy (block->data + block->len, buffer, num_bytes);
+		block->len += num_bytes;
+
+		g_cond_broadcast (pipeline->cond);
+		result = GNOME_VFS_OK;
+	}
+
+	g_mutex_unlock (pipeline->lock);
+
+	return result;
+}
+
+/* Returns whether reads or writes on the handle go through a pipeline,
+ * starting one from the second call after open or a seek on handles
+ * that are only read or only written */
+static gboolean
+use_pipeline (FileHandle *handle, gboolean writing)
+{
+	GnomeVFSOpenMode mode;
+
+	if (handle->pipeline != NULL) {
+		return TRUE;
+	}
+
+	mode = writing ? GNOME_VFS_OPEN_WRITE : GNOME_VFS_OPEN_READ;
+
+	if (pipeline_depth > 0 &&
+	    (handle->mode & (GNOME_VFS_OPEN_READ | GNOME_VFS_OPEN_WRITE)) == mode &&
+	    ++handle->sequential_calls >= 2) {
+		pipeline_start (handle, writing);
+	}
+
+	return handle->pipeline != NULL;
+}
+
 static GnomeVFSResult
 do_open (GnomeVFSMethod *method,
 	 GnomeVFSMethodHandle **method_handle,
@@ -1473,6 +2175,7 @@ do_open (GnomeVFSMethod *method,
 	 GnomeVFSOpenMode mode,
 	 GnomeVFSContext *context)
 {
+	SmbConnection *connection;
 	SmbAuthContext actx;
 	FileHandle *handle = NULL;
 	char *path, *name, *unescaped_name;
@@ -1500,7 +2203,7 @@ do_open (GnomeVFSMethod *method,
 		if (mode & GNOME_VFS_OPEN_WRITE) {
 			return GNOME_VFS_ERROR_READ_ONLY;
 		}
-		handle = g_new (FileHandle, 1);
+		handle = g_new0 (FileHandle, 1);
 		handle->is_data = TRUE;
 		handle->offset = 0;
 		unescaped_name = get_base_from_uri (uri);
@@ -1519,7 +2222,7 @@ do_open (GnomeVFSMethod *method,
 		if (mode & GNOME_VFS_OPEN_WRITE) {
 			return GNOME_VFS_ERROR_READ_ONLY;
 		}
-		handle = g_new (FileHandle, 1);
+		handle = g_new0 (FileHandle, 1);
 		handle->is_data = TRUE;
 		handle->offset = 0;
 		unescaped_name = get_base_from_uri (uri);
@@ -1554,25 +2257,31 @@ do_open (GnomeVFSMethod *method,
 	
 	path = gnome_vfs_uri_to_string (uri, GNOME_VFS_URI_HIDE_USER_NAME | GNOME_VFS_URI_HIDE_PASSWORD);
 	
-	LOCK_SMB();
-	init_authentication (&actx, uri);
+	connection = connection_get_for_uri (uri, type);
+	LOCK_SMB (connection);
+	init_authentication (&actx, connection, uri);
 
 	/* Important: perform_authentication leaves and re-enters the lock! */
 	while (perform_authentication (&actx) > 0) {
-		file = (smb_context->open) (smb_context, path, unix_mode, 0666);
+		file = (connection->context->open) (connection->context, path, unix_mode, 0666);
 		actx.res = (file != NULL) ? GNOME_VFS_OK : gnome_vfs_result_from_errno ();
 	}
 
-	UNLOCK_SMB();
+	UNLOCK_SMB (connection);
 
 	g_free (path);
 	
-	if (file == NULL)
+	if (file == NULL) {
+		connection_release (connection);
 		return actx.res;
+	}
 	
-	handle = g_new (FileHandle, 1);
+	/* The file belongs to this context, keep using it */
+	handle = g_new0 (FileHandle, 1);
+	handle->connection = connection;
 	handle->is_data = FALSE;
 	handle->file = file;
+	handle->mode = mode;
 
 	*method_handle = (GnomeVFSMethodHandle *)handle;
 
@@ -1586,6 +2295,7 @@ do_close (GnomeVFSMethod *method,
 
 {
 	FileHandle *handle = (FileHandle *)method_handle;
+	SmbConnection *connection;
 	SmbAuthContext actx;
 	GnomeVFSResult res;
 	int r;
@@ -1597,21 +2307,28 @@ do_close (GnomeVFSMethod *method,
 	if (handle->is_data) {
 		g_free (handle->file_data);
 	} else {
-		LOCK_SMB();
-		init_authentication (&actx, NULL);
+		if (handle->pipeline != NULL) {
+			res = pipeline_stop (handle);
+		}
+
+		connection = handle->connection;
+		LOCK_SMB (connection);
+		init_authentication (&actx, connection, NULL);
 
 		/* Important: perform_authentication leaves and re-enters the lock! */
 		while (perform_authentication (&actx) > 0) {
 #ifdef HAVE_SAMBA_OLD_CLOSE
-			r = smb_context->close (smb_context, handle->file);
+			r = connection->context->close (connection->context, handle->file);
 #else
-			r = smb_context->close_fn (smb_context, handle->file);
+			r = connection->context->close_fn (connection->context, handle->file);
 #endif
 			actx.res = (r >= 0) ? GNOME_VFS_OK : gnome_vfs_result_from_errno ();
 		}
 
-		res = actx.res;		
-		UNLOCK_SMB();
+		if (res == GNOME_VFS_OK)
+			res = actx.res;
+		UNLOCK_SMB (connection);
+		connection_release (connection);
 	}
 
 	g_free (handle);
@@ -1628,6 +2345,7 @@ do_read (GnomeVFSMethod *method,
 {
 	FileHandle *handle = (FileHandle *)method_handle;
 	GnomeVFSResult res = GNOME_VFS_OK;
+	SmbConnection *connection;
 	SmbAuthContext actx;
 	ssize_t n = 0;
 
@@ -1640,18 +2358,24 @@ do_read (GnomeVFSMethod *method,
 			n = MIN (num_bytes, handle->file_size - handle->offset);
 			memcpy (buffer, handle->file_data + handle->offset, n);
 		}
+	} else if (use_pipeline (handle, FALSE)) {
+		res = pipeline_read (handle->pipeline, buffer, num_bytes, bytes_read, context);
+		if (res != GNOME_VFS_OK)
+			return res;
+		n = *bytes_read;
 	} else {
-		LOCK_SMB();
-		init_authentication (&actx, NULL);
+		connection = handle->connection;
+		LOCK_SMB (connection);
+		init_authentication (&actx, connection, NULL);
 		
 		/* Important: perform_authentication leaves and re-enters the lock! */
 		while (perform_authentication (&actx) > 0) {
-			n = smb_context->read (smb_context, handle->file, buffer, MIN (USHRT_MAX, num_bytes));
+			n = connection->context->read (connection->context, handle->file, buffer, MIN (request_size, num_bytes));
 			actx.res = (n >= 0) ? GNOME_VFS_OK : gnome_vfs_result_from_errno ();
 		}
 		
 		res = actx.res;
-		UNLOCK_SMB();
+		UNLOCK_SMB (connection);
 	}
 
 	*bytes_read = (n < 0) ? 0 : n;
@@ -1675,6 +2399,7 @@ do_write (GnomeVFSMethod *method,
 
 {
 	FileHandle *handle = (FileHandle *)method_handle;
+	SmbConnection *connection;
 	SmbAuthContext actx;
 	ssize_t written = 0;
 
@@ -1683,18 +2408,25 @@ do_write (GnomeVFSMethod *method,
 	if (handle->is_data)
 		return GNOME_VFS_ERROR_READ_ONLY;
 
-	LOCK_SMB();
-	init_authentication (&actx, NULL);
+	if (use_pipeline (handle, TRUE)) {
+		actx.res = pipeline_write (handle->pipeline, buffer, num_bytes, context);
+		written = (actx.res == GNOME_VFS_OK) ? num_bytes : 0;
+	} else {
+		connection = handle->connection;
+		LOCK_SMB (connection);
+		init_authentication (&actx, connection, NULL);
 
-	/* Important: perform_authentication leaves and re-enters the lock! */
-	while (perform_authentication (&actx) > 0) {
-		written = smb_context->write (smb_context, handle->file, (void *)buffer, num_bytes);
-		actx.res = (written >= 0) ? GNOME_VFS_OK : gnome_vfs_result_from_errno ();
-	}
+		/* Important: perform_authentication leaves and re-enters the lock! */
+		while (perform_authentication (&actx) > 0) {
+			written = connection->context->write (connection->context, handle->file, (void *)buffer, num_bytes);
+			actx.res = (written >= 0) ? GNOME_VFS_OK : gnome_vfs_result_from_errno ();
+		}
 	
-	UNLOCK_SMB();
+		UNLOCK_SMB (connection);
+	}
 
 	*bytes_written = (written < 0) ? 0 : written;
+	handle->offset += *bytes_written;
 	return actx.res;
 }
 
@@ -1712,6 +2444,7 @@ do_create (GnomeVFSMethod *method,
 	char *path;
 	SMBCFILE *file = NULL;
 	FileHandle *handle;
+	SmbConnection *connection;
 	SmbAuthContext actx;
 	
 	DEBUG_SMB (("do_create() %s mode %d\n",
@@ -1748,24 +2481,29 @@ do_create (GnomeVFSMethod *method,
 
 	path = gnome_vfs_uri_to_string (uri, GNOME_VFS_URI_HIDE_USER_NAME | GNOME_VFS_URI_HIDE_PASSWORD);
 
-	LOCK_SMB();
-	init_authentication (&actx, uri);
+	connection = connection_get_for_uri (uri, type);
+	LOCK_SMB (connection);
+	init_authentication (&actx, connection, uri);
 	
 	/* Important: perform_authentication leaves and re-enters the lock! */	
 	while (perform_authentication (&actx) > 0) {
-		file = (smb_context->open) (smb_context, path, unix_mode, perm);
+		file = (connection->context->open) (connection->context, path, unix_mode, perm);
 		actx.res = (file != NULL) ? GNOME_VFS_OK : gnome_vfs_result_from_errno ();
 	}
 
-	UNLOCK_SMB();
+	UNLOCK_SMB (connection);
 
 	g_free (path);
 
-	if (file == NULL)
+	if (file == NULL) {
+		connection_release (connection);
 		return actx.res;
+	}
 	
-	handle = g_new (FileHandle, 1);
+	handle = g_new0 (FileHandle, 1);
+	handle->connection = connection;
 	handle->is_data = FALSE;
+	handle->mode = mode;
 	handle->file = file;
 
 	*method_handle = (GnomeVFSMethodHandle *)handle;
@@ -1785,6 +2523,7 @@ do_get_file_info (GnomeVFSMethod *method,
 	char *path;
 	int type, err = -1;
 	const char *mime_type;
+	SmbConnection *connection;
 	SmbAuthContext actx;
 
 	DEBUG_SMB (("do_get_file_info() %s\n",
@@ -1843,16 +2582,18 @@ do_get_file_info (GnomeVFSMethod *method,
 	    
 	path = gnome_vfs_uri_to_string (uri, GNOME_VFS_URI_HIDE_USER_NAME | GNOME_VFS_URI_HIDE_PASSWORD);
 
-	LOCK_SMB();
-	init_authentication (&actx, uri);
+	connection = connection_get_for_uri (uri, type);
+	LOCK_SMB (connection);
+	init_authentication (&actx, connection, uri);
 
 	/* Important: perform_authentication leaves and re-enters the lock! */
 	while (perform_authentication (&actx) > 0) {
-		err = smb_context->stat (smb_context, path, &st);
+		err = connection->context->stat (connection->context, path, &st);
 		actx.res = (err >= 0) ? GNOME_VFS_OK : gnome_vfs_result_from_errno ();
 	}
 
-	UNLOCK_SMB();
+	UNLOCK_SMB (connection);
+	connection_release (connection);
 
 	g_free (path);
 
@@ -1863,7 +2604,7 @@ do_get_file_info (GnomeVFSMethod *method,
 	file_info->name = get_base_from_uri (uri);
 
 	file_info->valid_fields |= GNOME_VFS_FILE_INFO_FIELDS_IO_BLOCK_SIZE;
-	file_info->io_block_size = SMB_BLOCK_SIZE;
+	file_info->io_block_size = request_size;
 	
 	if (options & GNOME_VFS_FILE_INFO_GET_MIME_TYPE) {		
 		if (S_ISDIR(st.st_mode)) {
@@ -1896,20 +2637,32 @@ do_get_file_info_from_handle (GnomeVFSMethod *method,
 		GnomeVFSContext *context)
 {
 	FileHandle *handle = (FileHandle *)method_handle;
+	SmbConnection *connection;
 	SmbAuthContext actx;
 	struct stat st;
 	int err = -1;
 
-	LOCK_SMB();
-	init_authentication (&actx, NULL);
+	if (handle->is_data)
+		return GNOME_VFS_ERROR_NOT_SUPPORTED;
+
+	/* The size has to include what is still queued */
+	if (handle->pipeline != NULL && handle->pipeline->writing) {
+		actx.res = pipeline_stop (handle);
+		if (actx.res != GNOME_VFS_OK)
+			return actx.res;
+	}
+
+	connection = handle->connection;
+	LOCK_SMB (connection);
+	init_authentication (&actx, connection, NULL);
 	
 	/* Important: perform_authentication leaves and re-enters the lock! */
 	while (perform_authentication (&actx) > 0) {
-		err = smb_context->fstat (smb_context, handle->file, &st);
+		err = connection->context->fstat (connection->context, handle->file, &st);
 		actx.res = (err >= 0) ? GNOME_VFS_OK : gnome_vfs_result_from_errno ();
 	}
 	
-	UNLOCK_SMB();
+	UNLOCK_SMB (connection);
 	
 	if (err < 0) 
 		return actx.res;
@@ -1917,7 +2670,7 @@ do_get_file_info_from_handle (GnomeVFSMethod *method,
 	gnome_vfs_stat_to_file_info (file_info, &st);
 
 	file_info->valid_fields |= GNOME_VFS_FILE_INFO_FIELDS_IO_BLOCK_SIZE;
-	file_info->io_block_size = SMB_BLOCK_SIZE;
+	file_info->io_block_size = request_size;
 	return GNOME_VFS_OK;
 }
 
@@ -1930,6 +2683,7 @@ do_is_local (GnomeVFSMethod *method,
 
 typedef struct {
 	GList *workgroups;
+	SmbConnection *connection;
 	SMBCFILE *dir;
 	char *path;
 } DirectoryHandle;
@@ -1961,6 +2715,7 @@ do_open_directory (GnomeVFSMethod *method,
 	char *path;
 	SmbUriType type;
 	SMBCFILE *dir = NULL;
+	SmbConnection *connection;
 	SmbAuthContext actx;
 
 	DEBUG_SMB(("do_open_directory() %s\n",
@@ -1972,7 +2727,9 @@ do_open_directory (GnomeVFSMethod *method,
 		update_workgroup_cache ();
 		
 		directory_handle = g_new0 (DirectoryHandle, 1);
+		G_LOCK (workgroups);
 		g_hash_table_foreach (workgroups, add_workgroup, directory_handle);
+		G_UNLOCK (workgroups);
 		*method_handle = (GnomeVFSMethodHandle *) directory_handle;
 		return GNOME_VFS_OK;
 	}
@@ -1983,6 +2740,8 @@ do_open_directory (GnomeVFSMethod *method,
 		return GNOME_VFS_ERROR_NOT_A_DIRECTORY;
 	}
 
+	connection = connection_get_for_uri (uri, type);
+
 	/* if it is the magic default workgroup name, map it to the 
 	 * SMBCCTX's workgroup, which comes from the smb.conf file. */
 	host_name = gnome_vfs_uri_get_host_name (uri);
@@ -1990,8 +2749,8 @@ do_open_directory (GnomeVFSMethod *method,
 	    !g_ascii_strcasecmp(host_name, DEFAULT_WORKGROUP_NAME)) {
 		new_uri = gnome_vfs_uri_dup (uri);
 		gnome_vfs_uri_set_host_name (new_uri,
-					     smb_context->workgroup
-					     ? smb_context->workgroup
+					     connection->context->workgroup
+					     ? connection->context->workgroup
 					     : "WORKGROUP");
 		uri = new_uri;
 	}
@@ -2000,27 +2759,29 @@ do_open_directory (GnomeVFSMethod *method,
 
 	DEBUG_SMB(("do_open_directory() path %s\n", path));
 
-	LOCK_SMB();
-	init_authentication (&actx, uri);
+	LOCK_SMB (connection);
+	init_authentication (&actx, connection, uri);
 
 	/* Important: perform_authentication leaves and re-enters the lock! */
 	while (perform_authentication (&actx) > 0) {
-		dir = smb_context->opendir (smb_context, path);
+		dir = connection->context->opendir (connection->context, path);
 		actx.res = (dir != NULL) ? GNOME_VFS_OK : gnome_vfs_result_from_errno ();
 	}
 
-	UNLOCK_SMB();
+	UNLOCK_SMB (connection);
 	
 	if (new_uri) 
 		gnome_vfs_uri_unref (new_uri);
 	
 	if (dir == NULL) {
+		connection_release (connection);
 		g_free (path);
 		return actx.res;
 	}
 	
 	/* Construct the handle */
 	directory_handle = g_new0 (DirectoryHandle, 1);
+	directory_handle->connection = connection;
 	directory_handle->dir = dir;
 	directory_handle->path = path;
 	*method_handle = (GnomeVFSMethodHandle *) directory_handle;
@@ -2035,6 +2796,7 @@ do_close_directory (GnomeVFSMethod *method,
 {
 	DirectoryHandle *directory_handle = (DirectoryHandle *) method_handle;
 	GnomeVFSResult res;
+	SmbConnection *connection;
 	SmbAuthContext actx;
 	GList *l;
 	int err = -1;
@@ -2054,17 +2816,19 @@ do_close_directory (GnomeVFSMethod *method,
 	res = GNOME_VFS_OK;
 	
 	if (directory_handle->dir != NULL) {
-		LOCK_SMB ();
-		init_authentication (&actx, NULL);
+		connection = directory_handle->connection;
+		LOCK_SMB (connection);
+		init_authentication (&actx, connection, NULL);
 
 		/* Important: perform_authentication leaves and re-enters the lock! */
 		while (perform_authentication (&actx) > 0) {
-			err = smb_context->closedir (smb_context, directory_handle->dir);
+			err = connection->context->closedir (connection->context, directory_handle->dir);
 			actx.res = (err >= 0) ? GNOME_VFS_OK : gnome_vfs_result_from_errno ();
 		}
 		
 		res = actx.res;
-		UNLOCK_SMB ();
+		UNLOCK_SMB (connection);
+		connection_release (connection);
 	}
 	g_free (directory_handle->path);
 	g_free (directory_handle);
@@ -2080,6 +2844,7 @@ do_read_directory (GnomeVFSMethod *method,
 {
 	DirectoryHandle *dh = (DirectoryHandle *) method_handle;
 	struct smbc_dirent *entry = NULL;
+	SmbConnection *connection;
 	SmbAuthContext actx;
 	struct stat st;
 	char *statpath;
@@ -2109,16 +2874,16 @@ do_read_directory (GnomeVFSMethod *method,
 		}
 	}
 	
-	
-	LOCK_SMB();
+	connection = dh->connection;
+	LOCK_SMB (connection);
 	do {
 		errno = 0;
 		
-		init_authentication (&actx, NULL);
+		init_authentication (&actx, connection, NULL);
 		
 		/* Important: perform_authentication leaves and re-enters the lock! */
 		while (perform_authentication (&actx) > 0) {
-			entry = smb_context->readdir (smb_context, dh->dir);
+			entry = connection->context->readdir (connection->context, dh->dir);
 			
 			if(entry == NULL) {
 				if(errno == 0)
@@ -2131,7 +2896,7 @@ do_read_directory (GnomeVFSMethod *method,
 		}
 		
 		if (entry == NULL) {
-			UNLOCK_SMB();
+			UNLOCK_SMB (connection);
 			return actx.res;
 		}
 		
@@ -2143,7 +2908,7 @@ do_read_directory (GnomeVFSMethod *method,
 		 (entry->smbc_type == SMBC_FILE_SHARE &&
 		  is_hidden_entry (entry->name)));
 		
-	UNLOCK_SMB();
+	UNLOCK_SMB (connection);
 
 	file_info->name = g_strndup (entry->name, entry->namelen);
 	DEBUG_SMB (("do_read_directory (): read %s\n", file_info->name));
@@ -2199,20 +2964,20 @@ do_read_directory (GnomeVFSMethod *method,
 		   password dialogs
 		*/
 		
-		LOCK_SMB();
-		init_authentication (&actx, NULL);
+		LOCK_SMB (connection);
+		init_authentication (&actx, connection, NULL);
 		
 		/* Important: perform_authentication leaves and re-enters the lock! */
 		while (perform_authentication (&actx) > 0) {
-			r = smb_context->stat (smb_context, statpath, &st);
+			r = connection->context->stat (connection->context, statpath, &st);
 			actx.res = (r == 0) ? GNOME_VFS_OK : gnome_vfs_result_from_errno ();
 		}
-		UNLOCK_SMB();
+		UNLOCK_SMB (connection);
 		
 		if (r == 0) {
 			gnome_vfs_stat_to_file_info (file_info, &st);
 			file_info->valid_fields |= GNOME_VFS_FILE_INFO_FIELDS_IO_BLOCK_SIZE;
-			file_info->io_block_size = SMB_BLOCK_SIZE;
+			file_info->io_block_size = request_size;
 		}
 		g_free (statpath);
 
@@ -2251,6 +3016,7 @@ do_seek (GnomeVFSMethod *method,
 		GnomeVFSContext *context)
 {
 	FileHandle *handle = (FileHandle *)method_handle;
+	SmbConnection *connection;
 	SmbAuthContext actx;
 	int meth_whence;
 	off_t ret = (off_t) -1;
@@ -2290,15 +3056,26 @@ do_seek (GnomeVFSMethod *method,
 		return GNOME_VFS_ERROR_NOT_SUPPORTED;
 	}
 
-	LOCK_SMB();
-	init_authentication (&actx, NULL);
+	handle->sequential_calls = 0;
+	if (handle->pipeline != NULL) {
+		actx.res = pipeline_stop (handle);
+		if (actx.res != GNOME_VFS_OK)
+			return actx.res;
+	}
+
+	connection = handle->connection;
+	LOCK_SMB (connection);
+	init_authentication (&actx, connection, NULL);
 	
 	/* Important: perform_authentication leaves and re-enters the lock! */
 	while (perform_authentication (&actx) > 0) {
-		ret = smb_context->lseek (smb_context, handle->file, (off_t) offset, meth_whence);
+		ret = connection->context->lseek (connection->context, handle->file, (off_t) offset, meth_whence);
 		actx.res = (ret != (off_t) -1) ? GNOME_VFS_OK : gnome_vfs_result_from_errno ();
 	}
-	UNLOCK_SMB();
+	UNLOCK_SMB (connection);
+
+	if (ret != (off_t) -1)
+		handle->offset = ret;
 	
 	return actx.res;
 }
@@ -2309,23 +3086,26 @@ do_tell (GnomeVFSMethod *method,
 		GnomeVFSFileSize *offset_return)
 {
 	FileHandle *handle = (FileHandle *)method_handle;
+	SmbConnection *connection;
 	SmbAuthContext actx;
 	off_t ret = (off_t) -1;
 
-	if (handle->is_data) {
+	/* Reading ahead or writing behind moves the file on its own */
+	if (handle->is_data || handle->pipeline != NULL) {
 		*offset_return = handle->offset;
 		return GNOME_VFS_OK;
 	}
 	
-	LOCK_SMB();
-	init_authentication (&actx, NULL);
+	connection = handle->connection;
+	LOCK_SMB (connection);
+	init_authentication (&actx, connection, NULL);
 	
 	/* Important: perform_authentication leaves and re-enters the lock! */
 	while (perform_authentication (&actx) > 0) {
-		ret = smb_context->lseek (smb_context, handle->file, (off_t) 0, SEEK_CUR);
+		ret = connection->context->lseek (connection->context, handle->file, (off_t) 0, SEEK_CUR);
 		actx.res = (ret != (off_t) -1) ? GNOME_VFS_OK : gnome_vfs_result_from_errno ();
 	}
-	UNLOCK_SMB();
+	UNLOCK_SMB (connection);
 	
 	*offset_return = (ret == (off_t) -1) ? 0 : (GnomeVFSFileOffset) ret;
 	return actx.res;
@@ -2337,6 +3117,7 @@ do_unlink (GnomeVFSMethod *method,
 	   GnomeVFSContext *context)
 {
 	char *path;
+	SmbConnection *connection;
 	SmbAuthContext actx;
 	int type, err = -1;
 
@@ -2360,16 +3141,18 @@ do_unlink (GnomeVFSMethod *method,
 
 	path = gnome_vfs_uri_to_string (uri, GNOME_VFS_URI_HIDE_USER_NAME | GNOME_VFS_URI_HIDE_PASSWORD);
 
-	LOCK_SMB();
-	init_authentication (&actx, uri);
+	connection = connection_get_for_uri (uri, type);
+	LOCK_SMB (connection);
+	init_authentication (&actx, connection, uri);
 	
 	/* Important: perform_authentication leaves and re-enters the lock! */
 	while (perform_authentication (&actx) > 0) {
-		err = smb_context->unlink (smb_context, path);
+		err = connection->context->unlink (connection->context, path);
 		actx.res = (err >= 0) ? GNOME_VFS_OK : gnome_vfs_result_from_errno ();
 	}
 	
-	UNLOCK_SMB();
+	UNLOCK_SMB (connection);
+	connection_release (connection);
 
 	g_free (path);
 	
@@ -2450,6 +3233,7 @@ do_move (GnomeVFSMethod *method,
 	char *old_path, *new_path;
 	int errnox = 0, err = -1;
 	gboolean tried_once;
+	SmbConnection *connection;
 	SmbAuthContext actx;
 	int old_type, new_type;
 	
@@ -2470,18 +3254,21 @@ do_move (GnomeVFSMethod *method,
 	old_path = gnome_vfs_uri_to_string (old_uri, GNOME_VFS_URI_HIDE_USER_NAME | GNOME_VFS_URI_HIDE_PASSWORD);
 	new_path = gnome_vfs_uri_to_string (new_uri, GNOME_VFS_URI_HIDE_USER_NAME | GNOME_VFS_URI_HIDE_PASSWORD);
 
+	/* Renames across servers fail with EXDEV anyway */
+	connection = connection_get_for_uri (old_uri, old_type);
+
 	tried_once = FALSE;
  retry:
-	LOCK_SMB();
-	init_authentication (&actx, old_uri);
+	LOCK_SMB (connection);
+	init_authentication (&actx, connection, old_uri);
 	
 	/* Important: perform_authentication leaves and re-enters the lock! */
 	while (perform_authentication (&actx) > 0) {
-		err = smb_context->rename (smb_context, old_path, smb_context, new_path);
+		err = connection->context->rename (connection->context, old_path, connection->context, new_path);
 		errnox = errno;
 		actx.res = (err >= 0) ? GNOME_VFS_OK : gnome_vfs_result_from_errno ();
 	}
-	UNLOCK_SMB();
+	UNLOCK_SMB (connection);
 	
 	if (err < 0) {
 		if (errnox == EXDEV) {
@@ -2489,15 +3276,15 @@ do_move (GnomeVFSMethod *method,
 			
 		} else if (err == EEXIST && force_replace != FALSE) {
 			/* If the target exists and force_replace is TRUE */
-			LOCK_SMB();
-			init_authentication (&actx, new_uri);
+			LOCK_SMB (connection);
+			init_authentication (&actx, connection, new_uri);
 
 			/* Important: perform_authentication leaves and re-enters the lock! */
 			while (perform_authentication (&actx) > 0) {			
-				err = smb_context->unlink (smb_context, new_path);
+				err = connection->context->unlink (connection->context, new_path);
 				actx.res = (err >= 0) ? GNOME_VFS_OK : gnome_vfs_result_from_errno ();
 			}
-			UNLOCK_SMB();
+			UNLOCK_SMB (connection);
 
 			if (err >= 0) {
 				if (!tried_once) {
@@ -2509,6 +3296,8 @@ do_move (GnomeVFSMethod *method,
 		}
 	}
 
+	connection_release (connection);
+
 	g_free (old_path);
 	g_free (new_path);
 
@@ -2534,6 +3323,7 @@ do_make_directory (GnomeVFSMethod *method,
 {
 	char *path;
 	int type, err = -1;
+	SmbConnection *connection;
 	SmbAuthContext actx;
 
 	type = smb_uri_type (uri);
@@ -2554,16 +3344,18 @@ do_make_directory (GnomeVFSMethod *method,
 	/* Transform the URI into a completely unescaped string */
 	path = gnome_vfs_uri_to_string (uri, GNOME_VFS_URI_HIDE_USER_NAME | GNOME_VFS_URI_HIDE_PASSWORD);
 
-	LOCK_SMB();
-	init_authentication (&actx, uri);
+	connection = connection_get_for_uri (uri, type);
+	LOCK_SMB (connection);
+	init_authentication (&actx, connection, uri);
 
 	/* Important: perform_authentication leaves and re-enters the lock! */
 	while (perform_authentication (&actx) > 0) {
-		err = smb_context->mkdir (smb_context, path, perm);
+		err = connection->context->mkdir (connection->context, path, perm);
 		actx.res = (err >= 0) ? GNOME_VFS_OK : gnome_vfs_result_from_errno ();
 	}
 
-	UNLOCK_SMB();
+	UNLOCK_SMB (connection);
+	connection_release (connection);
 
 	g_free (path);
 
@@ -2577,6 +3369,7 @@ do_remove_directory (GnomeVFSMethod *method,
 {
 	char *path;
 	int err = -1, type;
+	SmbConnection *connection;
 	SmbAuthContext actx;
 
 	type = smb_uri_type (uri);
@@ -2597,14 +3390,16 @@ do_remove_directory (GnomeVFSMethod *method,
 	/* Transform the URI into a completely unescaped string */
 	path = gnome_vfs_uri_to_string (uri, GNOME_VFS_URI_HIDE_USER_NAME | GNOME_VFS_URI_HIDE_PASSWORD);
 
-	LOCK_SMB();
-	init_authentication (&actx, uri);
+	connection = connection_get_for_uri (uri, type);
+	LOCK_SMB (connection);
+	init_authentication (&actx, connection, uri);
 
 	while (perform_authentication (&actx) > 0) {
-		err = smb_context->rmdir (smb_context, path);
+		err = connection->context->rmdir (connection->context, path);
 		actx.res = (err >= 0) ? GNOME_VFS_OK : gnome_vfs_result_from_errno ();
 	}
-	UNLOCK_SMB();
+	UNLOCK_SMB (connection);
+	connection_release (connection);
 
 	g_free (path);
 
@@ -2620,6 +3415,7 @@ do_set_file_info (GnomeVFSMethod *method,
 {
 	char *path;
 	int err = -1, errnox = 0, type;
+	SmbConnection *connection;
 	SmbAuthContext actx;	
 
 	DEBUG_SMB (("do_set_file_info: mask %x\n", mask));
@@ -2652,16 +3448,18 @@ do_set_file_info (GnomeVFSMethod *method,
 		gnome_vfs_uri_unref (new_uri);
 
 
-		LOCK_SMB();
-		init_authentication (&actx, uri);
+		connection = connection_get_for_uri (uri, type);
+		LOCK_SMB (connection);
+		init_authentication (&actx, connection, uri);
 		
 		while (perform_authentication (&actx) > 0) {
-			err = smb_context->rename (smb_context, path, smb_context, new_path);
+			err = connection->context->rename (connection->context, path, connection->context, new_path);
 			errnox = errno;
 			actx.res = (err >= 0) ? GNOME_VFS_OK : gnome_vfs_result_from_errno ();
 		}
 		
-		UNLOCK_SMB();
+		UNLOCK_SMB (connection);
+		connection_release (connection);
 
 		if (err < 0 && errnox == EXDEV)
 			actx.res = GNOME_VFS_ERROR_NOT_SAME_FILE_SYSTEM;
@@ -2730,10 +3528,27 @@ static GnomeVFSMethod method = {
 GnomeVFSMethod *
 vfs_module_init (const char *method_name, const char *args)
 {
-	smb_lock = g_mutex_new ();
+	const char *value;
+
+	value = getenv (CONTEXTS_PER_SERVER_VARIABLE);
+	if (value != NULL)
+		contexts_per_server = MAX (strtoul (value, NULL, 10), 1);
+
+	value = getenv (REQUEST_SIZE_VARIABLE);
+	if (value != NULL)
+		request_size = MAX (strtoul (value, NULL, 10), MIN_REQUEST_SIZE);
+
+	value = getenv (PIPELINE_DEPTH_VARIABLE);
+	if (value != NULL)
+		pipeline_depth = strtoul (value, NULL, 10);
 
 	DEBUG_SMB (("<-- smb module init called -->\n"));
 
+#ifdef HAVE_SMBC_THREAD_POSIX
+	/* Before any context exists */
+	smbc_thread_posix ();
+#endif
+
 	if (try_init ()) {
 		return &method;
 	} else {
@@ -2744,18 +3559,24 @@ vfs_module_init (const char *method_name, const char *args)
 void
 vfs_module_shutdown (GnomeVFSMethod *method)
 {
-	LOCK_SMB();
-	if (smb_context != NULL) {
-		smbc_free_context (smb_context, 1);
-		smb_context = NULL;
+	SmbConnection *connection;
+	GList *l;
+
+	G_LOCK (connections);
+	for (l = connections; l != NULL; l = l->next) {
+		connection = l->data;
+		LOCK_SMB (connection);
+		smbc_free_context (connection->context, 1);
+		UNLOCK_SMB (connection);
+		connection_free (connection);
 	}
-	UNLOCK_SMB();
+	g_list_free (connections);
+	connections = NULL;
+	G_UNLOCK (connections);
 
-	g_hash_table_destroy (server_cache);
 	g_hash_table_destroy (workgroups);
         g_hash_table_destroy (user_cache);
-	
-	g_mutex_free (smb_lock);
+	g_free (default_workgroup);
 
 	DEBUG_SMB (("<-- smb module shutdown called -->\n"));
 }
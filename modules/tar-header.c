@@ -0,0 +1,157 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 8; tab-width: 8 -*- */
+/* tar-header.c - Decoding of tar headers for the tar method.
+
+   Copyright (C) 2026 Free Software Foundation
+
+   The Gnome Library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   The Gnome Library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with the Gnome Library; see the file COPYING.LIB.  If not,
+   write to the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, USA.
+*/
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "tar-header.h"
+
+#define IS_OCTAL_DIGIT(c) ((c) >= '0' && (c) <= '7')
+#define OCTAL_DIGIT(c) ((c) - '0')
+
+GnomeVFSFileSize
+tar_header_parse_number (const char *str, int len)
+{
+	GnomeVFSFileSize ret = 0;
+	int i;
+
+	/* GNU tar stores numbers too big for the field in base 256,
+	 * flagged by the top bit of the first byte */
+	if ((guchar) str[0] == 0x80)
+	{
+		for (i = 1; i < len; i++)
+			ret = (ret << 8) | (guchar) str[i];
+		return ret;
+	}
+
+	for (i = 0; i < len && str[i] == ' '; i++)
+		;
+	for (; i < len && IS_OCTAL_DIGIT (str[i]); i++)
+		ret = ret * 8 + OCTAL_DIGIT (str[i]);
+
+	return ret;
+}
+
+gboolean
+tar_header_checksum_ok (const union TARPET_block *block)
+{
+	const guchar *data = (const guchar *) block->raw.data;
+	const int start = G_STRUCT_OFFSET (struct TARPET_POSIX, checksum);
+	guint unsigned_sum = 0;
+	int signed_sum = 0;
+	GnomeVFSFileSize expected;
+	int i;
+
+	/* the checksum field itself counts as spaces; some old tars
+	 * summed signed chars */
+	for (i = 0; i < TARPET_BLOCKSIZE; i++)
+	{
+		if (i >= start && i < start + (int) sizeof (block->p.checksum))
+		{
+			unsigned_sum += ' ';
+			signed_sum += ' ';
+		}
+		else
+		{
+			unsigned_sum += data[i];
+			signed_sum += (signed char) data[i];
+		}
+	}
+
+	expected = parse_octal_field (block->p.checksum);
+	return expected == unsigned_sum || expected == (GnomeVFSFileSize) signed_sum;
+}
+
+void
+tar_header_parse_pax (const gchar *data,
+		      gsize len,
+		      gchar **path,
+		      gchar **link_path,
+		      GnomeVFSFileSize *size,
+		      gboolean *have_size)
+{
+	const gchar *p, *end, *record_end, *equals;
+	gulong record_len;
+	gchar *value;
+
+	p = data;
+	end = data + len;
+	while (p < end)
+	{
+		record_len = strtoul (p, NULL, 10);
+		if (record_len == 0 || record_len > (gulong) (end - p))
+			break;
+		record_end = p + record_len;
+
+		p = memchr (p, ' ', record_end - p);
+		if (p == NULL)
+			break;
+		p++;
+		equals = memchr (p, '=', record_end - p);
+		if (equals == NULL || record_end[-1] != '\n')
+			break;
+
+		value = g_strndup (equals + 1, record_end - equals - 2);
+		if (equals - p == 4 && strncmp (p, "path", 4) == 0)
+		{
+			g_free (*path);
+			*path = value;
+		}
+		else if (equals - p == 8 && strncmp (p, "linkpath", 8) == 0)
+		{
+			g_free (*link_path);
+			*link_path = value;
+		}
+		else
+		{
+			if (equals - p == 4 && strncmp (p, "size", 4) == 0)
+			{
+				*size = g_ascii_strtoull (value, NULL, 10);
+				*have_size = TRUE;
+			}
+			g_free (value);
+		}
+
+		p = record_end;
+	}
+}
+
+gchar *
+tar_header_get_name (const union TARPET_block *block)
+{
+	gchar *name, *prefix, *ret;
+
+	name = g_strndup (block->p.name, sizeof (block->p.name));
+
+	/* POSIX ustar splits long names between the name and the prefix */
+	if (memcmp (block->p.magic, "ustar\0", 6) == 0 && block->p.extend[0] != '\0')
+	{
+		prefix = g_strndup (block->p.extend, sizeof (block->p.extend));
+		ret = g_strconcat (prefix, "/", name, NULL);
+		g_free (prefix);
+		g_free (name);
+		return ret;
+	}
+
+	return name;
+}
@@ -0,0 +1,55 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 8; tab-width: 8 -*- */
+/* tar-header.h - Decoding of tar headers for the tar method.
+
+   Copyright (C) 2026 Free Software Foundation
+
+   The Gnome Library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   The Gnome Library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with the Gnome Library; see the file COPYING.LIB.  If not,
+   write to the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, USA.
+*/
+
+#ifndef TAR_HEADER_H
+#define TAR_HEADER_H
+
+#include <glib.h>
+#include <libgnomevfs/gnome-vfs-file-size.h>
+#include "tarpet.h"
+
+/* What the archive formats (ustar, GNU, pax) put in a header block,
+ * independent of how the tar method indexes the members.
+ */
+
+#define TARPET_BLOCKSIZE (sizeof (union TARPET_block))
+#define TARPET_PADDED_SIZE(size) (((size) + TARPET_BLOCKSIZE - 1) & ~((GnomeVFSFileSize) TARPET_BLOCKSIZE - 1))
+
+#define parse_octal_field(v) (tar_header_parse_number ((v), sizeof (v)))
+
+/* Octal, or base 256 as GNU tar writes numbers too big for the field */
+GnomeVFSFileSize tar_header_parse_number (const char               *str,
+					  int                       len);
+
+gboolean         tar_header_checksum_ok  (const union TARPET_block *block);
+
+/* The member name, with the ustar prefix if there is one */
+gchar           *tar_header_get_name     (const union TARPET_block *block);
+
+/* Picks the path, link target and size out of a pax extended header */
+void             tar_header_parse_pax    (const gchar              *data,
+					  gsize                     len,
+					  gchar                   **path,
+					  gchar                   **link_path,
+					  GnomeVFSFileSize         *size,
+					  gboolean                 *have_size);
+
+#endif /* TAR_HEADER_H */
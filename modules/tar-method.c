@@ -23,6 +23,9 @@
    	    Abigail Brady <morwen@evilmagic.org> (tarpet.h) 
 */
 
+#include <config.h>
+
+#include <libgnomevfs/gnome-vfs-cancellable-ops.h>
 #include <libgnomevfs/gnome-vfs-method.h>
 #include <libgnomevfs/gnome-vfs-mime.h>
 #include <libgnomevfs/gnome-vfs-mime-utils.h>
@@ -30,279 +33,751 @@
 #include <libgnomevfs/gnome-vfs-handle.h>
 #include <libgnomevfs/gnome-vfs-file-info.h>
 #include <libgnomevfs/gnome-vfs.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include "tarpet.h"
+#include <time.h>
+#include "tar-header.h"
+
+/* The archive is scanned once for its headers; member data stays in
+ * the archive and is read from the parent at the offsets found by the
+ * scan, so memory use depends on the number of members, not on the
+ * size of the archive.
+ */
+
+typedef struct _TarEntry TarEntry;
+
+struct _TarEntry
+{
+	/* Path in the archive, without leading or trailing slashes; the
+	 * root of the archive is "" */
+	gchar *name;
+	gchar *link_name;
+	GnomeVFSFileType type;
+	guint mode;
+	guint uid;
+	guint gid;
+	GnomeVFSFileSize size;
+	time_t mtime;
+	time_t atime;
+	time_t ctime;
+	/* Where the member's data starts in the archive */
+	GnomeVFSFileOffset data_offset;
+
+	TarEntry *parent;
+	TarEntry *children;
+	TarEntry *last_child;
+	TarEntry *next;
+};
 
 typedef struct
 {
-	union TARPET_block* blocks;
-	guint num_blocks;
-	GNode *info_tree;
+	/* TarEntry by name, owns the entries */
+	GHashTable *entries;
+	TarEntry *root;
+	/* Whether the archive could be seeked in during the scan */
+	gboolean seekable;
+	GnomeVFSFileSize archive_size;
+	time_t archive_mtime;
+	/* When the archive was last found to match the above */
+	time_t checked;
 	int ref_count;
 	gchar *filename;
+	GnomeVFSURI *archive_uri;
 } TarFile;
 
 typedef struct
 {
 	TarFile *tar;
-	union TARPET_block* start;
-	union TARPET_block* current;
-	int current_offset;
-	int current_index;
-	gchar *filename;
-	gboolean is_directory;
+	TarEntry *entry;
+	GnomeVFSFileSize offset;
+	/* The archive, opened on the first read */
+	GnomeVFSHandle *parent;
+	GnomeVFSFileOffset parent_offset;
 } FileHandle;
 
-#define TARPET_BLOCKSIZE (sizeof (union TARPET_block))
+typedef struct
+{
+	TarFile *tar;
+	TarEntry *current;
+	GnomeVFSFileInfoOptions options;
+} DirectoryHandle;
 
-static GHashTable *tar_cache;
-G_LOCK_DEFINE_STATIC (tar_cache);
+/* Long names and pax headers bigger than this are skipped */
+#define MAX_METADATA_SIZE (1024 * 1024)
+
+/* Data is skipped by reading when the archive can't seek */
+#define SKIP_BUFFER_SIZE (64 * 1024)
+
+/* Seconds a scanned archive is used without checking whether it
+ * changed, so that opening a member after stat'ing it or listing its
+ * directory doesn't stat the archive every time */
+#define ARCHIVE_CHECK_INTERVAL 2
 
-#define iteration_initialize(condition, i, cond1, cond2) ((i) = (condition) ? (cond1) : (cond2))
-#define iteration_check(condition, i, op1, op2, val1, val2) ((condition) ? (i op1 val1) : (i op2 val2))
-#define iteration_iterate(condition, i, op1, op2) ((condition) ? (i op1) : (i op2))
+/* Directory to keep the indexes of scanned archives in */
+#define INDEX_DIR_VARIABLE "GNOME_VFS_TAR_INDEX_DIR"
+#define INDEX_MAGIC "gnome-vfs-tar-index 1\n"
 
-#define parse_octal_field(v) (parse_octal ((v), sizeof (v)))
-#define IS_OCTAL_DIGIT(c) ((c) >= '0' && (c) <= '8')
-#define OCTAL_DIGIT(c) ((c) - '0')
+static char *index_dir = NULL;
+
+static GHashTable *tar_cache;
+G_LOCK_DEFINE_STATIC (tar_cache);
 
-static int parse_octal (const char *str, int len)
+/* Strips leading "/" and "./" and trailing slashes from a path */
+static gchar *
+normalize_name (const gchar *name)
 {
-	int i, ret = 0;
-	for (i = 0; i < len; i++)
+	gchar *ret;
+	gsize len;
+
+	for (;;)
 	{
-		if (str[i] == '\0') break;
-		else if (!IS_OCTAL_DIGIT (str[i])) return 0;
-		ret = ret * 8 + OCTAL_DIGIT (str[i]);
+		if (name[0] == '/')
+			name++;
+		else if (name[0] == '.' && name[1] == '/')
+			name += 2;
+		else
+			break;
 	}
+	if (strcmp (name, ".") == 0)
+		name = "";
+
+	ret = g_strdup (name);
+	len = strlen (ret);
+	while (len > 0 && ret[len - 1] == '/')
+		ret[--len] = '\0';
+
 	return ret;
 }
 
+static TarEntry *
+tar_entry_new (const gchar *name)
+{
+	TarEntry *entry;
+
+	entry = g_new0 (TarEntry, 1);
+	entry->name = g_strdup (name);
+	entry->type = GNOME_VFS_FILE_TYPE_DIRECTORY;
+	entry->mode = 0755;
+
+	return entry;
+}
+
 static void
-split_name_with_level (const gchar *name, gchar **first, gchar **last, int level, gboolean backwards)
+tar_entry_free (TarEntry *entry)
 {
-	int i;
-	gchar *found = NULL;
-	int num_found = 0;
-	if (name[strlen (name) - 1] == '/' && backwards)
-		level++;
+	g_free (entry->name);
+	g_free (entry->link_name);
+	g_free (entry);
+}
 
-	for (iteration_initialize (backwards, i, strlen (name) - 1, 0);
-	     iteration_check (backwards, i, >=, <, 0, strlen (name));
-	     iteration_iterate (backwards, i, --, ++))
-	{
-		if (name[i] == '/')
-			num_found++;
-		
-		if (num_found >= level)
-		{
-			found = (gchar*) name + i;
-			break;
-		}
-	}
+static TarFile *
+tar_file_new (GnomeVFSURI *archive_uri, gchar *filename)
+{
+	TarFile *tar;
 
-	if (found)
-	{
-		*first = g_strndup (name, found - name + 1);
-		if (*(found + 1))
-			*last = g_strdup (found + 1);
-		else
-			*last = NULL;
-	}
-	else
-	{
-		*first = g_strdup (name);
-		*last = NULL;
-	}
+	tar = g_new0 (TarFile, 1);
+	tar->entries = g_hash_table_new_full (g_str_hash, g_str_equal,
+					      NULL, (GDestroyNotify) tar_entry_free);
+	tar->root = tar_entry_new ("");
+	g_hash_table_insert (tar->entries, tar->root->name, tar->root);
+	tar->seekable = TRUE;
+	tar->ref_count = 1;
+	tar->filename = filename;
+	tar->archive_uri = gnome_vfs_uri_ref (archive_uri);
+
+	return tar;
 }
 
 static void
-split_name (const gchar *name, gchar **first, gchar **last)
+tar_file_free (TarFile *tar)
 {
-	split_name_with_level (name, first, last, 1, TRUE);
+	g_hash_table_destroy (tar->entries);
+	gnome_vfs_uri_unref (tar->archive_uri);
+	g_free (tar->filename);
+	g_free (tar);
 }
 
-static GNode*
-real_lookup_entry (const GNode *tree, const gchar *name, int level)
+/* Call with the tar_cache lock held */
+static void
+tar_file_unref_locked (TarFile *tar)
 {
-	GNode *node, *ret = NULL;
-	gchar *first, *rest;
+	if (--tar->ref_count == 0)
+		tar_file_free (tar);
+}
 
-	split_name_with_level (name, &first, &rest, level, FALSE);
+static void
+tar_file_unref (TarFile *tar)
+{
+	G_LOCK (tar_cache);
+	tar_file_unref_locked (tar);
+	G_UNLOCK (tar_cache);
+}
 
-	for (node = tree->children; node; node = node->next)
-	{
-		union TARPET_block *b = (union TARPET_block*) node->data;
-		if (!strcmp (b->raw.data, first))
-		{
-			if (rest)
-				ret = real_lookup_entry (node, name, level + 1);
-			else
-				ret = node;
-			break;
-		}
-		else if (!strcmp (b->raw.data, name))
-		{
-			ret = node;
-			break;
-		}
-	}
-	g_free (first);
-	g_free (rest);
-	
-	
-	return ret;
+static TarEntry *
+tar_file_lookup (TarFile *tar, const gchar *path)
+{
+	TarEntry *entry;
+	gchar *name;
+
+	if (path == NULL)
+		return tar->root;
+
+	name = normalize_name (path);
+	entry = g_hash_table_lookup (tar->entries, name);
+	g_free (name);
+
+	return entry;
 }
 
-static GNode*
-tree_lookup_entry (const GNode *tree, const gchar *name)
+/* Returns the entry for a normalized name, adding it and any missing
+ * parent directories if needed */
+static TarEntry *
+tar_file_add_entry (TarFile *tar, const gchar *name)
 {
-	GNode *ret;
-	char *root = g_strdup (name);
-	char *txt = root;
-	
-	if (txt[0] == '/')
-		txt++;
+	TarEntry *entry, *parent;
+	const gchar *slash;
+	gchar *parent_name;
+
+	entry = g_hash_table_lookup (tar->entries, name);
+	if (entry != NULL)
+		return entry;
 
-	ret = real_lookup_entry (tree, txt, 1);
-	if (!ret && txt[strlen (txt) - 1] != '/')
+	slash = strrchr (name, '/');
+	if (slash != NULL)
 	{
-		txt = g_strconcat (txt, "/", NULL);
-		g_free (root);
-		root = txt;
-		ret = real_lookup_entry (tree, txt, 1);
+		parent_name = g_strndup (name, slash - name);
+		parent = tar_file_add_entry (tar, parent_name);
+		g_free (parent_name);
 	}
-	g_free (root);
+	else
+		parent = tar->root;
+
+	entry = tar_entry_new (name);
+	entry->parent = parent;
+	if (parent->last_child != NULL)
+		parent->last_child->next = entry;
+	else
+		parent->children = entry;
+	parent->last_child = entry;
+
+	g_hash_table_insert (tar->entries, entry->name, entry);
+
+	return entry;
+}
 
-	if (ret && ret != tree->children)
+static GnomeVFSResult
+read_fully (GnomeVFSHandle *handle,
+	    gpointer buffer,
+	    GnomeVFSFileSize num_bytes,
+	    GnomeVFSContext *context)
+{
+	GnomeVFSResult result;
+	GnomeVFSFileSize bytes_read;
+
+	while (num_bytes > 0)
 	{
-		union TARPET_block *b = ret->data;
-		b--;
-		if (b->p.typeflag == TARPET_TYPE_LONGFILEN)
-			ret = ret->next;
+		result = gnome_vfs_read_cancellable (handle, buffer, num_bytes,
+						     &bytes_read, context);
+		if (result != GNOME_VFS_OK)
+			return result;
+		if (bytes_read == 0)
+			return GNOME_VFS_ERROR_EOF;
+		buffer = (gchar *) buffer + bytes_read;
+		num_bytes -= bytes_read;
 	}
 
-	return ret;
+	return GNOME_VFS_OK;
 }
 
-static TarFile* read_tar_file (GnomeVFSHandle *handle)
+/* Moves forward in the archive, seeking while that works and reading
+ * otherwise. *seekable is cleared once seeking turns out not to be
+ * supported. */
+static GnomeVFSResult
+skip_forward (GnomeVFSHandle *handle,
+	      GnomeVFSFileSize num_bytes,
+	      gboolean *seekable,
+	      GnomeVFSContext *context)
 {
-	GArray *arr = g_array_new (TRUE, TRUE, sizeof (union TARPET_block));
-	GnomeVFSResult res;
-	TarFile* ret;
+	GnomeVFSResult result;
 	GnomeVFSFileSize bytes_read;
-	int i;
-	
-	do
-	{
-		union TARPET_block b;
-		res = gnome_vfs_read (handle, b.raw.data,
-				      TARPET_BLOCKSIZE, &bytes_read);
-		if (res == GNOME_VFS_OK)
-			g_array_append_val (arr, b);
-	} while (res == GNOME_VFS_OK && bytes_read > 0);
-
-	ret = g_new0 (TarFile, 1);
-	ret->blocks = (union TARPET_block*) arr->data;
-	ret->num_blocks = arr->len;
-	ret->info_tree = g_node_new (NULL); 
-
-	for (i = 0; i < ret->num_blocks;)
+	gpointer buffer;
+
+	if (num_bytes == 0)
+		return GNOME_VFS_OK;
+
+	if (*seekable)
 	{
-		gchar *dir;
-		gchar *rest;
-		GNode *node;
-		int size = 0, maxsize;
-		int orig;
+		result = gnome_vfs_seek_cancellable (handle, GNOME_VFS_SEEK_CURRENT,
+						     num_bytes, context);
+		if (result != GNOME_VFS_ERROR_NOT_SUPPORTED)
+			return result;
+		*seekable = FALSE;
+	}
 
-		if (!(*ret->blocks[i].p.name))
+	buffer = g_malloc (SKIP_BUFFER_SIZE);
+	result = GNOME_VFS_OK;
+	while (num_bytes > 0)
+	{
+		result = gnome_vfs_read_cancellable (handle, buffer,
+						     MIN (num_bytes, SKIP_BUFFER_SIZE),
+						     &bytes_read, context);
+		if (result != GNOME_VFS_OK)
+			break;
+		if (bytes_read == 0)
 		{
-			i++;
-			continue;
+			result = GNOME_VFS_ERROR_EOF;
+			break;
 		}
+		num_bytes -= bytes_read;
+	}
+	g_free (buffer);
 
-		if (ret->blocks[i].p.typeflag == TARPET_TYPE_LONGFILEN)
+	return result;
+}
+
+static GnomeVFSResult
+tar_file_scan (TarFile *tar,
+	       GnomeVFSHandle *handle,
+	       GnomeVFSContext *context)
+{
+	union TARPET_block block;
+	GnomeVFSResult result;
+	GnomeVFSFileOffset offset;
+	GnomeVFSFileSize size, padded_size, pax_size;
+	gboolean have_pax_size, is_gnu, trailing_slash;
+	gchar *long_name, *long_link, *data, *header_name, *name;
+	TarEntry *entry, *target;
+
+	offset = 0;
+	long_name = NULL;
+	long_link = NULL;
+	have_pax_size = FALSE;
+	pax_size = 0;
+
+	for (;;)
+	{
+		result = read_fully (handle, block.raw.data, TARPET_BLOCKSIZE, context);
+		if (result == GNOME_VFS_ERROR_EOF)
 		{
-			i++;
-			continue;
+			/* a truncated archive is read as far as it goes */
+			result = GNOME_VFS_OK;
+			break;
 		}
-		
-		split_name (ret->blocks[i].p.name, &dir, &rest);
-		node = tree_lookup_entry (ret->info_tree, dir);
-		
-		if (!node)
+		if (result != GNOME_VFS_OK)
+			break;
+		offset += TARPET_BLOCKSIZE;
+
+		/* the archive ends with zero blocks */
+		if (block.p.name[0] == '\0')
+			break;
+
+		if (!tar_header_checksum_ok (&block))
 		{
-			node = ret->info_tree;
+			if (tar->root->children == NULL)
+				result = GNOME_VFS_ERROR_WRONG_FORMAT;
+			break;
 		}
-		g_node_append (node, g_node_new (&(ret->blocks[i])));
-		
-		g_free (dir);
-		g_free (rest);
-	
-		maxsize = parse_octal_field (ret->blocks[i].p.size);
-		if (maxsize)
+
+		size = parse_octal_field (block.p.size);
+		if (have_pax_size)
+			size = pax_size;
+		padded_size = TARPET_PADDED_SIZE (size);
+
+		switch (block.p.typeflag)
 		{
-			for (orig = i; i < ret->num_blocks && size < maxsize; i++)
+		case TARPET_TYPE_LONGFILEN:
+		case TARPET_TYPE_LONGLINKN:
+		case 'x':
+			if (size > MAX_METADATA_SIZE)
+			{
+				result = skip_forward (handle, padded_size, &tar->seekable, context);
+				if (result != GNOME_VFS_OK)
+					goto out;
+				offset += padded_size;
+				continue;
+			}
+
+			data = g_malloc (padded_size + 1);
+			result = read_fully (handle, data, padded_size, context);
+			if (result != GNOME_VFS_OK)
 			{
-				int wsize = TARPET_BLOCKSIZE;
-				if ((maxsize - size) < TARPET_BLOCKSIZE)
-					wsize = maxsize - size;
-				size += wsize;
+				g_free (data);
+				goto out;
 			}
-			i++;
+			data[size] = '\0';
+			offset += padded_size;
+
+			if (block.p.typeflag == TARPET_TYPE_LONGFILEN)
+			{
+				g_free (long_name);
+				long_name = g_strdup (data);
+			}
+			else if (block.p.typeflag == TARPET_TYPE_LONGLINKN)
+			{
+				g_free (long_link);
+				long_link = g_strdup (data);
+			}
+			else
+				tar_header_parse_pax (data, size, &long_name, &long_link,
+						      &pax_size, &have_pax_size);
+			g_free (data);
+			continue;
+		case 'g':
+		case TARPET_TYPE_VOLUME:
+			result = skip_forward (handle, padded_size, &tar->seekable, context);
+			if (result != GNOME_VFS_OK)
+				goto out;
+			offset += padded_size;
+			continue;
+		default:
+			break;
 		}
+
+		if (long_name != NULL)
+			header_name = long_name;
 		else
+			header_name = tar_header_get_name (&block);
+		long_name = NULL;
+		trailing_slash = header_name[0] != '\0'
+			&& header_name[strlen (header_name) - 1] == '/';
+		name = normalize_name (header_name);
+		g_free (header_name);
+
+		entry = tar_file_add_entry (tar, name);
+		g_free (name);
+
+		g_free (entry->link_name);
+		if (long_link != NULL)
+			entry->link_name = long_link;
+		else
+			entry->link_name = g_strndup (block.p.linkname,
+						      sizeof (block.p.linkname));
+		long_link = NULL;
+
+		entry->mode = parse_octal_field (block.p.mode) & 07777;
+		entry->uid = parse_octal_field (block.p.uid);
+		entry->gid = parse_octal_field (block.p.gid);
+		entry->size = size;
+		entry->data_offset = offset;
+		entry->mtime = parse_octal_field (block.p.mtime);
+
+		/* only old GNU headers have room for the other times */
+		is_gnu = memcmp (block.p.magic, TARPET_GNU_MAGIC_OLD, 8) == 0;
+		entry->atime = is_gnu ? parse_octal_field (block.gnu_old.atime) : 0;
+		entry->ctime = is_gnu ? parse_octal_field (block.gnu_old.ctime) : 0;
+		if (entry->atime == 0)
+			entry->atime = entry->mtime;
+		if (entry->ctime == 0)
+			entry->ctime = entry->mtime;
+
+		switch (block.p.typeflag)
 		{
-			i++;
+		case TARPET_TYPE_DIRECTORY:
+		case TARPET_TYPE_DUMPDIR:
+			entry->type = GNOME_VFS_FILE_TYPE_DIRECTORY;
+			break;
+		case TARPET_TYPE_SYMLINK:
+			entry->type = GNOME_VFS_FILE_TYPE_SYMBOLIC_LINK;
+			break;
+		case TARPET_TYPE_CHARDEV:
+			entry->type = GNOME_VFS_FILE_TYPE_CHARACTER_DEVICE;
+			break;
+		case TARPET_TYPE_BLOCKDEV:
+			entry->type = GNOME_VFS_FILE_TYPE_BLOCK_DEVICE;
+			break;
+		case TARPET_TYPE_FIFO:
+			entry->type = GNOME_VFS_FILE_TYPE_FIFO;
+			break;
+		case TARPET_TYPE_LINK:
+			/* hard links share the data of an earlier member */
+			entry->type = GNOME_VFS_FILE_TYPE_REGULAR;
+			name = normalize_name (entry->link_name);
+			target = g_hash_table_lookup (tar->entries, name);
+			g_free (name);
+			if (target != NULL && target != entry)
+			{
+				entry->size = target->size;
+				entry->data_offset = target->data_offset;
+			}
+			break;
+		default:
+			if (trailing_slash)
+				entry->type = GNOME_VFS_FILE_TYPE_DIRECTORY;
+			else
+				entry->type = GNOME_VFS_FILE_TYPE_REGULAR;
+			break;
+		}
+
+		have_pax_size = FALSE;
+
+		if (block.p.typeflag != TARPET_TYPE_LINK)
+		{
+			result = skip_forward (handle, padded_size, &tar->seekable, context);
+			if (result == GNOME_VFS_ERROR_EOF)
+			{
+				result = GNOME_VFS_OK;
+				break;
+			}
+			if (result != GNOME_VFS_OK)
+				break;
+			offset += padded_size;
 		}
 	}
-	
-	g_array_free (arr, FALSE);
 
-	return ret;
+ out:
+	g_free (long_name);
+	g_free (long_link);
+
+	return result;
+}
+
+static gchar *
+index_path (const gchar *filename)
+{
+	gchar *name, *path;
+
+	name = g_strdup_printf ("%08x.tarindex", g_str_hash (filename));
+	path = g_build_filename (index_dir, name, NULL);
+	g_free (name);
+
+	return path;
+}
+
+/* Parents are written before their children, so loading can add the
+ * entries in file order */
+static void
+index_write_entries (GString *out, TarEntry *parent)
+{
+	TarEntry *entry;
+	const gchar *link_name;
+
+	for (entry = parent->children; entry != NULL; entry = entry->next)
+	{
+		link_name = entry->link_name != NULL ? entry->link_name : "";
+		g_string_append_printf (out,
+					"%d %u %u %u %" G_GUINT64_FORMAT " %ld %ld %ld %" G_GINT64_FORMAT " %lu %lu\n",
+					entry->type, entry->mode, entry->uid, entry->gid,
+					(guint64) entry->size,
+					(long) entry->mtime, (long) entry->atime, (long) entry->ctime,
+					(gint64) entry->data_offset,
+					(gulong) strlen (entry->name), (gulong) strlen (link_name));
+		g_string_append (out, entry->name);
+		g_string_append (out, link_name);
+		g_string_append_c (out, '\n');
+
+		index_write_entries (out, entry);
+	}
+}
+
+static void
+tar_file_save_index (TarFile *tar)
+{
+	GString *out;
+	gchar *path;
+	GError *error;
+
+	out = g_string_new (INDEX_MAGIC);
+	g_string_append_printf (out, "%s\n%d %" G_GUINT64_FORMAT " %ld\n",
+				tar->filename, tar->seekable,
+				(guint64) tar->archive_size, (long) tar->archive_mtime);
+	index_write_entries (out, tar->root);
+
+	path = index_path (tar->filename);
+	error = NULL;
+	if (!g_file_set_contents (path, out->str, out->len, &error))
+	{
+		g_warning ("Cannot write tar index %s: %s", path, error->message);
+		g_error_free (error);
+	}
+	g_free (path);
+	g_string_free (out, TRUE);
+}
+
+/* Returns FALSE if there is no index for the archive as it is now */
+static gboolean
+tar_file_load_index (TarFile *tar)
+{
+	gchar *path, *contents, *p, *end, *name;
+	gsize length;
+	gint seekable, type, consumed;
+	guint mode, uid, gid;
+	guint64 size, archive_size;
+	gint64 data_offset;
+	long mtime, atime, ctime, archive_mtime;
+	gulong name_len, link_len;
+	TarEntry *entry;
+
+	path = index_path (tar->filename);
+	if (!g_file_get_contents (path, &contents, &length, NULL))
+	{
+		g_free (path);
+		return FALSE;
+	}
+	g_free (path);
+
+	p = contents;
+	end = contents + length;
+
+	if (length < strlen (INDEX_MAGIC) || strncmp (p, INDEX_MAGIC, strlen (INDEX_MAGIC)) != 0)
+		goto bad;
+	p += strlen (INDEX_MAGIC);
+
+	/* the file name only hashes to the index name, check it */
+	if ((gsize) (end - p) <= strlen (tar->filename)
+	    || strncmp (p, tar->filename, strlen (tar->filename)) != 0
+	    || p[strlen (tar->filename)] != '\n')
+		goto bad;
+	p += strlen (tar->filename) + 1;
+
+	if (sscanf (p, "%d %" G_GUINT64_FORMAT " %ld%n",
+		    &seekable, &archive_size, &archive_mtime, &consumed) != 3
+	    || p[consumed] != '\n'
+	    || archive_size != tar->archive_size
+	    || archive_mtime != (long) tar->archive_mtime)
+		goto bad;
+	p += consumed + 1;
+	tar->seekable = seekable;
+
+	while (p < end)
+	{
+		if (sscanf (p, "%d %u %u %u %" G_GUINT64_FORMAT " %ld %ld %ld %" G_GINT64_FORMAT " %lu %lu%n",
+			    &type, &mode, &uid, &gid, &size, &mtime, &atime, &ctime,
+			    &data_offset, &name_len, &link_len, &consumed) != 11
+		    || p[consumed] != '\n')
+			goto bad;
+		p += consumed + 1;
+		if (name_len + link_len + 1 > (gulong) (end - p) || name_len == 0)
+			goto bad;
+
+		name = g_strndup (p, name_len);
+		entry = tar_file_add_entry (tar, name);
+		g_free (name);
+		p += name_len;
+
+		g_free (entry->link_name);
+		entry->link_name = g_strndup (p, link_len);
+		p += link_len + 1;
+
+		entry->type = type;
+		entry->mode = mode;
+		entry->uid = uid;
+		entry->gid = gid;
+		entry->size = size;
+		entry->mtime = mtime;
+		entry->atime = atime;
+		entry->ctime = ctime;
+		entry->data_offset = data_offset;
+	}
+
+	g_free (contents);
+	return TRUE;
+
+ bad:
+	g_free (contents);
+	return FALSE;
 }
 
 static TarFile* 
-ensure_tarfile (GnomeVFSURI *uri)
+ensure_tarfile (GnomeVFSURI *uri,
+		GnomeVFSContext *context,
+		GnomeVFSResult *result)
 {
 	TarFile *tar;
 	GnomeVFSHandle *handle;
+	GnomeVFSFileInfo *info;
 	gchar *parent_string;
+	gboolean have_stamp;
+	GnomeVFSFileSize archive_size;
+	time_t archive_mtime, now;
 
 	parent_string = gnome_vfs_uri_to_string (uri->parent, GNOME_VFS_URI_HIDE_NONE);
+	now = time (NULL);
+
 	G_LOCK (tar_cache);
 	tar = g_hash_table_lookup (tar_cache, parent_string);
-	if (!tar)
+	if (tar != NULL && now >= tar->checked
+	    && now - tar->checked < ARCHIVE_CHECK_INTERVAL)
 	{
-		if (gnome_vfs_open_uri (&handle, uri->parent, GNOME_VFS_OPEN_READ) != GNOME_VFS_OK)
-			return NULL;
-		tar = read_tar_file (handle);
-		tar->filename = parent_string;
-		gnome_vfs_close (handle);
-		g_hash_table_insert (tar_cache, parent_string, tar);
+		tar->ref_count++;
+		G_UNLOCK (tar_cache);
+		g_free (parent_string);
+		*result = GNOME_VFS_OK;
+		return tar;
 	}
 	G_UNLOCK (tar_cache);
 
-	tar->ref_count++;
-	return tar;
-}
+	/* Otherwise the archive is checked, so that a changed archive
+	 * gets scanned again */
+	info = gnome_vfs_file_info_new ();
+	*result = gnome_vfs_get_file_info_uri_cancellable (uri->parent, info,
+							  GNOME_VFS_FILE_INFO_DEFAULT,
+							  context);
+	have_stamp = *result == GNOME_VFS_OK
+		&& (info->valid_fields & GNOME_VFS_FILE_INFO_FIELDS_SIZE)
+		&& (info->valid_fields & GNOME_VFS_FILE_INFO_FIELDS_MTIME);
+	archive_size = info->size;
+	archive_mtime = info->mtime;
+	gnome_vfs_file_info_unref (info);
 
-static void
-tar_file_unref (TarFile *tar)
-{
-	tar->ref_count--;
-	if (tar->ref_count < 0)
+	G_LOCK (tar_cache);
+	tar = g_hash_table_lookup (tar_cache, parent_string);
+	if (tar != NULL && have_stamp
+	    && (tar->archive_size != archive_size || tar->archive_mtime != archive_mtime))
 	{
-		G_LOCK (tar_cache);
 		g_hash_table_remove (tar_cache, tar->filename);
-		G_UNLOCK (tar_cache);
-		g_free (tar->blocks);
-		g_node_destroy (tar->info_tree);
-		g_free (tar->filename);
-		g_free (tar);
+		tar_file_unref_locked (tar);
+		tar = NULL;
 	}
+
+	if (tar == NULL)
+	{
+		tar = tar_file_new (uri->parent, parent_string);
+		parent_string = NULL;
+		tar->archive_size = archive_size;
+		tar->archive_mtime = archive_mtime;
+
+		if (index_dir == NULL || !have_stamp || !tar_file_load_index (tar))
+		{
+			*result = gnome_vfs_open_uri_cancellable (&handle, uri->parent,
+								  GNOME_VFS_OPEN_READ,
+								  context);
+			if (*result == GNOME_VFS_OK)
+			{
+				*result = tar_file_scan (tar, handle, context);
+				gnome_vfs_close (handle);
+			}
+			if (*result != GNOME_VFS_OK)
+			{
+				tar_file_unref_locked (tar);
+				G_UNLOCK (tar_cache);
+				return NULL;
+			}
+
+			if (index_dir != NULL && have_stamp)
+				tar_file_save_index (tar);
+		}
+
+		g_hash_table_insert (tar_cache, tar->filename, tar);
+	}
+	tar->checked = now;
+	tar->ref_count++;
+	G_UNLOCK (tar_cache);
+
+	g_free (parent_string);
+
+	*result = GNOME_VFS_OK;
+	return tar;
 }
 
+static void
+get_entry_info (TarFile *tar,
+		TarEntry *entry,
+		GnomeVFSFileInfo *file_info,
+		GnomeVFSFileInfoOptions options,
+		GnomeVFSContext *context);
+
 static GnomeVFSResult
 do_open (GnomeVFSMethod *method,
 	 GnomeVFSMethodHandle **method_handle,
@@ -311,60 +786,115 @@ do_open (GnomeVFSMethod *method,
 	 GnomeVFSContext *context)
 {	
 	TarFile *tar;
+	TarEntry *entry;
 	FileHandle *new_handle;
-	GNode *node;
-	union TARPET_block *start;
-	int i;
+	GnomeVFSResult result;
 		
 	if (!uri->parent)
 		return GNOME_VFS_ERROR_INVALID_URI;
+	if (mode & GNOME_VFS_OPEN_WRITE)
+		return GNOME_VFS_ERROR_READ_ONLY_FILE_SYSTEM;
 	
-	tar = ensure_tarfile (uri);
+	tar = ensure_tarfile (uri, context, &result);
 	if (!tar)
-		return GNOME_VFS_ERROR_BAD_FILE;
-	node = tree_lookup_entry (tar->info_tree, uri->text);
-	if (!node)
+		return result;
+	entry = tar_file_lookup (tar, uri->text);
+	if (!entry)
 	{
 		tar_file_unref (tar);
 		return GNOME_VFS_ERROR_NOT_FOUND;
 	}
-	start = node->data;
-
-	if (start->p.name[strlen (start->p.name) - 1] == '/')
+	if (entry->type == GNOME_VFS_FILE_TYPE_DIRECTORY)
+	{
+		tar_file_unref (tar);
 		return GNOME_VFS_ERROR_IS_DIRECTORY;
+	}
+
 	new_handle = g_new0 (FileHandle, 1);
 	new_handle->tar = tar;
-	new_handle->filename = g_strdup (uri->text);
-	new_handle->start = start;
-	new_handle->current = new_handle->start;
-	new_handle->current_offset = 0;
-	for (i = 0; i < tar->num_blocks; i++)
-		if (start == &(tar->blocks[i]))
-			break;
-	new_handle->current_index = i;
-	new_handle->is_directory = FALSE;
+	new_handle->entry = entry;
 	
 	*method_handle = (GnomeVFSMethodHandle*) new_handle;
 	
 	return GNOME_VFS_OK;
 }
 
-static void
-file_handle_unref (FileHandle *handle)
+static GnomeVFSResult
+do_close (GnomeVFSMethod *method,
+	  GnomeVFSMethodHandle *method_handle,
+	  GnomeVFSContext *context)
 {
+	FileHandle *handle = (FileHandle*) method_handle;
+
+	if (handle->parent != NULL)
+		gnome_vfs_close (handle->parent);
 	tar_file_unref (handle->tar);
-	g_free (handle->filename);
 	g_free (handle);
+
+	return GNOME_VFS_OK;
 }
 
+/* Gets the archive to where the next read of the member starts */
 static GnomeVFSResult
-do_close (GnomeVFSMethod *method,
-	  GnomeVFSMethodHandle *method_handle,
-	  GnomeVFSContext *context)
+position_parent (FileHandle *handle,
+		 GnomeVFSContext *context)
 {
-	FileHandle *handle = (FileHandle*) method_handle;
+	GnomeVFSResult result;
+	GnomeVFSFileOffset target;
+
+	target = handle->entry->data_offset + handle->offset;
+	if (handle->parent != NULL && handle->parent_offset == target)
+		return GNOME_VFS_OK;
+
+	if (handle->parent == NULL)
+	{
+		result = gnome_vfs_open_uri_cancellable (&handle->parent,
+							 handle->tar->archive_uri,
+							 GNOME_VFS_OPEN_READ,
+							 context);
+		if (result != GNOME_VFS_OK)
+		{
+			handle->parent = NULL;
+			return result;
+		}
+		handle->parent_offset = 0;
+	}
+
+	if (handle->tar->seekable)
+	{
+		result = gnome_vfs_seek_cancellable (handle->parent, GNOME_VFS_SEEK_START,
+						     target, context);
+		if (result == GNOME_VFS_OK)
+			handle->parent_offset = target;
+		return result;
+	}
 
-	file_handle_unref (handle);
+	/* An archive that can't seek is read forwards, from the start
+	 * again if need be */
+	if (target < handle->parent_offset)
+	{
+		gnome_vfs_close (handle->parent);
+		result = gnome_vfs_open_uri_cancellable (&handle->parent,
+							 handle->tar->archive_uri,
+							 GNOME_VFS_OPEN_READ, context);
+		if (result != GNOME_VFS_OK)
+		{
+			handle->parent = NULL;
+			return result;
+		}
+		handle->parent_offset = 0;
+	}
+
+	result = skip_forward (handle->parent, target - handle->parent_offset,
+			       &handle->tar->seekable, context);
+	if (result != GNOME_VFS_OK)
+	{
+		/* the position in the archive is unknown now */
+		gnome_vfs_close (handle->parent);
+		handle->parent = NULL;
+		return result;
+	}
+	handle->parent_offset = target;
 
 	return GNOME_VFS_OK;
 }
@@ -378,41 +908,31 @@ do_read (GnomeVFSMethod *method,
 	 GnomeVFSContext *context)
 {
 	FileHandle *handle = (FileHandle*) method_handle;
-	int i, size = 0, maxsize;
-	
-	if (handle->is_directory)
-		return GNOME_VFS_ERROR_IS_DIRECTORY;
+	GnomeVFSResult result;
 
-	maxsize = parse_octal_field (handle->start->p.size);
-	if (handle->current == handle->start)
-	{
-		handle->current_index++;
-		handle->current_offset = TARPET_BLOCKSIZE;
-	}
+	*bytes_read = 0;
+	if (handle->offset >= handle->entry->size)
+		return GNOME_VFS_ERROR_EOF;
+	num_bytes = MIN (num_bytes, handle->entry->size - handle->offset);
+
+	result = position_parent (handle, context);
+	if (result != GNOME_VFS_OK)
+		return result;
 
-	for (i = handle->current_index; i < handle->tar->num_blocks && handle->current_offset < (maxsize + TARPET_BLOCKSIZE) && size < num_bytes; i++)
+	result = gnome_vfs_read_cancellable (handle->parent, buffer, num_bytes,
+					     bytes_read, context);
+	if (result != GNOME_VFS_OK)
 	{
-		int wsize = TARPET_BLOCKSIZE;
-		gpointer target_buf = (gchar*)buffer + size;
-		if ((maxsize - (handle->current_offset - TARPET_BLOCKSIZE)) < TARPET_BLOCKSIZE
-		   && (maxsize - (handle->current_offset - TARPET_BLOCKSIZE)) > 0)
-			wsize = maxsize - handle->current_offset + TARPET_BLOCKSIZE;
-		else if (num_bytes < (size + wsize))
-			wsize = num_bytes - size;
-		else
-			handle->current_index = i + 1;
-		
-		memcpy (target_buf, handle->start->raw.data + handle->current_offset, wsize);
-		
-		size += wsize;
-		handle->current_offset += wsize;
+		*bytes_read = 0;
+		return result;
 	}
-	if (handle->current_index < handle->tar->num_blocks)
-		handle->current = &handle->tar->blocks[handle->current_index]; 
-	else
-		handle->current = NULL;
-	
-	*bytes_read = size;
+	if (*bytes_read == 0)
+		/* the archive is shorter than its headers say */
+		return GNOME_VFS_ERROR_EOF;
+
+	handle->offset += *bytes_read;
+	handle->parent_offset += *bytes_read;
+
 	return GNOME_VFS_OK;
 }
 
@@ -432,17 +952,21 @@ do_seek (GnomeVFSMethod *method,
 		current_offset = 0;
 		break;
 	case GNOME_VFS_SEEK_CURRENT:
-		current_offset = handle->current_offset;
+		current_offset = handle->offset;
 		break;
 	case GNOME_VFS_SEEK_END:
-		current_offset = parse_octal_field (handle->start->p.size);
+		current_offset = handle->entry->size;
 		break;
 	default:
-		current_offset = handle->current_offset;
+		current_offset = handle->offset;
 		break;
 	}
 
-	handle->current_offset = current_offset + offset;
+	if (current_offset + offset < 0)
+		return GNOME_VFS_ERROR_BAD_PARAMETERS;
+
+	/* the archive is moved on the next read */
+	handle->offset = current_offset + offset;
 	return GNOME_VFS_OK;
 }
 
@@ -452,7 +976,7 @@ do_tell (GnomeVFSMethod *method,
 	 GnomeVFSFileSize *offset_return)
 {
 	FileHandle *handle = (FileHandle*) method_handle;
-	*offset_return = handle->current_offset;
+	*offset_return = handle->offset;
 	return GNOME_VFS_OK;
 }
 
@@ -464,58 +988,32 @@ do_open_directory (GnomeVFSMethod *method,
 		   GnomeVFSContext *context)
 {
 	TarFile *tar;
-	FileHandle *new_handle;
-	union TARPET_block *start, *current;
-	GNode *node;
-	int i;
+	TarEntry *entry;
+	DirectoryHandle *new_handle;
+	GnomeVFSResult result;
 
 	if (!uri->parent)
 		return GNOME_VFS_ERROR_INVALID_URI;
-	tar = ensure_tarfile (uri);
-	if (uri->text)
-	{
-		node = tree_lookup_entry (tar->info_tree, uri->text);
-		if (!node)
-		{
-			tar_file_unref (tar);
-			return GNOME_VFS_ERROR_NOT_FOUND;
-		}
-		start = node->data;
-		
-		if (start->p.name[strlen (start->p.name) - 1] != '/')
-			return GNOME_VFS_ERROR_NOT_A_DIRECTORY;
+	tar = ensure_tarfile (uri, context, &result);
+	if (!tar)
+		return result;
 
-		if (node->children)
-			current = node->children->data; 
-		else
-			current = NULL;
+	entry = tar_file_lookup (tar, uri->text);
+	if (!entry)
+	{
+		tar_file_unref (tar);
+		return GNOME_VFS_ERROR_NOT_FOUND;
 	}
-	else
+	if (entry->type != GNOME_VFS_FILE_TYPE_DIRECTORY)
 	{
-		node = tar->info_tree;
-		if (!node)
-		{
-			tar_file_unref (tar);
-			return GNOME_VFS_ERROR_NOT_FOUND;
-		}
-
-		if (node->children)
-			start = node->children->data;
-		else
-			start = NULL;
-		current = start;
+		tar_file_unref (tar);
+		return GNOME_VFS_ERROR_NOT_A_DIRECTORY;
 	}
 	
-	new_handle = g_new0 (FileHandle, 1);
+	new_handle = g_new0 (DirectoryHandle, 1);
 	new_handle->tar = tar;
-	new_handle->filename = g_strdup (tar->filename);
-	new_handle->start = start;
-	new_handle->current = current;
-	for (i = 0; i < tar->num_blocks; i++)
-		if (start == &(tar->blocks[i]))
-			break;
-	new_handle->current_index = i;
-	new_handle->is_directory = TRUE;
+	new_handle->current = entry->children;
+	new_handle->options = options;
 
 	*method_handle = (GnomeVFSMethodHandle*) new_handle;
 	
@@ -527,96 +1025,89 @@ do_close_directory (GnomeVFSMethod *method,
 		    GnomeVFSMethodHandle *method_handle,
 		    GnomeVFSContext *context)
 {
-	FileHandle *handle = (FileHandle*) method_handle;
+	DirectoryHandle *handle = (DirectoryHandle*) method_handle;
 
-	file_handle_unref (handle);
+	tar_file_unref (handle->tar);
+	g_free (handle);
 
 	return GNOME_VFS_OK;
 }
 
-static GnomeVFSResult 
-do_get_file_info (GnomeVFSMethod *method,
-		  GnomeVFSURI *uri,
-		  GnomeVFSFileInfo *file_info,
-		  GnomeVFSFileInfoOptions options,
-		  GnomeVFSContext *context)
+/* Sniffs the type of a member from its first block */
+static const char *
+get_data_mime_type (TarFile *tar,
+		    TarEntry *entry,
+		    GnomeVFSContext *context)
 {
-	TarFile *tar;
-	GNode *node;
-	union TARPET_block *current;
-	gchar *name;
-	gchar *path;
-	char *mime_type;
-	int i;
+	FileHandle handle;
+	union TARPET_block block;
+	GnomeVFSFileSize bytes_read;
+	const char *mime_type;
 
-	if (!uri->parent)
-		return GNOME_VFS_ERROR_INVALID_URI;
+	memset (&handle, 0, sizeof (handle));
+	handle.tar = tar;
+	handle.entry = entry;
 
-	tar = ensure_tarfile (uri);
-	
-	if (uri->text)
-		node = tree_lookup_entry (tar->info_tree, uri->text);
-	else
-		node = tar->info_tree->children;
-	
-	if (!node)
-	{
-		tar_file_unref (tar);
-		return GNOME_VFS_ERROR_NOT_FOUND;
-	}
+	mime_type = NULL;
+	if (do_read (NULL, (GnomeVFSMethodHandle *) &handle, block.raw.data,
+		     TARPET_BLOCKSIZE, &bytes_read, context) == GNOME_VFS_OK)
+		mime_type = gnome_vfs_get_mime_type_for_data (block.raw.data, bytes_read);
+	if (handle.parent != NULL)
+		gnome_vfs_close (handle.parent);
 
-	current = node->data;
-	for (i = 0; i < tar->num_blocks; i++)
-		if (&(tar->blocks[i]) == current)
-			break;
-	if (i && tar->blocks[i - 2].p.typeflag == TARPET_TYPE_LONGFILEN)
-		name = g_strdup (tar->blocks[i - 1].raw.data);
+	return mime_type;
+}
+
+static void
+get_entry_info (TarFile *tar,
+		TarEntry *entry,
+		GnomeVFSFileInfo *file_info,
+		GnomeVFSFileInfoOptions options,
+		GnomeVFSContext *context)
+{
+	const char *mime_type;
+	const char *slash;
+
+	slash = strrchr (entry->name, '/');
+	if (entry == tar->root)
+		file_info->name = g_strdup ("/");
 	else
-		name = g_strdup (current->p.name);
+		file_info->name = g_strdup (slash != NULL ? slash + 1 : entry->name);
 
-	file_info->name = g_path_get_basename (name);
-	if (name[strlen (name) - 1] == '/')
-		file_info->type = GNOME_VFS_FILE_TYPE_DIRECTORY;
-	else if (current->p.typeflag == TARPET_TYPE_SYMLINK)
+	file_info->type = entry->type;
+	if (entry->type == GNOME_VFS_FILE_TYPE_SYMBOLIC_LINK)
 	{
-		file_info->type = GNOME_VFS_FILE_TYPE_SYMBOLIC_LINK;
-		file_info->symlink_name = g_strdup (current->p.linkname);
+		file_info->symlink_name = g_strdup (entry->link_name);
+		file_info->valid_fields |= GNOME_VFS_FILE_INFO_FIELDS_SYMLINK_NAME;
 	}
-	else
-		file_info->type = GNOME_VFS_FILE_TYPE_REGULAR;
 
-	file_info->permissions = parse_octal_field (current->p.mode);
-	file_info->uid = parse_octal_field (current->p.uid);
-	file_info->gid = parse_octal_field (current->p.gid);
-	file_info->size = parse_octal_field (current->p.size);
-	file_info->mtime = parse_octal_field (current->p.mtime);
-	file_info->atime = parse_octal_field (current->gnu.atime);
-	file_info->ctime = parse_octal_field (current->gnu.ctime);
+	file_info->permissions = entry->mode;
+	file_info->uid = entry->uid;
+	file_info->gid = entry->gid;
+	file_info->size = entry->size;
+	file_info->mtime = entry->mtime;
+	file_info->atime = entry->atime;
+	file_info->ctime = entry->ctime;
 
+	mime_type = NULL;
 	if (file_info->type == GNOME_VFS_FILE_TYPE_DIRECTORY)
 		mime_type = "x-directory/normal";
 	else if (!(options & GNOME_VFS_FILE_INFO_FOLLOW_LINKS) && file_info->type == GNOME_VFS_FILE_TYPE_SYMBOLIC_LINK)
 		mime_type = "x-special/symlink";
-	else if (!file_info->size || (options & GNOME_VFS_FILE_INFO_FORCE_FAST_MIME_TYPE))
-	{
-		path = gnome_vfs_uri_to_string (uri, GNOME_VFS_URI_HIDE_NONE);
-		mime_type = (char*) gnome_vfs_get_file_mime_type (path, NULL, TRUE);
-		g_free (path);
-	}
-	else
-	{
-		mime_type = (char*) gnome_vfs_get_mime_type_for_data ((current + 1)->raw.data, MIN (TARPET_BLOCKSIZE, file_info->size));
-		if (!mime_type)
-		{
-			path = gnome_vfs_uri_to_string (uri, GNOME_VFS_URI_HIDE_NONE);
-			mime_type = (char*) gnome_vfs_get_file_mime_type (path, NULL, TRUE);
-			g_free (path);
-		}
-	}
+	/* Sniffing reopens the archive, which has to be read up to the
+	 * member again if it can't be seeked in; go by the name then */
+	else if (file_info->size
+		 && tar->seekable
+		 && (options & GNOME_VFS_FILE_INFO_GET_MIME_TYPE)
+		 && !(options & GNOME_VFS_FILE_INFO_FORCE_FAST_MIME_TYPE))
+		mime_type = get_data_mime_type (tar, entry, context);
+
+	if (!mime_type)
+		mime_type = gnome_vfs_get_file_mime_type (file_info->name, NULL, TRUE);
 
 	file_info->mime_type = g_strdup (mime_type);
 
-	file_info->valid_fields = GNOME_VFS_FILE_INFO_FIELDS_TYPE |
+	file_info->valid_fields |= GNOME_VFS_FILE_INFO_FIELDS_TYPE |
 			   	  GNOME_VFS_FILE_INFO_FIELDS_PERMISSIONS |
 			   	  GNOME_VFS_FILE_INFO_FIELDS_SIZE |
 			   	  GNOME_VFS_FILE_INFO_FIELDS_ATIME |
@@ -624,8 +1115,35 @@ do_get_file_info (GnomeVFSMethod *method,
 			   	  GNOME_VFS_FILE_INFO_FIELDS_CTIME |
 			   	  GNOME_VFS_FILE_INFO_FIELDS_MIME_TYPE |
 				  GNOME_VFS_FILE_INFO_FIELDS_IDS;
+}
+
+static GnomeVFSResult 
+do_get_file_info (GnomeVFSMethod *method,
+		  GnomeVFSURI *uri,
+		  GnomeVFSFileInfo *file_info,
+		  GnomeVFSFileInfoOptions options,
+		  GnomeVFSContext *context)
+{
+	TarFile *tar;
+	TarEntry *entry;
+	GnomeVFSResult result;
+
+	if (!uri->parent)
+		return GNOME_VFS_ERROR_INVALID_URI;
+
+	tar = ensure_tarfile (uri, context, &result);
+	if (!tar)
+		return result;
+	
+	entry = tar_file_lookup (tar, uri->text);
+	if (!entry)
+	{
+		tar_file_unref (tar);
+		return GNOME_VFS_ERROR_NOT_FOUND;
+	}
+
+	get_entry_info (tar, entry, file_info, options, context);
 
-	g_free (name);
 	tar_file_unref (tar);
 
 	return GNOME_VFS_OK;
@@ -637,29 +1155,14 @@ do_read_directory (GnomeVFSMethod *method,
 		   GnomeVFSFileInfo *file_info,
 		   GnomeVFSContext *context)
 {
-	FileHandle *handle = (FileHandle*) method_handle;
-	GnomeVFSURI *uri;
-	gchar *str;
-	GNode *node;
+	DirectoryHandle *handle = (DirectoryHandle*) method_handle;
 	
 	if (!handle->current)
 		return GNOME_VFS_ERROR_EOF;
 
-	str = g_strconcat (handle->filename, "#tar:", handle->current->p.name, NULL);
-	uri = gnome_vfs_uri_new (str);
-	do_get_file_info (method, uri, file_info, 0, context);
-	node = tree_lookup_entry (handle->tar->info_tree, uri->text);
-	if (!node)
-	{
-		gnome_vfs_uri_unref (uri);
-		return GNOME_VFS_ERROR_NOT_FOUND;
-	}
-	
-	if (node->next)
-		handle->current = node->next->data;
-	else
-		handle->current = NULL;
-	gnome_vfs_uri_unref (uri);
+	get_entry_info (handle->tar, handle->current, file_info,
+			handle->options, context);
+	handle->current = handle->current->next;
 
 	return GNOME_VFS_OK;
 }
@@ -672,11 +1175,8 @@ do_get_file_info_from_handle (GnomeVFSMethod *method,
 			      GnomeVFSContext *context)
 {
 	FileHandle *handle = (FileHandle*) method_handle;
-	GnomeVFSURI *uri;
-	
-	uri = gnome_vfs_uri_new (handle->start->p.name);
-	do_get_file_info (method, uri, file_info, options, context);
-	gnome_vfs_uri_unref (uri);
+
+	get_entry_info (handle->tar, handle->entry, file_info, options, context);
 
 	return GNOME_VFS_OK;
 }
@@ -721,16 +1221,38 @@ static GnomeVFSMethod method =
 GnomeVFSMethod *
 vfs_module_init (const char *method_name, const char *args)
 {
+	const char *dir;
+
 	G_LOCK (tar_cache);
 	tar_cache = g_hash_table_new (g_str_hash, g_str_equal);
+
+	dir = getenv (INDEX_DIR_VARIABLE);
+	if (dir != NULL && *dir != '\0')
+	{
+		if (g_mkdir_with_parents (dir, 0700) == 0)
+			index_dir = g_strdup (dir);
+		else
+			g_warning ("Cannot create tar index directory %s: %s",
+				   dir, g_strerror (errno));
+	}
 	G_UNLOCK (tar_cache);
 	return &method;
 }
 
+static gboolean
+drop_cached_tar (gpointer key, gpointer value, gpointer user_data)
+{
+	tar_file_unref_locked (value);
+	return TRUE;
+}
+
 void
 vfs_module_shutdown (GnomeVFSMethod *method)
 {
 	G_LOCK (tar_cache);
+	g_hash_table_foreach_remove (tar_cache, drop_cached_tar, NULL);
 	g_hash_table_destroy (tar_cache);
+	g_free (index_dir);
+	index_dir = NULL;
 	G_UNLOCK (tar_cache);
 }
@@ -39,6 +39,7 @@ static gboolean use_unique_names = 0;
 static gboolean link_items = 0;
 static gboolean follow_links_recursive = 0;
 static gboolean target_default_perms = 0;
+static gboolean parallel = 0;
 
 static char **uris = NULL;
 
@@ -57,6 +58,7 @@ static GOptionEntry option_entries[] =
   { "link-items", 0, 0, G_OPTION_ARG_NONE, &link_items, "Set GNOME_VFS_XFER_LINK_ITEMS", NULL },
   { "follow-links-recursive", 0, 0, G_OPTION_ARG_NONE, &follow_links_recursive, "Set GNOME_VFS_XFER_FOLLOW_LINKS_RECURSIVE", NULL },
   { "target-default-perms", 0, 0, G_OPTION_ARG_NONE, &target_default_perms, "Set GNOME_VFS_XFER_TARGET_DEFAULT_PERMS", NULL },
+  { "parallel", 0, 0, G_OPTION_ARG_NONE, &parallel, "Set GNOME_VFS_XFER_PARALLEL", NULL },
 
   { G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_STRING_ARRAY, &uris, "The xfer URIs", NULL },
   { NULL }
@@ -280,6 +282,10 @@ main (int argc,
 		options |= GNOME_VFS_XFER_TARGET_DEFAULT_PERMS;
 	}
 
+	if (parallel) {
+		options |= GNOME_VFS_XFER_PARALLEL;
+	}
+
 	result = gnome_vfs_async_xfer (&handle, from_list, to_list, options,
 				       GNOME_VFS_XFER_ERROR_MODE_QUERY,
 				       GNOME_VFS_XFER_OVERWRITE_MODE_QUERY,
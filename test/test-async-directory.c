@@ -33,6 +33,7 @@ static GMainLoop *main_loop;
 static gint items_per_notification = 1;
 static gboolean measure_speed = FALSE;
 static gboolean read_files = FALSE;
+static gboolean pull = FALSE;
 
 static GOptionEntry options[] = {
 	{ "chunk-size", 'c', G_OPTION_FLAG_IN_MAIN,
@@ -41,6 +42,8 @@ static GOptionEntry options[] = {
 	  G_OPTION_ARG_NONE, &measure_speed, "Meaure speed without displaying anything", NULL },
 	{ "read-files", 'r', G_OPTION_FLAG_IN_MAIN,
 	  G_OPTION_ARG_NONE, &read_files, "Test file reading", NULL },
+	{ "pull", 'p', G_OPTION_FLAG_IN_MAIN,
+	  G_OPTION_ARG_NONE, &pull, "Hold every batch and release it from an idle", NULL },
 	{ NULL }
 };
 
@@ -162,6 +165,13 @@ typedef struct {
 
 static volatile int async_task_counter; 
 
+static gboolean
+release_batch (gpointer data)
+{
+	gnome_vfs_async_load_directory_release ((GnomeVFSAsyncHandle *) data);
+	return FALSE;
+}
+
 static void
 directory_load_callback (GnomeVFSAsyncHandle *handle,
 			 GnomeVFSResult result,
@@ -214,6 +224,14 @@ directory_load_callback (GnomeVFSAsyncHandle *handle,
 	
 	data->num_entries_read += entries_read;
 
+	if (pull && result == GNOME_VFS_OK) {
+		if (gnome_vfs_async_load_directory_hold (handle)) {
+			g_idle_add (release_batch, handle);
+		} else {
+			printf ("Could not hold batch\n");
+		}
+	}
+
 	gnome_vfs_uri_unref (parent_uri);
 	if (result != GNOME_VFS_OK) {
 		if (--async_task_counter == 0) {
@@ -0,0 +1,189 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 8; tab-width: 8 -*- */
+/* test-compress-parallel.c - Benchmark for parallel gzip and bzip2
+   compression.
+
+   Copyright (C) 2026 Free Software Foundation
+
+   The Gnome Library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   The Gnome Library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with the Gnome Library; see the file COPYING.LIB.  If not,
+   write to the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, USA.
+*/
+
+/* Writes the same text-like data through the gzip and bzip2 methods,
+ * once compressing on the writing thread (GNOME_VFS_COMPRESS_THREADS=1)
+ * and once on as many threads as there are processors, and prints the
+ * throughput of each. Every file is read back through its method and
+ * compared with what was written. Each run happens in a process of its
+ * own, since the methods read the thread count when they are loaded.
+ */
+
+#include <config.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <libgnomevfs/gnome-vfs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "test-data.h"
+
+#define CHUNK_SIZE (64 * 1024)
+
+static int size_mb = 64;
+static char *only_method = NULL;
+
+static GOptionEntry options[] = {
+	{ "size", 's', 0, G_OPTION_ARG_INT, &size_mb,
+	  "Megabytes of data to compress (default 64)", "MB" },
+	{ "method", 'm', 0, G_OPTION_ARG_STRING, &only_method,
+	  "Only test gzip or bzip2", "METHOD" },
+	{ NULL }
+};
+
+static guchar *data;
+static gsize data_len;
+
+static gboolean
+compress_file (const char *uri)
+{
+	GnomeVFSHandle *handle;
+	GnomeVFSFileSize written;
+	gsize offset;
+
+	if (!test_data_check_result (gnome_vfs_open (&handle, uri, GNOME_VFS_OPEN_WRITE),
+				     "open for writing")) {
+		return FALSE;
+	}
+
+	for (offset = 0; offset < data_len; offset += CHUNK_SIZE) {
+		if (!test_data_check_result (gnome_vfs_write (handle, data + offset,
+							      MIN (CHUNK_SIZE, data_len - offset),
+							      &written), "write")) {
+			gnome_vfs_close (handle);
+			return FALSE;
+		}
+	}
+
+	return test_data_check_result (gnome_vfs_close (handle), "close");
+}
+
+/* Runs in a child process */
+static int
+run (const char *tmp_dir, const char *method, int n_threads)
+{
+	char *path, *threads, *uri, *file_uri;
+	struct stat st;
+	GTimer *timer;
+	double elapsed;
+	gboolean ok;
+
+	threads = g_strdup_printf ("%d", n_threads);
+	g_setenv ("GNOME_VFS_COMPRESS_THREADS", threads, TRUE);
+	g_free (threads);
+
+	if (!test_data_init_vfs ()) {
+		return 1;
+	}
+
+	path = g_strdup_printf ("%s/data-%d.%s", tmp_dir, n_threads,
+				strcmp (method, "gzip") == 0 ? "gz" : "bz2");
+	/* The methods open their parent without creating it */
+	if (!g_file_set_contents (path, "", 0, NULL)) {
+		fprintf (stderr, "Could not create %s\n", path);
+		return 1;
+	}
+	file_uri = gnome_vfs_get_uri_from_local_path (path);
+	uri = g_strdup_printf ("%s#%s:", file_uri, method);
+	g_free (file_uri);
+
+	timer = g_timer_new ();
+	ok = compress_file (uri);
+	elapsed = g_timer_elapsed (timer, NULL);
+	g_timer_destroy (timer);
+
+	if (ok && g_stat (path, &st) == 0) {
+		printf ("%-5s %3d thread%s: %7.1f MB/s, compressed to %.1f%%\n",
+			method, n_threads, n_threads == 1 ? " " : "s",
+			size_mb / elapsed, 100.0 * st.st_size / data_len);
+		fflush (stdout);
+		ok = test_data_verify_file (uri, data, data_len, CHUNK_SIZE);
+	}
+
+	g_unlink (path);
+	g_free (path);
+	g_free (uri);
+
+	gnome_vfs_shutdown ();
+
+	return ok ? 0 : 1;
+}
+
+int
+main (int argc, char **argv)
+{
+	const char *methods[] = { "gzip", "bzip2" };
+	char *tmp_dir;
+	int thread_counts[2];
+	int i, j, status;
+	gboolean failed;
+	pid_t pid;
+
+	if (!test_data_parse_options (&argc, &argv, NULL, options)) {
+		return 1;
+	}
+
+	thread_counts[0] = 1;
+	thread_counts[1] = test_data_n_processors (2);
+
+	tmp_dir = g_build_filename (g_get_tmp_dir (), "test-compress-parallel-XXXXXX", NULL);
+	if (mkdtemp (tmp_dir) == NULL) {
+		perror (tmp_dir);
+		return 1;
+	}
+
+	data_len = (gsize) size_mb * 1024 * 1024;
+	data = test_data_create (data_len, TEST_DATA_TEXT);
+
+	failed = FALSE;
+	for (i = 0; i < G_N_ELEMENTS (methods); i++) {
+		if (only_method != NULL && strcmp (only_method, methods[i]) != 0) {
+			continue;
+		}
+		for (j = 0; j < G_N_ELEMENTS (thread_counts); j++) {
+			pid = fork ();
+			if (pid < 0) {
+				perror ("fork");
+				return 1;
+			}
+			if (pid == 0) {
+				_exit (run (tmp_dir, methods[i], thread_counts[j]));
+			}
+			if (waitpid (pid, &status, 0) < 0 ||
+			    !WIFEXITED (status) || WEXITSTATUS (status) != 0) {
+				failed = TRUE;
+			}
+		}
+	}
+
+	g_rmdir (tmp_dir);
+	g_free (tmp_dir);
+	g_free (data);
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
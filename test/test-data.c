@@ -0,0 +1,229 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 8; tab-width: 8 -*- */
+/* test-data.c - Test data and helpers shared by the throughput tests.
+
+   Copyright (C) 2026 Free Software Foundation
+
+   The Gnome Library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   The Gnome Library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with the Gnome Library; see the file COPYING.LIB.  If not,
+   write to the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, USA.
+*/
+
+#include <config.h>
+
+#include "test-data.h"
+
+#include <libgnomevfs/gnome-vfs.h>
+#include <libgnomevfs/gnome-vfs-xfer.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+static const char *words[] = {
+	"the", "virtual", "file", "system", "gnome", "method", "handle",
+	"compress", "block", "thread", "stream", "buffer", "archive",
+	"directory", "read", "write", "seek", "close", "open", "data"
+};
+
+static void
+fill_text (GRand *rand, guchar *data, gsize len)
+{
+	char *word;
+	gsize word_len, i;
+
+	i = 0;
+	while (i < len) {
+		if (g_rand_int_range (rand, 0, 8) == 0) {
+			word = g_strdup_printf ("%u", g_rand_int (rand));
+		} else {
+			word = g_strdup (words[g_rand_int_range (rand, 0, G_N_ELEMENTS (words))]);
+		}
+		word_len = MIN (strlen (word), len - i);
+		memcpy (data + i, word, word_len);
+		i += word_len;
+		if (i < len) {
+			data[i++] = g_rand_int_range (rand, 0, 12) == 0 ? '\n' : ' ';
+		}
+		g_free (word);
+	}
+}
+
+static void
+fill_random (GRand *rand, guchar *data, gsize len)
+{
+	guint32 value;
+	gsize i;
+
+	for (i = 0; i < len; i += sizeof (value)) {
+		value = g_rand_int (rand);
+		memcpy (data + i, &value, MIN (sizeof (value), len - i));
+	}
+}
+
+guchar *
+test_data_create (gsize len, TestDataKind kind)
+{
+	GRand *rand;
+	guchar *data;
+
+	data = g_malloc (len);
+
+	rand = g_rand_new_with_seed (42);
+	if (kind == TEST_DATA_TEXT) {
+		fill_text (rand, data, len);
+	} else {
+		fill_random (rand, data, len);
+	}
+	g_rand_free (rand);
+
+	return data;
+}
+
+gboolean
+test_data_check_result (GnomeVFSResult result, const char *what)
+{
+	if (result != GNOME_VFS_OK) {
+		fprintf (stderr, "%s: %s\n", what, gnome_vfs_result_to_string (result));
+		return FALSE;
+	}
+	return TRUE;
+}
+
+gboolean
+test_data_verify_file (const char *uri,
+		       const guchar *data,
+		       gsize data_len,
+		       gsize chunk_size)
+{
+	GnomeVFSHandle *handle;
+	GnomeVFSFileSize bytes_read;
+	GnomeVFSResult result;
+	guchar *buffer;
+	gsize offset;
+	gboolean ok;
+
+	if (!test_data_check_result (gnome_vfs_open (&handle, uri, GNOME_VFS_OPEN_READ),
+				     "open for reading")) {
+		return FALSE;
+	}
+
+	buffer = g_malloc (chunk_size);
+	offset = 0;
+	ok = TRUE;
+	while ((result = gnome_vfs_read (handle, buffer, chunk_size, &bytes_read)) == GNOME_VFS_OK) {
+		if (offset + bytes_read > data_len ||
+		    memcmp (buffer, data + offset, bytes_read) != 0) {
+			fprintf (stderr, "Data read back differs near offset %lu\n",
+				 (unsigned long) offset);
+			ok = FALSE;
+			break;
+		}
+		offset += bytes_read;
+	}
+	if (ok && result != GNOME_VFS_ERROR_EOF) {
+		ok = test_data_check_result (result, "read");
+	}
+	if (ok && offset != data_len) {
+		fprintf (stderr, "Read back %lu bytes instead of %lu\n",
+			 (unsigned long) offset, (unsigned long) data_len);
+		ok = FALSE;
+	}
+
+	g_free (buffer);
+	gnome_vfs_close (handle);
+
+	return ok;
+}
+
+gboolean
+test_data_parse_options (int *argc,
+			 char ***argv,
+			 const char *parameter_string,
+			 GOptionEntry *entries)
+{
+	GOptionContext *ctx;
+	GError *error = NULL;
+	gboolean ok;
+
+	ctx = g_option_context_new (parameter_string);
+	g_option_context_add_main_entries (ctx, entries, NULL);
+	ok = g_option_context_parse (ctx, argc, argv, &error);
+	if (!ok) {
+		g_printerr ("main: %s\n", error->message);
+		g_error_free (error);
+	}
+	g_option_context_free (ctx);
+
+	return ok;
+}
+
+gboolean
+test_data_init_vfs (void)
+{
+	if (!gnome_vfs_init ()) {
+		fprintf (stderr, "Cannot initialize the GNOME Virtual File System.\n");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+void
+test_data_remove_tree (const char *uri)
+{
+	GnomeVFSURI *vfs_uri;
+	GList *uri_list;
+
+	vfs_uri = gnome_vfs_uri_new (uri);
+	uri_list = g_list_append (NULL, vfs_uri);
+	gnome_vfs_xfer_delete_list (uri_list,
+				    GNOME_VFS_XFER_ERROR_MODE_ABORT,
+				    GNOME_VFS_XFER_RECURSIVE,
+				    NULL, NULL);
+	g_list_free (uri_list);
+	gnome_vfs_uri_unref (vfs_uri);
+}
+
+int
+test_data_n_processors (int minimum)
+{
+	long n_processors;
+
+	n_processors = sysconf (_SC_NPROCESSORS_ONLN);
+
+	return MAX (n_processors, minimum);
+}
+
+double
+test_data_run_threads (GThreadFunc func, gpointer data, int n_threads)
+{
+	GThread **threads;
+	GTimer *timer;
+	double elapsed;
+	int i;
+
+	threads = g_new (GThread *, n_threads);
+
+	timer = g_timer_new ();
+	for (i = 0; i < n_threads; i++) {
+		threads[i] = g_thread_create (func, data, TRUE, NULL);
+	}
+	for (i = 0; i < n_threads; i++) {
+		g_thread_join (threads[i]);
+	}
+	elapsed = g_timer_elapsed (timer, NULL);
+	g_timer_destroy (timer);
+
+	g_free (threads);
+
+	return elapsed;
+}
@@ -0,0 +1,72 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 8; tab-width: 8 -*- */
+/* test-data.h - Test data and helpers shared by the throughput tests.
+
+   Copyright (C) 2026 Free Software Foundation
+
+   The Gnome Library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   The Gnome Library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with the Gnome Library; see the file COPYING.LIB.  If not,
+   write to the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, USA.
+*/
+
+#ifndef TEST_DATA_H
+#define TEST_DATA_H
+
+#include <glib.h>
+#include <libgnomevfs/gnome-vfs-result.h>
+
+G_BEGIN_DECLS
+
+typedef enum {
+	TEST_DATA_RANDOM,	/* doesn't compress */
+	TEST_DATA_TEXT		/* compresses roughly like source code or logs */
+} TestDataKind;
+
+/* Returns len bytes of data, the same on every call */
+guchar  *test_data_create       (gsize           len,
+				 TestDataKind    kind);
+
+/* Prints what failed and returns FALSE if result isn't GNOME_VFS_OK */
+gboolean test_data_check_result (GnomeVFSResult  result,
+				 const char     *what);
+
+/* Reads uri chunk_size bytes at a time and compares it with data */
+gboolean test_data_verify_file  (const char     *uri,
+				 const guchar   *data,
+				 gsize           data_len,
+				 gsize           chunk_size);
+
+/* Parses the options, printing what is wrong if they can't be */
+gboolean test_data_parse_options (int          *argc,
+				  char       ***argv,
+				  const char   *parameter_string,
+				  GOptionEntry *entries);
+
+/* Initializes GnomeVFS, printing a message if it can't be */
+gboolean test_data_init_vfs     (void);
+
+/* Deletes uri and everything below it */
+void     test_data_remove_tree  (const char     *uri);
+
+/* The number of processors online, but at least minimum */
+int      test_data_n_processors (int             minimum);
+
+/* Runs func in n_threads threads at once and returns the seconds it
+ * took until they all finished */
+double   test_data_run_threads  (GThreadFunc     func,
+				 gpointer        data,
+				 int             n_threads);
+
+G_END_DECLS
+
+#endif /* TEST_DATA_H */
@@ -0,0 +1,291 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 8; tab-width: 8 -*- */
+/* test-file-info-bulk.c - Test for directory loads with GNOME_VFS_FILE_INFO_BULK.
+
+   Copyright (C) 2026 Free Software Foundation
+
+   The Gnome Library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   The Gnome Library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with the Gnome Library; see the file COPYING.LIB.  If not,
+   write to the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, USA.
+*/
+
+/* Loads a directory large enough to fill several arena chunks with and
+ * without GNOME_VFS_FILE_INFO_BULK and fails unless both give the same
+ * entries. Then checks that freeing a bulk listing gives back every
+ * block it allocated, also when one of its infos outlives the list and
+ * when the application replaced some of the strings.
+ */
+
+#include <config.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <libgnomevfs/gnome-vfs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define N_FILES 400
+
+/* Blocks allocated through g_malloc and friends and not freed yet */
+static volatile gint live_blocks;
+
+static gpointer
+counting_malloc (gsize n_bytes)
+{
+	g_atomic_int_inc (&live_blocks);
+	return malloc (n_bytes);
+}
+
+static gpointer
+counting_realloc (gpointer mem, gsize n_bytes)
+{
+	if (mem == NULL) {
+		g_atomic_int_inc (&live_blocks);
+	}
+	return realloc (mem, n_bytes);
+}
+
+static void
+counting_free (gpointer mem)
+{
+	g_atomic_int_add (&live_blocks, -1);
+	free (mem);
+}
+
+static gpointer
+counting_calloc (gsize n_blocks, gsize n_block_bytes)
+{
+	g_atomic_int_inc (&live_blocks);
+	return calloc (n_blocks, n_block_bytes);
+}
+
+static GMemVTable counting_vtable = {
+	counting_malloc,
+	counting_realloc,
+	counting_free,
+	counting_calloc,
+	NULL,
+	NULL
+};
+
+static gint
+compare_names (gconstpointer a, gconstpointer b)
+{
+	return strcmp (((const GnomeVFSFileInfo *) a)->name,
+		       ((const GnomeVFSFileInfo *) b)->name);
+}
+
+static GList *
+load (const char *uri, GnomeVFSFileInfoOptions options)
+{
+	GnomeVFSResult result;
+	GList *list;
+
+	result = gnome_vfs_directory_list_load (&list, uri, options);
+	if (result != GNOME_VFS_OK) {
+		printf ("Loading %s failed: %s\n", uri,
+			gnome_vfs_result_to_string (result));
+		exit (EXIT_FAILURE);
+	}
+
+	return g_list_sort (list, compare_names);
+}
+
+static gboolean
+same_info (const GnomeVFSFileInfo *a, const GnomeVFSFileInfo *b)
+{
+	return strcmp (a->name, b->name) == 0
+		&& a->valid_fields == b->valid_fields
+		&& a->type == b->type
+		&& a->size == b->size
+		&& a->permissions == b->permissions
+		&& a->mtime == b->mtime
+		&& (a->symlink_name == NULL) == (b->symlink_name == NULL)
+		&& (a->symlink_name == NULL || strcmp (a->symlink_name, b->symlink_name) == 0)
+		&& (a->mime_type == NULL) == (b->mime_type == NULL)
+		&& (a->mime_type == NULL || strcmp (a->mime_type, b->mime_type) == 0);
+}
+
+static gboolean
+check_same_entries (const char *uri, GnomeVFSFileInfoOptions options)
+{
+	GList *plain, *bulk, *p, *b;
+	gboolean ok;
+
+	plain = load (uri, options);
+	bulk = load (uri, options | GNOME_VFS_FILE_INFO_BULK);
+
+	ok = g_list_length (plain) == g_list_length (bulk);
+	if (!ok) {
+		printf ("The bulk load returned %u entries instead of %u\n",
+			g_list_length (bulk), g_list_length (plain));
+	}
+	for (p = plain, b = bulk; ok && p != NULL; p = p->next, b = b->next) {
+		if (!same_info (p->data, b->data)) {
+			printf ("The bulk load returned a different %s\n",
+				((GnomeVFSFileInfo *) p->data)->name);
+			ok = FALSE;
+		}
+	}
+
+	gnome_vfs_file_info_list_free (plain);
+	gnome_vfs_file_info_list_free (bulk);
+
+	return ok;
+}
+
+static gboolean
+check_freed (const char *uri)
+{
+	GnomeVFSFileInfo *kept;
+	GList *list, *node;
+	gint before, after;
+	char *name;
+
+	before = g_atomic_int_get (&live_blocks);
+
+	list = load (uri, GNOME_VFS_FILE_INFO_BULK);
+
+	/* strings replaced by the application are its own */
+	node = g_list_nth (list, N_FILES / 3);
+	kept = node->data;
+	name = g_strdup_printf ("%s-renamed", kept->name);
+	kept->name = name;
+	gnome_vfs_file_info_ref (kept);
+
+	node = g_list_nth (list, N_FILES / 2);
+	gnome_vfs_file_info_clear (node->data);
+	((GnomeVFSFileInfo *) node->data)->name = g_strdup ("cleared");
+
+	gnome_vfs_file_info_list_free (list);
+
+	/* still there after the rest of its chunk went away */
+	if (strcmp (kept->name, name) != 0) {
+		printf ("A file info kept alive lost its name\n");
+		return FALSE;
+	}
+	gnome_vfs_file_info_unref (kept);
+
+	after = g_atomic_int_get (&live_blocks);
+	if (after != before) {
+		printf ("Freeing a bulk listing left %d blocks behind\n", after - before);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gboolean
+create_files (const char *dir)
+{
+	char *path, *contents;
+	int i;
+
+	contents = g_malloc0 (N_FILES);
+	for (i = 0; i < N_FILES; i++) {
+		/* long names so that the strings take more room than the infos */
+		path = g_strdup_printf ("%s/file-%03d-with-a-rather-long-name-"
+					"to-fill-the-arena-chunks-faster.txt", dir, i);
+		if (!g_file_set_contents (path, contents, i, NULL)) {
+			perror (path);
+			return FALSE;
+		}
+		g_free (path);
+	}
+	g_free (contents);
+
+	path = g_build_filename (dir, "subdir", NULL);
+	if (g_mkdir (path, 0755) != 0) {
+		perror (path);
+		return FALSE;
+	}
+	g_free (path);
+
+	path = g_build_filename (dir, "symlink", NULL);
+	if (symlink ("file-000-with-a-rather-long-name-"
+		     "to-fill-the-arena-chunks-faster.txt", path) != 0) {
+		perror (path);
+		return FALSE;
+	}
+	g_free (path);
+
+	return TRUE;
+}
+
+static void
+remove_files (const char *dir)
+{
+	const char *name;
+	char *path;
+	GDir *d;
+
+	d = g_dir_open (dir, 0, NULL);
+	if (d != NULL) {
+		while ((name = g_dir_read_name (d)) != NULL) {
+			path = g_build_filename (dir, name, NULL);
+			if (g_remove (path) != 0) {
+				g_rmdir (path);
+			}
+			g_free (path);
+		}
+		g_dir_close (d);
+	}
+	g_rmdir (dir);
+}
+
+int
+main (int argc, char **argv)
+{
+	char *dir, *uri;
+	gboolean ok;
+
+	/* has to come before anything else allocates */
+	g_mem_set_vtable (&counting_vtable);
+
+	dir = g_strdup_printf ("%s/test-file-info-bulk-%d", g_get_tmp_dir (), (int) getpid ());
+	if (g_mkdir (dir, 0755) != 0) {
+		perror (dir);
+		return EXIT_FAILURE;
+	}
+
+	if (!create_files (dir)) {
+		remove_files (dir);
+		return EXIT_FAILURE;
+	}
+
+	if (!gnome_vfs_init ()) {
+		fprintf (stderr, "Cannot initialize the GNOME Virtual File System.\n");
+		remove_files (dir);
+		return EXIT_FAILURE;
+	}
+
+	uri = gnome_vfs_get_uri_from_local_path (dir);
+
+	ok = check_same_entries (uri, GNOME_VFS_FILE_INFO_DEFAULT);
+	ok = check_same_entries (uri, GNOME_VFS_FILE_INFO_GET_MIME_TYPE
+				 | GNOME_VFS_FILE_INFO_FORCE_FAST_MIME_TYPE) && ok;
+
+	/* the loads above filled whatever the method caches */
+	ok = check_freed (uri) && ok;
+
+	g_free (uri);
+
+	gnome_vfs_shutdown ();
+
+	remove_files (dir);
+	g_free (dir);
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
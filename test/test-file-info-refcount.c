@@ -0,0 +1,120 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 8; tab-width: 8 -*- */
+/* test-file-info-refcount.c - Benchmark for GnomeVFSFileInfo refcounting.
+
+   Copyright (C) 2026 Free Software Foundation
+
+   The Gnome Library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   The Gnome Library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with the Gnome Library; see the file COPYING.LIB.  If not,
+   write to the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, USA.
+*/
+
+/* Refs and unrefs file infos from 1, 2, 4, ... threads up to twice the
+ * number of processors and prints the pairs per second, once with all
+ * threads sharing one info and once with an info of their own plus
+ * new/unref churn like a directory load does. Fails if a ref count
+ * ends up wrong.
+ */
+
+#include <config.h>
+
+#include "test-data.h"
+
+#include <glib.h>
+#include <libgnomevfs/gnome-vfs.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static int iterations = 1000000;
+
+static GOptionEntry options[] = {
+	{ "iterations", 'i', 0, G_OPTION_ARG_INT, &iterations,
+	  "Ref/unref pairs per thread (default 1000000)", "N" },
+	{ NULL }
+};
+
+static GnomeVFSFileInfo *shared_info;
+
+static gpointer
+shared_thread (gpointer data)
+{
+	int i;
+
+	for (i = 0; i < iterations; i++) {
+		gnome_vfs_file_info_ref (shared_info);
+		gnome_vfs_file_info_unref (shared_info);
+	}
+
+	return NULL;
+}
+
+static gpointer
+churn_thread (gpointer data)
+{
+	GnomeVFSFileInfo *info;
+	int i;
+
+	for (i = 0; i < iterations; i++) {
+		if (i % 16 == 0) {
+			/* like a directory load handing out new infos */
+			info = gnome_vfs_file_info_new ();
+			gnome_vfs_file_info_unref (info);
+		}
+		gnome_vfs_file_info_ref (shared_info);
+		gnome_vfs_file_info_unref (shared_info);
+	}
+
+	return NULL;
+}
+
+int
+main (int argc, char **argv)
+{
+	double shared_time, churn_time;
+	int n_processors;
+	int n_threads;
+	gboolean failed;
+
+	if (!test_data_parse_options (&argc, &argv, NULL, options) ||
+	    !test_data_init_vfs ()) {
+		return 1;
+	}
+
+	n_processors = test_data_n_processors (1);
+
+	shared_info = gnome_vfs_file_info_new ();
+	failed = FALSE;
+
+	for (n_threads = 1; n_threads <= 2 * n_processors; n_threads *= 2) {
+		shared_time = test_data_run_threads (shared_thread, NULL, n_threads);
+		churn_time = test_data_run_threads (churn_thread, NULL, n_threads);
+
+		printf ("%3d threads: shared %10.0f pairs/s, with churn %10.0f pairs/s\n",
+			n_threads,
+			(double) iterations * n_threads / shared_time,
+			(double) iterations * n_threads / churn_time);
+
+		if (shared_info->refcount != 1) {
+			printf ("Ref count is %u after %d threads, not 1\n",
+				shared_info->refcount, n_threads);
+			failed = TRUE;
+			break;
+		}
+	}
+
+	gnome_vfs_file_info_unref (shared_info);
+
+	gnome_vfs_shutdown ();
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,184 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 8; tab-width: 8 -*- */
+/* test-list-concurrent.c - Benchmark for listing many directories at once.
+
+   Copyright (C) 2026 Free Software Foundation
+
+   The Gnome Library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   The Gnome Library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with the Gnome Library; see the file COPYING.LIB.  If not,
+   write to the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, USA.
+*/
+
+/* Creates a number of directories full of empty files and lists all of
+ * them with 1, 2, 4, ... threads up to the number of processors, printing
+ * the entries per second for each thread count. Listing should scale
+ * with the thread count as long as there are cores for it.
+ */
+
+#include <config.h>
+
+#include "test-data.h"
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <libgnomevfs/gnome-vfs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int n_directories = 64;
+static int files_per_directory = 2000;
+static int rounds = 3;
+static gboolean name_only = FALSE;
+
+static GOptionEntry options[] = {
+	{ "directories", 'd', 0, G_OPTION_ARG_INT, &n_directories,
+	  "Number of directories (default 64)", "N" },
+	{ "files", 'n', 0, G_OPTION_ARG_INT, &files_per_directory,
+	  "Number of files per directory (default 2000)", "N" },
+	{ "rounds", 'r', 0, G_OPTION_ARG_INT, &rounds,
+	  "Times every directory is listed per run (default 3)", "N" },
+	{ "name-only", 0, 0, G_OPTION_ARG_NONE, &name_only,
+	  "List names only, without stat", NULL },
+	{ NULL }
+};
+
+static char **directory_uris;
+static volatile gint next_directory;
+static volatile gint entries_listed;
+
+static void
+create_directories (const char *root)
+{
+	char *dir, *file;
+	int i, j;
+
+	directory_uris = g_new0 (char *, n_directories + 1);
+
+	for (i = 0; i < n_directories; i++) {
+		dir = g_strdup_printf ("%s/dir%d", root, i);
+		if (g_mkdir (dir, 0755) != 0) {
+			perror (dir);
+			exit (1);
+		}
+
+		for (j = 0; j < files_per_directory; j++) {
+			file = g_strdup_printf ("%s/file%d", dir, j);
+			if (!g_file_set_contents (file, "", 0, NULL)) {
+				fprintf (stderr, "Could not create %s\n", file);
+				exit (1);
+			}
+			g_free (file);
+		}
+
+		directory_uris[i] = gnome_vfs_get_uri_from_local_path (dir);
+		g_free (dir);
+	}
+}
+
+static gpointer
+list_thread (gpointer data)
+{
+	GnomeVFSDirectoryHandle *handle;
+	GnomeVFSFileInfo *info;
+	GnomeVFSResult result;
+	int i, count;
+
+	info = gnome_vfs_file_info_new ();
+
+	while ((i = g_atomic_int_exchange_and_add (&next_directory, 1)) < n_directories * rounds) {
+		result = gnome_vfs_directory_open (&handle,
+						   directory_uris[i % n_directories],
+						   name_only ? GNOME_VFS_FILE_INFO_NAME_ONLY
+							     : GNOME_VFS_FILE_INFO_DEFAULT);
+		if (result != GNOME_VFS_OK) {
+			fprintf (stderr, "Could not open %s: %s\n",
+				 directory_uris[i % n_directories],
+				 gnome_vfs_result_to_string (result));
+			exit (1);
+		}
+
+		count = 0;
+		while (gnome_vfs_directory_read_next (handle, info) == GNOME_VFS_OK) {
+			count++;
+			gnome_vfs_file_info_clear (info);
+		}
+		gnome_vfs_directory_close (handle);
+
+		g_atomic_int_add (&entries_listed, count);
+	}
+
+	gnome_vfs_file_info_unref (info);
+
+	return NULL;
+}
+
+static double
+list_all (int n_threads)
+{
+	next_directory = 0;
+	entries_listed = 0;
+
+	return test_data_run_threads (list_thread, NULL, n_threads);
+}
+
+int
+main (int argc, char **argv)
+{
+	char *tmp_dir, *tmp_uri;
+	double elapsed, single_thread_rate, rate;
+	int n_processors;
+	int n_threads;
+
+	if (!test_data_parse_options (&argc, &argv, NULL, options) ||
+	    !test_data_init_vfs ()) {
+		return 1;
+	}
+
+	n_processors = test_data_n_processors (1);
+
+	tmp_dir = g_build_filename (g_get_tmp_dir (), "test-list-concurrent-XXXXXX", NULL);
+	if (mkdtemp (tmp_dir) == NULL) {
+		perror (tmp_dir);
+		return 1;
+	}
+
+	printf ("Creating %d directories of %d files...\n",
+		n_directories, files_per_directory);
+	create_directories (tmp_dir);
+
+	/* warm up the dentry cache so the first run isn't penalized */
+	list_all (1);
+
+	single_thread_rate = 0;
+	for (n_threads = 1; n_threads <= n_processors; n_threads *= 2) {
+		elapsed = list_all (n_threads);
+		rate = entries_listed / elapsed;
+		if (n_threads == 1) {
+			single_thread_rate = rate;
+		}
+		printf ("%3d threads: %8.0f entries/s, %.1fx\n",
+			n_threads, rate, rate / single_thread_rate);
+	}
+
+	tmp_uri = gnome_vfs_get_uri_from_local_path (tmp_dir);
+	test_data_remove_tree (tmp_uri);
+	g_free (tmp_uri);
+
+	g_strfreev (directory_uris);
+	g_free (tmp_dir);
+
+	gnome_vfs_shutdown ();
+
+	return 0;
+}
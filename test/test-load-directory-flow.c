@@ -0,0 +1,289 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 8; tab-width: 8 -*- */
+/* test-load-directory-flow.c - Test for the flow control of asynchronous
+   directory loads.
+
+   Copyright (C) 2026 Free Software Foundation
+
+   The Gnome Library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   The Gnome Library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with the Gnome Library; see the file COPYING.LIB.  If not,
+   write to the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, USA.
+*/
+
+/* Loads a directory asynchronously with a callback that holds every
+ * batch, and fails unless the load stops after MAX_PENDING_BATCHES
+ * batches, reads exactly one more batch per release, and delivers every
+ * entry once the batches are let go. Then checks that cancelling a load
+ * that waits for its callback ends the job.
+ */
+
+#include <config.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <libgnomevfs/gnome-vfs.h>
+#include <libgnomevfs/gnome-vfs-job.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* LOAD_DIRECTORY_MAX_PENDING_BATCHES in gnome-vfs-job.c */
+#define MAX_PENDING_BATCHES 4
+
+#define N_FILES 200
+#define ITEMS_PER_NOTIFICATION 10
+
+/* How long to wait for something that should happen, and to make sure
+ * that something that shouldn't doesn't */
+#define TIMEOUT_MSECS 10000
+#define QUIET_MSECS 500
+
+static gboolean hold;
+static int batches;
+static int held;
+static int entries;
+static gboolean done;
+static GnomeVFSResult last_result;
+
+static void
+load_callback (GnomeVFSAsyncHandle *handle,
+	       GnomeVFSResult result,
+	       GList *list,
+	       guint entries_read,
+	       gpointer callback_data)
+{
+	batches++;
+	entries += entries_read;
+	last_result = result;
+
+	if (result != GNOME_VFS_OK) {
+		done = TRUE;
+	} else if (hold) {
+		if (gnome_vfs_async_load_directory_hold (handle)) {
+			held++;
+		} else {
+			printf ("Could not hold batch %d\n", batches);
+		}
+	}
+}
+
+/* Runs the main loop until *value is at least expected or msecs have
+ * passed, and returns whether it got there */
+static gboolean
+wait_for (int *value, int expected, int msecs)
+{
+	GTimer *timer;
+
+	timer = g_timer_new ();
+	while (*value < expected && g_timer_elapsed (timer, NULL) * 1000 < msecs) {
+		g_main_context_iteration (NULL, FALSE);
+		g_usleep (1000);
+	}
+	g_timer_destroy (timer);
+
+	return *value >= expected;
+}
+
+static gboolean
+wait_for_jobs_gone (int msecs)
+{
+	GTimer *timer;
+
+	timer = g_timer_new ();
+	while (gnome_vfs_job_get_count () > 0 && g_timer_elapsed (timer, NULL) * 1000 < msecs) {
+		g_main_context_iteration (NULL, FALSE);
+		g_usleep (1000);
+	}
+	g_timer_destroy (timer);
+
+	return gnome_vfs_job_get_count () == 0;
+}
+
+static GnomeVFSAsyncHandle *
+start_load (const char *uri)
+{
+	GnomeVFSAsyncHandle *handle;
+
+	hold = TRUE;
+	batches = 0;
+	held = 0;
+	entries = 0;
+	done = FALSE;
+
+	gnome_vfs_async_load_directory (&handle, uri,
+					GNOME_VFS_FILE_INFO_DEFAULT,
+					ITEMS_PER_NOTIFICATION,
+					GNOME_VFS_PRIORITY_DEFAULT,
+					load_callback, NULL);
+
+	return handle;
+}
+
+static gboolean
+check_flow (const char *uri, int expected_entries)
+{
+	GnomeVFSAsyncHandle *handle;
+
+	handle = start_load (uri);
+
+	/* every batch is held, so the load has to stop at the limit */
+	if (!wait_for (&batches, MAX_PENDING_BATCHES, TIMEOUT_MSECS)) {
+		printf ("Only %d batches arrived\n", batches);
+		return FALSE;
+	}
+	wait_for (&batches, MAX_PENDING_BATCHES + 1, QUIET_MSECS);
+	if (batches != MAX_PENDING_BATCHES) {
+		printf ("%d batches arrived while %d were held\n", batches, held);
+		return FALSE;
+	}
+
+	/* each release lets exactly one more batch through */
+	gnome_vfs_async_load_directory_release (handle);
+	held--;
+	if (!wait_for (&batches, MAX_PENDING_BATCHES + 1, TIMEOUT_MSECS)) {
+		printf ("The load didn't resume after a release\n");
+		return FALSE;
+	}
+	wait_for (&batches, MAX_PENDING_BATCHES + 2, QUIET_MSECS);
+	if (batches != MAX_PENDING_BATCHES + 1) {
+		printf ("%d batches arrived after one release\n", batches);
+		return FALSE;
+	}
+
+	/* let go of everything and the load has to finish */
+	hold = FALSE;
+	while (held > 0) {
+		gnome_vfs_async_load_directory_release (handle);
+		held--;
+	}
+	if (!wait_for (&done, TRUE, TIMEOUT_MSECS)) {
+		printf ("The load didn't finish after releasing every batch\n");
+		return FALSE;
+	}
+	if (last_result != GNOME_VFS_ERROR_EOF) {
+		printf ("The load ended with %s\n", gnome_vfs_result_to_string (last_result));
+		return FALSE;
+	}
+	if (entries != expected_entries) {
+		printf ("The load delivered %d entries instead of %d\n",
+			entries, expected_entries);
+		return FALSE;
+	}
+
+	return wait_for_jobs_gone (TIMEOUT_MSECS);
+}
+
+static gboolean
+check_cancel (const char *uri)
+{
+	GnomeVFSAsyncHandle *handle;
+
+	handle = start_load (uri);
+
+	if (!wait_for (&batches, MAX_PENDING_BATCHES, TIMEOUT_MSECS)) {
+		printf ("Only %d batches arrived\n", batches);
+		return FALSE;
+	}
+
+	/* the worker is waiting for a release that never comes */
+	gnome_vfs_async_cancel (handle);
+	if (!wait_for_jobs_gone (TIMEOUT_MSECS)) {
+		printf ("Cancelling a held load didn't end its job\n");
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gboolean
+create_files (const char *dir)
+{
+	char *path;
+	int i;
+
+	for (i = 0; i < N_FILES; i++) {
+		path = g_strdup_printf ("%s/file%d", dir, i);
+		if (!g_file_set_contents (path, "", 0, NULL)) {
+			fprintf (stderr, "Could not create %s\n", path);
+			g_free (path);
+			return FALSE;
+		}
+		g_free (path);
+	}
+
+	return TRUE;
+}
+
+static void
+remove_files (const char *dir)
+{
+	char *path;
+	int i;
+
+	for (i = 0; i < N_FILES; i++) {
+		path = g_strdup_printf ("%s/file%d", dir, i);
+		g_unlink (path);
+		g_free (path);
+	}
+	g_rmdir (dir);
+}
+
+int
+main (int argc, char **argv)
+{
+	GnomeVFSResult result;
+	GList *list;
+	char *dir, *uri;
+	int expected_entries;
+	gboolean ok;
+
+	dir = g_strdup_printf ("%s/test-load-directory-flow-%d", g_get_tmp_dir (), (int) getpid ());
+	if (g_mkdir (dir, 0755) != 0) {
+		perror (dir);
+		return EXIT_FAILURE;
+	}
+	if (!create_files (dir)) {
+		remove_files (dir);
+		return EXIT_FAILURE;
+	}
+
+	if (!gnome_vfs_init ()) {
+		fprintf (stderr, "Cannot initialize the GNOME Virtual File System.\n");
+		remove_files (dir);
+		return EXIT_FAILURE;
+	}
+
+	uri = gnome_vfs_get_uri_from_local_path (dir);
+
+	/* whether . and .. are listed is up to the method */
+	result = gnome_vfs_directory_list_load (&list, uri, GNOME_VFS_FILE_INFO_DEFAULT);
+	if (result != GNOME_VFS_OK) {
+		printf ("Loading %s failed: %s\n", uri, gnome_vfs_result_to_string (result));
+		ok = FALSE;
+	} else {
+		expected_entries = g_list_length (list);
+		gnome_vfs_file_info_list_free (list);
+
+		ok = check_flow (uri, expected_entries);
+		ok = check_cancel (uri) && ok;
+	}
+
+	g_free (uri);
+
+	gnome_vfs_shutdown ();
+
+	remove_files (dir);
+	g_free (dir);
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -46,6 +46,8 @@
 #include <string.h>
 
 #define TEST_LIMIT 3
+#define TEST_HOST_LIMIT 2
+#define TEST_HOST_JOBS 5
 
 static GnomeVFSAsyncHandle *test_handle;
 static gpointer test_callback_data;
@@ -184,6 +186,83 @@ test_find_directory (const char *uri, int priority)
 }
 
 
+static int host_a_finished;
+static int host_a_finished_before_b;
+
+static void
+host_find_directory_callback (GnomeVFSAsyncHandle *handle,
+			      GList *results,
+			      gpointer callback_data)
+{
+	if (GPOINTER_TO_INT (callback_data)) {
+		host_a_finished++;
+	} else {
+		host_a_finished_before_b = host_a_finished;
+	}
+	jobs_started--;
+}
+
+static void
+test_host_find_directory (const char *uri, gboolean host_a)
+{
+	GnomeVFSAsyncHandle *handle;
+	GList *vfs_uri_as_list;
+
+	vfs_uri_as_list = g_list_append (NULL, gnome_vfs_uri_new (uri));
+	jobs_started++;
+
+	gnome_vfs_async_find_directory (&handle, vfs_uri_as_list,
+		GNOME_VFS_DIRECTORY_KIND_TRASH, FALSE, TRUE, 0777, 0,
+		host_find_directory_callback, GINT_TO_POINTER (host_a));
+
+	gnome_vfs_uri_list_free (vfs_uri_as_list);
+}
+
+/* find_directory takes a second in the test method (see
+ * queue-test-config.xml), so the jobs to host a run TEST_HOST_LIMIT at a
+ * time while the one to host b runs right away.
+ */
+static void
+test_host_limit (void)
+{
+	int i;
+
+	gnome_vfs_async_set_host_job_limit (TEST_HOST_LIMIT);
+	if (gnome_vfs_async_get_host_job_limit () != TEST_HOST_LIMIT) {
+		printf ("Host job limit is %d, not %d as expected\n",
+			gnome_vfs_async_get_host_job_limit (), TEST_HOST_LIMIT);
+		at_least_one_test_failed = TRUE;
+	}
+
+	/* enough threads for all of them */
+	gnome_vfs_async_set_job_limit (TEST_HOST_JOBS + 3);
+
+	for (i = 0; i < TEST_HOST_JOBS; i++) {
+		test_host_find_directory ("test://hosta/usr", TRUE);
+	}
+	test_host_find_directory ("test://hostb/usr", FALSE);
+
+	if (gnome_vfs_async_get_queue_depth () != TEST_HOST_JOBS - TEST_HOST_LIMIT) {
+		printf ("%d jobs queued, not %d as expected with a host job limit of %d\n",
+			gnome_vfs_async_get_queue_depth (),
+			TEST_HOST_JOBS - TEST_HOST_LIMIT, TEST_HOST_LIMIT);
+		at_least_one_test_failed = TRUE;
+	}
+
+	while (jobs_started > 0) {
+		g_main_context_iteration (NULL, TRUE);
+	}
+
+	if (host_a_finished_before_b > TEST_HOST_LIMIT) {
+		printf ("Scheduling error: %d jobs to one host finished before the "
+			"job to another host when the host job limit is %d\n",
+			host_a_finished_before_b, TEST_HOST_LIMIT);
+		at_least_one_test_failed = TRUE;
+	}
+
+	gnome_vfs_async_set_job_limit (TEST_LIMIT);
+}
+
 static int usage (void)
 {
 	printf ("Usage: test-queue [-h|--help] [-v|--verbose]\n");
@@ -198,6 +277,9 @@ main (int argc, char **argv)
 	int limit;
 	int finished_before_7;
 	int finished_before_0;
+	guint64 started;
+	guint64 average_wait;
+	guint64 max_wait;
 	int i;
 
 	for (i = 1; i < argc; i++) {
@@ -312,6 +394,26 @@ main (int argc, char **argv)
 		at_least_one_test_failed = TRUE;
 	}
 
+	if (gnome_vfs_async_get_queue_depth () != 0) {
+		printf ("%d jobs still queued after all jobs finished\n",
+			gnome_vfs_async_get_queue_depth ());
+		at_least_one_test_failed = TRUE;
+	}
+
+	/* 12 + 16 jobs were started above */
+	started = gnome_vfs_async_get_wait_time (&average_wait, &max_wait);
+	if (verbose) {
+		printf ("%lu jobs waited %lu usec on average, %lu usec at most\n",
+			(gulong) started, (gulong) average_wait, (gulong) max_wait);
+	}
+	if (started < 28 || average_wait > max_wait) {
+		printf ("Bad wait time statistics: %lu jobs, average %lu, max %lu\n",
+			(gulong) started, (gulong) average_wait, (gulong) max_wait);
+		at_least_one_test_failed = TRUE;
+	}
+
+	test_host_limit ();
+
 	if (verbose) {
 		printf ("Shutting down\n");
 	}
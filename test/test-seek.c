@@ -23,12 +23,23 @@
 
 #include <config.h>
 
+#include "test-data.h"
+
 #include <errno.h>
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <libgnomevfs/gnome-vfs-init.h>
 #include <libgnomevfs/gnome-vfs-ops.h>
+#include <libgnomevfs/gnome-vfs-utils.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Data for the gzip checks, and the checkpoint spacing they ask the gzip
+ * method for; the data spans several checkpoints */
+#define GZIP_DATA_SIZE (1024 * 1024)
+#define GZIP_CHECKPOINT_SPACING "131072"
 
 static void
 show_result (GnomeVFSResult result, const gchar *what, const gchar *text_uri)
@@ -183,6 +194,151 @@ seek_test_chunk (GnomeVFSHandle      *handle,
 	return TRUE;
 }
 
+/* Seeks and reads length bytes, which have to match data from offset */
+static gboolean
+gzip_check_chunk (GnomeVFSHandle      *handle,
+		  const guchar        *data,
+		  GnomeVFSSeekPosition whence,
+		  GnomeVFSFileOffset   vfs_offset,
+		  GnomeVFSFileSize     offset,
+		  GnomeVFSFileSize     length)
+{
+	GnomeVFSFileSize bytes_read, total, position;
+	GnomeVFSResult result;
+	guchar *buffer;
+	gboolean ok;
+
+	result = gnome_vfs_seek (handle, whence, vfs_offset);
+	if (show_if_error (result, "gzip gnome_vfs_seek"))
+		return FALSE;
+
+	result = gnome_vfs_tell (handle, &position);
+	if (show_if_error (result, "gzip gnome_vfs_tell"))
+		return FALSE;
+	if (position != offset) {
+		g_warning ("gzip %s to %d ended up at %d instead of %d",
+			   translate_vfs_seek_pos (whence, NULL), (int) vfs_offset,
+			   (int) position, (int) offset);
+		return FALSE;
+	}
+
+	buffer = g_malloc (MAX (length, 1));
+	total = 0;
+	result = GNOME_VFS_OK;
+	while (total < length) {
+		result = gnome_vfs_read (handle, buffer + total, length - total,
+					 &bytes_read);
+		if (result != GNOME_VFS_OK)
+			break;
+		total += bytes_read;
+	}
+
+	ok = TRUE;
+	if (offset + length >= GZIP_DATA_SIZE) {
+		/* reading on from the end has to say so */
+		if (result == GNOME_VFS_OK)
+			result = gnome_vfs_read (handle, buffer, 1, &bytes_read);
+		if (result != GNOME_VFS_ERROR_EOF) {
+			g_warning ("gzip read at the end gave '%s' instead of EOF",
+				   gnome_vfs_result_to_string (result));
+			ok = FALSE;
+		}
+	} else if (show_if_error (result, "gzip gnome_vfs_read")) {
+		ok = FALSE;
+	}
+
+	if (ok && total != MIN (length, GZIP_DATA_SIZE - offset)) {
+		g_warning ("gzip read %d bytes at %d instead of %d",
+			   (int) total, (int) offset, (int) length);
+		ok = FALSE;
+	}
+	if (ok && memcmp (buffer, data + offset, total) != 0) {
+		g_warning ("gzip data read at %d doesn't match", (int) offset);
+		ok = FALSE;
+	}
+
+	g_free (buffer);
+
+	return ok;
+}
+
+/* Compresses data through the gzip method, then seeks around in it
+ * forwards, backwards and from the end, the latter with the checkpoints
+ * in place and not */
+static int
+gzip_test (void)
+{
+	GnomeVFSFileSize bytes_written;
+	GnomeVFSHandle *handle;
+	GnomeVFSResult result;
+	char *path, *file_uri, *uri;
+	guchar *data;
+	int failures;
+
+	path = g_strdup_printf ("%s/test-seek-%d.gz", g_get_tmp_dir (), (int) getpid ());
+	/* the method opens its parent without creating it */
+	if (!g_file_set_contents (path, "", 0, NULL)) {
+		fprintf (stderr, "Could not create %s\n", path);
+		return 1;
+	}
+	file_uri = gnome_vfs_get_uri_from_local_path (path);
+	uri = g_strconcat (file_uri, "#gzip:", NULL);
+	g_free (file_uri);
+
+	data = test_data_create (GZIP_DATA_SIZE, TEST_DATA_TEXT);
+
+	result = gnome_vfs_open (&handle, uri, GNOME_VFS_OPEN_WRITE);
+	show_result (result, "gnome_vfs_open", uri);
+	result = gnome_vfs_write (handle, data, GZIP_DATA_SIZE, &bytes_written);
+	show_result (result, "gnome_vfs_write", uri);
+	result = gnome_vfs_close (handle);
+	show_result (result, "gnome_vfs_close", uri);
+
+	failures = 0;
+
+	result = gnome_vfs_open (&handle, uri, GNOME_VFS_OPEN_READ|GNOME_VFS_OPEN_RANDOM);
+	show_result (result, "gnome_vfs_open", uri);
+
+	/* to the end before there is an index */
+	if (!gzip_check_chunk (handle, data, GNOME_VFS_SEEK_END, -1000,
+			       GZIP_DATA_SIZE - 1000, 1000))
+		failures++;
+	if (!gzip_check_chunk (handle, data, GNOME_VFS_SEEK_START, 100000, 100000, 4096))
+		failures++;
+	/* forwards past a checkpoint */
+	if (!gzip_check_chunk (handle, data, GNOME_VFS_SEEK_START, 700000, 700000, 4096))
+		failures++;
+	if (!gzip_check_chunk (handle, data, GNOME_VFS_SEEK_CURRENT, 50000, 754096, 4096))
+		failures++;
+	/* backwards to before the first checkpoint and to between two */
+	if (!gzip_check_chunk (handle, data, GNOME_VFS_SEEK_START, 10, 10, 100000))
+		failures++;
+	if (!gzip_check_chunk (handle, data, GNOME_VFS_SEEK_CURRENT, 300000, 400010, 50000))
+		failures++;
+	if (!gzip_check_chunk (handle, data, GNOME_VFS_SEEK_START, 200000, 200000, 4096))
+		failures++;
+	if (!gzip_check_chunk (handle, data, GNOME_VFS_SEEK_END, 0, GZIP_DATA_SIZE, 10))
+		failures++;
+	if (!gzip_check_chunk (handle, data, GNOME_VFS_SEEK_END, -(GZIP_DATA_SIZE / 2),
+			       GZIP_DATA_SIZE / 2, GZIP_DATA_SIZE / 2))
+		failures++;
+
+	result = gnome_vfs_close (handle);
+	show_result (result, "gnome_vfs_close", uri);
+
+	if (failures)
+		printf ("%d gzip tests failed\n", failures);
+	else
+		printf ("All gzip tests successful\n");
+
+	g_unlink (path);
+	g_free (path);
+	g_free (uri);
+	g_free (data);
+
+	return failures ? 1 : 0;
+}
+
 int
 main (int argc, char **argv)
 {
@@ -191,15 +347,22 @@ main (int argc, char **argv)
 	FILE *ref;
 	int i, failures;
 
+	/* read by the gzip method when it is loaded */
+	g_setenv ("GNOME_VFS_GZIP_CHECKPOINT_SPACING", GZIP_CHECKPOINT_SPACING, TRUE);
+
 	if (! gnome_vfs_init ()) {
 		fprintf (stderr, "Cannot initialize gnome-vfs.\n");
 		return 1;
 	}
 
+	if (argc == 1)
+		return gzip_test ();
+
 	if (argc != 3) {
 		fprintf (stderr, "This is a program to test seek emulation on linear filesystems\n");
-		fprintf (stderr, "Usage: %s <source file uri> <seekable local reference fname>\n",
+		fprintf (stderr, "Usage: %s [<source file uri> <seekable local reference fname>]\n",
 			 argv[0]);
+		fprintf (stderr, "Without arguments it checks seeking in gzip files\n");
 		return 1;
 	}
 
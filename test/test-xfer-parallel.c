@@ -0,0 +1,297 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 8; tab-width: 8 -*- */
+/* test-xfer-parallel.c - Benchmark for GNOME_VFS_XFER_PARALLEL.
+
+   Copyright (C) 2026 Free Software Foundation
+
+   The Gnome Library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   The Gnome Library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with the Gnome Library; see the file COPYING.LIB.  If not,
+   write to the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, USA.
+*/
+
+/* Creates a tree of small files and copies it once file by file and once
+ * with GNOME_VFS_XFER_PARALLEL, printing how long each copy took. Fails
+ * unless both copies have the same names, sizes and contents as the
+ * source. Pass a target directory URI (e.g. sftp://host/tmp) to measure
+ * a remote file system.
+ */
+
+#include <config.h>
+
+#include "test-data.h"
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <libgnomevfs/gnome-vfs.h>
+#include <libgnomevfs/gnome-vfs-xfer.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int n_files = 50000;
+static int files_per_directory = 100;
+static int file_size = 1024;
+static int workers = 8;
+
+static GOptionEntry options[] = {
+	{ "files", 'n', 0, G_OPTION_ARG_INT, &n_files,
+	  "Number of files in the tree (default 50000)", "N" },
+	{ "per-directory", 'd', 0, G_OPTION_ARG_INT, &files_per_directory,
+	  "Number of files per directory (default 100)", "N" },
+	{ "size", 's', 0, G_OPTION_ARG_INT, &file_size,
+	  "Size of each file in bytes (default 1024)", "BYTES" },
+	{ "workers", 'w', 0, G_OPTION_ARG_INT, &workers,
+	  "Parallel worker count (default 8)", "N" },
+	{ NULL }
+};
+
+/* Each file gets its number as contents, so that files mixed up by the
+ * copy don't compare equal */
+static void
+fill_contents (char *contents, int i)
+{
+	char *number;
+	int j, len;
+
+	number = g_strdup_printf ("%d ", i);
+	len = strlen (number);
+	for (j = 0; j < file_size; j++) {
+		contents[j] = number[j % len];
+	}
+	g_free (number);
+}
+
+static void
+create_tree (const char *root)
+{
+	char *contents, *dir, *file;
+	int i;
+
+	contents = g_malloc (file_size);
+
+	dir = NULL;
+	for (i = 0; i < n_files; i++) {
+		if (i % files_per_directory == 0) {
+			g_free (dir);
+			dir = g_strdup_printf ("%s/dir%d", root, i / files_per_directory);
+			if (g_mkdir (dir, 0755) != 0) {
+				perror (dir);
+				exit (1);
+			}
+		}
+
+		file = g_strdup_printf ("%s/file%d", dir, i);
+		fill_contents (contents, i);
+		if (!g_file_set_contents (file, contents, file_size, NULL)) {
+			fprintf (stderr, "Could not create %s\n", file);
+			exit (1);
+		}
+		g_free (file);
+	}
+
+	g_free (dir);
+	g_free (contents);
+}
+
+static double
+copy_tree (const char *source, const char *target, GnomeVFSXferOptions options)
+{
+	GnomeVFSURI *source_uri, *target_uri;
+	GnomeVFSResult result;
+	GTimer *timer;
+	double elapsed;
+
+	source_uri = gnome_vfs_uri_new (source);
+	target_uri = gnome_vfs_uri_new (target);
+
+	timer = g_timer_new ();
+	result = gnome_vfs_xfer_uri (source_uri, target_uri,
+				     GNOME_VFS_XFER_RECURSIVE | options,
+				     GNOME_VFS_XFER_ERROR_MODE_ABORT,
+				     GNOME_VFS_XFER_OVERWRITE_MODE_ABORT,
+				     NULL, NULL);
+	elapsed = g_timer_elapsed (timer, NULL);
+	g_timer_destroy (timer);
+
+	if (result != GNOME_VFS_OK) {
+		fprintf (stderr, "Copying %s to %s failed: %s\n",
+			 source, target, gnome_vfs_result_to_string (result));
+		exit (1);
+	}
+
+	gnome_vfs_uri_unref (source_uri);
+	gnome_vfs_uri_unref (target_uri);
+
+	return elapsed;
+}
+
+static gint
+compare_names (gconstpointer a, gconstpointer b)
+{
+	return strcmp (((const GnomeVFSFileInfo *) a)->name,
+		       ((const GnomeVFSFileInfo *) b)->name);
+}
+
+static GList *
+load_sorted (const char *uri)
+{
+	GList *list;
+
+	if (!test_data_check_result (gnome_vfs_directory_list_load (&list, uri,
+								   GNOME_VFS_FILE_INFO_DEFAULT),
+				     uri)) {
+		return NULL;
+	}
+
+	return g_list_sort (list, compare_names);
+}
+
+static gboolean
+compare_file (const char *source, const char *target)
+{
+	char *contents;
+	int size;
+	gboolean ok;
+
+	if (!test_data_check_result (gnome_vfs_read_entire_file (source, &size, &contents),
+				     source)) {
+		return FALSE;
+	}
+
+	ok = test_data_verify_file (target, (guchar *) contents, size, 64 * 1024);
+	if (!ok) {
+		fprintf (stderr, "%s differs from %s\n", target, source);
+	}
+	g_free (contents);
+
+	return ok;
+}
+
+/* Checks that target has the same entries as source, recursively */
+static gboolean
+compare_tree (const char *source, const char *target)
+{
+	GnomeVFSFileInfo *source_info, *target_info;
+	GList *source_list, *target_list, *s, *t;
+	char *source_child, *target_child;
+	gboolean ok;
+
+	source_list = load_sorted (source);
+	target_list = load_sorted (target);
+
+	ok = source_list != NULL && target_list != NULL;
+	for (s = source_list, t = target_list; ok && s != NULL && t != NULL;
+	     s = s->next, t = t->next) {
+		source_info = s->data;
+		target_info = t->data;
+
+		if (strcmp (source_info->name, "..") == 0 ||
+		    strcmp (source_info->name, ".") == 0) {
+			continue;
+		}
+
+		if (strcmp (source_info->name, target_info->name) != 0 ||
+		    source_info->type != target_info->type ||
+		    (source_info->type == GNOME_VFS_FILE_TYPE_REGULAR &&
+		     source_info->size != target_info->size)) {
+			fprintf (stderr, "%s/%s doesn't match %s/%s\n",
+				 target, target_info->name, source, source_info->name);
+			ok = FALSE;
+			break;
+		}
+
+		source_child = g_strconcat (source, "/", source_info->name, NULL);
+		target_child = g_strconcat (target, "/", target_info->name, NULL);
+		if (source_info->type == GNOME_VFS_FILE_TYPE_DIRECTORY) {
+			ok = compare_tree (source_child, target_child);
+		} else {
+			ok = compare_file (source_child, target_child);
+		}
+		g_free (source_child);
+		g_free (target_child);
+	}
+	if (ok && (s != NULL || t != NULL)) {
+		fprintf (stderr, "%s has %u entries instead of %u\n", target,
+			 g_list_length (target_list), g_list_length (source_list));
+		ok = FALSE;
+	}
+
+	gnome_vfs_file_info_list_free (source_list);
+	gnome_vfs_file_info_list_free (target_list);
+
+	return ok;
+}
+
+int
+main (int argc, char **argv)
+{
+	char *tmp_dir, *source_dir, *source, *target_base;
+	char *serial_target, *parallel_target;
+	double serial_time, parallel_time;
+	gboolean ok;
+
+	if (!test_data_parse_options (&argc, &argv, "[TARGET-DIRECTORY-URI]", options) ||
+	    !test_data_init_vfs ()) {
+		return 1;
+	}
+
+	tmp_dir = g_build_filename (g_get_tmp_dir (), "test-xfer-parallel-XXXXXX", NULL);
+	if (mkdtemp (tmp_dir) == NULL) {
+		perror (tmp_dir);
+		return 1;
+	}
+
+	source_dir = g_build_filename (tmp_dir, "source", NULL);
+	g_mkdir (source_dir, 0755);
+
+	printf ("Creating %d files of %d bytes...\n", n_files, file_size);
+	create_tree (source_dir);
+
+	source = gnome_vfs_get_uri_from_local_path (source_dir);
+	if (argc > 1) {
+		target_base = g_strdup (argv[1]);
+	} else {
+		target_base = gnome_vfs_get_uri_from_local_path (tmp_dir);
+	}
+	serial_target = g_strconcat (target_base, "/serial", NULL);
+	parallel_target = g_strconcat (target_base, "/parallel", NULL);
+
+	serial_time = copy_tree (source, serial_target, 0);
+	printf ("serial copy:   %.2f s (%.0f files/s)\n",
+		serial_time, n_files / serial_time);
+
+	gnome_vfs_xfer_set_parallel_limit (workers);
+	parallel_time = copy_tree (source, parallel_target, GNOME_VFS_XFER_PARALLEL);
+	printf ("parallel copy: %.2f s (%.0f files/s) with %d workers, %.1fx\n",
+		parallel_time, n_files / parallel_time, workers,
+		serial_time / parallel_time);
+
+	ok = compare_tree (source, serial_target);
+	ok = compare_tree (source, parallel_target) && ok;
+
+	test_data_remove_tree (serial_target);
+	test_data_remove_tree (parallel_target);
+	test_data_remove_tree (source);
+	g_rmdir (tmp_dir);
+
+	g_free (serial_target);
+	g_free (parallel_target);
+	g_free (target_base);
+	g_free (source);
+	g_free (source_dir);
+	g_free (tmp_dir);
+
+	gnome_vfs_shutdown ();
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
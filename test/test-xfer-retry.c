@@ -0,0 +1,148 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 8; tab-width: 8 -*- */
+/* test-xfer-retry.c - Test for retrying failed reads during xfer.
+
+   Copyright (C) 2026 Free Software Foundation
+
+   The Gnome Library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   The Gnome Library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with the Gnome Library; see the file COPYING.LIB.  If not,
+   write to the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, USA.
+*/
+
+/* Copies a file through the test method, configured so that every read
+ * fails, and answers the error with RETRY a few times before giving up
+ * with ABORT. Each retry has to be reported back as another error; a
+ * copy that gives up after the first RETRY fails the test. The file is
+ * large enough to be copied by the pipelined reader.
+ */
+
+#include <config.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <libgnomevfs/gnome-vfs.h>
+#include <libgnomevfs/gnome-vfs-xfer.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FILE_SIZE (1024 * 1024)
+#define RETRIES 3
+
+static const char config[] =
+	"<?xml version=\"1.0\"?>\n"
+	"<TestModule method=\"file\">\n"
+	"  <function name=\"read\" result=\"GNOME_VFS_ERROR_IO\"/>\n"
+	"</TestModule>\n";
+
+static int errors;
+
+static gint
+xfer_progress_callback (GnomeVFSXferProgressInfo *info,
+			gpointer data)
+{
+	switch (info->status) {
+	case GNOME_VFS_XFER_PROGRESS_STATUS_VFSERROR:
+		if (info->vfs_status != GNOME_VFS_ERROR_IO) {
+			printf ("Unexpected error: %s\n",
+				gnome_vfs_result_to_string (info->vfs_status));
+			return GNOME_VFS_XFER_ERROR_ACTION_ABORT;
+		}
+		errors++;
+		return errors <= RETRIES
+			? GNOME_VFS_XFER_ERROR_ACTION_RETRY
+			: GNOME_VFS_XFER_ERROR_ACTION_ABORT;
+	case GNOME_VFS_XFER_PROGRESS_STATUS_OVERWRITE:
+		return GNOME_VFS_XFER_OVERWRITE_ACTION_REPLACE;
+	default:
+		return TRUE;
+	}
+}
+
+int
+main (int argc, char **argv)
+{
+	char *dir, *source, *target, *config_file, *contents;
+	char *source_uri, *target_uri;
+	GnomeVFSURI *src, *dest;
+	GnomeVFSResult result;
+	gboolean failed;
+
+	dir = g_strdup_printf ("%s/test-xfer-retry-%d", g_get_tmp_dir (), (int) getpid ());
+	if (g_mkdir (dir, 0755) != 0) {
+		perror (dir);
+		return 1;
+	}
+	source = g_build_filename (dir, "source", NULL);
+	target = g_build_filename (dir, "target", NULL);
+	config_file = g_build_filename (dir, "config.xml", NULL);
+
+	contents = g_malloc0 (FILE_SIZE);
+	if (!g_file_set_contents (source, contents, FILE_SIZE, NULL) ||
+	    !g_file_set_contents (config_file, config, strlen (config), NULL)) {
+		fprintf (stderr, "Could not create the files in %s\n", dir);
+		return 1;
+	}
+	g_free (contents);
+
+	/* read by the test method when it is loaded */
+	g_setenv ("GNOME_VFS_TEST_CONFIG_FILE", config_file, TRUE);
+
+	if (!gnome_vfs_init ()) {
+		fprintf (stderr, "Cannot initialize the GNOME Virtual File System.\n");
+		return 1;
+	}
+
+	source_uri = g_strconcat ("test://", source, NULL);
+	target_uri = g_strconcat ("file://", target, NULL);
+	src = gnome_vfs_uri_new (source_uri);
+	dest = gnome_vfs_uri_new (target_uri);
+
+	result = gnome_vfs_xfer_uri (src, dest,
+				     GNOME_VFS_XFER_DEFAULT,
+				     GNOME_VFS_XFER_ERROR_MODE_QUERY,
+				     GNOME_VFS_XFER_OVERWRITE_MODE_QUERY,
+				     xfer_progress_callback,
+				     NULL);
+
+	failed = FALSE;
+	if (errors != RETRIES + 1) {
+		printf ("The read error was reported %d times instead of %d\n",
+			errors, RETRIES + 1);
+		failed = TRUE;
+	}
+	if (result != GNOME_VFS_ERROR_INTERRUPTED) {
+		printf ("The copy returned %s instead of being interrupted\n",
+			gnome_vfs_result_to_string (result));
+		failed = TRUE;
+	}
+
+	gnome_vfs_uri_unref (src);
+	gnome_vfs_uri_unref (dest);
+	g_free (source_uri);
+	g_free (target_uri);
+
+	gnome_vfs_shutdown ();
+
+	g_unlink (target);
+	g_unlink (source);
+	g_unlink (config_file);
+	g_rmdir (dir);
+	g_free (target);
+	g_free (source);
+	g_free (config_file);
+	g_free (dir);
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}